@@ -15,7 +15,16 @@
 #ifndef REVERB_CC_CHECKPOINTING_INTERFACE_H_
 #define REVERB_CC_CHECKPOINTING_INTERFACE_H_
 
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <cstdint>
 #include "absl/status/status.h"
+#include "absl/strings/string_view.h"
+#include "reverb/cc/checkpointing/write_ahead_log.h"
+#include "reverb/cc/chunk_store.h"
 #include "reverb/cc/table.h"
 
 namespace deepmind {
@@ -34,6 +43,14 @@ class Checkpointer {
   virtual absl::Status Save(std::vector<Table*> tables, int keep_latest,
                             std::string* path) = 0;
 
+  // Same as `Save` but used for checkpoints that are created periodically in
+  // the background rather than requested by a user. Implementations may trade
+  // speed for less contention with the rest of the host.
+  virtual absl::Status SaveInBackground(std::vector<Table*> tables,
+                                        int keep_latest, std::string* path) {
+    return Save(std::move(tables), keep_latest, path);
+  }
+
   // Attempts to load a checkpoint from the active workspace.
   //
   // Tables loaded from checkpoint must already exist in `tables`. When
@@ -48,6 +65,14 @@ class Checkpointer {
   virtual absl::Status LoadLatest(
       ChunkStore* chunk_store, std::vector<std::shared_ptr<Table>>* tables) = 0;
 
+  // Returns the write-ahead log that records changes made after the most
+  // recent call to `Save`, or nullptr if the checkpointer does not keep one.
+  // Checkpointers that do keep a log replay it in `LoadLatest`.
+  //
+  // Entries can only be appended to the log once `Save` has been called at
+  // least once.
+  virtual WriteAheadLog* write_ahead_log() { return nullptr; }
+
   // Returns a summary string description.
   virtual std::string DebugString() const = 0;
 };
@@ -0,0 +1,86 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REVERB_CC_CHECKPOINTING_WRITE_AHEAD_LOG_H_
+#define REVERB_CC_CHECKPOINTING_WRITE_AHEAD_LOG_H_
+
+#include <memory>
+
+#include <cstdint>
+#include "absl/status/status.h"
+#include "absl/strings/string_view.h"
+#include "absl/types/span.h"
+#include "reverb/cc/chunk_store.h"
+#include "reverb/cc/schema.pb.h"
+
+namespace deepmind {
+namespace reverb {
+
+// A write-ahead log records the changes made to the tables after the most
+// recent checkpoint was created. When the checkpoint is loaded the log is
+// replayed on top of it, which means that changes that have been synced to the
+// log survive a crash even if no checkpoint was created after they were made.
+//
+// Tables append their changes themselves (see `Table::set_write_ahead_log`)
+// while holding their lock, so the entries of a table are in the order in
+// which the changes were applied. Each entry carries a sequence number which
+// increases with every change to the table. Checkpoints store the sequence
+// number of the last change they include, which allows the replay to skip the
+// entries that are already reflected in the checkpoint.
+//
+// Appending an entry only buffers it. Entries are written in the order they
+// were appended and `Sync` blocks until every entry appended before the call
+// has been durably written. Concurrent `Sync` calls are grouped so that a
+// single flush covers all of them.
+//
+// Samples are not logged. A replayed item therefore keeps the
+// `times_sampled` it had in the checkpoint and the rate limiters only count
+// the samples made before the checkpoint was created. Since items deleted
+// because they reached `max_times_sampled` would be restored by the replay,
+// the log cannot be used with tables that set `max_times_sampled`.
+//
+// All methods are thread safe.
+class WriteAheadLog {
+ public:
+  virtual ~WriteAheadLog() = default;
+
+  // Records that `item` has been inserted into (or updated in) the table named
+  // by `item.table()`. `chunks` must be the chunks referenced by the item. Any
+  // chunk that has not yet been recorded in the log is recorded before the
+  // item. `sequence` is the sequence number of the change within the table.
+  virtual absl::Status AppendItem(
+      PrioritizedItem item,
+      absl::Span<const std::shared_ptr<ChunkStore::Chunk>> chunks,
+      int64_t sequence) = 0;
+
+  // Records that the priorities of `updates` have been updated and that
+  // `deletes` have been deleted from `table`.
+  virtual absl::Status AppendMutation(absl::string_view table,
+                                      absl::Span<const KeyWithPriority> updates,
+                                      absl::Span<const uint64_t> deletes,
+                                      int64_t sequence) = 0;
+
+  // Records that `table` has been reset.
+  virtual absl::Status AppendReset(absl::string_view table,
+                                   int64_t sequence) = 0;
+
+  // Blocks until all entries appended before the call have been durably
+  // written.
+  virtual absl::Status Sync() = 0;
+};
+
+}  // namespace reverb
+}  // namespace deepmind
+
+#endif  // REVERB_CC_CHECKPOINTING_WRITE_AHEAD_LOG_H_
@@ -19,6 +19,7 @@
 #include <vector>
 
 #include <cstdint>
+#include "absl/memory/memory.h"
 #include "absl/strings/str_cat.h"
 #include "absl/synchronization/mutex.h"
 #include "absl/time/time.h"
@@ -36,8 +37,48 @@
 namespace deepmind {
 namespace reverb {
 
+namespace {
+
+// Capacity of the queue of keys whose chunks have been destroyed. Destroying a
+// chunk blocks while the queue is full, so the queue only has to absorb the
+// keys released between two cleanups.
+constexpr int kDeleteKeysCapacity = 1000000;
+
+// True if the compressed tensors of `a` and `b` are identical.
+bool SamePayload(const ChunkData::Data& a, const ChunkData::Data& b) {
+  if (a.tensors_size() != b.tensors_size()) return false;
+  for (int i = 0; i < a.tensors_size(); i++) {
+    const auto& x = a.tensors(i);
+    const auto& y = b.tensors(i);
+    if (x.dtype() != y.dtype() || x.tensor_content() != y.tensor_content() ||
+        x.tensor_shape().SerializeAsString() !=
+            y.tensor_shape().SerializeAsString() ||
+        x.ByteSizeLong() != y.ByteSizeLong()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
 ChunkStore::Chunk::Chunk(ChunkData data) : data_(std::move(data)) {}
 
+ChunkStore::Chunk::Chunk(ChunkData data,
+                         std::shared_ptr<const ChunkData::Data> payload)
+    : data_(std::move(data)), payload_(std::move(payload)) {
+  REVERB_CHECK(!data_.has_data());
+  // We const cast to avoid copying the shared data. It is released again in
+  // the destructor so `data_` never takes ownership of it.
+  data_.set_allocated_data(const_cast<ChunkData::Data*>(payload_.get()));
+}
+
+ChunkStore::Chunk::~Chunk() {
+  if (payload_ != nullptr) {
+    data_.release_data();
+  }
+}
+
 uint64_t ChunkStore::Chunk::key() const { return data_.chunk_key(); }
 
 const ChunkData& ChunkStore::Chunk::data() const { return data_; }
@@ -60,13 +101,24 @@ int ChunkStore::Chunk::num_columns() const {
   return data_.data().tensors_size();
 }
 
-ChunkStore::ChunkStore(int cleanup_batch_size)
-    : delete_keys_(std::make_shared<internal::Queue<Key>>(10000000)),
-      cleaner_(internal::StartThread(
-          "ChunkStore-Cleaner", [this, cleanup_batch_size] {
-            while (CleanupInternal(cleanup_batch_size)) {
-            }
-          })) {}
+ChunkStore::ChunkStore(int cleanup_batch_size, int num_shards,
+                       bool deduplicate_content)
+    : content_index_(deduplicate_content ? std::make_shared<ContentIndex>()
+                                         : nullptr),
+      usage_(std::make_shared<Usage>()),
+      delete_keys_(
+          std::make_shared<internal::Queue<Key>>(kDeleteKeysCapacity)) {
+  REVERB_CHECK_GE(num_shards, 1);
+  shards_.reserve(num_shards);
+  for (int i = 0; i < num_shards; i++) {
+    shards_.push_back(absl::make_unique<Shard>());
+  }
+  cleaner_ = internal::StartThread(
+      "ChunkStore-Cleaner", [this, cleanup_batch_size] {
+        while (CleanupInternal(cleanup_batch_size)) {
+        }
+      });
+}
 
 ChunkStore::~ChunkStore() {
   // Closing the queue makes all calls to `CleanupInternal` to return false
@@ -76,23 +128,77 @@ ChunkStore::~ChunkStore() {
 }
 
 std::shared_ptr<ChunkStore::Chunk> ChunkStore::Insert(ChunkData item) {
-  absl::WriterMutexLock lock(&mu_);
-  std::weak_ptr<Chunk>& wp = data_[item.chunk_key()];
-  std::shared_ptr<Chunk> sp = wp.lock();
-  if (sp == nullptr) {
-    wp = (sp = std::shared_ptr<Chunk>(new Chunk(std::move(item)),
-                                      [q = delete_keys_](Chunk* chunk) {
-                                        q->Push(chunk->key());
-                                        delete chunk;
-                                      }));
+  // Resolve the payload before locking the shard as comparing payloads can be
+  // expensive.
+  std::shared_ptr<const ChunkData::Data> payload;
+  if (content_index_ != nullptr && item.content_hash() != 0 &&
+      item.has_data()) {
+    payload = InternPayload(item.content_hash(),
+                            absl::WrapUnique(item.release_data()));
   }
+
+  Shard& shard = *shards_[ShardIndex(item.chunk_key())];
+  std::shared_ptr<Chunk> sp;
+  {
+    absl::WriterMutexLock lock(&shard.mu);
+    std::weak_ptr<Chunk>& wp = shard.data[item.chunk_key()];
+    sp = wp.lock();
+    if (sp != nullptr) return sp;
+
+    Chunk* chunk = payload == nullptr
+                       ? new Chunk(std::move(item))
+                       : new Chunk(std::move(item), std::move(payload));
+    wp = (sp = std::shared_ptr<Chunk>(
+              chunk, [q = delete_keys_, usage = usage_](Chunk* chunk) {
+                usage->num_chunks.Decrement();
+                usage->num_bytes.Add(
+                    -static_cast<int64_t>(chunk->DataByteSizeLong()));
+                q->Push(chunk->key());
+                delete chunk;
+              }));
+  }
+  // The size is computed (and cached) outside of the lock.
+  usage_->num_chunks.Increment();
+  usage_->num_bytes.Add(sp->DataByteSizeLong());
   return sp;
 }
 
+std::shared_ptr<const ChunkData::Data> ChunkStore::InternPayload(
+    uint64_t content_hash, std::unique_ptr<ChunkData::Data> data) {
+  // Declared before the lock so that it is never destroyed (which may run the
+  // deleter below) while the lock is held.
+  std::shared_ptr<const ChunkData::Data> existing;
+  {
+    absl::MutexLock lock(&content_index_->mu);
+    std::weak_ptr<const ChunkData::Data>& wp =
+        content_index_->payloads[content_hash];
+    existing = wp.lock();
+    if (existing == nullptr) {
+      wp = existing = std::shared_ptr<const ChunkData::Data>(
+          data.release(), [index = content_index_,
+                           content_hash](const ChunkData::Data* payload) {
+            {
+              absl::MutexLock lock(&index->mu);
+              auto it = index->payloads.find(content_hash);
+              if (it != index->payloads.end() && it->second.expired()) {
+                index->payloads.erase(it);
+              }
+            }
+            delete payload;
+          });
+      return existing;
+    }
+  }
+
+  if (SamePayload(*existing, *data)) return existing;
+
+  // Hash collision. The payload is stored separately from the indexed one.
+  return std::shared_ptr<const ChunkData::Data>(std::move(data));
+}
+
 tensorflow::Status ChunkStore::Get(
     absl::Span<const ChunkStore::Key> keys,
     std::vector<std::shared_ptr<Chunk>>* chunks) {
-  absl::ReaderMutexLock lock(&mu_);
   chunks->clear();
   chunks->reserve(keys.size());
   for (int i = 0; i < keys.size(); i++) {
@@ -106,8 +212,20 @@ tensorflow::Status ChunkStore::Get(
 }
 
 std::shared_ptr<ChunkStore::Chunk> ChunkStore::GetItem(Key key) {
-  auto it = data_.find(key);
-  return it == data_.end() ? nullptr : it->second.lock();
+  Shard& shard = *shards_[ShardIndex(key)];
+  absl::ReaderMutexLock lock(&shard.mu);
+  auto it = shard.data.find(key);
+  return it == shard.data.end() ? nullptr : it->second.lock();
+}
+
+std::vector<int64_t> ChunkStore::num_entries_per_shard() const {
+  std::vector<int64_t> num_entries;
+  num_entries.reserve(shards_.size());
+  for (const auto& shard : shards_) {
+    absl::ReaderMutexLock lock(&shard->mu);
+    num_entries.push_back(shard->data.size());
+  }
+  return num_entries;
 }
 
 bool ChunkStore::CleanupInternal(int num_chunks) {
@@ -117,9 +235,24 @@ bool ChunkStore::CleanupInternal(int num_chunks) {
     return false;
   }
 
-  absl::WriterMutexLock data_lock(&mu_);
-  for (const Key& key : popped_keys) {
-    data_.erase(key);
+  std::vector<std::vector<Key>> keys_by_shard(shards_.size());
+  for (Key key : popped_keys) {
+    keys_by_shard[ShardIndex(key)].push_back(key);
+  }
+
+  for (int i = 0; i < shards_.size(); i++) {
+    if (keys_by_shard[i].empty()) continue;
+
+    Shard& shard = *shards_[i];
+    absl::WriterMutexLock lock(&shard.mu);
+    for (Key key : keys_by_shard[i]) {
+      // The key may have been reinserted after the chunk was destroyed, in
+      // which case the entry refers to the new chunk and must be kept.
+      auto it = shard.data.find(key);
+      if (it != shard.data.end() && it->second.expired()) {
+        shard.data.erase(it);
+      }
+    }
   }
 
   return true;
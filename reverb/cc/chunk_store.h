@@ -27,6 +27,7 @@
 #include "reverb/cc/platform/hash_map.h"
 #include "reverb/cc/platform/thread.h"
 #include "reverb/cc/schema.pb.h"
+#include "reverb/cc/support/metrics.h"
 #include "reverb/cc/support/queue.h"
 #include "tensorflow/core/framework/tensor.h"
 #include "tensorflow/core/framework/tensor_shape.h"
@@ -47,15 +48,32 @@ namespace reverb {
 // reason, Insert() returns a shared pointer, as otherwise the Chunk would be
 // destroyed right away.
 //
+// The key space is split across a number of shards which are locked
+// independently, so concurrent inserts and lookups only contend when their keys
+// belong to the same shard.
+//
+// If `deduplicate_content` is set then chunks with the same
+// `ChunkData.content_hash` (and identical compressed tensors) share a single
+// copy of `ChunkData.data`. Each key still maps to its own Chunk, so the
+// deduplication is invisible to callers.
+//
 // All public methods are thread safe.
 class ChunkStore {
  public:
   using Key = uint64_t;
 
+  static constexpr int kDefaultNumShards = 16;
+
   class Chunk {
    public:
     explicit Chunk(ChunkData data);
 
+    // Creates a chunk whose `data().data()` is `payload`, which may be shared
+    // with other chunks. `data` must not have `data` set.
+    Chunk(ChunkData data, std::shared_ptr<const ChunkData::Data> payload);
+
+    ~Chunk();
+
     // Unique identifier of the chunk.
     uint64_t key() const;
 
@@ -77,13 +95,18 @@ class ChunkStore {
 
    private:
     ChunkData data_;
+    // Owner of `data_.data()` if it is shared with other chunks.
+    std::shared_ptr<const ChunkData::Data> payload_;
     mutable size_t data_byte_size_;
     mutable absl::once_flag data_byte_size_once_;
   };
 
   // Starts `cleaner_`. `cleanup_batch_size` is the number of keys the cleaner
-  // should wait for before acquiring the lock and erasing them from `data_`.
-  explicit ChunkStore(int cleanup_batch_size = 1000);
+  // should wait for before erasing them from the shards. `num_shards` must be
+  // >= 1.
+  explicit ChunkStore(int cleanup_batch_size = 1000,
+                      int num_shards = kDefaultNumShards,
+                      bool deduplicate_content = false);
 
   // Stops `cleaner_` closes `delete_keys_`.
   ~ChunkStore();
@@ -91,34 +114,80 @@ class ChunkStore {
   // Attempts to insert a Chunk into the map using the key inside `item`. If no
   // entry existed for the key, a new Chunk is created, inserted and returned.
   // Otherwise, the existing chunk is returned.
-  std::shared_ptr<Chunk> Insert(ChunkData item) ABSL_LOCKS_EXCLUDED(mu_);
+  std::shared_ptr<Chunk> Insert(ChunkData item);
 
   // Gets the Chunk for each given key. Returns an error if one of the items
   // does not exist or if `Close` has been called. On success, the returned
   // items are in the same order as given in `keys`.
   tensorflow::Status Get(absl::Span<const Key> keys,
-                         std::vector<std::shared_ptr<Chunk>>* chunks)
-      ABSL_LOCKS_EXCLUDED(mu_);
+                         std::vector<std::shared_ptr<Chunk>>* chunks);
 
-  // Blocks until `num_chunks` expired entries have been cleaned up from
-  // `data_`. This method is called automatically by a background thread to
+  // Blocks until `num_chunks` expired entries have been cleaned up from the
+  // shards. This method is called automatically by a background thread to
   // limit memory size, but does not have any effect on the semantics of Get()
-  // or Insert() calls.
+  // or Insert() calls. The popped keys are grouped by shard so each shard is
+  // only locked once per call.
   //
   // Returns false if `delete_keys_` closed before `num_chunks` could be popped.
-  bool CleanupInternal(int num_chunks) ABSL_LOCKS_EXCLUDED(mu_);
+  bool CleanupInternal(int num_chunks);
+
+  // Number of chunks currently alive, including chunks which are only
+  // referenced by items (or samples) after the store has forgotten them.
+  int64_t num_chunks() const { return usage_->num_chunks.Value(); }
+
+  // Sum of `Chunk::DataByteSizeLong` of the chunks counted by `num_chunks`.
+  // Payloads shared through deduplication are counted once per chunk.
+  int64_t num_bytes() const { return usage_->num_bytes.Value(); }
+
+  // Number of entries in each shard. Entries of destroyed chunks are counted
+  // until they have been cleaned up.
+  std::vector<int64_t> num_entries_per_shard() const;
 
  private:
+  struct Shard {
+    // Mutex protecting access to `data`.
+    mutable absl::Mutex mu;
+
+    // Holds the actual mapping of key to Chunk. We only hold a weak pointer to
+    // the Chunk, which means that destruction and reference counting of the
+    // chunks happens independently of this map.
+    internal::flat_hash_map<Key, std::weak_ptr<Chunk>> data
+        ABSL_GUARDED_BY(mu);
+  };
+
+  // Payloads of the chunks inserted with deduplication, keyed by content hash.
+  // Owned through a shared pointer as payloads can outlive the ChunkStore.
+  struct ContentIndex {
+    absl::Mutex mu;
+    internal::flat_hash_map<uint64_t, std::weak_ptr<const ChunkData::Data>>
+        payloads ABSL_GUARDED_BY(mu);
+  };
+
+  // Returns the payload already stored for `content_hash` if it is identical
+  // to `data`. Otherwise `data` is stored (if there is no live payload for the
+  // hash) and returned.
+  std::shared_ptr<const ChunkData::Data> InternPayload(
+      uint64_t content_hash, std::unique_ptr<ChunkData::Data> data);
+
+  // Index of the shard which owns `key`.
+  size_t ShardIndex(Key key) const { return key % shards_.size(); }
+
   // Gets an item. Returns nullptr if the item does not exist.
-  std::shared_ptr<Chunk> GetItem(Key key) ABSL_SHARED_LOCKS_REQUIRED(mu_);
+  std::shared_ptr<Chunk> GetItem(Key key);
 
-  // Holds the actual mapping of key to Chunk. We only hold a weak pointer to
-  // the Chunk, which means that destruction and reference counting of the
-  // chunks happens independently of this map.
-  internal::flat_hash_map<Key, std::weak_ptr<Chunk>> data_ ABSL_GUARDED_BY(mu_);
+  // Shards of the key space. Never resized after construction.
+  std::vector<std::unique_ptr<Shard>> shards_;
 
-  // Mutex protecting access to `data_`.
-  mutable absl::Mutex mu_;
+  // Set iff deduplication is enabled.
+  std::shared_ptr<ContentIndex> content_index_;
+
+  // Updated when chunks are created and destroyed. Owned through a shared
+  // pointer as chunks can outlive the ChunkStore.
+  struct Usage {
+    internal::StripedCounter num_chunks;
+    internal::StripedCounter num_bytes;
+  };
+  std::shared_ptr<Usage> usage_;
 
   // Queue of keys of deleted items that will be cleaned up by `cleaner_`. Note
   // the queue have to be allocated on the heap in order to avoid dereferencing
@@ -126,7 +195,7 @@ class ChunkStore {
   // Chunk have been destroyed.
   std::shared_ptr<internal::Queue<Key>> delete_keys_;
 
-  // Consumes `delete_keys_` to remove dead pointers in `data_`.
+  // Consumes `delete_keys_` to remove dead pointers from the shards.
   std::unique_ptr<internal::Thread> cleaner_;
 };
 
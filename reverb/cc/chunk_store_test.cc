@@ -20,6 +20,8 @@
 
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
 #include "reverb/cc/platform/thread.h"
 #include "reverb/cc/schema.pb.h"
 #include "reverb/cc/testing/proto_test_util.h"
@@ -103,6 +105,40 @@ TEST(ChunkStoreTest, CleanupDoesNotDeleteRequiredChunks) {
   }
 }
 
+TEST(ChunkStoreTest, CleanupDoesNotDeleteReinsertedChunks) {
+  ChunkStore store(/*cleanup_batch_size=*/1);
+
+  // Insert, destroy and reinsert the same key many times so that cleanups of
+  // the destroyed chunks race with the reinsertions.
+  std::shared_ptr<ChunkStore::Chunk> chunk;
+  for (int i = 0; i < 1000; i++) {
+    chunk = nullptr;
+    chunk = store.Insert(testing::MakeChunkData(1));
+  }
+
+  // Give the cleaner time to process the keys of all destroyed chunks before
+  // checking that the last insert is still reachable.
+  absl::SleepFor(absl::Milliseconds(100));
+  ChunkVector chunks;
+  TF_ASSERT_OK(store.Get({1}, &chunks));
+  EXPECT_EQ(chunks[0], chunk);
+}
+
+TEST(ChunkStoreTest, KeysAreSpreadOverShards) {
+  ChunkStore store(/*cleanup_batch_size=*/1000, /*num_shards=*/4);
+  ChunkVector inserted;
+  for (ChunkStore::Key key = 0; key < 100; key++) {
+    inserted.push_back(store.Insert(testing::MakeChunkData(key)));
+  }
+  for (ChunkStore::Key key = 0; key < 100; key++) {
+    ChunkVector chunks;
+    TF_ASSERT_OK(store.Get({key}, &chunks));
+    EXPECT_EQ(chunks[0], inserted[key]);
+  }
+  EXPECT_THAT(store.num_entries_per_shard(),
+              ::testing::ElementsAre(25, 25, 25, 25));
+}
+
 TEST(ChunkStoreTest, ConcurrentCalls) {
   ChunkStore store;
   std::vector<std::unique_ptr<internal::Thread>> bundle;
@@ -123,6 +159,70 @@ TEST(ChunkStoreTest, ConcurrentCalls) {
   EXPECT_EQ(count, 1000);
 }
 
+ChunkData MakeChunkDataWithHash(ChunkStore::Key key, uint64_t content_hash) {
+  ChunkData data = testing::MakeChunkData(key);
+  data.set_content_hash(content_hash);
+  return data;
+}
+
+TEST(ChunkStoreTest, DuplicateContentIsSharedIfEnabled) {
+  ChunkStore store(/*cleanup_batch_size=*/1, ChunkStore::kDefaultNumShards,
+                   /*deduplicate_content=*/true);
+  auto first = store.Insert(MakeChunkDataWithHash(1, 1337));
+  auto second = store.Insert(MakeChunkDataWithHash(2, 1337));
+
+  EXPECT_EQ(first->key(), 1);
+  EXPECT_EQ(second->key(), 2);
+  EXPECT_EQ(&first->data().data(), &second->data().data());
+
+  // The shared payload outlives the chunk it was first inserted with.
+  first = nullptr;
+  auto third = store.Insert(MakeChunkDataWithHash(3, 1337));
+  EXPECT_EQ(&second->data().data(), &third->data().data());
+  EXPECT_THAT(third->data().data(),
+              testing::EqualsProto(testing::MakeChunkData(3).data()));
+}
+
+TEST(ChunkStoreTest, DuplicateContentIsNotSharedIfDisabled) {
+  ChunkStore store;
+  auto first = store.Insert(MakeChunkDataWithHash(1, 1337));
+  auto second = store.Insert(MakeChunkDataWithHash(2, 1337));
+  EXPECT_NE(&first->data().data(), &second->data().data());
+}
+
+TEST(ChunkStoreTest, HashCollisionsAreNotShared) {
+  ChunkStore store(/*cleanup_batch_size=*/1, ChunkStore::kDefaultNumShards,
+                   /*deduplicate_content=*/true);
+  ChunkData other = testing::MakeChunkData(
+      2, testing::MakeSequenceRange(/*episode_id=*/1, 0, 5));
+  other.set_content_hash(1337);
+
+  auto first = store.Insert(MakeChunkDataWithHash(1, 1337));
+  auto second = store.Insert(other);
+  EXPECT_NE(&first->data().data(), &second->data().data());
+  EXPECT_THAT(second->data(), testing::EqualsProto(other));
+}
+
+TEST(ChunkStoreTest, TracksLiveChunksAndBytes) {
+  ChunkStore store;
+  auto first = store.Insert(testing::MakeChunkData(1));
+  auto second = store.Insert(testing::MakeChunkData(2));
+  auto again = store.Insert(testing::MakeChunkData(2));
+  EXPECT_EQ(store.num_chunks(), 2);
+  EXPECT_EQ(store.num_bytes(),
+            first->DataByteSizeLong() + second->DataByteSizeLong());
+
+  first = nullptr;
+  EXPECT_EQ(store.num_chunks(), 1);
+  EXPECT_EQ(store.num_bytes(), second->DataByteSizeLong());
+
+  second = nullptr;
+  EXPECT_EQ(store.num_chunks(), 1);
+  again = nullptr;
+  EXPECT_EQ(store.num_chunks(), 0);
+  EXPECT_EQ(store.num_bytes(), 0);
+}
+
 TEST(ChunkTest, Length) {
   ChunkData data;
   data.mutable_sequence_range()->set_start(5);
@@ -101,18 +101,7 @@ Chunker::Chunker(internal::TensorSpec spec,
 absl::Status Chunker::Append(tensorflow::Tensor tensor,
                                    CellRef::EpisodeInfo episode_info,
                                    std::weak_ptr<CellRef>* ref) {
-  if (tensor.dtype() != spec_.dtype) {
-    return absl::InvalidArgumentError(absl::StrCat(
-        "Tensor of wrong dtype provided for column ", spec_.name, ". Got ",
-        tensorflow::DataTypeString(tensor.dtype()), " but expected ",
-        tensorflow::DataTypeString(spec_.dtype), "."));
-  }
-  if (!spec_.shape.IsCompatibleWith(tensor.shape())) {
-    return absl::InvalidArgumentError(absl::StrCat(
-        "Tensor of incompatible shape provided for column ", spec_.name,
-        ". Got ", tensor.shape().DebugString(), " which is incompatible with ",
-        spec_.shape.DebugString(), "."));
-  }
+  REVERB_RETURN_IF_ERROR(CheckCompatible(tensor));
 
   absl::MutexLock lock(&mu_);
 
@@ -185,6 +174,7 @@ absl::Status Chunker::FlushLocked() {
   REVERB_RETURN_IF_ERROR(
       FromTensorflowStatus(tensorflow::tensor::Concat(buffer_, &batched)));
   CompressTensorAsProto(batched, chunk.mutable_data()->add_tensors());
+  chunk.set_content_hash(internal::ChunkContentHash(chunk.data()));
 
   // Set the sequence range of the chunk.
   for (const auto& ref : active_refs_) {
@@ -234,6 +224,27 @@ void Chunker::Reset() {
 
 const internal::TensorSpec& Chunker::spec() const { return spec_; }
 
+absl::Status Chunker::CheckCompatible(const tensorflow::Tensor& tensor) const {
+  if (tensor.dtype() != spec_.dtype) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Tensor of wrong dtype provided for column ", spec_.name, ". Got ",
+        tensorflow::DataTypeString(tensor.dtype()), " but expected ",
+        tensorflow::DataTypeString(spec_.dtype), "."));
+  }
+  if (!spec_.shape.IsCompatibleWith(tensor.shape())) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Tensor of incompatible shape provided for column ", spec_.name,
+        ". Got ", tensor.shape().DebugString(), " which is incompatible with ",
+        spec_.shape.DebugString(), "."));
+  }
+  return absl::OkStatus();
+}
+
+bool Chunker::HasBufferedData() const {
+  absl::MutexLock lock(&mu_);
+  return !buffer_.empty();
+}
+
 absl::Status Chunker::ApplyConfig(std::shared_ptr<ChunkerOptions> options) {
   absl::MutexLock lock(&mu_);
 
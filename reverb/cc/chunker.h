@@ -130,6 +130,14 @@ class Chunker : public std::enable_shared_from_this<Chunker> {
   // Spec which appended tensors need to be compatible with.
   const internal::TensorSpec& spec() const;
 
+  // Returns `InvalidArgumentError` if the dtype or shape of `tensor` is not
+  // compatible with `spec()`.
+  absl::Status CheckCompatible(const tensorflow::Tensor& tensor) const;
+
+  // True if the buffer holds data which has not yet been finalized into a
+  // chunk, in which case `ApplyConfig` fails.
+  bool HasBufferedData() const ABSL_LOCKS_EXCLUDED(mu_);
+
   // Modify options on Chunker with an empty buffer (i.e newly created or
   // `Flush` just called.). Returns `InvalidArgumentError` if
   // `max_chunk_length > num_keep_alive_refs`  or if either is <= 0.
@@ -505,6 +505,8 @@ TEST(Chunker, ApplyConfigRequireBufferToBeEmpty) {
   REVERB_ASSERT_OK(chunker->Append(MakeTensor(kIntSpec),
                                    {/*episode_id=*/1, /*step=*/0}, &step));
 
+  EXPECT_TRUE(chunker->HasBufferedData());
+
   auto status = chunker->ApplyConfig(std::make_shared<ConstantChunkerOptions>(
       /*max_chunk_length=*/1, /*num_keep_alive_refs=*/5));
   EXPECT_EQ(status.code(), absl::StatusCode::kFailedPrecondition);
@@ -513,6 +515,7 @@ TEST(Chunker, ApplyConfigRequireBufferToBeEmpty) {
 
   // Flushing and retrying the same configure call should succeed.
   REVERB_ASSERT_OK(chunker->Flush());
+  EXPECT_FALSE(chunker->HasBufferedData());
   REVERB_EXPECT_OK(
       chunker->ApplyConfig(std::make_shared<ConstantChunkerOptions>(
           /*max_chunk_length=*/1, /*num_keep_alive_refs=*/5)));
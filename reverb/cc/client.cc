@@ -151,6 +151,14 @@ absl::Status Client::MutatePriorities(
   return FromGrpcStatus(stub_->MutatePriorities(&context, request, &response));
 }
 
+absl::Status Client::NewPriorityUpdater(
+    const std::string& table, const PriorityUpdater::Options& options,
+    std::unique_ptr<PriorityUpdater>* updater) {
+  REVERB_RETURN_IF_ERROR(options.Validate());
+  *updater = absl::make_unique<PriorityUpdater>(stub_, table, options);
+  return absl::OkStatus();
+}
+
 absl::Status Client::NewSampler(
     const std::string& table, const Sampler::Options& options,
     internal::DtypesAndShapes dtypes_and_shapes,
@@ -371,6 +379,17 @@ absl::Status Client::Checkpoint(std::string* path) {
   return absl::OkStatus();
 }
 
+absl::Status Client::Metrics(std::string* text) {
+  grpc::ClientContext context;
+  context.set_fail_fast(true);
+  MetricsRequest request;
+  MetricsResponse response;
+  REVERB_RETURN_IF_ERROR(
+      FromGrpcStatus(stub_->Metrics(&context, request, &response)));
+  *text = std::move(*response.mutable_text());
+  return absl::OkStatus();
+}
+
 absl::Status Client::GetLocalTablePtr(absl::string_view table_name,
                                       std::shared_ptr<Table>* out) {
   grpc::ClientContext context;
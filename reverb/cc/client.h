@@ -27,6 +27,7 @@
 #include "absl/strings/string_view.h"
 #include "absl/synchronization/mutex.h"
 #include "absl/time/time.h"
+#include "reverb/cc/priority_updater.h"
 #include "reverb/cc/reverb_service.grpc.pb.h"
 #include "reverb/cc/reverb_service.pb.h"
 #include "reverb/cc/sampler.h"
@@ -110,10 +111,19 @@ class Client {
       const std::vector<uint64_t>& deletes,
       absl::Duration timeout = absl::InfiniteDuration());
 
+  // Upon successful return, `updater` will contain a `PriorityUpdater` which
+  // streams coalesced priority updates and deletions to `table`.
+  absl::Status NewPriorityUpdater(const std::string& table,
+                                  const PriorityUpdater::Options& options,
+                                  std::unique_ptr<PriorityUpdater>* updater);
+
   absl::Status Reset(const std::string& table);
 
   absl::Status Checkpoint(std::string* path);
 
+  // Fetches the metrics of the server in the Prometheus text exposition format.
+  absl::Status Metrics(std::string* text);
+
   // Requests ServerInfo. Forces an update of internal signature caches.
   absl::Status ServerInfo(absl::Duration timeout, struct ServerInfo* info);
   // Waits indefinitely for server to respond.
@@ -16,10 +16,15 @@
 
 #include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include <cstdint>
+#include "absl/base/thread_annotations.h"
 #include "absl/strings/str_cat.h"
+#include "absl/synchronization/mutex.h"
+#include "reverb/cc/platform/hash_map.h"
+#include "reverb/cc/sampler.h"
 #include "reverb/cc/support/tf_util.h"
 #include "tensorflow/core/framework/op.h"
 #include "tensorflow/core/framework/op_kernel.h"
@@ -58,11 +63,14 @@ REGISTER_OP("ReverbClientSample")
     .Output("outputs: Toutput_list")
     .Doc(R"doc(
 Blocking call to sample a single item from table `table` using shared resource.
-A `SampleStream`-stream is opened  between the client and the server and when
-the one sample has been received, the stream is closed.
+The first timestep of the item is returned.
 
-Prefer to use `ReverbDataset` when requesting more than one sample to avoid
-opening and closing the stream with each call.
+The samplers, and thus the `SampleStream`-streams, used by the op are kept
+open by the resource and reused across calls. Each idle sampler prefetches
+the next sample so one item per sampler may be sampled from the table before
+it is returned by the op.
+
+Prefer to use `ReverbDataset` when requesting more than one sample per step.
 )doc");
 
 REGISTER_OP("ReverbClientUpdatePriorities")
@@ -91,6 +99,10 @@ containing `data`.
 
 class ClientResource : public tensorflow::ResourceBase {
  public:
+  // Maximum number of idle samplers kept per table. Samplers returned to a
+  // full pool are closed.
+  static constexpr int kMaxIdleSamplersPerTable = 4;
+
   explicit ClientResource(const std::string& server_address)
       : tensorflow::ResourceBase(),
         client_(server_address),
@@ -102,10 +114,61 @@ class ClientResource : public tensorflow::ResourceBase {
 
   Client* client() { return &client_; }
 
+  // Takes an idle sampler of `table` from the pool or creates a new one if
+  // there are none. Samplers do not support concurrent calls so every sampler
+  // is only used by one op at the time. It should be returned to the pool
+  // using `ReturnSampler` once the sample has been received.
+  absl::Status BorrowSampler(const std::string& table,
+                             std::unique_ptr<Sampler>* sampler)
+      ABSL_LOCKS_EXCLUDED(mu_) {
+    {
+      absl::MutexLock lock(&mu_);
+      auto it = idle_samplers_.find(table);
+      if (it != idle_samplers_.end() && !it->second.empty()) {
+        *sampler = std::move(it->second.back());
+        it->second.pop_back();
+        return absl::OkStatus();
+      }
+    }
+
+    // The sampler streams samples one by one and keeps on doing so for as
+    // long as it is in the pool.
+    Sampler::Options options;
+    options.max_samples = Sampler::kUnlimitedMaxSamples;
+    options.max_in_flight_samples_per_worker = 1;
+    options.num_workers = 1;
+    options.flexible_batch_size = 1;
+
+    constexpr auto kValidationTimeout = absl::Seconds(30);
+    return client_.NewSampler(table, options,
+                              /*validation_timeout=*/kValidationTimeout,
+                              sampler);
+  }
+
+  // Returns a sampler borrowed using `BorrowSampler`. Samplers which returned
+  // an error must not be returned as they may be unable to recover from it.
+  void ReturnSampler(const std::string& table,
+                     std::unique_ptr<Sampler> sampler) ABSL_LOCKS_EXCLUDED(mu_) {
+    {
+      absl::MutexLock lock(&mu_);
+      auto& idle = idle_samplers_[table];
+      if (idle.size() < kMaxIdleSamplersPerTable) {
+        idle.push_back(std::move(sampler));
+      }
+    }
+    // If the pool was full then the sampler is closed without holding the
+    // lock as this joins its worker thread.
+    sampler = nullptr;
+  }
+
  private:
   Client client_;
   std::string server_address_;
 
+  absl::Mutex mu_;
+  internal::flat_hash_map<std::string, std::vector<std::unique_ptr<Sampler>>>
+      idle_samplers_ ABSL_GUARDED_BY(mu_);
+
   TF_DISALLOW_COPY_AND_ASSIGN(ClientResource);
 };
 
@@ -142,20 +205,23 @@ class SampleOp : public tensorflow::OpKernel {
     OP_REQUIRES_OK(context, context->input("table", &table_tensor));
     std::string table = table_tensor->scalar<tstring>()();
 
-    std::vector<tensorflow::Tensor> sample;
     std::unique_ptr<Sampler> sampler;
+    OP_REQUIRES_OK(context,
+                   ToTensorflowStatus(resource->BorrowSampler(table, &sampler)));
 
-    Sampler::Options options;
-    options.max_samples = 1;
-    options.max_in_flight_samples_per_worker = 1;
+    // Only the first timestep is returned so the rest of the sample is
+    // skipped before the sampler is returned to the pool.
+    std::vector<tensorflow::Tensor> sample;
+    bool end_of_sequence = false;
+    OP_REQUIRES_OK(context, ToTensorflowStatus(sampler->GetNextTimestep(
+                                &sample, &end_of_sequence)));
+    while (!end_of_sequence) {
+      std::vector<tensorflow::Tensor> skipped;
+      OP_REQUIRES_OK(context, ToTensorflowStatus(sampler->GetNextTimestep(
+                                  &skipped, &end_of_sequence)));
+    }
+    resource->ReturnSampler(table, std::move(sampler));
 
-    constexpr auto kValidationTimeout = absl::Seconds(30);
-    OP_REQUIRES_OK(
-        context, ToTensorflowStatus(resource->client()->NewSampler(
-                     table, options, /*validation_timeout=*/kValidationTimeout,
-                     &sampler)));
-    OP_REQUIRES_OK(context, ToTensorflowStatus(
-                                sampler->GetNextTimestep(&sample, nullptr)));
     OP_REQUIRES(context, sample.size() == context->num_outputs(),
                 InvalidArgument(
                     "Number of tensors in the replay sample did not match the "
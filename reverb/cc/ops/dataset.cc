@@ -45,6 +45,7 @@ REGISTER_OP("ReverbDataset")
     .Attr("max_samples_per_stream: int = -1")
     .Attr("rate_limiter_timeout_ms: int = -1")
     .Attr("flexible_batch_size: int = -1")
+    .Attr("batch_size: int = -1")
     .Attr("dtypes: list(type) >= 1")
     .Attr("shapes: list(shape) >= 1")
     .Output("dataset: variant")
@@ -75,7 +76,8 @@ Emitting complete samples is more efficient as it avoids the memcopies involved
 in splitting up a sequence and then batching it up again.
 
 `max_in_flight_samples_per_worker` (defaults to 100) is the maximum number of
- sampled item allowed to exist in flight (per iterator). See
+ sampled item allowed to exist in flight (per iterator). If -1 then the number
+is adapted to the rate at which samples are consumed. See
 `Sampler::Options::max_in_flight_samples_per_worker` for more details.
 
 `num_workers_per_iterator` (defaults to -1, i.e auto selected) is the number of
@@ -109,6 +111,14 @@ auto selected value should almost always be preferred.
 Larger `flexible_batch_size` values result a bias towards sampling over
 inserts. In highly overloaded systems this results in higher sample QPS
 and lower insert QPS compared to lower `flexible_batch_size` values.
+
+`batch_size` (defaults to -1, i.e. unbatched) is the number of sequences to
+return from each call to `GetNext`. Requires `emit_timesteps` to be false. When
+set, the iterator allocates the `[batch_size, sequence_length, ...]` outputs
+once and copies every sampled sequence directly into its row, which avoids the
+extra copy made by a subsequent `.batch()`. `shapes` still describe a single
+sequence. If the sampler stops before a batch is complete then the partial
+batch is dropped.
 )doc");
 
 class ReverbDatasetOp : public tensorflow::data::DatasetOpKernel {
@@ -126,6 +136,7 @@ class ReverbDatasetOp : public tensorflow::data::DatasetOpKernel {
                                      &sampler_options_.flexible_batch_size));
     OP_REQUIRES_OK(ctx, ctx->GetAttr("sequence_length", &sequence_length_));
     OP_REQUIRES_OK(ctx, ctx->GetAttr("emit_timesteps", &emit_timesteps_));
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("batch_size", &batch_size_));
     tensorflow::int64 rate_limiter_timeout_ms;
     OP_REQUIRES_OK(
         ctx, ctx->GetAttr("rate_limiter_timeout_ms", &rate_limiter_timeout_ms));
@@ -155,6 +166,13 @@ class ReverbDatasetOp : public tensorflow::data::DatasetOpKernel {
       }
     }
 
+    OP_REQUIRES(ctx, batch_size_ == -1 || batch_size_ >= 1,
+                InvalidArgument("batch_size (", batch_size_,
+                                ") must be -1 or >= 1."));
+    OP_REQUIRES(ctx, batch_size_ == -1 || !emit_timesteps_,
+                InvalidArgument("batch_size can only be set when "
+                                "emit_timesteps is false."));
+
     OP_REQUIRES_OK(ctx, ToTensorflowStatus(sampler_options_.Validate()));
   }
 
@@ -170,7 +188,8 @@ class ReverbDatasetOp : public tensorflow::data::DatasetOpKernel {
                        ctx, "table", &table));
 
     *output = new Dataset(ctx, server_address, dtypes_, shapes_, table,
-                          sampler_options_, sequence_length_, emit_timesteps_);
+                          sampler_options_, sequence_length_, emit_timesteps_,
+                          batch_size_);
   }
 
  private:
@@ -180,16 +199,25 @@ class ReverbDatasetOp : public tensorflow::data::DatasetOpKernel {
             tensorflow::DataTypeVector dtypes,
             std::vector<tensorflow::PartialTensorShape> shapes,
             std::string table, const Sampler::Options& sampler_options,
-            int sequence_length, bool emit_timesteps)
+            int sequence_length, bool emit_timesteps, int batch_size)
         : tensorflow::data::DatasetBase(tensorflow::data::DatasetContext(ctx)),
           server_address_(std::move(server_address)),
           dtypes_(std::move(dtypes)),
           shapes_(std::move(shapes)),
+          output_shapes_(shapes_),
           table_(std::move(table)),
           sampler_options_(sampler_options),
           sequence_length_(sequence_length),
           emit_timesteps_(emit_timesteps),
-          client_(absl::make_unique<Client>(server_address_)) {}
+          batch_size_(batch_size),
+          client_(absl::make_unique<Client>(server_address_)) {
+      if (batch_size_ > 0) {
+        for (auto& shape : output_shapes_) {
+          shape =
+              tensorflow::PartialTensorShape({batch_size_}).Concatenate(shape);
+        }
+      }
+    }
 
     std::unique_ptr<tensorflow::data::IteratorBase> MakeIteratorInternal(
         const std::string& prefix) const override {
@@ -197,7 +225,7 @@ class ReverbDatasetOp : public tensorflow::data::DatasetOpKernel {
           tensorflow::data::DatasetIterator<Dataset>::Params{
               this, absl::StrCat(prefix, "::ReverbDataset")},
           client_.get(), table_, sampler_options_, sequence_length_,
-          emit_timesteps_, dtypes_, shapes_);
+          emit_timesteps_, batch_size_, dtypes_, shapes_);
     }
 
     const tensorflow::DataTypeVector& output_dtypes() const override {
@@ -206,7 +234,7 @@ class ReverbDatasetOp : public tensorflow::data::DatasetOpKernel {
 
     const std::vector<tensorflow::PartialTensorShape>& output_shapes()
         const override {
-      return shapes_;
+      return output_shapes_;
     }
 
     std::string DebugString() const override {
@@ -228,6 +256,7 @@ class ReverbDatasetOp : public tensorflow::data::DatasetOpKernel {
       tensorflow::AttrValue emit_timesteps_attr;
       tensorflow::AttrValue rate_limiter_timeout_ms_attr;
       tensorflow::AttrValue flexible_batch_size_attr;
+      tensorflow::AttrValue batch_size_attr;
       tensorflow::AttrValue dtypes_attr;
       tensorflow::AttrValue shapes_attr;
 
@@ -250,6 +279,7 @@ class ReverbDatasetOp : public tensorflow::data::DatasetOpKernel {
       b->BuildAttrValue(emit_timesteps_, &emit_timesteps_attr);
       b->BuildAttrValue(sampler_options_.flexible_batch_size,
                         &flexible_batch_size_attr);
+      b->BuildAttrValue(batch_size_, &batch_size_attr);
       b->BuildAttrValue(dtypes_, &dtypes_attr);
       b->BuildAttrValue(shapes_, &shapes_attr);
 
@@ -266,6 +296,7 @@ class ReverbDatasetOp : public tensorflow::data::DatasetOpKernel {
               {"emit_timesteps", emit_timesteps_attr},
               {"rate_limiter_timeout_ms", rate_limiter_timeout_ms_attr},
               {"flexible_batch_size", flexible_batch_size_attr},
+              {"batch_size", batch_size_attr},
               {"dtypes", dtypes_attr},
               {"shapes", shapes_attr},
           },
@@ -280,7 +311,8 @@ class ReverbDatasetOp : public tensorflow::data::DatasetOpKernel {
       explicit Iterator(
           const Params& params, Client* client, const std::string& table,
           const Sampler::Options& sampler_options, int sequence_length,
-          bool emit_timesteps, const tensorflow::DataTypeVector& dtypes,
+          bool emit_timesteps, int batch_size,
+          const tensorflow::DataTypeVector& dtypes,
           const std::vector<tensorflow::PartialTensorShape>& shapes)
           : DatasetIterator<Dataset>(params),
             client_(client),
@@ -288,6 +320,7 @@ class ReverbDatasetOp : public tensorflow::data::DatasetOpKernel {
             sampler_options_(sampler_options),
             sequence_length_(sequence_length),
             emit_timesteps_(emit_timesteps),
+            batch_size_(batch_size),
             dtypes_(dtypes),
             shapes_(shapes),
             step_within_sample_(0) {}
@@ -363,6 +396,9 @@ class ReverbDatasetOp : public tensorflow::data::DatasetOpKernel {
           if (last_timestep) {
             step_within_sample_ = 0;
           }
+        } else if (batch_size_ > 0) {
+          status = ToTensorflowStatus(
+              sampler_->GetNextSampleBatch(batch_size_, out_tensors));
         } else {
           status = ToTensorflowStatus(sampler_->GetNextSample(out_tensors));
         }
@@ -404,6 +440,7 @@ class ReverbDatasetOp : public tensorflow::data::DatasetOpKernel {
       const Sampler::Options sampler_options_;
       const int sequence_length_;
       const bool emit_timesteps_;
+      const int batch_size_;
       const tensorflow::DataTypeVector& dtypes_;
       const std::vector<tensorflow::PartialTensorShape>& shapes_;
       std::unique_ptr<Sampler> sampler_;
@@ -413,16 +450,19 @@ class ReverbDatasetOp : public tensorflow::data::DatasetOpKernel {
     const std::string server_address_;
     const tensorflow::DataTypeVector dtypes_;
     const std::vector<tensorflow::PartialTensorShape> shapes_;
+    std::vector<tensorflow::PartialTensorShape> output_shapes_;
     const std::string table_;
     const Sampler::Options sampler_options_;
     const int sequence_length_;
     const bool emit_timesteps_;
+    const int batch_size_;
     std::unique_ptr<Client> client_;
   };  // Dataset.
 
   Sampler::Options sampler_options_;
   int sequence_length_;
   bool emit_timesteps_;
+  int batch_size_;
   tensorflow::DataTypeVector dtypes_;
   std::vector<tensorflow::PartialTensorShape> shapes_;
 
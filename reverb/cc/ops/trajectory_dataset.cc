@@ -32,6 +32,7 @@ namespace {
 
 using ::tensorflow::errors::Cancelled;
 using ::tensorflow::errors::FailedPrecondition;
+using ::tensorflow::errors::InvalidArgument;
 using ::tensorflow::errors::Unimplemented;
 
 REGISTER_OP("ReverbTrajectoryDataset")
@@ -42,6 +43,7 @@ REGISTER_OP("ReverbTrajectoryDataset")
     .Attr("max_samples_per_stream: int = -1")
     .Attr("rate_limiter_timeout_ms: int = -1")
     .Attr("flexible_batch_size: int = -1")
+    .Attr("batch_size: int = -1")
     .Attr("dtypes: list(type) >= 1")
     .Attr("shapes: list(shape) >= 1")
     .Output("dataset: variant")
@@ -60,7 +62,8 @@ parallel streams using a single connection.
 referenced by items in `table`.
 
 `max_in_flight_samples_per_worker` (defaults to 100) is the maximum number of
- sampled item allowed to exist in flight (per iterator). See
+ sampled item allowed to exist in flight (per iterator). If -1 then the number
+is adapted to the rate at which samples are consumed. See
 `Sampler::Options::max_in_flight_samples_per_worker` for more details.
 
 `num_workers_per_iterator` (defaults to -1, i.e auto selected) is the number of
@@ -94,6 +97,15 @@ auto selected value should almost always be preferred.
 Larger `flexible_batch_size` values result a bias towards sampling over
 inserts. In highly overloaded systems this results in higher sample QPS
 and lower insert QPS compared to lower `flexible_batch_size` values.
+
+`batch_size` (defaults to -1, i.e. unbatched) is the number of trajectories
+to return from each call to `GetNext`. When set, the iterator allocates the
+`[batch_size, ...]` outputs once and copies every sampled trajectory directly
+into its row, which avoids the extra copy made by a subsequent `.batch()`.
+The key, probability, table size and priority are returned as vectors of
+length `batch_size`. `shapes` still describe a single trajectory and all
+trajectories in a batch must have the same shape. If the sampler stops before
+a batch is complete then the partial batch is dropped.
 )doc");
 
 class ReverbTrajectoryDatasetOp : public tensorflow::data::DatasetOpKernel {
@@ -112,12 +124,17 @@ class ReverbTrajectoryDatasetOp : public tensorflow::data::DatasetOpKernel {
     tensorflow::int64 rate_limiter_timeout_ms;
     OP_REQUIRES_OK(
         ctx, ctx->GetAttr("rate_limiter_timeout_ms", &rate_limiter_timeout_ms));
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("batch_size", &batch_size_));
     OP_REQUIRES_OK(ctx, ctx->GetAttr("shapes", &shapes_));
     OP_REQUIRES_OK(ctx, ctx->GetAttr("dtypes", &dtypes_));
 
     sampler_options_.rate_limiter_timeout =
         Int64MillisToNonnegativeDuration(rate_limiter_timeout_ms);
 
+    OP_REQUIRES(ctx, batch_size_ == -1 || batch_size_ >= 1,
+                InvalidArgument("batch_size (", batch_size_,
+                                ") must be -1 or >= 1."));
+
     OP_REQUIRES_OK(ctx, ToTensorflowStatus(sampler_options_.Validate()));
   }
 
@@ -133,7 +150,7 @@ class ReverbTrajectoryDatasetOp : public tensorflow::data::DatasetOpKernel {
                        ctx, "table", &table));
 
     *output = new Dataset(ctx, server_address, dtypes_, shapes_, table,
-                          sampler_options_);
+                          sampler_options_, batch_size_);
   }
 
  private:
@@ -142,21 +159,32 @@ class ReverbTrajectoryDatasetOp : public tensorflow::data::DatasetOpKernel {
     Dataset(tensorflow::OpKernelContext* ctx, std::string server_address,
             tensorflow::DataTypeVector dtypes,
             std::vector<tensorflow::PartialTensorShape> shapes,
-            std::string table, const Sampler::Options& sampler_options)
+            std::string table, const Sampler::Options& sampler_options,
+            int batch_size)
         : tensorflow::data::DatasetBase(tensorflow::data::DatasetContext(ctx)),
           server_address_(std::move(server_address)),
           dtypes_(std::move(dtypes)),
           shapes_(std::move(shapes)),
+          output_shapes_(shapes_),
           table_(std::move(table)),
           sampler_options_(sampler_options),
-          client_(absl::make_unique<Client>(server_address_)) {}
+          batch_size_(batch_size),
+          client_(absl::make_unique<Client>(server_address_)) {
+      if (batch_size_ > 0) {
+        for (auto& shape : output_shapes_) {
+          shape =
+              tensorflow::PartialTensorShape({batch_size_}).Concatenate(shape);
+        }
+      }
+    }
 
     std::unique_ptr<tensorflow::data::IteratorBase> MakeIteratorInternal(
         const std::string& prefix) const override {
       return absl::make_unique<Iterator>(
           tensorflow::data::DatasetIterator<Dataset>::Params{
               this, absl::StrCat(prefix, "::ReverbDataset")},
-          client_.get(), table_, sampler_options_, dtypes_, shapes_);
+          client_.get(), table_, sampler_options_, batch_size_, dtypes_,
+          shapes_);
     }
 
     const tensorflow::DataTypeVector& output_dtypes() const override {
@@ -165,7 +193,7 @@ class ReverbTrajectoryDatasetOp : public tensorflow::data::DatasetOpKernel {
 
     const std::vector<tensorflow::PartialTensorShape>& output_shapes()
         const override {
-      return shapes_;
+      return output_shapes_;
     }
 
     std::string DebugString() const override {
@@ -185,6 +213,7 @@ class ReverbTrajectoryDatasetOp : public tensorflow::data::DatasetOpKernel {
       tensorflow::AttrValue max_samples_per_stream_attr;
       tensorflow::AttrValue rate_limiter_timeout_ms_attr;
       tensorflow::AttrValue flexible_batch_size_attr;
+      tensorflow::AttrValue batch_size_attr;
       tensorflow::AttrValue dtypes_attr;
       tensorflow::AttrValue shapes_attr;
 
@@ -205,6 +234,7 @@ class ReverbTrajectoryDatasetOp : public tensorflow::data::DatasetOpKernel {
           &rate_limiter_timeout_ms_attr);
       b->BuildAttrValue(sampler_options_.flexible_batch_size,
                         &flexible_batch_size_attr);
+      b->BuildAttrValue(batch_size_, &batch_size_attr);
       b->BuildAttrValue(dtypes_, &dtypes_attr);
       b->BuildAttrValue(shapes_, &shapes_attr);
 
@@ -219,6 +249,7 @@ class ReverbTrajectoryDatasetOp : public tensorflow::data::DatasetOpKernel {
               {"max_samples_per_stream", max_samples_per_stream_attr},
               {"rate_limiter_timeout_ms", rate_limiter_timeout_ms_attr},
               {"flexible_batch_size", flexible_batch_size_attr},
+              {"batch_size", batch_size_attr},
               {"dtypes", dtypes_attr},
               {"shapes", shapes_attr},
           },
@@ -232,13 +263,14 @@ class ReverbTrajectoryDatasetOp : public tensorflow::data::DatasetOpKernel {
      public:
       explicit Iterator(
           const Params& params, Client* client, const std::string& table,
-          const Sampler::Options& sampler_options,
+          const Sampler::Options& sampler_options, int batch_size,
           const tensorflow::DataTypeVector& dtypes,
           const std::vector<tensorflow::PartialTensorShape>& shapes)
           : DatasetIterator<Dataset>(params),
             client_(client),
             table_(table),
             sampler_options_(sampler_options),
+            batch_size_(batch_size),
             dtypes_(dtypes),
             shapes_(shapes),
             step_within_sample_(0) {}
@@ -280,8 +312,10 @@ class ReverbTrajectoryDatasetOp : public tensorflow::data::DatasetOpKernel {
           sampler_->Close();
         }
 
-        auto status =
-            ToTensorflowStatus(sampler_->GetNextTrajectory(out_tensors));
+        auto status = ToTensorflowStatus(
+            batch_size_ > 0
+                ? sampler_->GetNextTrajectoryBatch(batch_size_, out_tensors)
+                : sampler_->GetNextTrajectory(out_tensors));
         if (registered &&
             !ctx->cancellation_manager()->DeregisterCallback(token)) {
           return Cancelled("Iterator context was cancelled");
@@ -317,6 +351,7 @@ class ReverbTrajectoryDatasetOp : public tensorflow::data::DatasetOpKernel {
       Client* client_;
       const std::string& table_;
       const Sampler::Options sampler_options_;
+      const int batch_size_;
       const tensorflow::DataTypeVector& dtypes_;
       const std::vector<tensorflow::PartialTensorShape>& shapes_;
       std::unique_ptr<Sampler> sampler_;
@@ -326,12 +361,15 @@ class ReverbTrajectoryDatasetOp : public tensorflow::data::DatasetOpKernel {
     const std::string server_address_;
     const tensorflow::DataTypeVector dtypes_;
     const std::vector<tensorflow::PartialTensorShape> shapes_;
+    std::vector<tensorflow::PartialTensorShape> output_shapes_;
     const std::string table_;
     const Sampler::Options sampler_options_;
+    const int batch_size_;
     std::unique_ptr<Client> client_;
   };  // Dataset.
 
   Sampler::Options sampler_options_;
+  int batch_size_;
   tensorflow::DataTypeVector dtypes_;
   std::vector<tensorflow::PartialTensorShape> shapes_;
 
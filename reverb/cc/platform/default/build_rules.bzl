@@ -277,6 +277,32 @@ def reverb_cc_test(name, srcs, deps = [], **kwargs):
         **kwargs
     )
 
+def reverb_cc_benchmark(name, srcs, deps = [], **kwargs):
+    """Reverb-specific Google Benchmark binary.
+
+    Benchmarks are regular binaries (rather than tests) and should be run with
+    `bazel run -c opt`.
+
+    Args:
+      name: Target name.
+      srcs: Target sources.
+      deps: Target deps.
+      **kwargs: Additional args to cc_binary.
+    """
+    new_deps = [
+        "@com_github_google_benchmark//:benchmark_main",
+        "@tensorflow_includes//:includes",
+        "@tensorflow_solib//:framework_lib",
+    ]
+    native.cc_binary(
+        name = name,
+        copts = tf_copts(),
+        srcs = srcs,
+        testonly = 1,
+        deps = depset(deps + new_deps),
+        **kwargs
+    )
+
 def reverb_gen_op_wrapper_py(name, out, kernel_lib, linkopts = [], **kwargs):
     """Generates the py_library `name` with a data dep on the ops in kernel_lib.
 
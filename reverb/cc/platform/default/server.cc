@@ -19,6 +19,7 @@
 
 #include "grpcpp/server_builder.h"
 #include "absl/strings/str_cat.h"
+#include "absl/time/time.h"
 #include "reverb/cc/checkpointing/interface.h"
 #include "reverb/cc/client.h"
 #include "reverb/cc/platform/grpc_utils.h"
@@ -35,11 +36,13 @@ class ServerImpl : public Server {
   ServerImpl(int port) : port_(port) {}
 
   absl::Status Initialize(std::vector<std::shared_ptr<Table>> tables,
-                          std::shared_ptr<Checkpointer> checkpointer) {
+                          std::shared_ptr<Checkpointer> checkpointer,
+                          ReverbServiceImpl::Options options) {
     absl::WriterMutexLock lock(&mu_);
     REVERB_CHECK(!running_) << "Initialize() called twice?";
     REVERB_RETURN_IF_ERROR(ReverbServiceImpl::Create(
-        std::move(tables), std::move(checkpointer), &reverb_service_));
+        std::move(tables), std::move(checkpointer), std::move(options),
+        &reverb_service_));
     server_ = grpc::ServerBuilder()
                   .AddListeningPort(absl::StrCat("[::]:", port_),
                                     MakeServerCredentials())
@@ -91,6 +94,10 @@ class ServerImpl : public Server {
                         ")");
   }
 
+  std::string MetricsText() const override {
+    return reverb_service_->MetricsText();
+  }
+
  private:
   int port_;
   std::unique_ptr<ReverbServiceImpl> reverb_service_;
@@ -105,9 +112,27 @@ class ServerImpl : public Server {
 absl::Status StartServer(std::vector<std::shared_ptr<Table>> tables, int port,
                          std::shared_ptr<Checkpointer> checkpointer,
                          std::unique_ptr<Server> *server) {
+  return StartServer(std::move(tables), port, std::move(checkpointer),
+                     /*checkpoint_interval=*/absl::ZeroDuration(), server);
+}
+
+absl::Status StartServer(std::vector<std::shared_ptr<Table>> tables, int port,
+                         std::shared_ptr<Checkpointer> checkpointer,
+                         absl::Duration checkpoint_interval,
+                         std::unique_ptr<Server> *server) {
+  ReverbServiceImpl::Options options;
+  options.checkpoint_interval = checkpoint_interval;
+  return StartServer(std::move(tables), port, std::move(checkpointer),
+                     std::move(options), server);
+}
+
+absl::Status StartServer(std::vector<std::shared_ptr<Table>> tables, int port,
+                         std::shared_ptr<Checkpointer> checkpointer,
+                         ReverbServiceImpl::Options options,
+                         std::unique_ptr<Server> *server) {
   auto s = absl::make_unique<ServerImpl>(port);
-  REVERB_RETURN_IF_ERROR(
-      s->Initialize(std::move(tables), std::move(checkpointer)));
+  REVERB_RETURN_IF_ERROR(s->Initialize(
+      std::move(tables), std::move(checkpointer), std::move(options)));
   *server = std::move(s);
   return absl::OkStatus();
 }
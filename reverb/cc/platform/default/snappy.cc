@@ -150,6 +150,22 @@ class CheckedByteArraySink : public snappy::Sink {
   bool overflowed_;
 };
 
+// A snappy Sink which forwards every appended piece to a callback.
+class CallbackSink : public snappy::Sink {
+ public:
+  explicit CallbackSink(const std::function<void(absl::string_view)>& consume)
+      : consume_(consume) {}
+  CallbackSink(const CallbackSink&) = delete;
+  CallbackSink& operator=(const CallbackSink&) = delete;
+
+  void Append(const char* bytes, size_t n) override {
+    consume_(absl::string_view(bytes, n));
+  }
+
+ private:
+  const std::function<void(absl::string_view)>& consume_;
+};
+
 }  // namespace
 
 template <>
@@ -167,5 +183,14 @@ bool SnappyUncompressToString(const std::string& input, size_t output_capacity,
   return snappy::Uncompress(&source, &sink);
 }
 
+template <>
+bool SnappyUncompressToCallback(
+    const std::string& input,
+    const std::function<void(absl::string_view)>& consume) {
+  snappy::ByteArraySource source(input.data(), input.size());
+  CallbackSink sink(consume);
+  return snappy::Uncompress(&source, &sink);
+}
+
 }  // namespace reverb
 }  // namespace deepmind
@@ -16,6 +16,11 @@
 
 #include <thread>  // NOLINT(build/c++11)
 
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 #include "absl/memory/memory.h"
 
 namespace deepmind {
@@ -40,6 +45,24 @@ std::unique_ptr<Thread> StartThread(absl::string_view name,
   return {absl::make_unique<StdThread>(std::move(fn))};
 }
 
+bool SetCurrentThreadLowIoPriority() {
+#if defined(__linux__) && defined(SYS_ioprio_set)
+  // Values from linux/ioprio.h, which is not exposed by glibc. Use the lowest
+  // level of the best-effort class rather than the idle class as the latter
+  // can starve the thread indefinitely on a busy disk.
+  constexpr int kIoprioWhoProcess = 1;
+  constexpr int kIoprioClassBestEffort = 2;
+  constexpr int kIoprioClassShift = 13;
+  constexpr int kLowestBestEffortLevel = 7;
+  // A `who` of 0 refers to the calling thread.
+  return syscall(SYS_ioprio_set, kIoprioWhoProcess, 0,
+                 (kIoprioClassBestEffort << kIoprioClassShift) |
+                     kLowestBestEffortLevel) == 0;
+#else
+  return false;
+#endif
+}
+
 }  // namespace internal
 }  // namespace reverb
 }  // namespace deepmind
@@ -19,8 +19,10 @@
 #include <vector>
 
 #include "absl/status/status.h"
+#include "absl/time/time.h"
 #include "reverb/cc/checkpointing/interface.h"
 #include "reverb/cc/client.h"
+#include "reverb/cc/reverb_service_impl.h"
 #include "reverb/cc/table.h"
 
 namespace deepmind {
@@ -47,12 +49,31 @@ class Server {
 
   // Returns a summary string description.
   virtual std::string DebugString() const = 0;
+
+  // Returns the metrics of the server in the Prometheus text exposition
+  // format. The same text is returned by the `Metrics` RPC.
+  virtual std::string MetricsText() const = 0;
 };
 
 absl::Status StartServer(std::vector<std::shared_ptr<Table>> tables, int port,
                          std::shared_ptr<Checkpointer> checkpointer,
                          std::unique_ptr<Server> *server);
 
+// Same as above but also saves a checkpoint in the background every
+// `checkpoint_interval`. Periodic checkpoints are written with lowered I/O
+// priority and are skipped if a checkpoint requested by a client is already in
+// progress. `checkpointer` must not be nullptr.
+absl::Status StartServer(std::vector<std::shared_ptr<Table>> tables, int port,
+                         std::shared_ptr<Checkpointer> checkpointer,
+                         absl::Duration checkpoint_interval,
+                         std::unique_ptr<Server> *server);
+
+// Same as above but with full control over the options of the service.
+absl::Status StartServer(std::vector<std::shared_ptr<Table>> tables, int port,
+                         std::shared_ptr<Checkpointer> checkpointer,
+                         ReverbServiceImpl::Options options,
+                         std::unique_ptr<Server> *server);
+
 }  // namespace reverb
 }  // namespace deepmind
 
@@ -15,6 +15,7 @@
 #include "reverb/cc/platform/server.h"
 
 #include <memory>
+#include <string>
 
 #include "grpcpp/impl/codegen/client_context.h"
 #include "grpcpp/impl/codegen/status.h"
@@ -36,6 +37,18 @@ TEST(ServerTest, StartServer) {
                                &server));
 }
 
+TEST(ServerTest, MetricsAreServedByRpc) {
+  int port = internal::PickUnusedPortOrDie();
+  std::unique_ptr<Server> server;
+  REVERB_ASSERT_OK(StartServer(/*tables=*/{},
+                               /*port=*/port, /*checkpointer=*/nullptr,
+                               &server));
+  std::string text;
+  REVERB_ASSERT_OK(server->InProcessClient()->Metrics(&text));
+  EXPECT_THAT(text, ::testing::HasSubstr("# TYPE reverb_open_streams gauge"));
+  EXPECT_EQ(text, server->MetricsText());
+}
+
 TEST(ServerTest, ErrorOnUnavailablePort) {
   // We expect that port==-1 to always be unavailable.
   std::unique_ptr<Server> server;
@@ -16,6 +16,7 @@
 #define REVERB_CC_PLATFORM_SNAPPY_H_
 
 #include <cstddef>
+#include <functional>
 
 #include "absl/strings/string_view.h"
 
@@ -31,6 +32,15 @@ template <typename Tinput>
 bool SnappyUncompressToString(const Tinput& input, size_t output_capacity,
                               char* output);
 
+// Uncompress an `input` containing snappy-compressed data and pass the result
+// to `consume` as one or more consecutive pieces. Unlike
+// `SnappyUncompressToString`, the caller does not need to provide a buffer
+// large enough to hold the entire uncompressed data.
+template <typename Tinput>
+bool SnappyUncompressToCallback(
+    const Tinput& input,
+    const std::function<void(absl::string_view)>& consume);
+
 }  // namespace reverb
 }  // namespace deepmind
 
@@ -34,6 +34,7 @@
 #include "reverb/cc/platform/hash_map.h"
 #include "reverb/cc/platform/hash_set.h"
 #include "reverb/cc/platform/status_macros.h"
+#include "reverb/cc/platform/tfrecord_write_ahead_log.h"
 #include "reverb/cc/rate_limiter.h"
 #include "reverb/cc/schema.pb.h"
 #include "reverb/cc/selectors/fifo.h"
@@ -59,6 +60,7 @@ namespace {
 constexpr char kTablesFileName[] = "tables.tfrecord";
 constexpr char kChunksFileName[] = "chunks.tfrecord";
 constexpr char kDoneFileName[] = "DONE";
+constexpr char kWriteAheadLogFileName[] = "wal.tfrecord";
 
 using RecordWriterUniquePtr =
     std::unique_ptr<tensorflow::io::RecordWriter,
@@ -130,6 +132,30 @@ std::unique_ptr<ItemSelector> MakeDistribution(
   }
 }
 
+// Sleeps as needed to keep the average rate at which bytes are written since
+// construction below `max_bytes_per_second`. Values <= 0 disables the limit.
+class WriteThrottle {
+ public:
+  explicit WriteThrottle(int64_t max_bytes_per_second)
+      : max_bytes_per_second_(max_bytes_per_second), start_(absl::Now()) {}
+
+  // Registers that `num_bytes` have been written and blocks until writing them
+  // no longer exceeds the limit.
+  void Wait(size_t num_bytes) {
+    if (max_bytes_per_second_ <= 0) return;
+    bytes_written_ += num_bytes;
+    const absl::Time allowed_at =
+        start_ + absl::Seconds(static_cast<double>(bytes_written_) /
+                               max_bytes_per_second_);
+    absl::SleepFor(allowed_at - absl::Now());
+  }
+
+ private:
+  const int64_t max_bytes_per_second_;
+  const absl::Time start_;
+  int64_t bytes_written_ = 0;
+};
+
 inline size_t find_table_index(
     const std::vector<std::shared_ptr<Table>>* tables,
     const std::string& name) {
@@ -143,13 +169,36 @@ inline size_t find_table_index(
 
 TFRecordCheckpointer::TFRecordCheckpointer(std::string root_dir,
                                            std::string group)
-    : root_dir_(std::move(root_dir)), group_(std::move(group)) {
+    : TFRecordCheckpointer(std::move(root_dir), std::move(group), Options()) {}
+
+TFRecordCheckpointer::TFRecordCheckpointer(std::string root_dir,
+                                           std::string group, Options options)
+    : root_dir_(std::move(root_dir)),
+      group_(std::move(group)),
+      options_(options),
+      write_ahead_log_(options.use_write_ahead_log
+                           ? absl::make_unique<TFRecordWriteAheadLog>()
+                           : nullptr) {
   REVERB_LOG(REVERB_INFO) << "Initializing TFRecordCheckpointer in "
                           << root_dir_;
 }
 
 absl::Status TFRecordCheckpointer::Save(std::vector<Table*> tables,
                                         int keep_latest, std::string* path) {
+  return SaveInternal(std::move(tables), keep_latest,
+                      /*max_write_bytes_per_second=*/0, path);
+}
+
+absl::Status TFRecordCheckpointer::SaveInBackground(std::vector<Table*> tables,
+                                                    int keep_latest,
+                                                    std::string* path) {
+  return SaveInternal(std::move(tables), keep_latest,
+                      options_.max_write_bytes_per_second, path);
+}
+
+absl::Status TFRecordCheckpointer::SaveInternal(
+    std::vector<Table*> tables, int keep_latest,
+    int64_t max_write_bytes_per_second, std::string* path) {
   if (keep_latest <= 0) {
     return absl::InvalidArgumentError(
         "TFRecordCheckpointer must have keep_latest > 0.");
@@ -164,6 +213,18 @@ absl::Status TFRecordCheckpointer::Save(std::vector<Table*> tables,
   REVERB_RETURN_IF_ERROR(FromTensorflowStatus(
       tensorflow::Env::Default()->RecursivelyCreateDir(dir_path)));
 
+  // Changes made from this point onwards are recorded in the log of the new
+  // checkpoint. Changes made before a table is encoded below are thus both part
+  // of the checkpoint and the log. The checkpoint of each table stores the
+  // sequence number of the last change it includes so these entries are
+  // skipped when the log is replayed.
+  if (write_ahead_log_ != nullptr) {
+    REVERB_RETURN_IF_ERROR(write_ahead_log_->Rotate(
+        tensorflow::io::JoinPath(dir_path, kWriteAheadLogFileName)));
+  }
+
+  WriteThrottle throttle(max_write_bytes_per_second);
+
   RecordWriterUniquePtr table_writer;
   REVERB_RETURN_IF_ERROR(OpenWriter(
       tensorflow::io::JoinPath(dir_path, kTablesFileName), &table_writer));
@@ -172,8 +233,10 @@ absl::Status TFRecordCheckpointer::Save(std::vector<Table*> tables,
   for (Table* table : tables) {
     auto checkpoint = table->Checkpoint();
     chunks.merge(checkpoint.chunks);
-    REVERB_RETURN_IF_ERROR(FromTensorflowStatus(
-        table_writer->WriteRecord(checkpoint.checkpoint.SerializeAsString())));
+    std::string record = checkpoint.checkpoint.SerializeAsString();
+    REVERB_RETURN_IF_ERROR(
+        FromTensorflowStatus(table_writer->WriteRecord(record)));
+    throttle.Wait(record.size());
   }
 
   REVERB_RETURN_IF_ERROR(FromTensorflowStatus(table_writer->Close()));
@@ -186,6 +249,7 @@ absl::Status TFRecordCheckpointer::Save(std::vector<Table*> tables,
   for (const auto& chunk : chunks) {
     REVERB_RETURN_IF_ERROR(FromTensorflowStatus(
         chunk_writer->WriteRecord(chunk->data().SerializeAsString())));
+    throttle.Wait(chunk->DataByteSizeLong());
   }
   REVERB_RETURN_IF_ERROR(FromTensorflowStatus(chunk_writer->Close()));
   chunk_writer = nullptr;
@@ -269,6 +333,10 @@ absl::Status TFRecordCheckpointer::Load(
   REVERB_RETURN_IF_ERROR(OpenReader(
       tensorflow::io::JoinPath(dir_path, kTablesFileName), &table_reader));
 
+  // Restored rate limiters keyed by the limiter of the table being replaced.
+  internal::flat_hash_map<RateLimiter*, std::shared_ptr<RateLimiter>>
+      rate_limiters;
+
   PriorityTableCheckpoint checkpoint;
   absl::Status table_status;
   tensorflow::uint64 table_offset = 0;
@@ -298,8 +366,14 @@ absl::Status TFRecordCheckpointer::Load(
 
     auto sampler = MakeDistribution(checkpoint.sampler());
     auto remover = MakeDistribution(checkpoint.remover());
-    auto rate_limiter =
-        std::make_shared<RateLimiter>(checkpoint.rate_limiter());
+    // Tables which share a rate limiter must continue to do so after the load.
+    // The checkpoints of such tables all hold the combined counts so the
+    // limiter is restored from the first of them.
+    auto& rate_limiter =
+        rate_limiters[tables->at(index)->rate_limiter().get()];
+    if (rate_limiter == nullptr) {
+      rate_limiter = std::make_shared<RateLimiter>(checkpoint.rate_limiter());
+    }
     auto extensions = tables->at(index)->UnsafeClearExtensions();
     auto signature =
         checkpoint.has_signature()
@@ -312,11 +386,15 @@ absl::Status TFRecordCheckpointer::Load(
         /*remover=*/std::move(remover),
         /*max_size=*/checkpoint.max_size(),
         /*max_times_sampled=*/checkpoint.max_times_sampled(),
-        /*rate_limiter=*/std::move(rate_limiter),
+        /*rate_limiter=*/rate_limiter,
         /*extensions=*/std::move(extensions),
-        /*signature=*/std::move(signature));
+        /*signature=*/std::move(signature),
+        /*sample_window_length=*/checkpoint.sample_window_length());
     table->set_num_deleted_episodes_from_checkpoint(
         checkpoint.num_deleted_episodes());
+    table->set_num_samples_drawn_from_checkpoint(
+        checkpoint.num_samples_drawn());
+    table->set_write_ahead_log_sequence(checkpoint.write_ahead_log_sequence());
 
     for (const auto& checkpoint_item : checkpoint.items()) {
       Table::Item insert_item;
@@ -373,18 +451,140 @@ absl::Status TFRecordCheckpointer::LoadLatest(
       FromTensorflowStatus(tensorflow::Env::Default()->GetMatchingPaths(
           tensorflow::io::JoinPath(root_dir_, "*"), &filenames)));
   std::sort(filenames.begin(), filenames.end());
-  for (auto it = filenames.rbegin(); it != filenames.rend(); it++) {
-    if (HasDone(*it)) {
-      return Load(tensorflow::io::Basename(*it), chunk_store, tables);
-    }
+
+  auto latest = std::find_if(filenames.rbegin(), filenames.rend(), HasDone);
+  if (latest != filenames.rend()) {
+    REVERB_RETURN_IF_ERROR(
+        Load(tensorflow::io::Basename(*latest), chunk_store, tables));
+  }
+
+  if (write_ahead_log_ == nullptr) {
+    if (latest != filenames.rend()) return absl::OkStatus();
+    return absl::NotFoundError(
+        absl::StrCat("No checkpoint found in ", root_dir_));
   }
-  return absl::NotFoundError(
-      absl::StrCat("No checkpoint found in ", root_dir_));
+
+  // Replay the log of the loaded checkpoint followed by the logs of any
+  // checkpoints that were started but never completed after it. If no
+  // checkpoint has been completed then all logs are replayed.
+  internal::flat_hash_map<ChunkStore::Key, std::shared_ptr<ChunkStore::Chunk>>
+      chunk_by_key;
+  bool found_log = false;
+  for (auto it = latest == filenames.rend() ? filenames.begin()
+                                            : std::prev(latest.base());
+       it != filenames.end(); ++it) {
+    const std::string path =
+        tensorflow::io::JoinPath(*it, kWriteAheadLogFileName);
+    if (!tensorflow::Env::Default()->FileExists(path).ok()) continue;
+    REVERB_RETURN_IF_ERROR(
+        ReplayWriteAheadLog(path, chunk_store, tables, &chunk_by_key));
+    found_log = true;
+  }
+
+  if (latest == filenames.rend() && !found_log) {
+    return absl::NotFoundError(
+        absl::StrCat("No checkpoint found in ", root_dir_));
+  }
+  return absl::OkStatus();
+}
+
+absl::Status TFRecordCheckpointer::ReplayWriteAheadLog(
+    const std::string& path, ChunkStore* chunk_store,
+    std::vector<std::shared_ptr<Table>>* tables,
+    internal::flat_hash_map<ChunkStore::Key,
+                            std::shared_ptr<ChunkStore::Chunk>>*
+        chunk_by_key) {
+  REVERB_LOG(REVERB_INFO) << "Replaying write-ahead log " << path;
+
+  auto find_table = [tables](const std::string& name) -> Table* {
+    int index = find_table_index(tables, name);
+    return index == -1 ? nullptr : tables->at(index).get();
+  };
+
+  // Returns the table that `entry` should be applied to, or nullptr if the
+  // table is unknown or the change is already reflected in its checkpoint.
+  auto target_table = [&find_table](const std::string& name,
+                                    const WriteAheadLogEntry& entry) -> Table* {
+    Table* table = find_table(name);
+    if (table == nullptr ||
+        entry.sequence() <= table->write_ahead_log_sequence()) {
+      return nullptr;
+    }
+    table->set_write_ahead_log_sequence(entry.sequence());
+    return table;
+  };
+
+  return TFRecordWriteAheadLog::Read(path, [&](WriteAheadLogEntry entry) {
+    switch (entry.payload_case()) {
+      case WriteAheadLogEntry::kChunk: {
+        const auto key = entry.chunk().chunk_key();
+        (*chunk_by_key)[key] =
+            chunk_store->Insert(std::move(*entry.mutable_chunk()));
+        return absl::OkStatus();
+      }
+      case WriteAheadLogEntry::kItem: {
+        if (find_table(entry.item().table()) == nullptr) {
+          return absl::InvalidArgumentError(
+              absl::StrCat("Write-ahead log ", path, " references table ",
+                           entry.item().table(),
+                           " which was not found in provided list of tables."));
+        }
+        Table* table = target_table(entry.item().table(), entry);
+        if (table == nullptr) return absl::OkStatus();
+
+        Table::Item item;
+        for (const auto& key :
+             internal::GetChunkKeys(entry.item().flat_trajectory())) {
+          auto it = chunk_by_key->find(key);
+          if (it != chunk_by_key->end()) {
+            item.chunks.push_back(it->second);
+            continue;
+          }
+
+          // The chunk was not recorded in the log so it must be referenced by
+          // an item that was included in the loaded checkpoint.
+          std::vector<std::shared_ptr<ChunkStore::Chunk>> chunks;
+          if (!chunk_store->Get({key}, &chunks).ok()) {
+            return absl::DataLossError(absl::StrCat(
+                "Chunk ", key, " referenced by item ", entry.item().key(),
+                " in write-ahead log ", path, " could not be found."));
+          }
+          item.chunks.push_back(std::move(chunks[0]));
+        }
+        item.item = std::move(*entry.mutable_item());
+        return table->InsertOrAssignFromLog(std::move(item));
+      }
+      case WriteAheadLogEntry::kMutation: {
+        Table* table = target_table(entry.mutation().table(), entry);
+        if (table == nullptr) return absl::OkStatus();
+        return table->MutateItems(
+            std::vector<KeyWithPriority>(entry.mutation().updates().begin(),
+                                         entry.mutation().updates().end()),
+            entry.mutation().delete_keys());
+      }
+      case WriteAheadLogEntry::kReset: {
+        Table* table = target_table(entry.reset().table(), entry);
+        if (table == nullptr) return absl::OkStatus();
+        return table->Reset();
+      }
+      case WriteAheadLogEntry::PAYLOAD_NOT_SET:
+        break;
+    }
+    return absl::DataLossError(
+        absl::StrCat("Write-ahead log ", path, " contains an empty entry."));
+  });
+}
+
+WriteAheadLog* TFRecordCheckpointer::write_ahead_log() {
+  return write_ahead_log_.get();
 }
 
 std::string TFRecordCheckpointer::DebugString() const {
   return absl::StrCat("TFRecordCheckpointer(root_dir=", root_dir_,
-                      ", group=", group_, ")");
+                      ", group=", group_, ", use_write_ahead_log=",
+                      options_.use_write_ahead_log ? "true" : "false",
+                      ", max_write_bytes_per_second=",
+                      options_.max_write_bytes_per_second, ")");
 }
 
 }  // namespace reverb
@@ -19,10 +19,13 @@
 #include <string>
 #include <vector>
 
+#include <cstdint>
 #include "absl/status/status.h"
 #include "absl/strings/string_view.h"
 #include "reverb/cc/checkpointing/interface.h"
 #include "reverb/cc/chunk_store.h"
+#include "reverb/cc/platform/hash_map.h"
+#include "reverb/cc/platform/tfrecord_write_ahead_log.h"
 #include "reverb/cc/table.h"
 
 namespace deepmind {
@@ -59,9 +62,43 @@ namespace reverb {
 //
 // If `group` is nonempty then the directory containing the checkpoint will be
 // created with `group` as group.
+//
+// If `options.use_write_ahead_log` is true then a `TFRecordWriteAheadLog` is
+// kept alongside the checkpoints. Each call to `Save` starts a new log in the
+// directory of the new checkpoint:
+//
+//   <root_dir>/
+//     <timestamp of the checkpoint>/
+//       tables.tfrecord
+//       chunks.tfrecord
+//       wal.tfrecord
+//       DONE
+//
+// `LoadLatest` loads the most recent checkpoint and then replays the log of
+// that checkpoint followed by the logs of all (unfinished) checkpoints created
+// after it. Entries which are already reflected in the checkpoint of their
+// table are skipped, so every change is applied exactly once. The log is only
+// written to by tables that have been attached to it with
+// `Table::set_write_ahead_log`.
 class TFRecordCheckpointer : public Checkpointer {
  public:
+  struct Options {
+    // Whether to keep a write-ahead log alongside the checkpoints. Samples are
+    // not logged (see `WriteAheadLog`) so the log cannot be used by servers
+    // with tables that set `max_times_sampled`.
+    bool use_write_ahead_log = false;
+
+    // If > 0 then `SaveInBackground` limits the rate at which data is written
+    // to roughly this many bytes per second. This prevents periodic
+    // checkpoints from saturating the disk (or network when `root_dir` is
+    // remote) at the expense of taking longer to complete. Checkpoints created
+    // with `Save` are never throttled.
+    int64_t max_write_bytes_per_second = 0;
+  };
+
   explicit TFRecordCheckpointer(std::string root_dir, std::string group = "");
+  TFRecordCheckpointer(std::string root_dir, std::string group,
+                       Options options);
 
   // Save a new checkpoint for every table in `tables` in sub directory
   // inside `root_dir_`. If the call is successful, the ABSOLUTE path to the
@@ -75,14 +112,23 @@ class TFRecordCheckpointer : public Checkpointer {
   absl::Status Save(std::vector<Table*> tables, int keep_latest,
                     std::string* path) override;
 
+  // Same as `Save` but throttled by `options.max_write_bytes_per_second`.
+  absl::Status SaveInBackground(std::vector<Table*> tables, int keep_latest,
+                                std::string* path) override;
+
   // Attempts to load a checkpoint stored within `root_dir_`.
   absl::Status Load(absl::string_view relative_path, ChunkStore* chunk_store,
                     std::vector<std::shared_ptr<Table>>* tables) override;
 
-  // Finds the most recent checkpoint within `root_dir_` and calls `Load`.
+  // Finds the most recent checkpoint within `root_dir_` and calls `Load`. If
+  // the write-ahead log is used then the logged changes are replayed on top of
+  // the loaded checkpoint.
   absl::Status LoadLatest(ChunkStore* chunk_store,
                           std::vector<std::shared_ptr<Table>>* tables) override;
 
+  // Returns nullptr unless `options.use_write_ahead_log` was set.
+  WriteAheadLog* write_ahead_log() override;
+
   // Returns a summary string description.
   std::string DebugString() const override;
 
@@ -91,8 +137,30 @@ class TFRecordCheckpointer : public Checkpointer {
   TFRecordCheckpointer& operator=(const TFRecordCheckpointer&) = delete;
 
  private:
+  // Implementation of `Save` and `SaveInBackground`. Values <= 0 for
+  // `max_write_bytes_per_second` disables throttling.
+  absl::Status SaveInternal(std::vector<Table*> tables, int keep_latest,
+                            int64_t max_write_bytes_per_second,
+                            std::string* path);
+
+  // Applies the changes recorded in the write-ahead log stored at `path` to
+  // `tables`, skipping the entries whose sequence number is not greater than
+  // the `write_ahead_log_sequence` of their table. Chunks recorded in the log are kept alive in `chunk_by_key` until
+  // all logs have been replayed.
+  absl::Status ReplayWriteAheadLog(
+      const std::string& path, ChunkStore* chunk_store,
+      std::vector<std::shared_ptr<Table>>* tables,
+      internal::flat_hash_map<ChunkStore::Key,
+                              std::shared_ptr<ChunkStore::Chunk>>*
+          chunk_by_key);
+
   const std::string root_dir_;
   const std::string group_;
+  const Options options_;
+
+  // Records changes made after the most recent call to `Save`. nullptr unless
+  // `options_.use_write_ahead_log` is set.
+  std::unique_ptr<TFRecordWriteAheadLog> write_ahead_log_;
 };
 
 }  // namespace reverb
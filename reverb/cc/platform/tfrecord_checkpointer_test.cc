@@ -25,6 +25,7 @@
 #include "reverb/cc/chunk_store.h"
 #include "reverb/cc/rate_limiter.h"
 #include "reverb/cc/platform/status_matchers.h"
+#include "reverb/cc/platform/thread.h"
 #include "reverb/cc/selectors/fifo.h"
 #include "reverb/cc/selectors/heap.h"
 #include "reverb/cc/selectors/prioritized.h"
@@ -256,6 +257,137 @@ TEST(TFRecordCheckpointerTest, LoadLatestInEmptyDir) {
             absl::StatusCode::kNotFound);
 }
 
+TEST(TFRecordCheckpointerTest, LoadLatestReplaysWriteAheadLog) {
+  const std::string root = MakeRoot();
+  TFRecordCheckpointer::Options options;
+  options.use_write_ahead_log = true;
+  ChunkStore chunk_store;
+  std::vector<std::shared_ptr<Table>> tables;
+  tables.push_back(MakeUniformTable("uniform"));
+
+  auto insert = [&](uint64_t key) {
+    auto chunk = chunk_store.Insert(testing::MakeChunkData(key));
+    auto item = testing::MakePrioritizedItem(key, key, {chunk->data()});
+    REVERB_EXPECT_OK(tables[0]->InsertOrAssign({item, {chunk}}));
+  };
+
+  {
+    TFRecordCheckpointer checkpointer(root, "", options);
+    auto* log = checkpointer.write_ahead_log();
+    ASSERT_NE(log, nullptr);
+
+    // Items inserted before the checkpoint is created are stored in the
+    // checkpoint.
+    std::string path;
+    REVERB_ASSERT_OK(checkpointer.Save({tables[0].get()}, 1, &path));
+    tables[0]->set_write_ahead_log(log);
+    insert(1);
+    REVERB_ASSERT_OK(checkpointer.Save({tables[0].get()}, 1, &path));
+
+    // Changes made after the checkpoint are only stored in the log.
+    insert(2);
+    insert(3);
+    REVERB_EXPECT_OK(tables[0]->MutateItems(
+        {testing::MakeKeyWithPriority(2, 10)}, {3}));
+    REVERB_EXPECT_OK(log->Sync());
+    tables[0]->set_write_ahead_log(nullptr);
+  }
+
+  TFRecordCheckpointer checkpointer(root, "", options);
+  ChunkStore loaded_chunk_store;
+  std::vector<std::shared_ptr<Table>> loaded_tables;
+  loaded_tables.push_back(MakeUniformTable("uniform"));
+  REVERB_ASSERT_OK(
+      checkpointer.LoadLatest(&loaded_chunk_store, &loaded_tables));
+
+  ASSERT_EQ(loaded_tables[0]->size(), 2);
+  Table::Item item;
+  EXPECT_TRUE(loaded_tables[0]->Get(1, &item));
+  ASSERT_TRUE(loaded_tables[0]->Get(2, &item));
+  EXPECT_EQ(item.item.priority(), 10);
+  EXPECT_FALSE(loaded_tables[0]->Get(3, &item));
+
+  // Every insert and delete is counted exactly once.
+  const auto rate_limiter =
+      loaded_tables[0]->Checkpoint().checkpoint.rate_limiter();
+  EXPECT_EQ(rate_limiter.insert_count(), 3);
+  EXPECT_EQ(rate_limiter.delete_count(), 1);
+}
+
+TEST(TFRecordCheckpointerTest, ReplayMatchesTableAfterConcurrentChanges) {
+  constexpr int kNumItems = 500;
+  const std::string root = MakeRoot();
+  TFRecordCheckpointer::Options options;
+  options.use_write_ahead_log = true;
+  ChunkStore chunk_store;
+  std::vector<std::shared_ptr<Table>> tables;
+  tables.push_back(MakeUniformTable("uniform"));
+
+  std::vector<Table::Item> expected;
+  PriorityTableCheckpoint expected_checkpoint;
+  {
+    TFRecordCheckpointer checkpointer(root, "", options);
+    std::string path;
+    REVERB_ASSERT_OK(checkpointer.Save({tables[0].get()}, 1, &path));
+    tables[0]->set_write_ahead_log(checkpointer.write_ahead_log());
+
+    // Every item is deleted and updated while it is being inserted so the
+    // order in which the changes are applied differs between runs. A
+    // checkpoint is created concurrently so some of the changes are part of
+    // both the checkpoint and its log.
+    std::vector<std::unique_ptr<internal::Thread>> threads;
+    threads.push_back(internal::StartThread("Inserter", [&] {
+      for (uint64_t key = 0; key < kNumItems; key++) {
+        auto chunk = chunk_store.Insert(testing::MakeChunkData(key));
+        REVERB_EXPECT_OK(tables[0]->InsertOrAssign(
+            {testing::MakePrioritizedItem(key, 1, {chunk->data()}), {chunk}}));
+      }
+    }));
+    threads.push_back(internal::StartThread("Deleter", [&] {
+      for (uint64_t key = 0; key < kNumItems; key += 2) {
+        REVERB_EXPECT_OK(tables[0]->MutateItems({}, {key}));
+      }
+    }));
+    threads.push_back(internal::StartThread("Updater", [&] {
+      for (uint64_t key = 1; key < kNumItems; key += 2) {
+        REVERB_EXPECT_OK(tables[0]->MutateItems(
+            {testing::MakeKeyWithPriority(key, 2)}, {}));
+      }
+    }));
+    REVERB_ASSERT_OK(checkpointer.Save({tables[0].get()}, 1, &path));
+    threads.clear();  // Joins threads.
+
+    REVERB_ASSERT_OK(checkpointer.write_ahead_log()->Sync());
+    tables[0]->set_write_ahead_log(nullptr);
+    expected = tables[0]->Copy();
+    expected_checkpoint = tables[0]->Checkpoint().checkpoint;
+  }
+
+  TFRecordCheckpointer checkpointer(root, "", options);
+  ChunkStore loaded_chunk_store;
+  std::vector<std::shared_ptr<Table>> loaded_tables;
+  loaded_tables.push_back(MakeUniformTable("uniform"));
+  REVERB_ASSERT_OK(
+      checkpointer.LoadLatest(&loaded_chunk_store, &loaded_tables));
+
+  ASSERT_EQ(loaded_tables[0]->size(), expected.size());
+  for (const auto& expected_item : expected) {
+    Table::Item item;
+    ASSERT_TRUE(loaded_tables[0]->Get(expected_item.item.key(), &item));
+    EXPECT_EQ(item.item.priority(), expected_item.item.priority());
+  }
+  const auto loaded_checkpoint = loaded_tables[0]->Checkpoint().checkpoint;
+  EXPECT_THAT(loaded_checkpoint.rate_limiter(),
+              EqualsProto(expected_checkpoint.rate_limiter()));
+  EXPECT_EQ(loaded_checkpoint.write_ahead_log_sequence(),
+            expected_checkpoint.write_ahead_log_sequence());
+}
+
+TEST(TFRecordCheckpointerTest, WriteAheadLogIsNullByDefault) {
+  TFRecordCheckpointer checkpointer(MakeRoot());
+  EXPECT_EQ(checkpointer.write_ahead_log(), nullptr);
+}
+
 }  // namespace
 }  // namespace reverb
 }  // namespace deepmind
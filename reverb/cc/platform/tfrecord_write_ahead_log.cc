@@ -0,0 +1,271 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/platform/tfrecord_write_ahead_log.h"
+
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <cstdint>
+#include "absl/memory/memory.h"
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/types/span.h"
+#include "reverb/cc/checkpointing/checkpoint.pb.h"
+#include "reverb/cc/chunk_store.h"
+#include "reverb/cc/platform/logging.h"
+#include "reverb/cc/platform/status_macros.h"
+#include "reverb/cc/platform/thread.h"
+#include "reverb/cc/schema.pb.h"
+#include "reverb/cc/support/tf_util.h"
+#include "tensorflow/core/lib/io/record_reader.h"
+#include "tensorflow/core/lib/io/record_writer.h"
+#include "tensorflow/core/platform/env.h"
+#include "tensorflow/core/platform/file_system.h"
+
+namespace deepmind {
+namespace reverb {
+
+TFRecordWriteAheadLog::TFRecordWriteAheadLog()
+    : writer_thread_(internal::StartThread("WriteAheadLog-Writer",
+                                           [this] { WriteLoop(); })) {}
+
+TFRecordWriteAheadLog::~TFRecordWriteAheadLog() {
+  {
+    absl::MutexLock lock(&mu_);
+    closed_ = true;
+  }
+  writer_thread_ = nullptr;  // Joins thread.
+
+  if (writer_ != nullptr) {
+    auto status = FromTensorflowStatus(writer_->Close());
+    if (status.ok()) status = FromTensorflowStatus(file_->Close());
+    if (!status.ok()) {
+      REVERB_LOG(REVERB_ERROR)
+          << "Failed to close write-ahead log: " << status.ToString();
+    }
+  }
+}
+
+absl::Status TFRecordWriteAheadLog::Rotate(std::string path) {
+  absl::MutexLock lock(&mu_);
+  if (!status_.ok()) return status_;
+
+  PendingEntry rotation;
+  rotation.rotate_to = std::move(path);
+  pending_.push_back(std::move(rotation));
+  const int64_t seq = ++num_appended_;
+
+  // Chunks recorded in the previous file must be recorded again if they are
+  // referenced by items written to the new file.
+  logged_chunks_.clear();
+  has_file_ = true;
+
+  auto done = [this, seq]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    return num_written_ >= seq || !status_.ok();
+  };
+  mu_.Await(absl::Condition(&done));
+  return status_;
+}
+
+absl::Status TFRecordWriteAheadLog::AppendItem(
+    PrioritizedItem item,
+    absl::Span<const std::shared_ptr<ChunkStore::Chunk>> chunks,
+    int64_t sequence) {
+  PendingEntry item_entry;
+  *item_entry.entry.mutable_item() = std::move(item);
+  item_entry.entry.set_sequence(sequence);
+
+  std::vector<PendingEntry> entries;
+  entries.reserve(chunks.size() + 1);
+
+  absl::MutexLock lock(&mu_);
+  for (const auto& chunk : chunks) {
+    if (logged_chunks_.insert(chunk->key()).second) {
+      PendingEntry chunk_entry;
+      chunk_entry.chunk = chunk;
+      entries.push_back(std::move(chunk_entry));
+    }
+  }
+  entries.push_back(std::move(item_entry));
+  return AppendLocked(std::move(entries));
+}
+
+absl::Status TFRecordWriteAheadLog::AppendMutation(
+    absl::string_view table, absl::Span<const KeyWithPriority> updates,
+    absl::Span<const uint64_t> deletes, int64_t sequence) {
+  std::vector<PendingEntry> entries(1);
+  entries[0].entry.set_sequence(sequence);
+  auto* mutation = entries[0].entry.mutable_mutation();
+  mutation->set_table(std::string(table));
+  mutation->mutable_updates()->Add(updates.begin(), updates.end());
+  mutation->mutable_delete_keys()->Add(deletes.begin(), deletes.end());
+
+  absl::MutexLock lock(&mu_);
+  return AppendLocked(std::move(entries));
+}
+
+absl::Status TFRecordWriteAheadLog::AppendReset(absl::string_view table,
+                                                int64_t sequence) {
+  std::vector<PendingEntry> entries(1);
+  entries[0].entry.set_sequence(sequence);
+  entries[0].entry.mutable_reset()->set_table(std::string(table));
+
+  absl::MutexLock lock(&mu_);
+  return AppendLocked(std::move(entries));
+}
+
+absl::Status TFRecordWriteAheadLog::AppendLocked(
+    std::vector<PendingEntry> entries) {
+  if (!status_.ok()) return status_;
+  if (!has_file_) {
+    return absl::FailedPreconditionError(
+        "Entries cannot be appended to the write-ahead log before Rotate has "
+        "been called.");
+  }
+  num_appended_ += entries.size();
+  std::move(entries.begin(), entries.end(), std::back_inserter(pending_));
+  return absl::OkStatus();
+}
+
+absl::Status TFRecordWriteAheadLog::Sync() {
+  absl::MutexLock lock(&mu_);
+  const int64_t seq = num_appended_;
+  auto done = [this, seq]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    return num_written_ >= seq || !status_.ok();
+  };
+  mu_.Await(absl::Condition(&done));
+  return status_;
+}
+
+void TFRecordWriteAheadLog::WriteLoop() {
+  auto has_work = [this]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    return closed_ || !pending_.empty();
+  };
+
+  while (true) {
+    std::vector<PendingEntry> entries;
+    bool failed;
+    {
+      absl::MutexLock lock(&mu_);
+      mu_.Await(absl::Condition(&has_work));
+      if (pending_.empty()) return;
+      entries.swap(pending_);
+      failed = !status_.ok();
+    }
+
+    // Entries appended before a write failed are dropped as the file can no
+    // longer be trusted. The callers are notified through `status_`.
+    auto status = failed ? absl::OkStatus() : WriteEntries(&entries);
+
+    absl::MutexLock lock(&mu_);
+    if (!status.ok() && status_.ok()) {
+      REVERB_LOG(REVERB_ERROR)
+          << "Failed to write to write-ahead log: " << status.ToString();
+      status_ = std::move(status);
+    }
+    num_written_ += entries.size();
+  }
+}
+
+absl::Status TFRecordWriteAheadLog::WriteEntries(
+    std::vector<PendingEntry>* entries) {
+  bool needs_sync = false;
+  for (auto& pending : *entries) {
+    if (pending.rotate_to.has_value()) {
+      REVERB_RETURN_IF_ERROR(SwitchFile(*pending.rotate_to));
+      needs_sync = false;
+      continue;
+    }
+
+    // We const cast to avoid copying the chunk data.
+    if (pending.chunk != nullptr) {
+      pending.entry.set_allocated_chunk(
+          const_cast<ChunkData*>(&pending.chunk->data()));
+    }
+    std::string record = pending.entry.SerializeAsString();
+    if (pending.chunk != nullptr) {
+      pending.entry.release_chunk();
+    }
+
+    REVERB_RETURN_IF_ERROR(
+        FromTensorflowStatus(writer_->WriteRecord(record)));
+    needs_sync = true;
+  }
+
+  if (needs_sync) {
+    REVERB_RETURN_IF_ERROR(FromTensorflowStatus(writer_->Flush()));
+    REVERB_RETURN_IF_ERROR(FromTensorflowStatus(file_->Sync()));
+  }
+  return absl::OkStatus();
+}
+
+absl::Status TFRecordWriteAheadLog::SwitchFile(const std::string& path) {
+  if (writer_ != nullptr) {
+    REVERB_RETURN_IF_ERROR(FromTensorflowStatus(writer_->Flush()));
+    REVERB_RETURN_IF_ERROR(FromTensorflowStatus(file_->Sync()));
+    REVERB_RETURN_IF_ERROR(FromTensorflowStatus(writer_->Close()));
+    REVERB_RETURN_IF_ERROR(FromTensorflowStatus(file_->Close()));
+    writer_ = nullptr;
+    file_ = nullptr;
+  }
+
+  REVERB_RETURN_IF_ERROR(FromTensorflowStatus(
+      tensorflow::Env::Default()->NewWritableFile(path, &file_)));
+  writer_ = absl::make_unique<tensorflow::io::RecordWriter>(file_.get());
+  REVERB_LOG(REVERB_INFO) << "Writing write-ahead log to " << path;
+  return absl::OkStatus();
+}
+
+absl::Status TFRecordWriteAheadLog::Read(
+    const std::string& path,
+    const std::function<absl::Status(WriteAheadLogEntry)>& fn) {
+  std::unique_ptr<tensorflow::RandomAccessFile> file;
+  REVERB_RETURN_IF_ERROR(FromTensorflowStatus(
+      tensorflow::Env::Default()->NewRandomAccessFile(path, &file)));
+  tensorflow::io::RecordReader reader(file.get());
+
+  WriteAheadLogEntry entry;
+  tensorflow::uint64 offset = 0;
+  tensorflow::tstring record;
+  while (true) {
+    auto status = FromTensorflowStatus(reader.ReadRecord(&offset, &record));
+    if (absl::IsOutOfRange(status)) break;
+    if (absl::IsDataLoss(status)) {
+      REVERB_LOG(REVERB_WARNING)
+          << "Ignoring truncated record at offset " << offset
+          << " of write-ahead log " << path << ": " << status.ToString();
+      break;
+    }
+    REVERB_RETURN_IF_ERROR(status);
+
+    if (!entry.ParseFromArray(record.data(), record.size())) {
+      return absl::DataLossError(
+          absl::StrCat("Could not parse record at offset ", offset, " of ",
+                       path, " as WriteAheadLogEntry."));
+    }
+    REVERB_RETURN_IF_ERROR(fn(std::move(entry)));
+    entry.Clear();
+  }
+  return absl::OkStatus();
+}
+
+}  // namespace reverb
+}  // namespace deepmind
@@ -0,0 +1,155 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REVERB_CC_PLATFORM_TFRECORD_WRITE_AHEAD_LOG_H_
+#define REVERB_CC_PLATFORM_TFRECORD_WRITE_AHEAD_LOG_H_
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <cstdint>
+#include "absl/base/thread_annotations.h"
+#include "absl/status/status.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/types/optional.h"
+#include "absl/types/span.h"
+#include "reverb/cc/checkpointing/checkpoint.pb.h"
+#include "reverb/cc/checkpointing/write_ahead_log.h"
+#include "reverb/cc/chunk_store.h"
+#include "reverb/cc/platform/hash_set.h"
+#include "reverb/cc/platform/thread.h"
+#include "reverb/cc/schema.pb.h"
+#include "tensorflow/core/lib/io/record_writer.h"
+#include "tensorflow/core/platform/file_system.h"
+
+namespace deepmind {
+namespace reverb {
+
+// Write-ahead log which stores `WriteAheadLogEntry` protos in a TFRecord file.
+//
+// Appended entries are buffered in memory and written by a background thread.
+// Every time the thread wakes up it writes all the entries appended since its
+// previous iteration and then syncs the file once, so the cost of a sync is
+// shared by all the entries (and `Sync` callers) that were waiting for it.
+//
+// The log does not write anything until `Rotate` has been called. `Rotate` is
+// called by the owner (e.g `TFRecordCheckpointer`) whenever a new checkpoint is
+// created so that each file only contains the changes made after the
+// checkpoint it belongs to. Chunks are recorded at most once per file.
+class TFRecordWriteAheadLog : public WriteAheadLog {
+ public:
+  TFRecordWriteAheadLog();
+
+  // Writes all pending entries and joins the background thread.
+  ~TFRecordWriteAheadLog() override;
+
+  // Writes and syncs all entries appended before the call and then directs all
+  // subsequent entries to a new file at `path`. Blocks until the new file has
+  // been opened.
+  absl::Status Rotate(std::string path);
+
+  absl::Status AppendItem(
+      PrioritizedItem item,
+      absl::Span<const std::shared_ptr<ChunkStore::Chunk>> chunks,
+      int64_t sequence) override;
+
+  absl::Status AppendMutation(absl::string_view table,
+                              absl::Span<const KeyWithPriority> updates,
+                              absl::Span<const uint64_t> deletes,
+                              int64_t sequence) override;
+
+  absl::Status AppendReset(absl::string_view table, int64_t sequence) override;
+
+  absl::Status Sync() override;
+
+  // Reads the log stored at `path` and calls `fn` with each entry in the order
+  // they were appended. A truncated final record, which is the result of the
+  // process being terminated while the record was being written, is treated
+  // as the end of the log.
+  static absl::Status Read(
+      const std::string& path,
+      const std::function<absl::Status(WriteAheadLogEntry)>& fn);
+
+  // TFRecordWriteAheadLog is neither copyable nor movable.
+  TFRecordWriteAheadLog(const TFRecordWriteAheadLog&) = delete;
+  TFRecordWriteAheadLog& operator=(const TFRecordWriteAheadLog&) = delete;
+
+ private:
+  // An entry which has been appended but not yet written.
+  struct PendingEntry {
+    // The entry to write. Chunks are attached by the background thread from
+    // `chunk` in order to avoid copying the data.
+    WriteAheadLogEntry entry;
+
+    // Set if the entry records a chunk.
+    std::shared_ptr<ChunkStore::Chunk> chunk;
+
+    // If set then this is not an entry but a request to switch to a new file.
+    absl::optional<std::string> rotate_to;
+  };
+
+  // Adds `entries` to `pending_`. Fails if `Rotate` has not yet been called or
+  // if a previous write failed.
+  absl::Status AppendLocked(std::vector<PendingEntry> entries)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Body of `writer_thread_`.
+  void WriteLoop();
+
+  // Writes `entries` to the current file and syncs it. Only called from
+  // `writer_thread_`.
+  absl::Status WriteEntries(std::vector<PendingEntry>* entries);
+
+  // Closes the current file (if any) and opens a new one at `path`. Only
+  // called from `writer_thread_`.
+  absl::Status SwitchFile(const std::string& path);
+
+  mutable absl::Mutex mu_;
+
+  // Entries waiting to be picked up by `writer_thread_`.
+  std::vector<PendingEntry> pending_ ABSL_GUARDED_BY(mu_);
+
+  // Total number of entries (including rotations) appended and written.
+  int64_t num_appended_ ABSL_GUARDED_BY(mu_) = 0;
+  int64_t num_written_ ABSL_GUARDED_BY(mu_) = 0;
+
+  // First error encountered by `writer_thread_`. Once set, all subsequent
+  // calls fail with the same error as entries may have been lost.
+  absl::Status status_ ABSL_GUARDED_BY(mu_);
+
+  // True once `Rotate` has been called for the first time.
+  bool has_file_ ABSL_GUARDED_BY(mu_) = false;
+
+  // Set in the destructor to stop `writer_thread_` once `pending_` is empty.
+  bool closed_ ABSL_GUARDED_BY(mu_) = false;
+
+  // Keys of the chunks which have been recorded in the current file.
+  internal::flat_hash_set<ChunkStore::Key> logged_chunks_ ABSL_GUARDED_BY(mu_);
+
+  // The file currently written to. Only accessed by `writer_thread_` (and the
+  // destructor once the thread has been joined).
+  std::unique_ptr<tensorflow::WritableFile> file_;
+  std::unique_ptr<tensorflow::io::RecordWriter> writer_;
+
+  // Writes the entries in `pending_` to `file_`.
+  std::unique_ptr<internal::Thread> writer_thread_;
+};
+
+}  // namespace reverb
+}  // namespace deepmind
+
+#endif  // REVERB_CC_PLATFORM_TFRECORD_WRITE_AHEAD_LOG_H_
@@ -0,0 +1,162 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/platform/tfrecord_write_ahead_log.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/status/status.h"
+#include "reverb/cc/checkpointing/checkpoint.pb.h"
+#include "reverb/cc/chunk_store.h"
+#include "reverb/cc/platform/logging.h"
+#include "reverb/cc/platform/status_macros.h"
+#include "reverb/cc/platform/status_matchers.h"
+#include "reverb/cc/platform/thread.h"
+#include "reverb/cc/schema.pb.h"
+#include "reverb/cc/testing/proto_test_util.h"
+#include "tensorflow/core/platform/env.h"
+
+namespace deepmind {
+namespace reverb {
+namespace {
+
+using ::deepmind::reverb::testing::EqualsProto;
+using ::testing::ElementsAre;
+
+std::string MakePath() {
+  std::string name;
+  REVERB_CHECK(tensorflow::Env::Default()->LocalTempFilename(&name));
+  return name;
+}
+
+std::vector<WriteAheadLogEntry> ReadAll(const std::string& path) {
+  std::vector<WriteAheadLogEntry> entries;
+  REVERB_CHECK_OK(TFRecordWriteAheadLog::Read(
+      path, [&entries](WriteAheadLogEntry entry) {
+        entries.push_back(std::move(entry));
+        return absl::OkStatus();
+      }));
+  return entries;
+}
+
+std::vector<WriteAheadLogEntry::PayloadCase> PayloadCases(
+    const std::vector<WriteAheadLogEntry>& entries) {
+  std::vector<WriteAheadLogEntry::PayloadCase> cases;
+  for (const auto& entry : entries) {
+    cases.push_back(entry.payload_case());
+  }
+  return cases;
+}
+
+TEST(TFRecordWriteAheadLogTest, AppendBeforeRotateFails) {
+  TFRecordWriteAheadLog log;
+  EXPECT_EQ(log.AppendReset("table", /*sequence=*/1).code(),
+            absl::StatusCode::kFailedPrecondition);
+}
+
+TEST(TFRecordWriteAheadLogTest, EntriesAreReadInAppendOrder) {
+  ChunkStore chunk_store;
+  auto chunk = chunk_store.Insert(testing::MakeChunkData(1));
+  auto item = testing::MakePrioritizedItem(2, 1.0, {chunk->data()});
+  item.set_table("table");
+
+  const std::string path = MakePath();
+  {
+    TFRecordWriteAheadLog log;
+    REVERB_ASSERT_OK(log.Rotate(path));
+    REVERB_EXPECT_OK(log.AppendItem(item, {chunk}, /*sequence=*/1));
+    REVERB_EXPECT_OK(log.AppendMutation(
+        "table", {testing::MakeKeyWithPriority(2, 5.0)}, {3}, /*sequence=*/2));
+    REVERB_EXPECT_OK(log.AppendReset("table", /*sequence=*/3));
+    REVERB_EXPECT_OK(log.Sync());
+  }
+
+  auto entries = ReadAll(path);
+  ASSERT_THAT(PayloadCases(entries),
+              ElementsAre(WriteAheadLogEntry::kChunk,
+                          WriteAheadLogEntry::kItem,
+                          WriteAheadLogEntry::kMutation,
+                          WriteAheadLogEntry::kReset));
+  EXPECT_THAT(entries[0].chunk(), EqualsProto(chunk->data()));
+  EXPECT_THAT(entries[1].item(), EqualsProto(item));
+  EXPECT_THAT(entries[2].mutation(), EqualsProto(R"pb(
+                table: "table"
+                updates: { key: 2 priority: 5.0 }
+                delete_keys: 3
+              )pb"));
+  EXPECT_EQ(entries[3].reset().table(), "table");
+
+  // Chunks don't belong to a table and are therefore not numbered.
+  EXPECT_EQ(entries[0].sequence(), 0);
+  EXPECT_EQ(entries[1].sequence(), 1);
+  EXPECT_EQ(entries[2].sequence(), 2);
+  EXPECT_EQ(entries[3].sequence(), 3);
+}
+
+TEST(TFRecordWriteAheadLogTest, ChunksAreRecordedOncePerFile) {
+  ChunkStore chunk_store;
+  auto chunk = chunk_store.Insert(testing::MakeChunkData(1));
+  auto item_a = testing::MakePrioritizedItem(2, 1.0, {chunk->data()});
+  auto item_b = testing::MakePrioritizedItem(3, 1.0, {chunk->data()});
+
+  const std::string first_path = MakePath();
+  const std::string second_path = MakePath();
+  {
+    TFRecordWriteAheadLog log;
+    REVERB_ASSERT_OK(log.Rotate(first_path));
+    REVERB_EXPECT_OK(log.AppendItem(item_a, {chunk}, /*sequence=*/1));
+    REVERB_EXPECT_OK(log.AppendItem(item_b, {chunk}, /*sequence=*/2));
+
+    REVERB_ASSERT_OK(log.Rotate(second_path));
+    REVERB_EXPECT_OK(log.AppendItem(item_b, {chunk}, /*sequence=*/3));
+    REVERB_EXPECT_OK(log.Sync());
+  }
+
+  EXPECT_THAT(PayloadCases(ReadAll(first_path)),
+              ElementsAre(WriteAheadLogEntry::kChunk,
+                          WriteAheadLogEntry::kItem,
+                          WriteAheadLogEntry::kItem));
+  EXPECT_THAT(PayloadCases(ReadAll(second_path)),
+              ElementsAre(WriteAheadLogEntry::kChunk,
+                          WriteAheadLogEntry::kItem));
+}
+
+TEST(TFRecordWriteAheadLogTest, ConcurrentSyncs) {
+  const std::string path = MakePath();
+  {
+    TFRecordWriteAheadLog log;
+    REVERB_ASSERT_OK(log.Rotate(path));
+
+    std::vector<std::unique_ptr<internal::Thread>> threads;
+    for (int i = 0; i < 10; i++) {
+      threads.push_back(internal::StartThread("", [&log] {
+        for (int j = 0; j < 100; j++) {
+          REVERB_EXPECT_OK(log.AppendReset("table", /*sequence=*/j + 1));
+          REVERB_EXPECT_OK(log.Sync());
+        }
+      }));
+    }
+    threads.clear();  // Joins threads.
+  }
+
+  EXPECT_EQ(ReadAll(path).size(), 1000);
+}
+
+}  // namespace
+}  // namespace reverb
+}  // namespace deepmind
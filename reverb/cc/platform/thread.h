@@ -51,6 +51,11 @@ class Thread {
 std::unique_ptr<Thread> StartThread(absl::string_view name_prefix,
                                     std::function<void()> fn);
 
+// Lowers the I/O scheduling priority of the calling thread so that its disk
+// operations yield to those of other threads. Returns false if this is not
+// supported by the platform or the priority could not be changed.
+bool SetCurrentThreadLowIoPriority();
+
 }  // namespace internal
 }  // namespace reverb
 }  // namespace deepmind
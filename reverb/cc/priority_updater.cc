@@ -0,0 +1,276 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/priority_updater.h"
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/memory/memory.h"
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "reverb/cc/platform/logging.h"
+#include "reverb/cc/platform/status_macros.h"
+#include "reverb/cc/support/grpc_util.h"
+
+namespace deepmind {
+namespace reverb {
+
+absl::Status PriorityUpdater::Options::Validate() const {
+  if (flush_size < 1) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("flush_size (", flush_size, ") must be >= 1."));
+  }
+  if (flush_interval <= absl::ZeroDuration()) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "flush_interval (", absl::FormatDuration(flush_interval),
+        ") must be > 0."));
+  }
+  if (max_pending_keys < flush_size) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("max_pending_keys (", max_pending_keys,
+                     ") must be >= flush_size (", flush_size, ")."));
+  }
+  if (retry_delay < absl::ZeroDuration()) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("retry_delay (", absl::FormatDuration(retry_delay),
+                     ") must be >= 0."));
+  }
+  return absl::OkStatus();
+}
+
+PriorityUpdater::PriorityUpdater(
+    std::shared_ptr</* grpc_gen:: */ReverbService::StubInterface> stub,
+    std::string table, const Options& options)
+    : stub_(std::move(stub)), table_(std::move(table)), options_(options) {
+  REVERB_CHECK(stub_ != nullptr);
+  REVERB_CHECK_OK(options_.Validate());
+  worker_ = internal::StartThread("PriorityUpdater", [this] { RunWorker(); });
+}
+
+PriorityUpdater::~PriorityUpdater() {
+  auto status = Close();
+  if (!status.ok() && !absl::IsCancelled(status)) {
+    REVERB_LOG(REVERB_WARNING)
+        << "Pending priority updates of table " << table_
+        << " could not be applied: " << status;
+  }
+}
+
+absl::Status PriorityUpdater::Update(
+    const std::vector<KeyWithPriority>& updates, absl::Duration timeout) {
+  absl::MutexLock lock(&mu_);
+  REVERB_RETURN_IF_ERROR(WaitForSpaceLocked(timeout));
+  if (NumPendingKeysLocked() == 0) oldest_pending_ = absl::Now();
+  for (const auto& update : updates) {
+    // The item is deleted by the server before updates of the same batch are
+    // applied so there is no point in sending the update.
+    if (pending_deletes_.contains(update.key())) continue;
+    pending_updates_[update.key()] = update.priority();
+  }
+  num_buffered_++;
+  return absl::OkStatus();
+}
+
+absl::Status PriorityUpdater::Delete(const std::vector<uint64_t>& keys,
+                                     absl::Duration timeout) {
+  absl::MutexLock lock(&mu_);
+  REVERB_RETURN_IF_ERROR(WaitForSpaceLocked(timeout));
+  if (NumPendingKeysLocked() == 0) oldest_pending_ = absl::Now();
+  for (uint64_t key : keys) {
+    pending_updates_.erase(key);
+    pending_deletes_.insert(key);
+  }
+  num_buffered_++;
+  return absl::OkStatus();
+}
+
+absl::Status PriorityUpdater::Flush(absl::Duration timeout) {
+  absl::MutexLock lock(&mu_);
+  if (closed_) return absl::CancelledError("PriorityUpdater has been closed.");
+
+  const int64_t target = num_buffered_;
+  flush_target_ = std::max(flush_target_, target);
+  auto flushed = [this, target]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    return !status_.ok() || num_flushed_ >= target ||
+           (!in_flight_ && NumPendingKeysLocked() == 0);
+  };
+  if (!mu_.AwaitWithTimeout(absl::Condition(&flushed), timeout)) {
+    return absl::DeadlineExceededError(
+        absl::StrCat("Timeout exceeded before the pending priority updates of "
+                     "table ",
+                     table_, " had been applied."));
+  }
+  return status_;
+}
+
+absl::Status PriorityUpdater::Close() {
+  {
+    absl::MutexLock lock(&mu_);
+    if (closed_) return status_;
+    closed_ = true;
+  }
+  worker_ = nullptr;  // Joins the thread.
+
+  absl::MutexLock lock(&mu_);
+  return status_;
+}
+
+int PriorityUpdater::NumPendingKeysLocked() const {
+  return pending_updates_.size() + pending_deletes_.size();
+}
+
+absl::Status PriorityUpdater::WaitForSpaceLocked(absl::Duration timeout) {
+  auto has_space = [this]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    return closed_ || !status_.ok() ||
+           NumPendingKeysLocked() < options_.max_pending_keys;
+  };
+  const bool ready = mu_.AwaitWithTimeout(absl::Condition(&has_space), timeout);
+  REVERB_RETURN_IF_ERROR(status_);
+  if (closed_) return absl::CancelledError("PriorityUpdater has been closed.");
+  if (!ready) {
+    return absl::DeadlineExceededError(
+        absl::StrCat("Timeout exceeded before the buffer of pending priority "
+                     "updates of table ",
+                     table_, " had space for more updates."));
+  }
+  return absl::OkStatus();
+}
+
+void PriorityUpdater::RunWorker() {
+  while (true) {
+    MutatePrioritiesRequest request;
+    int64_t num_buffered;
+    absl::Time oldest_pending;
+    {
+      absl::MutexLock lock(&mu_);
+      while (true) {
+        const int num_pending = NumPendingKeysLocked();
+        if (num_pending == 0 && closed_) break;
+        if (num_pending > 0 &&
+            (closed_ || num_pending >= options_.flush_size ||
+             flush_target_ > num_flushed_ ||
+             absl::Now() >= oldest_pending_ + options_.flush_interval)) {
+          break;
+        }
+
+        // Wake up when the state changes in a way which could make a flush
+        // due. When the buffer is empty the deadline is infinite so the first
+        // new key must also wake us up to set a deadline.
+        const bool was_empty = num_pending == 0;
+        auto flush_due = [this, was_empty]()
+                             ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+          const int num_pending = NumPendingKeysLocked();
+          return closed_ || (was_empty && num_pending > 0) ||
+                 num_pending >= options_.flush_size ||
+                 (num_pending > 0 && flush_target_ > num_flushed_);
+        };
+        mu_.AwaitWithDeadline(
+            absl::Condition(&flush_due),
+            was_empty ? absl::InfiniteFuture()
+                      : oldest_pending_ + options_.flush_interval);
+      }
+
+      if (NumPendingKeysLocked() == 0) break;  // Closed and fully flushed.
+
+      request.set_table(table_);
+      for (const auto& [key, priority] : pending_updates_) {
+        auto* update = request.add_updates();
+        update->set_key(key);
+        update->set_priority(priority);
+      }
+      request.mutable_delete_keys()->Reserve(pending_deletes_.size());
+      for (uint64_t key : pending_deletes_) {
+        request.add_delete_keys(key);
+      }
+      pending_updates_.clear();
+      pending_deletes_.clear();
+      oldest_pending = oldest_pending_;
+      oldest_pending_ = absl::InfiniteFuture();
+      num_buffered = num_buffered_;
+      in_flight_ = true;
+    }
+
+    auto status = SendBatch(request);
+
+    absl::MutexLock lock(&mu_);
+    in_flight_ = false;
+    if (absl::IsUnavailable(status) && !closed_) {
+      REVERB_LOG(REVERB_WARNING)
+          << "Priority updates of table " << table_
+          << " could not be sent and will be retried: " << status;
+      RequeueLocked(request, oldest_pending);
+      mu_.AwaitWithTimeout(absl::Condition(&closed_), options_.retry_delay);
+      continue;
+    }
+    if (!status.ok()) {
+      status_ = status;
+      pending_updates_.clear();
+      pending_deletes_.clear();
+      return;
+    }
+    num_flushed_ = num_buffered;
+  }
+
+  if (stream_ != nullptr) {
+    stream_->WritesDone();
+    auto status = FromGrpcStatus(stream_->Finish());
+    if (!status.ok()) {
+      absl::MutexLock lock(&mu_);
+      status_ = status;
+    }
+  }
+}
+
+void PriorityUpdater::RequeueLocked(const MutatePrioritiesRequest& request,
+                                    absl::Time oldest_pending) {
+  for (uint64_t key : request.delete_keys()) {
+    pending_updates_.erase(key);
+    pending_deletes_.insert(key);
+  }
+  for (const auto& update : request.updates()) {
+    if (pending_deletes_.contains(update.key())) continue;
+    pending_updates_.try_emplace(update.key(), update.priority());
+  }
+  oldest_pending_ = std::min(oldest_pending_, oldest_pending);
+}
+
+absl::Status PriorityUpdater::SendBatch(
+    const MutatePrioritiesRequest& request) {
+  if (stream_ == nullptr) {
+    context_ = absl::make_unique<grpc::ClientContext>();
+    context_->set_wait_for_ready(true);
+    stream_ = stub_->MutatePrioritiesStream(context_.get());
+  }
+
+  MutatePrioritiesResponse response;
+  if (!stream_->Write(request) || !stream_->Read(&response)) {
+    auto status = FromGrpcStatus(stream_->Finish());
+    stream_ = nullptr;
+    if (status.ok()) {
+      return absl::UnavailableError(
+          "MutatePrioritiesStream was closed before the batch had been "
+          "acknowledged.");
+    }
+    return status;
+  }
+  return absl::OkStatus();
+}
+
+}  // namespace reverb
+}  // namespace deepmind
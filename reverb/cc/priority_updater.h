@@ -0,0 +1,175 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REVERB_CC_PRIORITY_UPDATER_H_
+#define REVERB_CC_PRIORITY_UPDATER_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <cstdint>
+#include "grpcpp/impl/codegen/client_context.h"
+#include "grpcpp/impl/codegen/sync_stream.h"
+#include "absl/base/thread_annotations.h"
+#include "absl/status/status.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "reverb/cc/platform/hash_map.h"
+#include "reverb/cc/platform/hash_set.h"
+#include "reverb/cc/platform/thread.h"
+#include "reverb/cc/reverb_service.grpc.pb.h"
+#include "reverb/cc/reverb_service.pb.h"
+#include "reverb/cc/schema.pb.h"
+
+namespace deepmind {
+namespace reverb {
+
+// Buffers priority updates and deletions for a single table and sends them to
+// the server in batches over a `MutatePrioritiesStream`.
+//
+// Updates of the same key are coalesced while they wait in the buffer so only
+// the last priority written is sent. A deletion replaces any pending update of
+// the key and updates of a key with a pending deletion are dropped. The buffer
+// is flushed from a background thread once `flush_size` keys are pending or
+// when the oldest pending key has waited for `flush_interval`. At most one
+// batch is in flight at a time so calls to `Update` and `Delete` block once
+// `max_pending_keys` keys are waiting for it to be acknowledged.
+//
+// If the stream fails with `Unavailable`, e.g. because the server restarted,
+// then the batch is put back in the buffer and sent again on a new stream after
+// `retry_delay`. If a batch could not be applied for any other reason, or the
+// updater is closing, then the stream is closed and all subsequent calls return
+// the error.
+//
+// This class is thread safe.
+class PriorityUpdater {
+ public:
+  struct Options {
+    // Number of pending keys which triggers a flush.
+    int flush_size = 1000;
+
+    // Maximum time that an update or deletion is buffered before it is sent.
+    absl::Duration flush_interval = absl::Milliseconds(100);
+
+    // Maximum number of pending keys. `Update` and `Delete` block while the
+    // buffer is full.
+    int max_pending_keys = 10000;
+
+    // Time to wait before a batch which failed with `Unavailable` is sent
+    // again.
+    absl::Duration retry_delay = absl::Seconds(1);
+
+    // Checks that field values are valid and returns `InvalidArgument` if any
+    // field value invalid.
+    absl::Status Validate() const;
+  };
+
+  PriorityUpdater(
+      std::shared_ptr</* grpc_gen:: */ReverbService::StubInterface> stub,
+      std::string table, const Options& options);
+
+  // Flushes the pending updates and closes the stream.
+  ~PriorityUpdater();
+
+  // Buffers new priorities for the items with the given keys. Blocks for up to
+  // `timeout` while the buffer is full and returns `DeadlineExceeded` if no
+  // space became available in time.
+  absl::Status Update(const std::vector<KeyWithPriority>& updates,
+                      absl::Duration timeout = absl::InfiniteDuration())
+      ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Buffers the deletion of the items with the given keys. Blocks in the same
+  // way as `Update`.
+  absl::Status Delete(const std::vector<uint64_t>& keys,
+                      absl::Duration timeout = absl::InfiniteDuration())
+      ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Blocks until all updates and deletions buffered before the call have been
+  // applied by the server.
+  absl::Status Flush(absl::Duration timeout = absl::InfiniteDuration())
+      ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Flushes the pending updates and closes the stream. Subsequent calls to
+  // `Update`, `Delete` and `Flush` return `Cancelled`. Must not be called
+  // concurrently with itself.
+  absl::Status Close() ABSL_LOCKS_EXCLUDED(mu_);
+
+ private:
+  using Stream = grpc::ClientReaderWriterInterface<MutatePrioritiesRequest,
+                                                   MutatePrioritiesResponse>;
+
+  // Number of keys waiting to be sent.
+  int NumPendingKeysLocked() const ABSL_SHARED_LOCKS_REQUIRED(mu_);
+
+  // Blocks until `NumPendingKeysLocked` is below `max_pending_keys` or an
+  // error has been encountered.
+  absl::Status WaitForSpaceLocked(absl::Duration timeout)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Sends the pending keys in batches until the updater is closed.
+  void RunWorker() ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Puts the keys of a batch which could not be sent back in the buffer. Keys
+  // buffered since the batch was taken are newer and take precedence.
+  void RequeueLocked(const MutatePrioritiesRequest& request,
+                     absl::Time oldest_pending)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Writes `request` to `stream_`, opening it if necessary, and waits for the
+  // server to acknowledge it.
+  absl::Status SendBatch(const MutatePrioritiesRequest& request);
+
+  const std::shared_ptr</* grpc_gen:: */ReverbService::StubInterface> stub_;
+  const std::string table_;
+  const Options options_;
+
+  // Only accessed by the worker thread.
+  std::unique_ptr<grpc::ClientContext> context_;
+  std::unique_ptr<Stream> stream_;
+
+  mutable absl::Mutex mu_;
+
+  // Keys and their latest priority, and the keys to delete, which have not yet
+  // been sent. A key is never in both.
+  internal::flat_hash_map<uint64_t, double> pending_updates_
+      ABSL_GUARDED_BY(mu_);
+  internal::flat_hash_set<uint64_t> pending_deletes_ ABSL_GUARDED_BY(mu_);
+
+  // Time at which the oldest pending key was buffered.
+  absl::Time oldest_pending_ ABSL_GUARDED_BY(mu_) = absl::InfiniteFuture();
+
+  // Number of calls to `Update` and `Delete` which have been buffered, and the
+  // number of them which are included in a batch acknowledged by the server.
+  int64_t num_buffered_ ABSL_GUARDED_BY(mu_) = 0;
+  int64_t num_flushed_ ABSL_GUARDED_BY(mu_) = 0;
+
+  // Largest value of `num_buffered_` that a call to `Flush` is waiting for.
+  int64_t flush_target_ ABSL_GUARDED_BY(mu_) = 0;
+
+  // True while the worker is waiting for a batch to be acknowledged.
+  bool in_flight_ ABSL_GUARDED_BY(mu_) = false;
+
+  bool closed_ ABSL_GUARDED_BY(mu_) = false;
+
+  // The first error encountered by the worker.
+  absl::Status status_ ABSL_GUARDED_BY(mu_);
+
+  std::unique_ptr<internal::Thread> worker_;
+};
+
+}  // namespace reverb
+}  // namespace deepmind
+
+#endif  // REVERB_CC_PRIORITY_UPDATER_H_
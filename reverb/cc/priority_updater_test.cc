@@ -0,0 +1,284 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/priority_updater.h"
+
+#include <memory>
+#include <vector>
+
+#include "grpcpp/impl/codegen/status.h"
+#include "grpcpp/test/mock_stream.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/status/status.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/synchronization/notification.h"
+#include "absl/time/time.h"
+#include "reverb/cc/platform/status_matchers.h"
+#include "reverb/cc/reverb_service.pb.h"
+#include "reverb/cc/reverb_service_mock.grpc.pb.h"
+#include "reverb/cc/testing/proto_test_util.h"
+
+namespace deepmind {
+namespace reverb {
+namespace {
+
+using ::deepmind::reverb::testing::EqualsProto;
+using ::deepmind::reverb::testing::MakeKeyWithPriority;
+using ::grpc::testing::MockClientReaderWriter;
+using ::testing::_;
+using ::testing::ElementsAre;
+using ::testing::IsEmpty;
+using ::testing::Return;
+using ::testing::UnorderedElementsAre;
+
+// Records the requests and acknowledges each of them once `ack` has been
+// notified.
+class FakeStream : public MockClientReaderWriter<MutatePrioritiesRequest,
+                                                 MutatePrioritiesResponse> {
+ public:
+  explicit FakeStream(absl::Notification* ack = nullptr,
+                      grpc::Status status = grpc::Status::OK)
+      : ack_(ack), status_(std::move(status)) {}
+
+  bool Write(const MutatePrioritiesRequest& msg,
+             grpc::WriteOptions options) override {
+    absl::MutexLock lock(&mu_);
+    requests_.push_back(msg);
+    return status_.ok();
+  }
+
+  bool Read(MutatePrioritiesResponse* response) override {
+    if (ack_ != nullptr) ack_->WaitForNotification();
+    return true;
+  }
+
+  bool WritesDone() override { return true; }
+
+  grpc::Status Finish() override { return status_; }
+
+  void BlockUntilNumRequestsIs(int size) const {
+    absl::MutexLock lock(&mu_);
+    auto trigger = [size, this]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+      return requests_.size() == size;
+    };
+    mu_.Await(absl::Condition(&trigger));
+  }
+
+  std::vector<MutatePrioritiesRequest> requests() const {
+    absl::MutexLock lock(&mu_);
+    return requests_;
+  }
+
+ private:
+  absl::Notification* ack_;
+  const grpc::Status status_;
+  mutable absl::Mutex mu_;
+  std::vector<MutatePrioritiesRequest> requests_ ABSL_GUARDED_BY(mu_);
+};
+
+PriorityUpdater::Options MakeOptions(int flush_size,
+                                     absl::Duration flush_interval,
+                                     int max_pending_keys) {
+  PriorityUpdater::Options options;
+  options.flush_size = flush_size;
+  options.flush_interval = flush_interval;
+  options.max_pending_keys = max_pending_keys;
+  return options;
+}
+
+TEST(PriorityUpdaterTest, CoalescesUpdatesOfSameKey) {
+  auto* stream = new FakeStream();
+  auto stub = std::make_shared</* grpc_gen:: */MockReverbServiceStub>();
+  EXPECT_CALL(*stub, MutatePrioritiesStreamRaw(_)).WillOnce(Return(stream));
+
+  PriorityUpdater updater(stub, "table",
+                          MakeOptions(100, absl::Hours(1), 100));
+  REVERB_ASSERT_OK(updater.Update({MakeKeyWithPriority(1, 1.0)}));
+  REVERB_ASSERT_OK(updater.Update(
+      {MakeKeyWithPriority(1, 2.0), MakeKeyWithPriority(2, 3.0)}));
+  REVERB_ASSERT_OK(updater.Flush());
+
+  auto requests = stream->requests();
+  ASSERT_EQ(requests.size(), 1);
+  EXPECT_EQ(requests[0].table(), "table");
+  EXPECT_THAT(requests[0].updates(),
+              UnorderedElementsAre(EqualsProto(MakeKeyWithPriority(1, 2.0)),
+                                   EqualsProto(MakeKeyWithPriority(2, 3.0))));
+  EXPECT_THAT(requests[0].delete_keys(), IsEmpty());
+}
+
+TEST(PriorityUpdaterTest, DeleteReplacesPendingUpdates) {
+  auto* stream = new FakeStream();
+  auto stub = std::make_shared</* grpc_gen:: */MockReverbServiceStub>();
+  EXPECT_CALL(*stub, MutatePrioritiesStreamRaw(_)).WillOnce(Return(stream));
+
+  PriorityUpdater updater(stub, "table",
+                          MakeOptions(100, absl::Hours(1), 100));
+  REVERB_ASSERT_OK(updater.Update({MakeKeyWithPriority(1, 1.0)}));
+  REVERB_ASSERT_OK(updater.Delete({1}));
+  REVERB_ASSERT_OK(updater.Update({MakeKeyWithPriority(1, 2.0)}));
+  REVERB_ASSERT_OK(updater.Flush());
+
+  auto requests = stream->requests();
+  ASSERT_EQ(requests.size(), 1);
+  EXPECT_THAT(requests[0].updates(), IsEmpty());
+  EXPECT_THAT(requests[0].delete_keys(), ElementsAre(1));
+}
+
+TEST(PriorityUpdaterTest, FlushesWhenFlushSizeIsReached) {
+  auto* stream = new FakeStream();
+  auto stub = std::make_shared</* grpc_gen:: */MockReverbServiceStub>();
+  EXPECT_CALL(*stub, MutatePrioritiesStreamRaw(_)).WillOnce(Return(stream));
+
+  PriorityUpdater updater(stub, "table", MakeOptions(2, absl::Hours(1), 10));
+  REVERB_ASSERT_OK(updater.Update({MakeKeyWithPriority(1, 1.0)}));
+  REVERB_ASSERT_OK(updater.Update({MakeKeyWithPriority(2, 1.0)}));
+  stream->BlockUntilNumRequestsIs(1);
+  EXPECT_EQ(stream->requests()[0].updates_size(), 2);
+}
+
+TEST(PriorityUpdaterTest, FlushesWhenFlushIntervalHasPassed) {
+  auto* stream = new FakeStream();
+  auto stub = std::make_shared</* grpc_gen:: */MockReverbServiceStub>();
+  EXPECT_CALL(*stub, MutatePrioritiesStreamRaw(_)).WillOnce(Return(stream));
+
+  PriorityUpdater updater(stub, "table",
+                          MakeOptions(100, absl::Milliseconds(10), 100));
+  REVERB_ASSERT_OK(updater.Update({MakeKeyWithPriority(1, 1.0)}));
+  stream->BlockUntilNumRequestsIs(1);
+}
+
+TEST(PriorityUpdaterTest, UpdateBlocksWhileBufferIsFull) {
+  absl::Notification ack;
+  auto* stream = new FakeStream(&ack);
+  auto stub = std::make_shared</* grpc_gen:: */MockReverbServiceStub>();
+  EXPECT_CALL(*stub, MutatePrioritiesStreamRaw(_)).WillOnce(Return(stream));
+
+  PriorityUpdater updater(stub, "table", MakeOptions(1, absl::Hours(1), 1));
+
+  // The first key is sent right away but is not acknowledged so the second
+  // key fills the buffer.
+  REVERB_ASSERT_OK(updater.Update({MakeKeyWithPriority(1, 1.0)}));
+  stream->BlockUntilNumRequestsIs(1);
+  REVERB_ASSERT_OK(updater.Update({MakeKeyWithPriority(2, 1.0)}));
+
+  EXPECT_EQ(updater
+                .Update({MakeKeyWithPriority(3, 1.0)}, absl::Milliseconds(10))
+                .code(),
+            absl::StatusCode::kDeadlineExceeded);
+
+  ack.Notify();
+  REVERB_ASSERT_OK(updater.Update({MakeKeyWithPriority(3, 1.0)}));
+  REVERB_ASSERT_OK(updater.Flush());
+}
+
+TEST(PriorityUpdaterTest, FlushTimesOutWhileBatchIsInFlight) {
+  absl::Notification ack;
+  auto* stream = new FakeStream(&ack);
+  auto stub = std::make_shared</* grpc_gen:: */MockReverbServiceStub>();
+  EXPECT_CALL(*stub, MutatePrioritiesStreamRaw(_)).WillOnce(Return(stream));
+
+  PriorityUpdater updater(stub, "table",
+                          MakeOptions(100, absl::Hours(1), 100));
+  REVERB_ASSERT_OK(updater.Update({MakeKeyWithPriority(1, 1.0)}));
+  EXPECT_EQ(updater.Flush(absl::Milliseconds(10)).code(),
+            absl::StatusCode::kDeadlineExceeded);
+
+  ack.Notify();
+  REVERB_EXPECT_OK(updater.Flush());
+}
+
+TEST(PriorityUpdaterTest, ErrorIsReturnedByLaterCalls) {
+  auto* stream = new FakeStream(
+      nullptr, grpc::Status(grpc::StatusCode::NOT_FOUND, "no table"));
+  auto stub = std::make_shared</* grpc_gen:: */MockReverbServiceStub>();
+  EXPECT_CALL(*stub, MutatePrioritiesStreamRaw(_)).WillOnce(Return(stream));
+
+  PriorityUpdater updater(stub, "table",
+                          MakeOptions(100, absl::Hours(1), 100));
+  REVERB_ASSERT_OK(updater.Update({MakeKeyWithPriority(1, 1.0)}));
+  EXPECT_EQ(updater.Flush().code(), absl::StatusCode::kNotFound);
+  EXPECT_EQ(updater.Update({MakeKeyWithPriority(1, 1.0)}).code(),
+            absl::StatusCode::kNotFound);
+  EXPECT_EQ(updater.Close().code(), absl::StatusCode::kNotFound);
+}
+
+TEST(PriorityUpdaterTest, UnavailableBatchIsRetriedOnNewStream) {
+  auto* broken = new FakeStream(
+      nullptr, grpc::Status(grpc::StatusCode::UNAVAILABLE, "restarting"));
+  auto* stream = new FakeStream();
+  auto stub = std::make_shared</* grpc_gen:: */MockReverbServiceStub>();
+  EXPECT_CALL(*stub, MutatePrioritiesStreamRaw(_))
+      .WillOnce(Return(broken))
+      .WillOnce(Return(stream));
+
+  auto options = MakeOptions(100, absl::Hours(1), 100);
+  options.retry_delay = absl::Milliseconds(10);
+  PriorityUpdater updater(stub, "table", options);
+  REVERB_ASSERT_OK(updater.Update({MakeKeyWithPriority(1, 1.0)}));
+  REVERB_ASSERT_OK(updater.Delete({2}));
+  REVERB_EXPECT_OK(updater.Flush());
+
+  ASSERT_EQ(stream->requests().size(), 1);
+  EXPECT_THAT(stream->requests()[0], EqualsProto(R"pb(
+                table: "table"
+                updates: { key: 1 priority: 1.0 }
+                delete_keys: 2
+              )pb"));
+  REVERB_EXPECT_OK(updater.Close());
+}
+
+TEST(PriorityUpdaterTest, CloseFlushesPendingUpdates) {
+  auto* stream = new FakeStream();
+  auto stub = std::make_shared</* grpc_gen:: */MockReverbServiceStub>();
+  EXPECT_CALL(*stub, MutatePrioritiesStreamRaw(_)).WillOnce(Return(stream));
+
+  PriorityUpdater updater(stub, "table",
+                          MakeOptions(100, absl::Hours(1), 100));
+  REVERB_ASSERT_OK(updater.Delete({1, 2}));
+  REVERB_ASSERT_OK(updater.Close());
+
+  EXPECT_EQ(stream->requests().size(), 1);
+  EXPECT_EQ(updater.Update({MakeKeyWithPriority(3, 1.0)}).code(),
+            absl::StatusCode::kCancelled);
+}
+
+TEST(PriorityUpdaterTest, NoStreamIsOpenedWithoutUpdates) {
+  auto stub = std::make_shared</* grpc_gen:: */MockReverbServiceStub>();
+  EXPECT_CALL(*stub, MutatePrioritiesStreamRaw(_)).Times(0);
+
+  PriorityUpdater updater(stub, "table",
+                          MakeOptions(100, absl::Hours(1), 100));
+  REVERB_EXPECT_OK(updater.Flush());
+  REVERB_EXPECT_OK(updater.Close());
+}
+
+TEST(PriorityUpdaterOptionsTest, Validate) {
+  REVERB_EXPECT_OK(PriorityUpdater::Options().Validate());
+  EXPECT_EQ(MakeOptions(0, absl::Seconds(1), 10).Validate().code(),
+            absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(MakeOptions(1, absl::ZeroDuration(), 10).Validate().code(),
+            absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(MakeOptions(10, absl::Seconds(1), 5).Validate().code(),
+            absl::StatusCode::kInvalidArgument);
+
+  auto options = MakeOptions(10, absl::Seconds(1), 10);
+  options.retry_delay = -absl::Seconds(1);
+  EXPECT_EQ(options.Validate().code(), absl::StatusCode::kInvalidArgument);
+}
+
+}  // namespace
+}  // namespace reverb
+}  // namespace deepmind
@@ -15,13 +15,19 @@
 #include "reverb/cc/rate_limiter.h"
 
 #include <algorithm>
+#include <functional>
+#include <iterator>
+#include <list>
+#include <memory>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "google/protobuf/duration.pb.h"
 #include <cstdint>
 #include "absl/base/thread_annotations.h"
 #include "absl/container/fixed_array.h"
+#include "absl/memory/memory.h"
 #include "absl/strings/str_cat.h"
 #include "absl/strings/string_view.h"
 #include "absl/synchronization/mutex.h"
@@ -68,39 +74,110 @@ RateLimiter::RateLimiter(const RateLimiterCheckpoint& checkpoint)
                   checkpoint.min_size_to_sample(),
                   /*min_diff=*/checkpoint.min_diff(),
                   /*max_diff=*/checkpoint.max_diff()) {
-  inserts_ = checkpoint.insert_count();
-  samples_ = checkpoint.sample_count();
-  deletes_ = checkpoint.delete_count();
+  absl::MutexLock lock(&mu_);
+  inserts_ = unattributed_.inserts = checkpoint.insert_count();
+  samples_ = unattributed_.samples = checkpoint.sample_count();
+  deletes_ = unattributed_.deletes = checkpoint.delete_count();
 }
 
-absl::Status RateLimiter::RegisterTable(Table* table) {
-  if (table_) {
+RateLimiter::~RateLimiter() {
+  std::unique_ptr<internal::Thread> deadline_thread;
+  {
+    absl::MutexLock lock(&mu_);
+    stop_deadline_thread_ = true;
+    deadline_cv_.Signal();
+    deadline_thread = std::move(deadline_thread_);
+  }
+  deadline_thread = nullptr;  // Joins the thread.
+
+  // Tables unregister (and thus cancel their operations) before the limiter
+  // is destroyed but calls made with other locks may still be queued.
+  {
+    absl::MutexLock lock(&mu_);
+    CompleteAllLocked([](const Waiter&) { return true; },
+                      absl::CancelledError("RateLimiter has been destroyed"));
+  }
+  RunReadyCallbacks();
+}
+
+absl::Status RateLimiter::RegisterTable(absl::Mutex* mu, Table* table) {
+  absl::MutexLock table_lock(mu);
+  absl::MutexLock lock(&mu_);
+  auto& state = tables_[mu];
+  if (state != nullptr) {
     return absl::FailedPreconditionError(absl::StrCat(
-        "Attempting to registering a table ", absl::Hex(table),
-        " (name: ", table->name(), ") with RateLimiter when is ",
-        "already registered with this limiter: ", absl::Hex(table_),
-        " (name: ", table_->name(), ")"));
+        "Attempting to register table ", absl::Hex(table),
+        " (name: ", table->name(), ") with RateLimiter when it is ",
+        "already registered with this limiter."));
   }
-  table_ = table;
+  state = absl::make_unique<TableState>();
+  state->table = table;
   return absl::OkStatus();
 }
 
 void RateLimiter::UnregisterTable(absl::Mutex* mu, Table* table) {
-  REVERB_CHECK_EQ(table, table_)
-      << "The wrong Table attempted to unregister this rate limiter.";
-  absl::MutexLock lock(mu);
-  Reset(mu);
-  table_ = nullptr;
+  {
+    absl::MutexLock table_lock(mu);
+    absl::MutexLock lock(&mu_);
+    auto it = tables_.find(mu);
+    REVERB_CHECK(it != tables_.end() && it->second->table == table)
+        << "The wrong Table attempted to unregister this rate limiter.";
+    const TableState* state = it->second.get();
+    CompleteAllLocked(
+        [state](const Waiter& waiter) { return waiter.state == state; },
+        absl::CancelledError("Table has been destroyed"));
+    ResetLocked(it->second.get());
+    tables_.erase(it);
+  }
+  RunReadyCallbacks();
+}
+
+RateLimiter::TableState* RateLimiter::StateOf(absl::Mutex* mu) {
+  auto it = tables_.find(mu);
+  return it == tables_.end() ? &unattributed_ : it->second.get();
+}
+
+const RateLimiter::TableState* RateLimiter::StateOf(absl::Mutex* mu) const {
+  auto it = tables_.find(mu);
+  return it == tables_.end() ? &unattributed_ : it->second.get();
+}
+
+bool RateLimiter::WaitWithDeadline(absl::Mutex* mu, absl::CondVar* cv,
+                                   absl::Time deadline) {
+  mu->Unlock();
+  const bool timed_out = cv->WaitWithDeadline(&mu_, deadline);
+  mu_.Unlock();
+  mu->Lock();
+  mu_.Lock();
+  return timed_out;
 }
 
 absl::Status RateLimiter::AwaitCanInsert(absl::Mutex* mu,
                                          absl::Duration timeout) {
+  return AwaitCanInsert(mu, /*num_inserts=*/1, timeout);
+}
+
+absl::Status RateLimiter::AwaitCanInsert(absl::Mutex* mu, int num_inserts,
+                                         absl::Duration timeout) {
+  REVERB_CHECK_GT(num_inserts, 0);
   const auto deadline = absl::Now() + timeout;
+  absl::MutexLock lock(&mu_);
   {
-    auto event = insert_stats_.CreateEvent(mu);
-    while (!cancelled_ && !CanInsert(mu, 1)) {
+    auto event = insert_stats_.CreateEvent(&mu_);
+    if (!cancelled_ && !CanInsertLocked(num_inserts)) {
       event.set_was_blocked();
-      if (can_insert_cv_.WaitWithDeadline(mu, deadline)) {
+      Waiter waiter(num_inserts, num_inserts, StateOf(mu));
+      auto it = insert_waiters_.insert(insert_waiters_.end(), &waiter);
+      bool timed_out;
+      do {
+        timed_out = WaitWithDeadline(mu, &waiter.cv, deadline);
+      } while (!timed_out && !cancelled_ && !CanInsertLocked(num_inserts));
+      insert_waiters_.erase(it);
+
+      if (timed_out) {
+        // The call may have been signalled in favour of another call so the
+        // signal is passed on.
+        MaybeSignalCondVarsLocked();
         return errors::RateLimiterTimeout();
       }
     }
@@ -109,32 +186,87 @@ absl::Status RateLimiter::AwaitCanInsert(absl::Mutex* mu,
   return absl::OkStatus();
 }
 
-void RateLimiter::Insert(absl::Mutex* mu) {
-  inserts_++;
-  MaybeSignalCondVars(mu);
+void RateLimiter::Insert(absl::Mutex* mu, int num_inserts) {
+  absl::MutexLock lock(&mu_);
+  TableState* state = StateOf(mu);
+  inserts_ += num_inserts;
+  state->inserts += num_inserts;
+  state->known_empty = TableIsEmpty(mu, *state);
+  MaybeSignalCondVarsLocked();
 }
 
 void RateLimiter::Delete(absl::Mutex* mu) {
+  absl::MutexLock lock(&mu_);
+  TableState* state = StateOf(mu);
   deletes_++;
-  MaybeSignalCondVars(mu);
+  state->deletes++;
+  state->known_empty = TableIsEmpty(mu, *state);
+  MaybeSignalCondVarsLocked();
 }
 
 void RateLimiter::Reset(absl::Mutex* mu) {
-  inserts_ = 0;
-  samples_ = 0;
-  deletes_ = 0;
-  MaybeSignalCondVars(mu);
+  absl::MutexLock lock(&mu_);
+  TableState* state = StateOf(mu);
+  state->known_empty = TableIsEmpty(mu, *state);
+  ResetLocked(state);
+}
+
+void RateLimiter::ResetLocked(TableState* state) {
+  if (tables_.size() <= 1) {
+    // Not shared so the state of all operations is reset. This includes the
+    // counts restored from a checkpoint.
+    inserts_ = samples_ = deletes_ = 0;
+    unattributed_.inserts = unattributed_.samples = unattributed_.deletes = 0;
+    for (auto& entry : tables_) {
+      entry.second->inserts = entry.second->samples =
+          entry.second->deletes = 0;
+    }
+  } else {
+    inserts_ -= state->inserts;
+    samples_ -= state->samples;
+    deletes_ -= state->deletes;
+    state->inserts = state->samples = state->deletes = 0;
+  }
+  MaybeSignalCondVarsLocked();
 }
 
 absl::Status RateLimiter::AwaitAndFinalizeSample(absl::Mutex* mu,
                                                  absl::Duration timeout) {
+  int num_samples;
+  return AwaitAndFinalizeSamples(mu, /*max_samples=*/1, /*min_samples=*/1,
+                                 timeout, &num_samples);
+}
+
+absl::Status RateLimiter::AwaitAndFinalizeSamples(absl::Mutex* mu,
+                                                  int max_samples,
+                                                  int min_samples,
+                                                  absl::Duration timeout,
+                                                  int* num_samples) {
+  REVERB_CHECK_GT(min_samples, 0);
+  REVERB_CHECK_GE(max_samples, min_samples);
   const auto deadline = absl::Now() + timeout;
+  absl::MutexLock lock(&mu_);
+  TableState* state = StateOf(mu);
+  auto can_proceed = [&]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    state->known_empty = TableIsEmpty(mu, *state);
+    return cancelled_ ||
+           (!state->known_empty && CanSampleLocked(min_samples));
+  };
 
   {
-    auto event = sample_stats_.CreateEvent(mu);
-    while (!cancelled_ && !CanSample(mu, 1)) {
+    auto event = sample_stats_.CreateEvent(&mu_);
+    if (!can_proceed()) {
       event.set_was_blocked();
-      if (can_sample_cv_.WaitWithDeadline(mu, deadline)) {
+      Waiter waiter(min_samples, max_samples, state);
+      auto it = sample_waiters_.insert(sample_waiters_.end(), &waiter);
+      bool timed_out;
+      do {
+        timed_out = WaitWithDeadline(mu, &waiter.cv, deadline);
+      } while (!timed_out && !can_proceed());
+      sample_waiters_.erase(it);
+
+      if (timed_out) {
+        MaybeSignalCondVarsLocked();
         return errors::RateLimiterTimeout();
       }
     }
@@ -142,12 +274,55 @@ absl::Status RateLimiter::AwaitAndFinalizeSample(absl::Mutex* mu,
 
   REVERB_RETURN_IF_ERROR(CheckIfCancelled());
 
-  samples_++;
-  MaybeSignalCondVars(mu);
+  *num_samples = FinalizeSamplesLocked(state, max_samples);
+  return absl::OkStatus();
+}
+
+absl::Status RateLimiter::FinalizeSamples(absl::Mutex* mu, int max_samples,
+                                          int* num_samples) {
+  REVERB_CHECK_GT(max_samples, 0);
+  absl::MutexLock lock(&mu_);
+  REVERB_RETURN_IF_ERROR(CheckIfCancelled());
+  TableState* state = StateOf(mu);
+  state->known_empty = TableIsEmpty(mu, *state);
+  *num_samples = FinalizeSamplesLocked(state, max_samples);
   return absl::OkStatus();
 }
 
-bool RateLimiter::CanSample(absl::Mutex*, int num_samples) const {
+int RateLimiter::FinalizeSamplesLocked(TableState* state, int max_samples) {
+  const int num_samples =
+      NumSamplesAllowedLocked(/*num_reserved=*/0, max_samples);
+  samples_ += num_samples;
+  state->samples += num_samples;
+  MaybeSignalCondVarsLocked();
+  return num_samples;
+}
+
+void RateLimiter::ReleaseSamples(absl::Mutex* mu, int num_samples) {
+  absl::MutexLock lock(&mu_);
+  TableState* state = StateOf(mu);
+  samples_ -= num_samples;
+  state->samples -= num_samples;
+  state->known_empty = TableIsEmpty(mu, *state);
+  MaybeSignalCondVarsLocked();
+}
+
+bool RateLimiter::CanSample(absl::Mutex* mu, int num_samples) const {
+  absl::MutexLock lock(&mu_);
+  return CanSampleLocked(num_samples) && !TableIsEmpty(mu, *StateOf(mu));
+}
+
+bool RateLimiter::MinSizeReached(absl::Mutex*) const {
+  absl::MutexLock lock(&mu_);
+  return inserts_ - deletes_ >= min_size_to_sample_;
+}
+
+bool RateLimiter::CanInsert(absl::Mutex*, int num_inserts) const {
+  absl::MutexLock lock(&mu_);
+  return CanInsertLocked(num_inserts);
+}
+
+bool RateLimiter::CanSampleLocked(int num_samples) const {
   REVERB_CHECK_GT(num_samples, 0);
   if (inserts_ - deletes_ < min_size_to_sample_) {
     return false;
@@ -156,7 +331,7 @@ bool RateLimiter::CanSample(absl::Mutex*, int num_samples) const {
   return diff >= min_diff_;
 }
 
-bool RateLimiter::CanInsert(absl::Mutex*, int num_inserts) const {
+bool RateLimiter::CanInsertLocked(int num_inserts) const {
   REVERB_CHECK_GT(num_inserts, 0);
   // Until the min size is reached inserts are free to progress.
   if (inserts_ + num_inserts - deletes_ <= min_size_to_sample_) {
@@ -167,13 +342,200 @@ bool RateLimiter::CanInsert(absl::Mutex*, int num_inserts) const {
   return diff <= max_diff_;
 }
 
+bool RateLimiter::HasQueuedInserts(absl::Mutex*) const {
+  absl::MutexLock lock(&mu_);
+  return !insert_waiters_.empty();
+}
+
+bool RateLimiter::HasQueuedSamples(absl::Mutex*) const {
+  absl::MutexLock lock(&mu_);
+  return !sample_waiters_.empty();
+}
+
+void RateLimiter::RecordAsyncInsert(absl::Mutex*, absl::Time start,
+                                    bool was_blocked) {
+  absl::MutexLock lock(&mu_);
+  insert_stats_.RecordEvent(&mu_, start, was_blocked);
+}
+
+void RateLimiter::RecordAsyncSample(absl::Mutex*, absl::Time start,
+                                    bool was_blocked) {
+  absl::MutexLock lock(&mu_);
+  sample_stats_.RecordEvent(&mu_, start, was_blocked);
+}
+
+void RateLimiter::EnqueueInsert(absl::Mutex* mu, int num_inserts,
+                                absl::Time deadline, AsyncCallback callback) {
+  REVERB_CHECK_GT(num_inserts, 0);
+  absl::MutexLock lock(&mu_);
+  auto waiter = absl::make_unique<Waiter>(num_inserts, num_inserts, StateOf(mu));
+  waiter->callback = std::move(callback);
+  waiter->deadline = deadline;
+  EnqueueLocked(&insert_waiters_, std::move(waiter));
+}
+
+void RateLimiter::EnqueueSample(absl::Mutex* mu, int max_samples,
+                                int min_samples, absl::Time deadline,
+                                AsyncCallback callback) {
+  REVERB_CHECK_GT(min_samples, 0);
+  REVERB_CHECK_GE(max_samples, min_samples);
+  absl::MutexLock lock(&mu_);
+  TableState* state = StateOf(mu);
+  state->known_empty = TableIsEmpty(mu, *state);
+  auto waiter = absl::make_unique<Waiter>(min_samples, max_samples, state);
+  waiter->callback = std::move(callback);
+  waiter->deadline = deadline;
+  EnqueueLocked(&sample_waiters_, std::move(waiter));
+}
+
+void RateLimiter::EnqueueLocked(std::list<Waiter*>* waiters,
+                                std::unique_ptr<Waiter> waiter) {
+  if (cancelled_) {
+    ready_callbacks_.emplace_back(std::move(waiter->callback),
+                                  CheckIfCancelled());
+    has_ready_callbacks_ = true;
+    return;
+  }
+
+  if (waiter->deadline != absl::InfiniteFuture()) {
+    if (deadline_thread_ == nullptr) {
+      deadline_thread_ = internal::StartThread(
+          "RateLimiterDeadlines", [this] { ExpireQueuedOperations(); });
+    }
+    deadline_cv_.Signal();
+  }
+
+  waiters->push_back(waiter.release());
+
+  // The state may have changed since the caller checked it.
+  MaybeSignalCondVarsLocked();
+}
+
+std::list<RateLimiter::Waiter*>::iterator RateLimiter::CompleteLocked(
+    std::list<Waiter*>* waiters, std::list<Waiter*>::iterator it,
+    absl::Status status) {
+  std::unique_ptr<Waiter> waiter(*it);
+  ready_callbacks_.emplace_back(std::move(waiter->callback), std::move(status));
+  has_ready_callbacks_ = true;
+  return waiters->erase(it);
+}
+
+std::list<RateLimiter::Waiter*>::iterator RateLimiter::WakeLocked(
+    std::list<Waiter*>* waiters, std::list<Waiter*>::iterator it) {
+  if ((*it)->callback) {
+    return CompleteLocked(waiters, it, absl::OkStatus());
+  }
+  (*it)->cv.Signal();
+  return std::next(it);
+}
+
+void RateLimiter::CompleteAllLocked(
+    const std::function<bool(const Waiter&)>& pred,
+    const absl::Status& status) {
+  for (auto* waiters : {&insert_waiters_, &sample_waiters_}) {
+    for (auto it = waiters->begin(); it != waiters->end();) {
+      if ((*it)->callback && pred(**it)) {
+        it = CompleteLocked(waiters, it, status);
+      } else {
+        ++it;
+      }
+    }
+  }
+}
+
+void RateLimiter::RunReadyCallbacks() {
+  if (!has_ready_callbacks_.load()) return;
+
+  // The callbacks retry their operations, which call this method again and may
+  // make further operations ready. The limiters drained by the current thread
+  // are tracked so that these nested calls return straight away and the loop
+  // below picks up the new callbacks instead.
+  static thread_local std::vector<const RateLimiter*> draining;
+  if (std::find(draining.begin(), draining.end(), this) != draining.end()) {
+    return;
+  }
+  draining.push_back(this);
+
+  while (has_ready_callbacks_.load()) {
+    std::vector<std::pair<AsyncCallback, absl::Status>> ready;
+    {
+      absl::MutexLock lock(&mu_);
+      std::swap(ready, ready_callbacks_);
+      has_ready_callbacks_ = false;
+    }
+    for (auto& callback_and_status : ready) {
+      callback_and_status.first(callback_and_status.second);
+    }
+  }
+
+  draining.erase(std::find(draining.begin(), draining.end(), this));
+}
+
+void RateLimiter::ExpireQueuedOperations() {
+  while (true) {
+    {
+      absl::MutexLock lock(&mu_);
+      bool expired = false;
+      while (!stop_deadline_thread_ && !expired) {
+        const absl::Time now = absl::Now();
+        absl::Time next_deadline = absl::InfiniteFuture();
+        CompleteAllLocked(
+            [&](const Waiter& waiter) {
+              if (waiter.deadline <= now) {
+                expired = true;
+                return true;
+              }
+              next_deadline = std::min(next_deadline, waiter.deadline);
+              return false;
+            },
+            errors::RateLimiterTimeout());
+        if (!expired) {
+          deadline_cv_.WaitWithDeadline(&mu_, next_deadline);
+        }
+      }
+      if (stop_deadline_thread_) return;
+
+      // The expired operations may have been woken up in favour of other
+      // operations so the wakeups are passed on.
+      MaybeSignalCondVarsLocked();
+    }
+    RunReadyCallbacks();
+  }
+}
+
+int RateLimiter::NumSamplesAllowedLocked(int num_reserved,
+                                         int max_samples) const {
+  // `CanSampleLocked` is monotonic in the number of samples so the largest
+  // allowed number is found with a binary search.
+  int low = 0;
+  int high = max_samples;
+  while (low < high) {
+    int mid = low + (high - low + 1) / 2;
+    if (CanSampleLocked(num_reserved + mid)) {
+      low = mid;
+    } else {
+      high = mid - 1;
+    }
+  }
+  return low;
+}
+
+bool RateLimiter::TableIsEmpty(absl::Mutex* mu, const TableState& state) const {
+  // `state.table` is only set for the table which registered with `mu` so the
+  // lock of the table is held.
+  return state.table != nullptr && state.table->RawLookup()->empty();
+}
+
 void RateLimiter::Cancel(absl::Mutex*) {
+  absl::MutexLock lock(&mu_);
   cancelled_ = true;
-  can_insert_cv_.SignalAll();
-  can_sample_cv_.SignalAll();
+  for (Waiter* waiter : insert_waiters_) waiter->cv.Signal();
+  for (Waiter* waiter : sample_waiters_) waiter->cv.Signal();
+  CompleteAllLocked([](const Waiter&) { return true; }, CheckIfCancelled());
 }
 
 RateLimiterCheckpoint RateLimiter::CheckpointReader(absl::Mutex*) const {
+  absl::MutexLock lock(&mu_);
   RateLimiterCheckpoint checkpoint;
   checkpoint.set_samples_per_insert(samples_per_insert_);
   checkpoint.set_min_diff(min_diff_);
@@ -191,15 +553,44 @@ absl::Status RateLimiter::CheckIfCancelled() const {
   return absl::CancelledError("RateLimiter has been cancelled");
 }
 
-void RateLimiter::MaybeSignalCondVars(absl::Mutex* mu) {
-  if (CanInsert(mu, 1)) can_insert_cv_.Signal();
-  if (CanSample(mu, 1)) can_sample_cv_.Signal();
+void RateLimiter::MaybeSignalCondVars(absl::Mutex*) {
+  absl::MutexLock lock(&mu_);
+  MaybeSignalCondVarsLocked();
 }
 
-RateLimiterInfo RateLimiter::Info(absl::Mutex* mu) const {
+void RateLimiter::MaybeSignalCondVarsLocked() {
+  int num_inserts = 0;
+  for (auto it = insert_waiters_.begin(); it != insert_waiters_.end();) {
+    if (!CanInsertLocked(num_inserts + 1)) break;
+    if (!CanInsertLocked(num_inserts + (*it)->min_operations)) {
+      ++it;
+      continue;
+    }
+    num_inserts += (*it)->min_operations;
+    it = WakeLocked(&insert_waiters_, it);
+  }
+
+  // A sample can only proceed if its table has items. Calls from tables which
+  // are known to be empty are woken up by the insert into their table.
+  int num_samples = 0;
+  for (auto it = sample_waiters_.begin(); it != sample_waiters_.end();) {
+    if (!CanSampleLocked(num_samples + 1)) break;
+    const Waiter& waiter = **it;
+    if (waiter.state->known_empty ||
+        !CanSampleLocked(num_samples + waiter.min_operations)) {
+      ++it;
+      continue;
+    }
+    num_samples += NumSamplesAllowedLocked(num_samples, waiter.max_operations);
+    it = WakeLocked(&sample_waiters_, it);
+  }
+}
+
+RateLimiterInfo RateLimiter::Info(absl::Mutex*) const {
   RateLimiterInfo info_proto = InfoWithoutCallStats();
-  insert_stats_.ToProto(mu, info_proto.mutable_insert_stats());
-  sample_stats_.ToProto(mu, info_proto.mutable_sample_stats());
+  absl::MutexLock lock(&mu_);
+  insert_stats_.ToProto(&mu_, info_proto.mutable_insert_stats());
+  sample_stats_.ToProto(&mu_, info_proto.mutable_sample_stats());
   return info_proto;
 }
 
@@ -213,10 +604,11 @@ RateLimiterInfo RateLimiter::InfoWithoutCallStats() const {
 }
 
 RateLimiterEventHistory RateLimiter::GetEventHistory(
-    absl::Mutex* mu, size_t min_insert_event_id,
+    absl::Mutex*, size_t min_insert_event_id,
     size_t min_sample_event_id) const {
-  return {insert_stats_.GetEventHistory(mu, min_insert_event_id),
-          sample_stats_.GetEventHistory(mu, min_sample_event_id)};
+  absl::MutexLock lock(&mu_);
+  return {insert_stats_.GetEventHistory(&mu_, min_insert_event_id),
+          sample_stats_.GetEventHistory(&mu_, min_sample_event_id)};
 }
 
 std::string RateLimiter::DebugString() const {
@@ -246,6 +638,18 @@ RateLimiter::StatsManager::ScopedEvent RateLimiter::StatsManager::CreateEvent(
   return ScopedEvent(this, &events_[id % events_.size()]);
 }
 
+void RateLimiter::StatsManager::RecordEvent(absl::Mutex* mu, absl::Time start,
+                                            bool was_blocked)
+    ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu) {
+  const size_t id = next_event_id_++;
+  RateLimiterEvent* event = &events_[id % events_.size()];
+  *event = {id, start,
+            was_blocked ? absl::Now() - start : absl::ZeroDuration()};
+  completed_++;
+  limited_ += was_blocked ? 1 : 0;
+  total_wait_ += event->blocked_for;
+}
+
 void RateLimiter::StatsManager::CompleteEvent(RateLimiterEvent* event) {
   active_.erase(event->id);
   completed_++;
@@ -15,7 +15,13 @@
 #ifndef REVERB_CC_RATE_LIMITER_H_
 #define REVERB_CC_RATE_LIMITER_H_
 
+#include <atomic>
+#include <functional>
+#include <list>
+#include <memory>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include <cstdint>
 #include "absl/base/thread_annotations.h"
@@ -24,7 +30,9 @@
 #include "absl/synchronization/mutex.h"
 #include "absl/time/time.h"
 #include "reverb/cc/checkpointing/checkpoint.pb.h"
+#include "reverb/cc/platform/hash_map.h"
 #include "reverb/cc/platform/hash_set.h"
+#include "reverb/cc/platform/thread.h"
 #include "reverb/cc/schema.pb.h"
 
 namespace deepmind {
@@ -59,6 +67,18 @@ struct RateLimiterEventHistory {
 // RateLimiter manages the data throughput for a `Table` by blocking
 // sample or insert calls if the ratio between the two deviates too much from
 // the ratio specified by `samples_per_insert`.
+//
+// A RateLimiter can be shared by several tables, in which case the limits are
+// applied to the combined inserts and samples of all the tables. This is
+// useful when the same data is written to multiple tables (e.g one uniform
+// and one prioritized) and the learner should consume them at a fixed ratio
+// in total. Samples from a table are still only allowed while that table has
+// items.
+//
+// The methods are called with the lock of the calling table held (`mu`). The
+// state of the limiter is guarded by an internal mutex which is always
+// acquired after `mu`. While a call is blocked both locks are released, so
+// changes made through any of the tables wake up the blocked calls.
 class RateLimiter {
  public:
   RateLimiter(double samples_per_insert, int64_t min_size_to_sample,
@@ -67,6 +87,14 @@ class RateLimiter {
   // Construct and restore a RateLimiter from a previous checkpoint.
   explicit RateLimiter(const RateLimiterCheckpoint& checkpoint);
 
+  ~RateLimiter();
+
+  // Callback of an operation queued with `EnqueueInsert` or `EnqueueSample`.
+  // Called with OK when the operation might be able to proceed, in which case
+  // the caller must retry it, or with the error (timeout or cancellation)
+  // which ended the operation.
+  using AsyncCallback = std::function<void(const absl::Status&)>;
+
   // Waits until the insert operation can proceed without violating the
   // conditions of the rate limiter.
   //
@@ -78,6 +106,13 @@ class RateLimiter {
                               absl::Duration timeout = kDefaultTimeout)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu);
 
+  // Same as above but waits until `num_inserts` inserts can proceed. The call
+  // blocks until the timeout expires if the limits never allow that many
+  // inserts at once.
+  absl::Status AwaitCanInsert(absl::Mutex* mu, int num_inserts,
+                              absl::Duration timeout = kDefaultTimeout)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu);
+
   // Waits until the sample operation can proceed without violating the
   // conditions of the rate limiter. If the condition is fulfilled before the
   // timeout expires or `Cancel` called then the state is updated.
@@ -85,35 +120,100 @@ class RateLimiter {
       absl::Mutex* mu, absl::Duration timeout = kDefaultTimeout)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu);
 
-  // Register that an item has been inserted into the table. Caller must call
-  // `AwaitCanInsert` before calling this method without releasing the lock in
-  // between.
-  void Insert(absl::Mutex* mu) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu);
+  // Waits until at least `min_samples` sample operations can proceed and then
+  // finalizes as many of them as the conditions allow, up to `max_samples`.
+  // The number of finalized samples is written to `num_samples`. Samples that
+  // the caller ends up not using must be returned with `ReleaseSamples`.
+  absl::Status AwaitAndFinalizeSamples(absl::Mutex* mu, int max_samples,
+                                       int min_samples, absl::Duration timeout,
+                                       int* num_samples)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu);
+
+  // Undoes `num_samples` of the samples finalized by `AwaitAndFinalizeSamples`.
+  void ReleaseSamples(absl::Mutex* mu, int num_samples)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu);
+
+  // Non-blocking alternatives to `AwaitCanInsert` and
+  // `AwaitAndFinalizeSamples`. The operation is queued until `num_inserts`
+  // inserts (or `min_samples` samples) might be allowed, `deadline` is reached
+  // or `Cancel` is called. The callback is not called by this method but by
+  // `RunReadyCallbacks`, which the tables call after every operation which
+  // changes the state. A thread is started the first time an operation with a
+  // finite deadline is queued to time out the operations.
+  void EnqueueInsert(absl::Mutex* mu, int num_inserts, absl::Time deadline,
+                     AsyncCallback callback) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu);
+  void EnqueueSample(absl::Mutex* mu, int max_samples, int min_samples,
+                     absl::Time deadline, AsyncCallback callback)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu);
+
+  // Calls the callbacks of the queued operations which are ready, including
+  // those which become ready while the callbacks run. Must not be called while
+  // holding the lock of a table using the limiter. Calls made from within a
+  // callback return immediately and leave the work to the outer call so that
+  // the stack does not grow with the number of queued operations.
+  void RunReadyCallbacks() ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Returns true iff an insert (or sample) operation of any table is waiting
+  // for the limiter. Non-blocking callers check this before proceeding so that
+  // they do not overtake the queued operations.
+  bool HasQueuedInserts(absl::Mutex* mu) const ABSL_SHARED_LOCKS_REQUIRED(mu);
+  bool HasQueuedSamples(absl::Mutex* mu) const ABSL_SHARED_LOCKS_REQUIRED(mu);
+
+  // Finalizes as many samples as the conditions allow, up to `max_samples`,
+  // without waiting. Must only be called after `CanSample` returned true. The
+  // call is not recorded in the call stats, see `RecordAsyncSample`.
+  absl::Status FinalizeSamples(absl::Mutex* mu, int max_samples,
+                               int* num_samples)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu);
+
+  // Records a call of a non-blocking operation in the call stats once it has
+  // completed. `start` is the time of the first attempt and `was_blocked`
+  // whether the operation was ever queued. Queued operations are not reported
+  // as pending.
+  void RecordAsyncInsert(absl::Mutex* mu, absl::Time start, bool was_blocked)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu);
+  void RecordAsyncSample(absl::Mutex* mu, absl::Time start, bool was_blocked)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu);
+
+  // Register that `num_inserts` items have been inserted into the table. Caller
+  // must call `AwaitCanInsert` before calling this method without releasing
+  // the lock in between.
+  void Insert(absl::Mutex* mu, int num_inserts = 1)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu);
 
   // Register that an item have been deleted from the table.
   void Delete(absl::Mutex* mu) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu);
 
-  // Register that the table has been fully reset.
+  // Register that the table has been fully reset. If the limiter is shared
+  // then only the operations of the table are forgotten.
   void Reset(absl::Mutex* mu) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu);
 
-  // Unblocks any `Await` calls with a Cancelled-status.
+  // Unblocks any `Await` calls with a Cancelled-status. If the limiter is
+  // shared then the calls of all tables are cancelled.
   void Cancel(absl::Mutex* mu) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu);
 
   // Returns true iff the current state would allow for `num_samples` to be
-  // sampled. Dies if `num_samples` is < 1.
+  // sampled from the table which holds `mu`. Dies if `num_samples` is < 1.
   bool CanSample(absl::Mutex* mu, int num_samples) const
       ABSL_SHARED_LOCKS_REQUIRED(mu);
 
+  // Returns true iff the tables using the limiter hold at least
+  // `min_size_to_sample` items. Used to stop using samples finalized by
+  // `AwaitAndFinalizeSamples` once deletions have shrunk the table too much.
+  bool MinSizeReached(absl::Mutex* mu) const ABSL_SHARED_LOCKS_REQUIRED(mu);
+
   // Returns true iff the current state would allow for `num_inserts` to be
   // inserted. Dies if `num_inserts` is < 1.
   bool CanInsert(absl::Mutex* mu, int num_inserts) const
       ABSL_SHARED_LOCKS_REQUIRED(mu);
 
-  // Creates a checkpoint of the current state for the rate limiter.
+  // Creates a checkpoint of the current state for the rate limiter. The counts
+  // are the combined counts of all tables sharing the limiter.
   RateLimiterCheckpoint CheckpointReader(absl::Mutex* mu) const
       ABSL_SHARED_LOCKS_REQUIRED(mu);
 
-  // Configuration and call stats of the limiter.
+  // Configuration and call stats of the limiter. The call stats include the
+  // calls of all tables sharing the limiter.
   RateLimiterInfo Info(absl::Mutex* mu) const ABSL_SHARED_LOCKS_REQUIRED(mu);
 
   // Same as Info but without call stats. Can be called without locking parent
@@ -132,21 +232,140 @@ class RateLimiter {
 
  private:
   friend class Table;
-  // `Table` calls these methods on construction and destruction.
-  absl::Status RegisterTable(Table* table);
+
+  // `Table` calls these methods on construction and destruction. `mu` is the
+  // lock of the table and identifies it in the calls which follow.
+  absl::Status RegisterTable(absl::Mutex* mu, Table* table)
+      ABSL_LOCKS_EXCLUDED(mu);
   void UnregisterTable(absl::Mutex* mu, Table* table) ABSL_LOCKS_EXCLUDED(mu);
 
   // Checks if sample and insert operations can proceed and if so calls `Signal`
   // on respective `CondVar`
   void MaybeSignalCondVars(absl::Mutex* mu) ABSL_SHARED_LOCKS_REQUIRED(mu);
 
+  // Operations of a single table.
+  struct TableState {
+    // Nullptr for `unattributed_`.
+    Table* table = nullptr;
+
+    // Contribution of the table to `inserts_`, `samples_` and `deletes_`.
+    int64_t inserts = 0;
+    int64_t samples = 0;
+    int64_t deletes = 0;
+
+    // Whether the table was empty the last time the limiter was called with
+    // the lock of the table held. Blocked samples from a table known to be
+    // empty are not woken up by the operations of other tables.
+    bool known_empty = false;
+  };
+
+  // A blocked `Await` call.
+  struct Waiter {
+    Waiter(int min_operations, int max_operations, TableState* state)
+        : min_operations(min_operations),
+          max_operations(max_operations),
+          state(state) {}
+
+    // The call proceeds once `min_operations` are allowed and then uses up to
+    // `max_operations` of them.
+    const int min_operations;
+    const int max_operations;
+
+    // State of the table which made the call.
+    TableState* const state;
+
+    // Signalled when the call might be able to proceed.
+    absl::CondVar cv;
+
+    // Only set for queued operations. These are completed by moving the
+    // callback to `ready_callbacks_` instead of signalling `cv`.
+    AsyncCallback callback;
+    absl::Time deadline = absl::InfiniteFuture();
+  };
+
+  // Queues an operation created by `EnqueueInsert` or `EnqueueSample`.
+  void EnqueueLocked(std::list<Waiter*>* waiters,
+                     std::unique_ptr<Waiter> waiter)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Removes the queued operation at `it` and schedules its callback to be
+  // called with `status`. Returns the iterator following `it`.
+  std::list<Waiter*>::iterator CompleteLocked(std::list<Waiter*>* waiters,
+                                              std::list<Waiter*>::iterator it,
+                                              absl::Status status)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Wakes up the call at `it` and returns the iterator following it.
+  std::list<Waiter*>::iterator WakeLocked(std::list<Waiter*>* waiters,
+                                          std::list<Waiter*>::iterator it)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Completes the queued operations which satisfy `pred` with `status`.
+  void CompleteAllLocked(const std::function<bool(const Waiter&)>& pred,
+                         const absl::Status& status)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Body of `deadline_thread_`.
+  void ExpireQueuedOperations();
+
+  // Returns the state of the table registered with `mu`, or `unattributed_`
+  // if there is no such table.
+  TableState* StateOf(absl::Mutex* mu) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  const TableState* StateOf(absl::Mutex* mu) const
+      ABSL_SHARED_LOCKS_REQUIRED(mu_);
+
+  // Forgets the operations of `state`. If the limiter is not shared then all
+  // operations are forgotten.
+  void ResetLocked(TableState* state) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  bool CanInsertLocked(int num_inserts) const ABSL_SHARED_LOCKS_REQUIRED(mu_);
+  bool CanSampleLocked(int num_samples) const ABSL_SHARED_LOCKS_REQUIRED(mu_);
+
+  // Finalizes the samples allowed for `state`, up to `max_samples`, and returns
+  // their number.
+  int FinalizeSamplesLocked(TableState* state, int max_samples)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Returns the largest number of samples, at most `max_samples`, which are
+  // allowed on top of `num_reserved` samples. Returns 0 if none is allowed.
+  int NumSamplesAllowedLocked(int num_reserved, int max_samples) const
+      ABSL_SHARED_LOCKS_REQUIRED(mu_);
+
+  // True if `state` belongs to a table without any items. `mu` is the lock of
+  // the table and must be held.
+  bool TableIsEmpty(absl::Mutex* mu, const TableState& state) const
+      ABSL_SHARED_LOCKS_REQUIRED(mu);
+
+  // Wakes up the blocked calls which can proceed in the current state. The
+  // calls are considered in the order they started waiting and only as many
+  // are signalled as the state allows, so a single operation does not wake up
+  // every blocked call. Calls which ask for more operations than are
+  // available are skipped so they don't hold back smaller calls.
+  void MaybeSignalCondVarsLocked() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Releases `mu` and waits on `cv` until it is signalled or `deadline` is
+  // reached. `mu_` is released before `mu` is reacquired so the locks are
+  // always acquired in the same order. Returns true if the deadline was
+  // reached.
+  bool WaitWithDeadline(absl::Mutex* mu, absl::CondVar* cv,
+                        absl::Time deadline)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu, mu_);
+
   // Returns Cancelled-status if `Cancel` have been called.
-  absl::Status CheckIfCancelled() const;
+  absl::Status CheckIfCancelled() const ABSL_SHARED_LOCKS_REQUIRED(mu_);
+
+  // Guards the mutable state of the limiter. Acquired after the lock of the
+  // calling table.
+  mutable absl::Mutex mu_;
 
-  // Pointer to the table. We expect this to be available (if set), since it's
-  // set by a Table calling RegisterTable(this) after it stores a shared_ptr to
-  // this RateLimiter;.
-  Table* table_ = nullptr;
+  // Tables which have registered with the limiter, keyed by their lock.
+  internal::flat_hash_map<absl::Mutex*, std::unique_ptr<TableState>> tables_
+      ABSL_GUARDED_BY(mu_);
+
+  // Operations which can't be attributed to a registered table. That is, the
+  // counts restored from a checkpoint and calls made with other locks (e.g in
+  // tests).
+  TableState unattributed_ ABSL_GUARDED_BY(mu_);
 
   // The desired ratio between sample ops and insert operations. This can be
   // interpreted as the average number of times each item is sampled during
@@ -164,21 +383,36 @@ class RateLimiter {
   // to be allowed.
   const int64_t min_size_to_sample_;
 
-  // Total number of items inserted into table.
-  int64_t inserts_;
+  // Total number of items inserted into the tables.
+  int64_t inserts_ ABSL_GUARDED_BY(mu_);
 
-  // Total number of times any item has been sampled from the table.
-  int64_t samples_;
+  // Total number of times any item has been sampled from the tables.
+  int64_t samples_ ABSL_GUARDED_BY(mu_);
 
-  // Total number of items that has been deleted from the table.
-  int64_t deletes_;
+  // Total number of items that has been deleted from the tables.
+  int64_t deletes_ ABSL_GUARDED_BY(mu_);
 
   // Whether `Cancel` has been called.
-  bool cancelled_;
+  bool cancelled_ ABSL_GUARDED_BY(mu_);
+
+  // Blocked insert and sample calls in the order they started waiting.
+  std::list<Waiter*> insert_waiters_ ABSL_GUARDED_BY(mu_);
+  std::list<Waiter*> sample_waiters_ ABSL_GUARDED_BY(mu_);
+
+  // Callbacks of queued operations which are waiting to be called by
+  // `RunReadyCallbacks`.
+  std::vector<std::pair<AsyncCallback, absl::Status>> ready_callbacks_
+      ABSL_GUARDED_BY(mu_);
 
-  // Signal called on respective cv if operation can proceed after state change.
-  absl::CondVar can_insert_cv_;
-  absl::CondVar can_sample_cv_;
+  // Whether `ready_callbacks_` is non empty. Lets `RunReadyCallbacks` return
+  // without acquiring `mu_` when there is nothing to do.
+  std::atomic<bool> has_ready_callbacks_{false};
+
+  // Times out queued operations. Started when the first operation with a
+  // finite deadline is queued and stopped by the destructor.
+  std::unique_ptr<internal::Thread> deadline_thread_ ABSL_GUARDED_BY(mu_);
+  absl::CondVar deadline_cv_;
+  bool stop_deadline_thread_ ABSL_GUARDED_BY(mu_) = false;
 
   // The StatsManager maintains a circular buffer of `RateLimiterEvent` and a
   // set of all time stats for calls of a single type (sample/insert).
@@ -210,6 +444,11 @@ class RateLimiter {
     // RateLimiter.
     ScopedEvent CreateEvent(absl::Mutex* mu) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu);
 
+    // Creates an event which started at `start` and immediately completes it.
+    // Used for calls which did not hold the lock while they were blocked.
+    void RecordEvent(absl::Mutex* mu, absl::Time start, bool was_blocked)
+        ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu);
+
     // Marks the event as completed by removing it from `active_` and
     // updating the summary metrics. This method should only be called by
     // ScopedEvent.
@@ -258,8 +497,8 @@ class RateLimiter {
   };
 
   // Summary statistics and a (large) buffers of recent events.
-  StatsManager insert_stats_;
-  StatsManager sample_stats_;
+  StatsManager insert_stats_ ABSL_GUARDED_BY(mu_);
+  StatsManager sample_stats_ ABSL_GUARDED_BY(mu_);
 };
 
 }  // namespace reverb
@@ -14,6 +14,8 @@
 
 #include "reverb/cc/rate_limiter.h"
 
+#include <algorithm>
+#include <functional>
 #include <memory>
 #include <vector>
 
@@ -22,6 +24,7 @@
 #include "absl/synchronization/mutex.h"
 #include "absl/synchronization/notification.h"
 #include "absl/time/time.h"
+#include "reverb/cc/chunk_store.h"
 #include "reverb/cc/platform/status_matchers.h"
 #include "reverb/cc/platform/thread.h"
 #include "reverb/cc/selectors/uniform.h"
@@ -45,6 +48,15 @@ std::unique_ptr<Table> MakeTable(const std::string &name,
                                   0, std::move(limiter));
 }
 
+Table::Item MakeItem(uint64_t key) {
+  Table::Item item;
+  ChunkData data =
+      testing::MakeChunkData(key, testing::MakeSequenceRange(key, 0, 1));
+  item.chunks.push_back(std::make_shared<ChunkStore::Chunk>(data));
+  item.item = testing::MakePrioritizedItem(key, 1.0, {data});
+  return item;
+}
+
 TEST(RateLimiterTest, BlocksSamplesUntilMinInsertsReached) {
   auto limiter =
       std::make_shared<RateLimiter>(/*samples_per_insert=*/1.0,
@@ -429,6 +441,241 @@ TEST(RateLimiterTest, BlocksSamplesIfDeleteBringsSizeBelowMinSize) {
   sample_thread = nullptr;  // Joins the thread.
 }
 
+TEST(RateLimiterTest, GrantsAsManySamplesAsAllowedInOneCall) {
+  auto limiter =
+      std::make_shared<RateLimiter>(/*samples_per_insert=*/1.0,
+                                    /*min_size_to_sample=*/1, /*min_diff=*/-5,
+                                    /*max_diff=*/100);
+  absl::Mutex mu;
+  absl::WriterMutexLock lock(&mu);
+  REVERB_EXPECT_OK(limiter->AwaitCanInsert(&mu, 3));
+  limiter->Insert(&mu, 3);
+
+  // The cursor may go down to -5 so 8 of the 10 samples are allowed.
+  int num_samples;
+  REVERB_EXPECT_OK(limiter->AwaitAndFinalizeSamples(
+      &mu, /*max_samples=*/10, /*min_samples=*/1, kTimeout, &num_samples));
+  EXPECT_EQ(num_samples, 8);
+  EXPECT_FALSE(limiter->CanSample(&mu, 1));
+
+  // Released samples can be used by other calls.
+  limiter->ReleaseSamples(&mu, 2);
+  EXPECT_TRUE(limiter->CanSample(&mu, 2));
+  EXPECT_FALSE(limiter->CanSample(&mu, 3));
+  EXPECT_THAT(limiter->CheckpointReader(&mu),
+              Partially(EqualsProto("sample_count: 6")));
+}
+
+TEST(RateLimiterTest, BlocksSamplesUntilMinSamplesAllowed) {
+  auto limiter =
+      std::make_shared<RateLimiter>(/*samples_per_insert=*/1.0,
+                                    /*min_size_to_sample=*/1, /*min_diff=*/0,
+                                    /*max_diff=*/100);
+  absl::Mutex mu;
+  absl::Notification notification;
+  auto thread = internal::StartThread("", [&] {
+    absl::WriterMutexLock lock(&mu);
+    int num_samples;
+    REVERB_EXPECT_OK(limiter->AwaitAndFinalizeSamples(
+        &mu, /*max_samples=*/5, /*min_samples=*/2, kDefaultTimeout,
+        &num_samples));
+    EXPECT_EQ(num_samples, 2);
+    notification.Notify();
+  });
+
+  // A single sample is allowed but the call requires two.
+  {
+    absl::WriterMutexLock lock(&mu);
+    limiter->Insert(&mu);
+  }
+  EXPECT_FALSE(notification.WaitForNotificationWithTimeout(kTimeout));
+
+  {
+    absl::WriterMutexLock lock(&mu);
+    limiter->Insert(&mu);
+  }
+  EXPECT_TRUE(notification.WaitForNotificationWithTimeout(kTimeout));
+
+  thread = nullptr;  // Joins the thread.
+}
+
+TEST(RateLimiterTest, BlocksInsertsUntilAllAreAllowed) {
+  auto limiter =
+      std::make_shared<RateLimiter>(/*samples_per_insert=*/1.0,
+                                    /*min_size_to_sample=*/1, /*min_diff=*/-10,
+                                    /*max_diff=*/3);
+  absl::Mutex mu;
+  {
+    absl::WriterMutexLock lock(&mu);
+    REVERB_EXPECT_OK(limiter->AwaitCanInsert(&mu, 3));
+    limiter->Insert(&mu, 3);
+  }
+
+  absl::Notification large;
+  absl::Notification small;
+  auto large_thread = internal::StartThread("", [&] {
+    absl::WriterMutexLock lock(&mu);
+    REVERB_EXPECT_OK(limiter->AwaitCanInsert(&mu, 2));
+    limiter->Insert(&mu, 2);
+    large.Notify();
+  });
+  EXPECT_FALSE(large.WaitForNotificationWithTimeout(kTimeout));
+  auto small_thread = internal::StartThread("", [&] {
+    absl::WriterMutexLock lock(&mu);
+    REVERB_EXPECT_OK(limiter->AwaitCanInsert(&mu, 1));
+    limiter->Insert(&mu, 1);
+    small.Notify();
+  });
+  EXPECT_FALSE(small.WaitForNotificationWithTimeout(kTimeout));
+
+  // One sample makes room for one insert. The large call can't proceed so the
+  // small one, which started waiting later, is woken up instead.
+  {
+    absl::WriterMutexLock lock(&mu);
+    REVERB_EXPECT_OK(limiter->AwaitAndFinalizeSample(&mu));
+  }
+  EXPECT_TRUE(small.WaitForNotificationWithTimeout(kTimeout));
+  EXPECT_FALSE(large.HasBeenNotified());
+
+  {
+    absl::WriterMutexLock lock(&mu);
+    int num_samples;
+    REVERB_EXPECT_OK(limiter->AwaitAndFinalizeSamples(
+        &mu, /*max_samples=*/2, /*min_samples=*/2, kTimeout, &num_samples));
+  }
+  EXPECT_TRUE(large.WaitForNotificationWithTimeout(kTimeout));
+
+  small_thread = nullptr;  // Joins the thread.
+  large_thread = nullptr;  // Joins the thread.
+}
+
+TEST(RateLimiterTest, EnqueuedInsertCompletesWhenAllowed) {
+  auto limiter =
+      std::make_shared<RateLimiter>(/*samples_per_insert=*/1.0,
+                                    /*min_size_to_sample=*/1, /*min_diff=*/-10,
+                                    /*max_diff=*/1);
+  absl::Mutex mu;
+  int num_calls = 0;
+  absl::Status status;
+  {
+    absl::WriterMutexLock lock(&mu);
+    limiter->Insert(&mu);
+    EXPECT_FALSE(limiter->CanInsert(&mu, 1));
+    limiter->EnqueueInsert(&mu, 1, absl::InfiniteFuture(),
+                           [&](const absl::Status& s) {
+                             status = s;
+                             num_calls++;
+                           });
+  }
+  limiter->RunReadyCallbacks();
+  EXPECT_EQ(num_calls, 0);
+
+  // The sample makes room for the insert but the callback is only run once the
+  // caller has released the lock.
+  {
+    absl::WriterMutexLock lock(&mu);
+    REVERB_EXPECT_OK(limiter->AwaitAndFinalizeSample(&mu));
+  }
+  EXPECT_EQ(num_calls, 0);
+  limiter->RunReadyCallbacks();
+  EXPECT_EQ(num_calls, 1);
+  REVERB_EXPECT_OK(status);
+}
+
+TEST(RateLimiterTest, RunReadyCallbacksDoesNotRecurse) {
+  auto limiter =
+      std::make_shared<RateLimiter>(/*samples_per_insert=*/1.0,
+                                    /*min_size_to_sample=*/1, /*min_diff=*/-10,
+                                    /*max_diff=*/10);
+  absl::Mutex mu;
+  constexpr int kNumCalls = 10000;
+  int num_calls = 0;
+  int depth = 0;
+  int max_depth = 0;
+
+  // Every callback queues the next operation and runs the ready callbacks,
+  // like the tables do when they retry a queued operation.
+  std::function<void(const absl::Status&)> callback =
+      [&](const absl::Status& status) {
+        REVERB_EXPECT_OK(status);
+        max_depth = std::max(max_depth, ++depth);
+        if (++num_calls < kNumCalls) {
+          {
+            absl::WriterMutexLock lock(&mu);
+            limiter->EnqueueInsert(&mu, 1, absl::InfiniteFuture(), callback);
+          }
+          limiter->RunReadyCallbacks();
+        }
+        depth--;
+      };
+  {
+    absl::WriterMutexLock lock(&mu);
+    limiter->EnqueueInsert(&mu, 1, absl::InfiniteFuture(), callback);
+  }
+  limiter->RunReadyCallbacks();
+  EXPECT_EQ(num_calls, kNumCalls);
+  EXPECT_EQ(max_depth, 1);
+}
+
+TEST(RateLimiterTest, HasQueuedOperations) {
+  auto limiter =
+      std::make_shared<RateLimiter>(/*samples_per_insert=*/1.0,
+                                    /*min_size_to_sample=*/1, /*min_diff=*/-10,
+                                    /*max_diff=*/1);
+  absl::Mutex mu;
+  absl::WriterMutexLock lock(&mu);
+  limiter->Insert(&mu);
+  EXPECT_FALSE(limiter->HasQueuedInserts(&mu));
+  limiter->EnqueueInsert(&mu, 1, absl::InfiniteFuture(),
+                         [](const absl::Status&) {});
+  EXPECT_TRUE(limiter->HasQueuedInserts(&mu));
+  EXPECT_FALSE(limiter->HasQueuedSamples(&mu));
+  limiter->Cancel(&mu);
+  EXPECT_FALSE(limiter->HasQueuedInserts(&mu));
+}
+
+TEST(RateLimiterTest, EnqueuedSampleTimesOut) {
+  auto limiter =
+      std::make_shared<RateLimiter>(/*samples_per_insert=*/1.0,
+                                    /*min_size_to_sample=*/1, /*min_diff=*/0,
+                                    /*max_diff=*/1);
+  absl::Mutex mu;
+  absl::Notification notification;
+  absl::Status status;
+  {
+    absl::WriterMutexLock lock(&mu);
+    limiter->EnqueueSample(&mu, /*max_samples=*/4, /*min_samples=*/1,
+                           absl::Now() + kTimeout, [&](const absl::Status& s) {
+                             status = s;
+                             notification.Notify();
+                           });
+  }
+  EXPECT_TRUE(notification.WaitForNotificationWithTimeout(10 * kTimeout));
+  EXPECT_EQ(status.code(), absl::StatusCode::kDeadlineExceeded);
+}
+
+TEST(RateLimiterTest, CancelCompletesEnqueuedOperations) {
+  auto limiter =
+      std::make_shared<RateLimiter>(/*samples_per_insert=*/1.0,
+                                    /*min_size_to_sample=*/1, /*min_diff=*/0,
+                                    /*max_diff=*/1);
+  absl::Mutex mu;
+  std::vector<absl::Status> statuses;
+  auto callback = [&](const absl::Status& s) { statuses.push_back(s); };
+  {
+    absl::WriterMutexLock lock(&mu);
+    limiter->EnqueueSample(&mu, 1, 1, absl::InfiniteFuture(), callback);
+    limiter->Cancel(&mu);
+
+    // Operations enqueued after the cancellation fail immediately.
+    limiter->EnqueueSample(&mu, 1, 1, absl::InfiniteFuture(), callback);
+  }
+  limiter->RunReadyCallbacks();
+  ASSERT_EQ(statuses.size(), 2);
+  EXPECT_EQ(statuses[0].code(), absl::StatusCode::kCancelled);
+  EXPECT_EQ(statuses[1].code(), absl::StatusCode::kCancelled);
+}
+
 TEST(RateLimiterTest, Info) {
   absl::Mutex mu;
   absl::ReaderMutexLock lock(&mu);
@@ -461,6 +708,111 @@ TEST(RateLimiterTest, Info) {
                           "}"));
 }
 
+TEST(RateLimiterTest, SharedLimiterCombinesOperationsOfAllTables) {
+  auto limiter =
+      std::make_shared<RateLimiter>(/*samples_per_insert=*/1.0,
+                                    /*min_size_to_sample=*/1, /*min_diff=*/-10,
+                                    /*max_diff=*/2.0);
+  auto first = MakeTable("first", limiter);
+  auto second = MakeTable("second", limiter);
+
+  REVERB_EXPECT_OK(first->InsertOrAssign(MakeItem(1)));
+  EXPECT_TRUE(second->CanInsert(1));
+  REVERB_EXPECT_OK(second->InsertOrAssign(MakeItem(2)));
+
+  // The combined inserts have reached `max_diff`.
+  EXPECT_FALSE(first->CanInsert(1));
+  EXPECT_FALSE(second->CanInsert(1));
+
+  // A sample from either table makes room for another insert.
+  Table::SampledItem sample;
+  REVERB_EXPECT_OK(first->Sample(&sample));
+  EXPECT_TRUE(second->CanInsert(1));
+
+  EXPECT_THAT(second->Checkpoint().checkpoint.rate_limiter(),
+              Partially(EqualsProto("insert_count: 2 sample_count: 1")));
+}
+
+TEST(RateLimiterTest, SharedLimiterUnblocksCallsOfOtherTables) {
+  auto limiter =
+      std::make_shared<RateLimiter>(/*samples_per_insert=*/1.0,
+                                    /*min_size_to_sample=*/1, /*min_diff=*/-10,
+                                    /*max_diff=*/1.0);
+  auto first = MakeTable("first", limiter);
+  auto second = MakeTable("second", limiter);
+  REVERB_EXPECT_OK(first->InsertOrAssign(MakeItem(1)));
+
+  absl::Notification inserted;
+  auto thread = internal::StartThread("", [&] {
+    REVERB_EXPECT_OK(second->InsertOrAssign(MakeItem(2)));
+    inserted.Notify();
+  });
+
+  // The insert into the second table must wait for a sample.
+  EXPECT_FALSE(inserted.WaitForNotificationWithTimeout(kTimeout));
+
+  Table::SampledItem sample;
+  REVERB_EXPECT_OK(first->Sample(&sample));
+  EXPECT_TRUE(inserted.WaitForNotificationWithTimeout(kTimeout));
+
+  thread = nullptr;  // Joins the thread.
+}
+
+TEST(RateLimiterTest, SharedLimiterBlocksSamplesFromEmptyTables) {
+  auto limiter =
+      std::make_shared<RateLimiter>(/*samples_per_insert=*/1.0,
+                                    /*min_size_to_sample=*/1, /*min_diff=*/-10,
+                                    /*max_diff=*/10);
+  auto first = MakeTable("first", limiter);
+  auto second = MakeTable("second", limiter);
+
+  absl::Notification sampled;
+  auto thread = internal::StartThread("", [&] {
+    Table::SampledItem sample;
+    REVERB_EXPECT_OK(first->Sample(&sample));
+    EXPECT_EQ(sample.item.key(), 2);
+    sampled.Notify();
+  });
+
+  // The limiter allows samples but the table of the call is still empty.
+  REVERB_EXPECT_OK(second->InsertOrAssign(MakeItem(1)));
+  EXPECT_TRUE(second->CanSample(1));
+  EXPECT_FALSE(first->CanSample(1));
+  EXPECT_FALSE(sampled.WaitForNotificationWithTimeout(kTimeout));
+
+  REVERB_EXPECT_OK(first->InsertOrAssign(MakeItem(2)));
+  EXPECT_TRUE(sampled.WaitForNotificationWithTimeout(kTimeout));
+
+  thread = nullptr;  // Joins the thread.
+}
+
+TEST(RateLimiterTest, ResetOfSharedLimiterOnlyForgetsOperationsOfTable) {
+  auto limiter =
+      std::make_shared<RateLimiter>(/*samples_per_insert=*/1.0,
+                                    /*min_size_to_sample=*/1, /*min_diff=*/-10,
+                                    /*max_diff=*/2.0);
+  auto first = MakeTable("first", limiter);
+  auto second = MakeTable("second", limiter);
+  auto third = MakeTable("third", limiter);
+
+  REVERB_EXPECT_OK(first->InsertOrAssign(MakeItem(1)));
+  REVERB_EXPECT_OK(second->InsertOrAssign(MakeItem(2)));
+  EXPECT_FALSE(third->CanInsert(1));
+
+  REVERB_EXPECT_OK(first->Reset());
+  EXPECT_TRUE(third->CanInsert(1));
+  EXPECT_THAT(third->Checkpoint().checkpoint.rate_limiter(),
+              Partially(EqualsProto("insert_count: 1")));
+
+  // Destroying a table unregisters it which forgets its operations.
+  REVERB_EXPECT_OK(third->InsertOrAssign(MakeItem(3)));
+  EXPECT_FALSE(third->CanInsert(1));
+  second = nullptr;
+  EXPECT_TRUE(third->CanInsert(1));
+  EXPECT_THAT(third->Checkpoint().checkpoint.rate_limiter(),
+              Partially(EqualsProto("insert_count: 1")));
+}
+
 TEST(RateLimiterDeathTest, DiesIfMinSizeToSampleNonPositive) {
   ASSERT_DEATH(RateLimiter(1, 0, 0, 5), "");
   ASSERT_DEATH(RateLimiter(1, -1, 0, 5), "");
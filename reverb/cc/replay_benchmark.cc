@@ -0,0 +1,382 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// End-to-end throughput benchmark of a Reverb server.
+//
+// Each benchmark starts a server (in the same process) with a single table and
+// then runs `writers` `TrajectoryWriter` threads and `samplers` `Sampler`
+// threads against it for a fixed amount of time. The clients either connect
+// through gRPC (`local=0`) or use the in-process paths (`local=1`), i.e the
+// writers use an in-process gRPC channel and the samplers access the table
+// directly.
+//
+// Every step appended by the writers holds a single float tensor with
+// `step_floats` elements. Items span the last `trajectory_length` steps and
+// the chunks hold `chunk_length` steps. If `samples_per_insert` is 0 then the
+// rate limiter only requires the table to be non empty, otherwise it enforces
+// the ratio with a large error buffer.
+//
+// Reported counters:
+//
+//   * inserts_per_second, samples_per_second: items created and sampled.
+//   * insert_bytes_per_second, sample_bytes_per_second: tensor bytes appended
+//     by the writers and returned to the samplers.
+//   * insert_p50_us, insert_p99_us: latency of a writer step (Append,
+//     CreateItem and Flush with at most `kMaxInFlightItems` pending items).
+//   * sample_p50_us, sample_p99_us: latency of `Sampler::GetNextTrajectory`.
+//   * cpu_cores: process CPU time (server and clients) per wall time second.
+//
+// CPU profiles of the measured window are written to
+// `$REVERB_BENCHMARK_CPU_PROFILE.<run>` when the environment variable is set
+// and the binary is linked with gperftools' profiler.
+//
+// Run with e.g:
+//
+//   bazel run -c opt //reverb/cc:replay_benchmark -- \
+//     --benchmark_filter='BM_Replay/writers:4/samplers:4/local:1/.*'
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <cstdint>
+#include "benchmark/benchmark.h"
+#include "absl/memory/memory.h"
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "absl/types/optional.h"
+#include "reverb/cc/chunker.h"
+#include "reverb/cc/client.h"
+#include "reverb/cc/platform/grpc_utils.h"
+#include "reverb/cc/platform/logging.h"
+#include "reverb/cc/platform/net.h"
+#include "reverb/cc/platform/server.h"
+#include "reverb/cc/platform/status_macros.h"
+#include "reverb/cc/platform/thread.h"
+#include "reverb/cc/rate_limiter.h"
+#include "reverb/cc/reverb_service.grpc.pb.h"
+#include "reverb/cc/sampler.h"
+#include "reverb/cc/selectors/fifo.h"
+#include "reverb/cc/selectors/uniform.h"
+#include "reverb/cc/table.h"
+#include "reverb/cc/trajectory_writer.h"
+#include "tensorflow/core/framework/tensor.h"
+
+// Provided by gperftools when it is linked into the binary.
+extern "C" int ProfilerStart(const char* fname) __attribute__((weak));
+extern "C" void ProfilerStop() __attribute__((weak));
+
+namespace deepmind {
+namespace reverb {
+namespace {
+
+constexpr char kTable[] = "dist";
+constexpr int64_t kMaxTableSize = 10000;
+
+// Parameters of the rate limiter when `samples_per_insert` > 0.
+constexpr int64_t kMinSizeToSample = 100;
+constexpr double kErrorBuffer = 1000;
+
+// Maximum number of unconfirmed items per writer.
+constexpr int kMaxInFlightItems = 32;
+
+// Time the clients run before and during the measurement.
+constexpr absl::Duration kWarmupDuration = absl::Seconds(1);
+constexpr absl::Duration kMeasureDuration = absl::Seconds(5);
+
+// How long blocked clients wait before checking if the benchmark has ended.
+constexpr absl::Duration kPollInterval = absl::Milliseconds(100);
+
+struct Config {
+  int num_writers;
+  int num_samplers;
+  bool local;
+  int chunk_length;
+  int64_t step_floats;
+  int trajectory_length;
+  double samples_per_insert;
+};
+
+// Stats collected by a single client thread during the measured window.
+struct ClientStats {
+  int64_t num_ops = 0;
+  int64_t num_bytes = 0;
+  std::vector<int64_t> latencies_ns;
+
+  void Record(absl::Time start, int64_t bytes) {
+    num_ops++;
+    num_bytes += bytes;
+    latencies_ns.push_back(absl::ToInt64Nanoseconds(absl::Now() - start));
+  }
+};
+
+// Returns the `p`th percentile (0 <= p <= 1) of the latencies of `stats` in
+// microseconds.
+double PercentileMicros(const std::vector<ClientStats>& stats, double p) {
+  std::vector<int64_t> all;
+  for (const auto& s : stats) {
+    all.insert(all.end(), s.latencies_ns.begin(), s.latencies_ns.end());
+  }
+  if (all.empty()) return 0;
+  auto nth = all.begin() + static_cast<int64_t>(p * (all.size() - 1));
+  std::nth_element(all.begin(), nth, all.end());
+  return *nth / 1000.0;
+}
+
+absl::Duration ProcessCpuTime() {
+  rusage usage;
+  REVERB_CHECK_EQ(getrusage(RUSAGE_SELF, &usage), 0);
+  return absl::DurationFromTimeval(usage.ru_utime) +
+         absl::DurationFromTimeval(usage.ru_stime);
+}
+
+std::shared_ptr<Table> MakeTable(const Config& config) {
+  std::shared_ptr<RateLimiter> rate_limiter;
+  if (config.samples_per_insert == 0) {
+    rate_limiter = std::make_shared<RateLimiter>(
+        /*samples_per_insert=*/1.0, /*min_size_to_sample=*/1,
+        /*min_diff=*/-std::numeric_limits<double>::max(),
+        /*max_diff=*/std::numeric_limits<double>::max());
+  } else {
+    const double offset = config.samples_per_insert * kMinSizeToSample;
+    const double buffer =
+        std::max(1.0, config.samples_per_insert) * kErrorBuffer;
+    rate_limiter = std::make_shared<RateLimiter>(
+        config.samples_per_insert, kMinSizeToSample, offset - buffer,
+        offset + buffer);
+  }
+  return std::make_shared<Table>(
+      kTable, std::make_shared<UniformSelector>(),
+      std::make_shared<FifoSelector>(), kMaxTableSize,
+      /*max_times_sampled=*/0, std::move(rate_limiter));
+}
+
+void RunWriter(Client* client, const Config& config,
+               const std::atomic<bool>* measuring,
+               const std::atomic<bool>* stopped, ClientStats* stats) {
+  TrajectoryWriter::Options options;
+  options.chunker_options = std::make_shared<ConstantChunkerOptions>(
+      config.chunk_length,
+      std::max(config.chunk_length, config.trajectory_length));
+  std::unique_ptr<TrajectoryWriter> writer;
+  REVERB_CHECK_OK(client->NewTrajectoryWriter(options, &writer));
+
+  tensorflow::Tensor step(tensorflow::DT_FLOAT,
+                          tensorflow::TensorShape({config.step_floats}));
+  step.flat<float>().setConstant(1.0f);
+
+  std::deque<std::weak_ptr<CellRef>> history;
+  std::vector<absl::optional<std::weak_ptr<CellRef>>> refs;
+  while (!stopped->load()) {
+    const absl::Time start = absl::Now();
+    refs.clear();
+    REVERB_CHECK_OK(writer->Append({step}, &refs));
+    history.push_back(refs[0].value());
+    if (history.size() > static_cast<size_t>(config.trajectory_length)) {
+      history.pop_front();
+    }
+    if (history.size() < static_cast<size_t>(config.trajectory_length)) {
+      continue;
+    }
+
+    std::vector<std::weak_ptr<CellRef>> column(history.begin(), history.end());
+    REVERB_CHECK_OK(writer->CreateItem(
+        kTable, /*priority=*/1.0,
+        {TrajectoryColumn(std::move(column), /*squeeze=*/false)}));
+
+    // Blocks while the rate limiter is holding back the inserts.
+    absl::Status status;
+    do {
+      status = writer->Flush(kMaxInFlightItems, kPollInterval);
+    } while (absl::IsDeadlineExceeded(status) && !stopped->load());
+    if (absl::IsDeadlineExceeded(status)) break;
+    REVERB_CHECK_OK(status);
+
+    if (measuring->load()) stats->Record(start, step.TotalBytes());
+  }
+  writer->Close();
+}
+
+std::unique_ptr<Sampler> MakeSampler(Client* client,
+                                     const std::string& address,
+                                     const Config& config) {
+  Sampler::Options options;
+  options.num_workers = 1;
+  options.rate_limiter_timeout = kPollInterval;
+
+  std::unique_ptr<Sampler> sampler;
+  if (config.local) {
+    REVERB_CHECK_OK(client->NewSampler(kTable, options,
+                                       /*validation_timeout=*/absl::Seconds(10),
+                                       &sampler));
+    return sampler;
+  }
+
+  // `Client::NewSampler` bypasses gRPC when the server is running in the same
+  // process so the sampler is created with its own stub instead.
+  grpc::ChannelArguments arguments;
+  arguments.SetMaxReceiveMessageSize(kMaxMessageSize);
+  arguments.SetMaxSendMessageSize(kMaxMessageSize);
+  return absl::make_unique<Sampler>(
+      /* grpc_gen:: */ReverbService::NewStub(CreateCustomGrpcChannel(
+          address, MakeChannelCredentials(), arguments)),
+      kTable, options);
+}
+
+void RunSampler(Client* client, const std::string& address,
+                const Config& config, const std::atomic<bool>* measuring,
+                const std::atomic<bool>* stopped, ClientStats* stats) {
+  std::vector<tensorflow::Tensor> data;
+  while (!stopped->load()) {
+    // The sampler is recreated whenever the rate limiter times out as the
+    // error is permanent.
+    auto sampler = MakeSampler(client, address, config);
+    while (!stopped->load()) {
+      const absl::Time start = absl::Now();
+      data.clear();
+      auto status = sampler->GetNextTrajectory(&data);
+      if (absl::IsDeadlineExceeded(status)) break;
+      REVERB_CHECK_OK(status);
+
+      if (measuring->load()) {
+        int64_t bytes = 0;
+        // The first four tensors hold the sample info.
+        for (int i = 4; i < data.size(); i++) bytes += data[i].TotalBytes();
+        stats->Record(start, bytes);
+      }
+    }
+    sampler->Close();
+  }
+}
+
+void BM_Replay(benchmark::State& state) {
+  static int run_index = 0;
+  const Config config{
+      /*num_writers=*/static_cast<int>(state.range(0)),
+      /*num_samplers=*/static_cast<int>(state.range(1)),
+      /*local=*/state.range(2) != 0,
+      /*chunk_length=*/static_cast<int>(state.range(3)),
+      /*step_floats=*/state.range(4),
+      /*trajectory_length=*/static_cast<int>(state.range(5)),
+      /*samples_per_insert=*/static_cast<double>(state.range(6)),
+  };
+
+  const int port = internal::PickUnusedPortOrDie();
+  const std::string address = absl::StrCat("localhost:", port);
+  std::unique_ptr<Server> server;
+  REVERB_CHECK_OK(StartServer({MakeTable(config)}, port,
+                              /*checkpointer=*/nullptr, &server));
+  std::unique_ptr<Client> client = config.local
+                                       ? server->InProcessClient()
+                                       : absl::make_unique<Client>(address);
+
+  std::vector<ClientStats> writer_stats(config.num_writers);
+  std::vector<ClientStats> sampler_stats(config.num_samplers);
+  std::atomic<bool> measuring(false);
+  std::atomic<bool> stopped(false);
+  absl::Duration elapsed;
+  absl::Duration cpu_time;
+
+  for (auto _ : state) {
+    std::vector<std::unique_ptr<internal::Thread>> threads;
+    for (int i = 0; i < config.num_writers; i++) {
+      threads.push_back(internal::StartThread("Writer", [&, i] {
+        RunWriter(client.get(), config, &measuring, &stopped,
+                  &writer_stats[i]);
+      }));
+    }
+    for (int i = 0; i < config.num_samplers; i++) {
+      threads.push_back(internal::StartThread("Sampler", [&, i] {
+        RunSampler(client.get(), address, config, &measuring, &stopped,
+                   &sampler_stats[i]);
+      }));
+    }
+
+    absl::SleepFor(kWarmupDuration);
+
+    const char* profile_path = std::getenv("REVERB_BENCHMARK_CPU_PROFILE");
+    const bool profiling = profile_path != nullptr && ProfilerStart != nullptr;
+    if (profiling) {
+      ProfilerStart(absl::StrCat(profile_path, ".", run_index++).c_str());
+    }
+
+    const absl::Duration cpu_start = ProcessCpuTime();
+    const absl::Time start = absl::Now();
+    measuring = true;
+    absl::SleepFor(kMeasureDuration);
+    measuring = false;
+    elapsed = absl::Now() - start;
+    cpu_time = ProcessCpuTime() - cpu_start;
+
+    if (profiling) ProfilerStop();
+
+    stopped = true;
+    threads.clear();  // Joins all threads.
+  }
+
+  const double seconds = absl::ToDoubleSeconds(elapsed);
+  int64_t inserts = 0, insert_bytes = 0, samples = 0, sample_bytes = 0;
+  for (const auto& s : writer_stats) {
+    inserts += s.num_ops;
+    insert_bytes += s.num_bytes;
+  }
+  for (const auto& s : sampler_stats) {
+    samples += s.num_ops;
+    sample_bytes += s.num_bytes;
+  }
+  state.counters["inserts_per_second"] = inserts / seconds;
+  state.counters["samples_per_second"] = samples / seconds;
+  state.counters["insert_bytes_per_second"] = insert_bytes / seconds;
+  state.counters["sample_bytes_per_second"] = sample_bytes / seconds;
+  state.counters["insert_p50_us"] = PercentileMicros(writer_stats, 0.5);
+  state.counters["insert_p99_us"] = PercentileMicros(writer_stats, 0.99);
+  state.counters["sample_p50_us"] = PercentileMicros(sampler_stats, 0.5);
+  state.counters["sample_p99_us"] = PercentileMicros(sampler_stats, 0.99);
+  state.counters["cpu_cores"] = absl::ToDoubleSeconds(cpu_time) / seconds;
+
+  client = nullptr;
+  server->Stop();
+}
+
+void Configs(benchmark::internal::Benchmark* b) {
+  b->ArgNames({"writers", "samplers", "local", "chunk_length", "step_floats",
+               "trajectory_length", "samples_per_insert"});
+  for (int local : {0, 1}) {
+    for (int clients : {1, 4, 16}) {
+      for (int chunk_length : {1, 10}) {
+        b->Args({clients, clients, local, chunk_length, /*step_floats=*/1000,
+                 /*trajectory_length=*/10, /*samples_per_insert=*/0});
+      }
+      b->Args({clients, clients, local, /*chunk_length=*/10,
+               /*step_floats=*/1000, /*trajectory_length=*/10,
+               /*samples_per_insert=*/4});
+    }
+  }
+  b->Iterations(1)->Unit(benchmark::kMillisecond)->UseRealTime();
+}
+
+BENCHMARK(BM_Replay)->Apply(Configs);
+
+}  // namespace
+}  // namespace reverb
+}  // namespace deepmind
@@ -15,10 +15,13 @@
 #include "reverb/cc/reverb_service_impl.h"
 
 #include <algorithm>
+#include <atomic>
+#include <functional>
 #include <list>
 #include <memory>
 #include <vector>
 
+#include "absl/memory/memory.h"
 #include "absl/status/status.h"
 #include "absl/strings/match.h"
 #include "absl/strings/str_cat.h"
@@ -35,6 +38,8 @@
 #include "reverb/cc/sampler.h"
 #include "reverb/cc/support/cleanup.h"
 #include "reverb/cc/support/grpc_util.h"
+#include "reverb/cc/support/metrics.h"
+#include "reverb/cc/support/periodic_closure.h"
 #include "reverb/cc/support/queue.h"
 #include "reverb/cc/support/trajectory_util.h"
 #include "reverb/cc/support/uint128.h"
@@ -52,23 +57,108 @@ inline grpc::Status Internal(const std::string& message) {
   return grpc::Status(grpc::StatusCode::INTERNAL, message);
 }
 
+// Upper limit on the number of item keys confirmed by a single
+// `InsertStreamResponse`.
+constexpr int kMaxConfirmationsPerResponse = 1024;
+
+// Item which should be confirmed on an `InsertStream`.
+struct PendingConfirmation {
+  uint64_t key = 0;
+
+  // Whether the client accepts the confirmation as part of a batch. If false
+  // then the item is confirmed in a separate response with only `key` set.
+  bool batched = false;
+};
+
+// Request read from an `InsertStream`. Chunks are inserted into the
+// `ChunkStore` by the read thread so they are passed on as `chunk` rather
+// than as part of `request`.
+struct PendingInsertRequest {
+  InsertStreamRequest request;
+  ChunkStore::Key chunk_key = 0;
+  std::shared_ptr<ChunkStore::Chunk> chunk;
+};
+
+// Writes responses confirming `pending` in order. Consecutive confirmations
+// which accept batching are sent in the same response.
+grpc::Status WriteConfirmations(
+    const std::vector<PendingConfirmation>& pending,
+    grpc::ServerReaderWriterInterface<InsertStreamResponse,
+                                      InsertStreamRequest>* stream) {
+  InsertStreamResponse response;
+  bool has_response = false;
+  auto flush = [&]() -> grpc::Status {
+    if (!has_response) return grpc::Status::OK;
+    const int num_items = std::max(response.keys_size(), 1);
+    if (!stream->Write(response)) {
+      return Internal(absl::StrCat(
+          "Error when sending confirmation that ", num_items,
+          " items have been successfully inserted/updated."));
+    }
+    response.Clear();
+    has_response = false;
+    return grpc::Status::OK;
+  };
+
+  for (const auto& confirmation : pending) {
+    if (confirmation.batched) {
+      response.add_keys(confirmation.key);
+      has_response = true;
+      continue;
+    }
+    if (auto status = flush(); !status.ok()) return status;
+    response.set_key(confirmation.key);
+    has_response = true;
+    if (auto status = flush(); !status.ok()) return status;
+  }
+  return flush();
+}
+
 }  // namespace
 
-ReverbServiceImpl::ReverbServiceImpl(std::shared_ptr<Checkpointer> checkpointer)
-    : checkpointer_(std::move(checkpointer)) {}
+ReverbServiceImpl::ReverbServiceImpl(
+    std::shared_ptr<Checkpointer> checkpointer, Options options)
+    : checkpointer_(std::move(checkpointer)),
+      options_(std::move(options)),
+      chunk_store_(/*cleanup_batch_size=*/1000, ChunkStore::kDefaultNumShards,
+                   options_.deduplicate_chunks) {}
+
+ReverbServiceImpl::~ReverbServiceImpl() {
+  StopPeriodicCheckpoints();
+
+  // The tables can outlive the service (and thus the log).
+  if (write_ahead_log_ != nullptr) {
+    for (auto& table : tables_) {
+      table.second->set_write_ahead_log(nullptr);
+    }
+  }
+}
 
 absl::Status ReverbServiceImpl::Create(
     std::vector<std::shared_ptr<Table>> tables,
-    std::shared_ptr<Checkpointer> checkpointer,
+    std::shared_ptr<Checkpointer> checkpointer, Options options,
     std::unique_ptr<ReverbServiceImpl>* service) {
+  if (options.checkpoint_interval > absl::ZeroDuration() &&
+      checkpointer == nullptr) {
+    return absl::InvalidArgumentError(
+        "Periodic checkpoints require a Checkpointer to be configured.");
+  }
   // Can't use make_unique because it can't see the Impl's private constructor.
   auto new_service = std::unique_ptr<ReverbServiceImpl>(
-      new ReverbServiceImpl(std::move(checkpointer)));
+      new ReverbServiceImpl(std::move(checkpointer), std::move(options)));
   REVERB_RETURN_IF_ERROR(new_service->Initialize(std::move(tables)));
   std::swap(new_service, *service);
   return absl::OkStatus();
 }
 
+absl::Status ReverbServiceImpl::Create(
+    std::vector<std::shared_ptr<Table>> tables,
+    std::shared_ptr<Checkpointer> checkpointer,
+    std::unique_ptr<ReverbServiceImpl>* service) {
+  return Create(std::move(tables), std::move(checkpointer), Options(),
+                service);
+}
+
 absl::Status ReverbServiceImpl::Create(
     std::vector<std::shared_ptr<Table>> tables,
     std::unique_ptr<ReverbServiceImpl>* service) {
@@ -88,32 +178,116 @@ absl::Status ReverbServiceImpl::Initialize(
     tables_[table->name()] = std::move(table);
   }
 
+  // The write-ahead log is replayed on top of the checkpoint that was created
+  // when the log was started. A checkpoint is therefore created right away so
+  // that everything restored above is covered before any entries are logged.
+  if (checkpointer_ != nullptr && checkpointer_->write_ahead_log() != nullptr) {
+    // Samples are not logged so items deleted because they reached
+    // `max_times_sampled` would be resurrected when the log is replayed.
+    for (const auto& entry : tables_) {
+      if (entry.second->info().max_times_sampled() > 0) {
+        return absl::InvalidArgumentError(absl::StrCat(
+            "The write-ahead log does not support tables with "
+            "max_times_sampled > 0 but table '",
+            entry.first, "' has max_times_sampled = ",
+            entry.second->info().max_times_sampled(), "."));
+      }
+    }
+    std::string path;
+    REVERB_RETURN_IF_ERROR(SaveCheckpoint(&path));
+    write_ahead_log_ = checkpointer_->write_ahead_log();
+    for (auto& table : tables_) {
+      table.second->set_write_ahead_log(write_ahead_log_);
+    }
+  }
+
   tables_state_id_ = absl::MakeUint128(absl::Uniform<uint64_t>(rnd_),
                                        absl::Uniform<uint64_t>(rnd_));
 
+  if (options_.checkpoint_interval > absl::ZeroDuration()) {
+    absl::MutexLock lock(&checkpoint_closure_mu_);
+    checkpoint_closure_ = absl::make_unique<internal::PeriodicClosure>(
+        [this] { MaybeSaveCheckpointInBackground(); },
+        options_.checkpoint_interval, "PeriodicCheckpoint");
+    REVERB_RETURN_IF_ERROR(checkpoint_closure_->Start());
+  }
+
   return absl::OkStatus();
 }
 
 grpc::Status ReverbServiceImpl::Checkpoint(grpc::ServerContext* context,
                                            const CheckpointRequest* request,
                                            CheckpointResponse* response) {
+  internal::ScopedLatencyRecorder latency(
+      &metrics_.rpc_latency[kCheckpointRpc]);
   if (checkpointer_ == nullptr) {
     return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
                         "no Checkpointer configured for the replay service.");
   }
 
+  auto status = SaveCheckpoint(response->mutable_checkpoint_path());
+  if (!status.ok()) return ToGrpcStatus(status);
+
+  REVERB_LOG(REVERB_INFO) << "Stored checkpoint to "
+                          << response->checkpoint_path();
+  return grpc::Status::OK;
+}
+
+absl::Status ReverbServiceImpl::SaveCheckpoint(std::string* path) {
+  absl::MutexLock lock(&checkpoint_mu_);
+  return SaveCheckpointLocked(/*background=*/false, path);
+}
+
+absl::Status ReverbServiceImpl::SaveCheckpointLocked(bool background,
+                                                     std::string* path) {
   std::vector<Table*> tables;
   for (auto& table : tables_) {
     tables.push_back(table.second.get());
   }
 
-  auto status = checkpointer_->Save(std::move(tables), 1,
-                                    response->mutable_checkpoint_path());
-  if (!status.ok()) return ToGrpcStatus(status);
+  const absl::Time start = absl::Now();
+  auto status =
+      background ? checkpointer_->SaveInBackground(std::move(tables), 1, path)
+                 : checkpointer_->Save(std::move(tables), 1, path);
+  metrics_.checkpoint_duration.Record(absl::Now() - start);
+  if (!status.ok()) metrics_.checkpoint_failures.Increment();
+  return status;
+}
 
-  REVERB_LOG(REVERB_INFO) << "Stored checkpoint to "
-                          << response->checkpoint_path();
-  return grpc::Status::OK;
+void ReverbServiceImpl::MaybeSaveCheckpointInBackground() {
+  // Periodic checkpoints should not compete for I/O with the rest of the
+  // host. Lowering the priority is cheap and idempotent so it is simply done
+  // before every checkpoint.
+  internal::SetCurrentThreadLowIoPriority();
+
+  // A checkpoint which was requested through `Checkpoint` is already in
+  // progress, there is no point in creating another one right after it. The
+  // lock is kept until the periodic checkpoint has been saved so a requested
+  // checkpoint can't start in between.
+  if (!checkpoint_mu_.TryLock()) {
+    REVERB_LOG(REVERB_INFO)
+        << "Skipping periodic checkpoint as another checkpoint is in progress.";
+    return;
+  }
+
+  std::string path;
+  const absl::Time start = absl::Now();
+  auto status = SaveCheckpointLocked(/*background=*/true, &path);
+  checkpoint_mu_.Unlock();
+  if (!status.ok()) {
+    REVERB_LOG(REVERB_ERROR)
+        << "Failed to create periodic checkpoint: " << status.ToString();
+    return;
+  }
+  REVERB_LOG(REVERB_INFO) << "Stored periodic checkpoint to " << path << " in "
+                          << absl::FormatDuration(absl::Now() - start);
+}
+
+void ReverbServiceImpl::StopPeriodicCheckpoints() {
+  absl::MutexLock lock(&checkpoint_closure_mu_);
+  if (checkpoint_closure_ == nullptr) return;
+  REVERB_CHECK_OK(checkpoint_closure_->Stop());
+  checkpoint_closure_ = nullptr;
 }
 
 grpc::Status ReverbServiceImpl::InsertStream(
@@ -127,109 +301,234 @@ grpc::Status ReverbServiceImpl::InsertStreamInternal(
     grpc::ServerContext* context,
     grpc::ServerReaderWriterInterface<InsertStreamResponse,
                                       InsertStreamRequest>* stream) {
-  // Start a background thread that unpacks the data ahead of time.
-  deepmind::reverb::internal::Queue<InsertStreamRequest> queue(1);
-  auto read_thread = internal::StartThread("ReadThread", [stream, &queue]() {
-    InsertStreamRequest request;
-    while (stream->Read(&request) && queue.Push(std::move(request))) {
-      request = InsertStreamRequest();
-    }
-    queue.SetLastItemPushed();
-  });
-  auto cleanup = internal::MakeCleanup([&queue] { queue.Close(); });
+  metrics_.open_insert_streams.Increment();
+  auto close_stream = internal::MakeCleanup(
+      [this] { metrics_.open_insert_streams.Decrement(); });
+
+  // The stream is processed by a pipeline of three threads:
+  //
+  //   1. The read thread pulls requests from the stream, inserts chunks into
+  //      `chunk_store_` and forwards the requests to `requests`. It can get
+  //      `options_.insert_stream_read_ahead` requests ahead of the handler, so
+  //      the stream keeps being drained while an insert is blocked by a rate
+  //      limiter.
+  //   2. The handler (the calling thread) inserts items into their tables and
+  //      pushes the keys that should be confirmed to `confirmations`.
+  //   3. The confirmation thread writes all confirmations which are pending at
+  //      the time in a single response. If a write-ahead log is used then the
+  //      log is synced once per response rather than once per item.
+  internal::Queue<PendingInsertRequest> requests(
+      std::max(options_.insert_stream_read_ahead, 1));
+
+  // Number of requests in `requests`. Their contribution to
+  // `metrics_.insert_queue_depth` is removed once the read thread has been
+  // joined.
+  std::atomic<int64_t> queued{0};
+  auto clear_queue_depth = internal::MakeCleanup(
+      [this, &queued] { metrics_.insert_queue_depth.Add(-queued.load()); });
+
+  grpc::Status read_status;
+  auto read_thread = internal::StartThread(
+      "InsertStream-Reader",
+      [this, stream, &requests, &queued, &read_status]() {
+        InsertStreamRequest request;
+        while (stream->Read(&request)) {
+          PendingInsertRequest pending;
+          if (request.has_chunk()) {
+            pending.chunk_key = request.chunk().chunk_key();
+            pending.chunk = chunk_store_.Insert(
+                std::move(*request.mutable_chunk()));
+            if (!pending.chunk) {
+              read_status = grpc::Status(grpc::StatusCode::CANCELLED,
+                                         "Service has been closed");
+              break;
+            }
+            metrics_.insert_bytes.Add(pending.chunk->DataByteSizeLong());
+          } else {
+            pending.request = std::move(request);
+          }
+          queued++;
+          metrics_.insert_queue_depth.Increment();
+          if (!requests.Push(std::move(pending))) {
+            queued--;
+            metrics_.insert_queue_depth.Decrement();
+            break;
+          }
+          request = InsertStreamRequest();
+        }
+        requests.SetLastItemPushed();
+      });
+  auto close_requests =
+      internal::MakeCleanup([&requests] { requests.Close(); });
+
+  internal::Queue<PendingConfirmation> confirmations(
+      kMaxConfirmationsPerResponse);
+  grpc::Status write_status;
+  auto write_thread = internal::StartThread(
+      "InsertStream-Confirmer",
+      [this, stream, &confirmations, &write_status]() {
+        std::vector<PendingConfirmation> pending;
+        while (confirmations.PopMany(kMaxConfirmationsPerResponse, &pending)) {
+          // The confirmation must not be sent until the items have been
+          // durably logged.
+          if (write_ahead_log_ != nullptr) {
+            if (auto status = write_ahead_log_->Sync(); !status.ok()) {
+              write_status = ToGrpcStatus(status);
+              break;
+            }
+          }
+          if (auto status = WriteConfirmations(pending, stream); !status.ok()) {
+            write_status = status;
+            break;
+          }
+          pending.clear();
+        }
+        // Unblocks the handler if the loop was stopped by an error.
+        confirmations.Close();
+      });
+  auto close_confirmations =
+      internal::MakeCleanup([&confirmations] { confirmations.Close(); });
 
   internal::flat_hash_map<ChunkStore::Key, std::shared_ptr<ChunkStore::Chunk>>
       chunks;
 
-  InsertStreamRequest request;
-  while (queue.Pop(&request)) {
-    if (request.has_chunk()) {
-      ChunkStore::Key key = request.chunk().chunk_key();
-      std::shared_ptr<ChunkStore::Chunk> chunk =
-          chunk_store_.Insert(std::move(*request.mutable_chunk()));
-      if (!chunk) {
-        return grpc::Status(grpc::StatusCode::CANCELLED,
-                            "Service has been closed");
-      }
-      chunks[key] = std::move(chunk);
-    } else if (request.has_item()) {
-      Table::Item item;
-
-      auto push_or = [&chunks, &item](ChunkStore::Key key) -> grpc::Status {
-        auto it = chunks.find(key);
-        if (it == chunks.end()) {
-          return Internal(
-              absl::StrCat("Could not find sequence chunk ", key, "."));
-        }
-        item.chunks.push_back(it->second);
-        return grpc::Status::OK;
-      };
-
-      for (ChunkStore::Key key :
-           internal::GetChunkKeys(request.item().item().flat_trajectory())) {
-        auto status = push_or(key);
-        if (!status.ok()) return status;
-      }
+  PendingInsertRequest pending;
+  while (requests.Pop(&pending)) {
+    queued--;
+    metrics_.insert_queue_depth.Decrement();
 
-      const auto& table_name = request.item().item().table();
-      Table* table = TableByName(table_name);
-      if (table == nullptr) return TableNotFound(table_name);
+    if (pending.chunk != nullptr) {
+      chunks[pending.chunk_key] = std::move(pending.chunk);
+      continue;
+    }
 
-      const auto item_key = request.item().item().key();
-      item.item = std::move(*request.mutable_item()->mutable_item());
+    InsertStreamRequest& request = pending.request;
+    if (!request.has_item()) continue;
 
-      if (auto status = table->InsertOrAssign(item); !status.ok()) {
-        return ToGrpcStatus(status);
-      }
+    Table::Item item;
 
-      // Let caller know that the item has been inserted if requested by the
-      // caller.
-      if (request.item().send_confirmation()) {
-        InsertStreamResponse response;
-        response.set_key(item_key);
-        if (!stream->Write(response)) {
-          return Internal(absl::StrCat(
-              "Error when sending confirmation that item ", item_key,
-              " has been successfully inserted/updated."));
-        }
+    auto push_or = [&chunks, &item](ChunkStore::Key key) -> grpc::Status {
+      auto it = chunks.find(key);
+      if (it == chunks.end()) {
+        return Internal(
+            absl::StrCat("Could not find sequence chunk ", key, "."));
       }
+      item.chunks.push_back(it->second);
+      return grpc::Status::OK;
+    };
+
+    for (ChunkStore::Key key :
+         internal::GetChunkKeys(request.item().item().flat_trajectory())) {
+      auto status = push_or(key);
+      if (!status.ok()) return status;
+    }
 
-      // Only keep specified chunks.
-      absl::flat_hash_set<int64_t> keep_keys{
-          request.item().keep_chunk_keys().begin(),
-          request.item().keep_chunk_keys().end()};
-      for (auto it = chunks.cbegin(); it != chunks.cend();) {
-        if (keep_keys.find(it->first) == keep_keys.end()) {
-          chunks.erase(it++);
-        } else {
-          ++it;
-        }
+    const auto& table_name = request.item().item().table();
+    Table* table = TableByName(table_name);
+    if (table == nullptr) return TableNotFound(table_name);
+
+    const auto item_key = request.item().item().key();
+    item.item = std::move(*request.mutable_item()->mutable_item());
+
+    const absl::Time insert_start = absl::Now();
+    if (auto status = table->InsertOrAssign(item); !status.ok()) {
+      return ToGrpcStatus(status);
+    }
+    metrics_.insert_latency.Record(absl::Now() - insert_start);
+
+    // Let caller know that the item has been inserted if requested by the
+    // caller.
+    if (request.item().send_confirmation() &&
+        !confirmations.Push(
+            {item_key, request.item().accept_batched_confirmation()})) {
+      write_thread = nullptr;  // Joins thread.
+      return write_status;
+    }
+
+    // Only keep specified chunks.
+    absl::flat_hash_set<int64_t> keep_keys{
+        request.item().keep_chunk_keys().begin(),
+        request.item().keep_chunk_keys().end()};
+    for (auto it = chunks.cbegin(); it != chunks.cend();) {
+      if (keep_keys.find(it->first) == keep_keys.end()) {
+        chunks.erase(it++);
+      } else {
+        ++it;
       }
-      REVERB_CHECK_EQ(chunks.size(), keep_keys.size())
-          << "Kept less chunks than expected.";
     }
+    REVERB_CHECK_EQ(chunks.size(), keep_keys.size())
+        << "Kept less chunks than expected.";
   }
 
-  return grpc::Status::OK;
+  // The read thread stopped pushing requests so it is about to exit.
+  read_thread = nullptr;  // Joins thread.
+  if (!read_status.ok()) return read_status;
+
+  // Wait for all pending confirmations to be sent.
+  confirmations.SetLastItemPushed();
+  write_thread = nullptr;  // Joins thread.
+  return write_status;
 }
 
 grpc::Status ReverbServiceImpl::MutatePriorities(
     grpc::ServerContext* context, const MutatePrioritiesRequest* request,
     MutatePrioritiesResponse* response) {
-  Table* table = TableByName(request->table());
-  if (table == nullptr) return TableNotFound(request->table());
+  internal::ScopedLatencyRecorder latency(
+      &metrics_.rpc_latency[kMutatePrioritiesRpc]);
+  return ApplyMutation(*request);
+}
+
+grpc::Status ReverbServiceImpl::MutatePrioritiesStream(
+    grpc::ServerContext* context,
+    grpc::ServerReaderWriter<MutatePrioritiesResponse,
+                             MutatePrioritiesRequest>* stream) {
+  return MutatePrioritiesStreamInternal(context, stream);
+}
+
+grpc::Status ReverbServiceImpl::MutatePrioritiesStreamInternal(
+    grpc::ServerContext* context,
+    grpc::ServerReaderWriterInterface<MutatePrioritiesResponse,
+                                      MutatePrioritiesRequest>* stream) {
+  metrics_.open_mutate_priorities_streams.Increment();
+  auto close_stream = internal::MakeCleanup(
+      [this] { metrics_.open_mutate_priorities_streams.Decrement(); });
+
+  MutatePrioritiesRequest request;
+  while (stream->Read(&request)) {
+    {
+      internal::ScopedLatencyRecorder latency(&metrics_.mutate_stream_latency);
+      if (auto status = ApplyMutation(request); !status.ok()) return status;
+    }
+    if (!stream->Write(MutatePrioritiesResponse())) {
+      return Internal("Failed to write to MutatePriorities stream.");
+    }
+    request.Clear();
+  }
+  return grpc::Status::OK;
+}
 
-  auto status = table->MutateItems(
-      std::vector<KeyWithPriority>(request->updates().begin(),
-                                   request->updates().end()),
-      request->delete_keys());
+grpc::Status ReverbServiceImpl::ApplyMutation(
+    const MutatePrioritiesRequest& request) {
+  Table* table = TableByName(request.table());
+  if (table == nullptr) return TableNotFound(request.table());
+
+  std::vector<KeyWithPriority> updates(request.updates().begin(),
+                                       request.updates().end());
+  auto status = table->MutateItems(updates, request.delete_keys());
   if (!status.ok()) return ToGrpcStatus(status);
+
+  // The table records the mutation in the log before releasing its lock.
+  if (write_ahead_log_ != nullptr) {
+    status = write_ahead_log_->Sync();
+    if (!status.ok()) return ToGrpcStatus(status);
+  }
   return grpc::Status::OK;
 }
 
 grpc::Status ReverbServiceImpl::Reset(grpc::ServerContext* context,
                                       const ResetRequest* request,
                                       ResetResponse* response) {
+  internal::ScopedLatencyRecorder latency(&metrics_.rpc_latency[kResetRpc]);
   Table* table = TableByName(request->table());
   if (table == nullptr) return TableNotFound(request->table());
 
@@ -237,6 +536,11 @@ grpc::Status ReverbServiceImpl::Reset(grpc::ServerContext* context,
   if (!status.ok()) {
     return ToGrpcStatus(status);
   }
+
+  if (write_ahead_log_ != nullptr) {
+    status = write_ahead_log_->Sync();
+    if (!status.ok()) return ToGrpcStatus(status);
+  }
   return grpc::Status::OK;
 }
 
@@ -251,6 +555,10 @@ grpc::Status ReverbServiceImpl::SampleStreamInternal(
     grpc::ServerContext* context,
     grpc::ServerReaderWriterInterface<SampleStreamResponse,
                                       SampleStreamRequest>* stream) {
+  metrics_.open_sample_streams.Increment();
+  auto close_stream = internal::MakeCleanup(
+      [this] { metrics_.open_sample_streams.Decrement(); });
+
   SampleStreamRequest request;
   if (!stream->Read(&request)) {
     return Internal("Could not read initial request");
@@ -286,11 +594,13 @@ grpc::Status ReverbServiceImpl::SampleStreamInternal(
               ? default_flexible_batch_size
               : request.flexible_batch_size(),
           request.num_samples() - count);
+      const absl::Time sample_start = absl::Now();
       if (auto status =
               table->SampleFlexibleBatch(&samples, max_batch_size, timeout);
           !status.ok()) {
         return ToGrpcStatus(status);
       }
+      metrics_.sample_latency.Record(absl::Now() - sample_start);
       count += samples.size();
 
       for (auto& sample : samples) {
@@ -303,6 +613,8 @@ grpc::Status ReverbServiceImpl::SampleStreamInternal(
             *response.mutable_info()->mutable_item() = sample.item;
             response.mutable_info()->set_probability(sample.probability);
             response.mutable_info()->set_table_size(sample.table_size);
+            response.mutable_info()->set_sequence_number(
+                sample.sequence_number);
           }
 
           // We const cast to avoid copying the proto.
@@ -316,6 +628,7 @@ grpc::Status ReverbServiceImpl::SampleStreamInternal(
           if (!ok) {
             return Internal("Failed to write to Sample stream.");
           }
+          metrics_.sample_bytes.Add(sample.chunks[i]->DataByteSizeLong());
 
           // We no longer need our chunk reference, so we free it.
           sample.chunks[i] = nullptr;
@@ -336,6 +649,7 @@ Table* ReverbServiceImpl::TableByName(absl::string_view name) const {
 }
 
 void ReverbServiceImpl::Close() {
+  StopPeriodicCheckpoints();
   for (auto& table : tables_) {
     table.second->Close();
   }
@@ -358,6 +672,8 @@ std::string ReverbServiceImpl::DebugString() const {
 grpc::Status ReverbServiceImpl::ServerInfo(grpc::ServerContext* context,
                                            const ServerInfoRequest* request,
                                            ServerInfoResponse* response) {
+  internal::ScopedLatencyRecorder latency(
+      &metrics_.rpc_latency[kServerInfoRpc]);
   for (const auto& iter : tables_) {
     *response->add_table_info() = iter.second->info();
   }
@@ -365,6 +681,129 @@ grpc::Status ReverbServiceImpl::ServerInfo(grpc::ServerContext* context,
   return grpc::Status::OK;
 }
 
+grpc::Status ReverbServiceImpl::Metrics(grpc::ServerContext* context,
+                                        const MetricsRequest* request,
+                                        MetricsResponse* response) {
+  response->set_text(MetricsText());
+  return grpc::Status::OK;
+}
+
+std::string ReverbServiceImpl::MetricsText() const {
+  using Labels = internal::PrometheusTextBuilder::Labels;
+  internal::PrometheusTextBuilder builder;
+
+  std::vector<TableInfo> infos;
+  infos.reserve(tables_.size());
+  for (const auto& iter : tables_) {
+    infos.push_back(iter.second->info());
+  }
+  using TableValue = std::function<int64_t(const TableInfo&)>;
+  auto add_table_family = [&builder, &infos](absl::string_view name,
+                                             absl::string_view type,
+                                             absl::string_view help,
+                                             const TableValue& value) {
+    builder.AddFamily(name, type, help);
+    for (const auto& info : infos) {
+      builder.AddSample(name, {{"table", info.name()}}, value(info));
+    }
+  };
+  add_table_family(
+      "reverb_table_items", "gauge", "Number of items in the table.",
+      [](const TableInfo& info) { return info.current_size(); });
+  add_table_family(
+      "reverb_table_max_items", "gauge", "Maximum size of the table.",
+      [](const TableInfo& info) { return info.max_size(); });
+  add_table_family("reverb_table_episodes", "gauge",
+                   "Number of episodes referenced by items in the table.",
+                   [](const TableInfo& info) { return info.num_episodes(); });
+  add_table_family("reverb_table_inserts_total", "counter",
+                   "Number of completed inserts into the table.",
+                   [](const TableInfo& info) {
+                     return info.rate_limiter_info().insert_stats().completed();
+                   });
+  add_table_family("reverb_table_samples_total", "counter",
+                   "Number of completed samples from the table.",
+                   [](const TableInfo& info) {
+                     return info.rate_limiter_info().sample_stats().completed();
+                   });
+  add_table_family("reverb_table_pending_inserts", "gauge",
+                   "Number of inserts blocked by the rate limiter.",
+                   [](const TableInfo& info) {
+                     return info.rate_limiter_info().insert_stats().pending();
+                   });
+  add_table_family("reverb_table_pending_samples", "gauge",
+                   "Number of samples blocked by the rate limiter.",
+                   [](const TableInfo& info) {
+                     return info.rate_limiter_info().sample_stats().pending();
+                   });
+
+  builder.AddFamily("reverb_insert_bytes_total", "counter",
+                    "Bytes of chunk data received by InsertStream.");
+  builder.AddSample("reverb_insert_bytes_total", {},
+                    metrics_.insert_bytes.Value());
+  builder.AddFamily("reverb_sample_bytes_total", "counter",
+                    "Bytes of chunk data sent by SampleStream.");
+  builder.AddSample("reverb_sample_bytes_total", {},
+                    metrics_.sample_bytes.Value());
+
+  builder.AddFamily("reverb_chunk_store_chunks", "gauge",
+                    "Number of chunks held in memory.");
+  builder.AddSample("reverb_chunk_store_chunks", {}, chunk_store_.num_chunks());
+  builder.AddFamily("reverb_chunk_store_bytes", "gauge",
+                    "Bytes of chunk data held in memory.");
+  builder.AddSample("reverb_chunk_store_bytes", {}, chunk_store_.num_bytes());
+
+  builder.AddFamily("reverb_open_streams", "gauge",
+                    "Number of open streaming RPCs.");
+  builder.AddSample("reverb_open_streams", {{"rpc", "InsertStream"}},
+                    metrics_.open_insert_streams.Value());
+  builder.AddSample("reverb_open_streams", {{"rpc", "SampleStream"}},
+                    metrics_.open_sample_streams.Value());
+  builder.AddSample("reverb_open_streams",
+                    {{"rpc", "MutatePrioritiesStream"}},
+                    metrics_.open_mutate_priorities_streams.Value());
+  builder.AddFamily("reverb_insert_stream_queue_depth", "gauge",
+                    "Requests read from InsertStreams but not yet processed.");
+  builder.AddSample("reverb_insert_stream_queue_depth", {},
+                    metrics_.insert_queue_depth.Value());
+
+  builder.AddFamily(
+      "reverb_operation_latency_seconds", "histogram",
+      "Time spent inserting an item, sampling a batch or applying a batch of "
+      "streamed priority mutations, including time blocked by the rate "
+      "limiter.");
+  builder.AddHistogram("reverb_operation_latency_seconds",
+                       Labels{{"op", "insert"}},
+                       metrics_.insert_latency.Collect());
+  builder.AddHistogram("reverb_operation_latency_seconds",
+                       Labels{{"op", "sample"}},
+                       metrics_.sample_latency.Collect());
+  builder.AddHistogram("reverb_operation_latency_seconds",
+                       Labels{{"op", "mutate_batch"}},
+                       metrics_.mutate_stream_latency.Collect());
+
+  static constexpr std::array<const char*, kNumRpcs> kRpcNames = {
+      "Checkpoint", "MutatePriorities", "Reset", "ServerInfo"};
+  builder.AddFamily("reverb_rpc_latency_seconds", "histogram",
+                    "Latency of unary RPCs.");
+  for (int i = 0; i < kNumRpcs; i++) {
+    builder.AddHistogram("reverb_rpc_latency_seconds",
+                         Labels{{"rpc", kRpcNames[i]}},
+                         metrics_.rpc_latency[i].Collect());
+  }
+
+  builder.AddFamily("reverb_checkpoint_duration_seconds", "histogram",
+                    "Time spent saving checkpoints.");
+  builder.AddHistogram("reverb_checkpoint_duration_seconds", {},
+                       metrics_.checkpoint_duration.Collect());
+  builder.AddFamily("reverb_checkpoint_failures_total", "counter",
+                    "Number of checkpoints which failed to save.");
+  builder.AddSample("reverb_checkpoint_failures_total", {},
+                    metrics_.checkpoint_failures.Value());
+
+  return builder.text();
+}
+
 internal::flat_hash_map<std::string, std::shared_ptr<Table>>
 ReverbServiceImpl::tables() const {
   return tables_;
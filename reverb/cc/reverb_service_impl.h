@@ -15,19 +15,25 @@
 #ifndef REVERB_CC_REVERB_SERVICE_IMPL_H_
 #define REVERB_CC_REVERB_SERVICE_IMPL_H_
 
+#include <array>
 #include <memory>
+#include <string>
 
 #include "grpcpp/grpcpp.h"
 #include "absl/numeric/int128.h"
 #include "absl/random/random.h"
 #include "absl/status/status.h"
 #include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
 #include "reverb/cc/checkpointing/interface.h"
 #include "reverb/cc/chunk_store.h"
 #include "reverb/cc/platform/hash_map.h"
 #include "reverb/cc/reverb_service.grpc.pb.h"
 #include "reverb/cc/reverb_service.pb.h"
 #include "reverb/cc/schema.pb.h"
+#include "reverb/cc/support/metrics.h"
+#include "reverb/cc/support/periodic_closure.h"
 #include "reverb/cc/table.h"
 
 namespace deepmind {
@@ -36,6 +42,28 @@ namespace reverb {
 // Implements ReverbService. See reverb_service.proto for documentation.
 class ReverbServiceImpl : public /* grpc_gen:: */ReverbService::Service {
  public:
+  struct Options {
+    // If > 0 then checkpoints are created in the background at this interval.
+    // The checkpoints are written from a thread with lowered I/O priority and
+    // only the latest one is kept. Requires a checkpointer.
+    absl::Duration checkpoint_interval = absl::ZeroDuration();
+
+    // Maximum number of requests which are read from an `InsertStream` ahead
+    // of the request currently being processed. Chunks are inserted into the
+    // `ChunkStore` as soon as they are read.
+    int insert_stream_read_ahead = 16;
+
+    // If true then chunks with identical content (as identified by
+    // `ChunkData.content_hash`) share a single copy of their data in the
+    // `ChunkStore`, even when inserted by different writers.
+    bool deduplicate_chunks = false;
+  };
+
+  static absl::Status Create(std::vector<std::shared_ptr<Table>> tables,
+                             std::shared_ptr<Checkpointer> checkpointer,
+                             Options options,
+                             std::unique_ptr<ReverbServiceImpl>* service);
+
   static absl::Status Create(std::vector<std::shared_ptr<Table>> tables,
                              std::shared_ptr<Checkpointer> checkpointer,
                              std::unique_ptr<ReverbServiceImpl>* service);
@@ -61,6 +89,16 @@ class ReverbServiceImpl : public /* grpc_gen:: */ReverbService::Service {
                                 const MutatePrioritiesRequest* request,
                                 MutatePrioritiesResponse* response) override;
 
+  grpc::Status MutatePrioritiesStream(
+      grpc::ServerContext* context,
+      grpc::ServerReaderWriter<MutatePrioritiesResponse,
+                               MutatePrioritiesRequest>* stream) override;
+
+  grpc::Status MutatePrioritiesStreamInternal(
+      grpc::ServerContext* context,
+      grpc::ServerReaderWriterInterface<MutatePrioritiesResponse,
+                                        MutatePrioritiesRequest>* stream);
+
   grpc::Status Reset(grpc::ServerContext* context, const ResetRequest* request,
                      ResetResponse* response) override;
 
@@ -83,29 +121,118 @@ class ReverbServiceImpl : public /* grpc_gen:: */ReverbService::Service {
       grpc::ServerReaderWriter<InitializeConnectionResponse,
                                InitializeConnectionRequest>* stream) override;
 
+  grpc::Status Metrics(grpc::ServerContext* context,
+                       const MetricsRequest* request,
+                       MetricsResponse* response) override;
+
+  // Returns the metrics of the service in the Prometheus text exposition
+  // format. Counters on the hot paths are aggregated when this is called and
+  // each table is locked once to read its info.
+  std::string MetricsText() const;
+
   // Gets a copy of the table lookup.
   internal::flat_hash_map<std::string, std::shared_ptr<Table>> tables() const;
 
-  // Closes all tables and the chunk store.
+  ~ReverbServiceImpl() override;
+
+  // Stops periodic checkpointing and closes all tables.
   void Close();
 
   // Returns a summary string description.
   std::string DebugString() const;
 
  private:
-  explicit ReverbServiceImpl(
-      std::shared_ptr<Checkpointer> checkpointer = nullptr);
+  ReverbServiceImpl(std::shared_ptr<Checkpointer> checkpointer,
+                    Options options);
 
   absl::Status Initialize(std::vector<std::shared_ptr<Table>> tables);
 
+  // Saves a checkpoint of all tables and stores its path in `path`. Blocks
+  // until any checkpoint already in progress has completed.
+  absl::Status SaveCheckpoint(std::string* path)
+      ABSL_LOCKS_EXCLUDED(checkpoint_mu_);
+
+  // Same as `SaveCheckpoint` but requires that `checkpoint_mu_` is held. If
+  // `background` is true then the checkpoint is saved with
+  // `Checkpointer::SaveInBackground`.
+  absl::Status SaveCheckpointLocked(bool background, std::string* path)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(checkpoint_mu_);
+
+  // Called by `checkpoint_closure_`. Skips the checkpoint if one is already
+  // being created as a result of a `Checkpoint` call.
+  void MaybeSaveCheckpointInBackground() ABSL_LOCKS_EXCLUDED(checkpoint_mu_);
+
+  // Stops `checkpoint_closure_` if it is running.
+  void StopPeriodicCheckpoints();
+
   // Lookups the table for a given name. Returns nullptr if not found.
   Table* TableByName(absl::string_view name) const;
 
+  // Applies the updates and deletions of `request` with a single
+  // `Table::MutateItems` call and records them in the write-ahead log.
+  grpc::Status ApplyMutation(const MutatePrioritiesRequest& request);
+
+  // Unary RPCs whose latency is recorded in `ServiceMetrics::rpc_latency`.
+  enum Rpc {
+    kCheckpointRpc = 0,
+    kMutatePrioritiesRpc,
+    kResetRpc,
+    kServerInfoRpc,
+    kNumRpcs,
+  };
+
+  // Metrics exported by `MetricsText`. None of the updates take a lock.
+  struct ServiceMetrics {
+    // Size of the chunks received by `InsertStream` and sent by
+    // `SampleStream`.
+    internal::StripedCounter insert_bytes;
+    internal::StripedCounter sample_bytes;
+
+    internal::StripedCounter open_insert_streams;
+    internal::StripedCounter open_sample_streams;
+    internal::StripedCounter open_mutate_priorities_streams;
+
+    // Time spent applying a batch read from a `MutatePrioritiesStream`.
+    internal::LatencyHistogram mutate_stream_latency;
+
+    // Requests which have been read from an `InsertStream` but not yet
+    // processed by its handler.
+    internal::StripedCounter insert_queue_depth;
+
+    // Time spent inserting an item or sampling a batch from a table,
+    // including the time blocked by the rate limiter.
+    internal::LatencyHistogram insert_latency;
+    internal::LatencyHistogram sample_latency;
+
+    // Duration of all checkpoints, requested or periodic.
+    internal::LatencyHistogram checkpoint_duration;
+    internal::StripedCounter checkpoint_failures;
+
+    std::array<internal::LatencyHistogram, kNumRpcs> rpc_latency;
+  };
+
   // Checkpointer used to restore state in the constructor and to save data
   // when `Checkpoint` is called. Note that if `checkpointer_` is nullptr then
   // `Checkpoint` will return an `InvalidArgumentError`.
   std::shared_ptr<Checkpointer> checkpointer_;
 
+  const Options options_;
+
+  // Held while a checkpoint is being saved so that periodic and requested
+  // checkpoints are never written concurrently.
+  absl::Mutex checkpoint_mu_;
+
+  // Calls `MaybeSaveCheckpointInBackground` every
+  // `options_.checkpoint_interval`. Nullptr if periodic checkpoints are
+  // disabled or have been stopped.
+  std::unique_ptr<internal::PeriodicClosure> checkpoint_closure_;
+  absl::Mutex checkpoint_closure_mu_;
+
+  // Write-ahead log of `checkpointer_`, or nullptr if it doesn't keep one. If
+  // set then the tables record their inserts, mutations and resets in the log
+  // and responses confirming them are only sent once they have been synced.
+  WriteAheadLog* write_ahead_log_ = nullptr;
+
   // Stores chunks and keeps references to them.
   ChunkStore chunk_store_;
 
@@ -114,6 +241,8 @@ class ReverbServiceImpl : public /* grpc_gen:: */ReverbService::Service {
 
   absl::BitGen rnd_;
 
+  ServiceMetrics metrics_;
+
   // A new id must be generated whenever a table is added, deleted, or has its
   // signature modified.
   absl::uint128 tables_state_id_;
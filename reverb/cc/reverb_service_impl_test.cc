@@ -22,11 +22,15 @@
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 #include "absl/memory/memory.h"
+#include "absl/synchronization/mutex.h"
 #include "absl/synchronization/notification.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
 #include "absl/types/optional.h"
 #include "reverb/cc/platform/checkpointing.h"
 #include "reverb/cc/platform/status_macros.h"
 #include "reverb/cc/platform/status_matchers.h"
+#include "reverb/cc/platform/tfrecord_checkpointer.h"
 #include "reverb/cc/platform/thread.h"
 #include "reverb/cc/reverb_service.pb.h"
 #include "reverb/cc/schema.pb.h"
@@ -61,7 +65,8 @@ class FakeInsertStream
   PrioritizedItem AddItem(absl::string_view table,
                           const std::vector<int64_t>& sequence_chunks,
                           const std::vector<int64_t>& keep_chunks = {},
-                          bool send_confirmation = false) {
+                          bool send_confirmation = false,
+                          bool accept_batched_confirmation = true) {
     PrioritizedItem item;
     item.set_key(nextId++);
     item.set_table(table.data(), table.size());
@@ -82,6 +87,8 @@ class FakeInsertStream
                                                           keep_chunks.end()};
     *request.mutable_item()->mutable_item() = item;
     request.mutable_item()->set_send_confirmation(send_confirmation);
+    request.mutable_item()->set_accept_batched_confirmation(
+        accept_batched_confirmation);
     read_buffer_.push_back(std::move(request));
     return item;
   }
@@ -154,6 +161,37 @@ class FakeSampleStream
   grpc::WriteOptions options_;
 };
 
+class FakeMutatePrioritiesStream
+    : public grpc::ServerReaderWriterInterface<MutatePrioritiesResponse,
+                                               MutatePrioritiesRequest> {
+ public:
+  void AddRequest(MutatePrioritiesRequest request) {
+    requests_.push_back(std::move(request));
+  }
+
+  bool Read(MutatePrioritiesRequest* request) override {
+    if (requests_.empty()) return false;
+    *request = requests_.front();
+    requests_.pop_front();
+    return true;
+  }
+
+  bool Write(const MutatePrioritiesResponse& response,
+             grpc::WriteOptions options) override {
+    num_responses_++;
+    return true;
+  }
+
+  void SendInitialMetadata() override {}
+  bool NextMessageSize(uint32_t*) override { return false; }
+
+  int num_responses() const { return num_responses_; }
+
+ private:
+  std::list<MutatePrioritiesRequest> requests_;
+  int num_responses_ = 0;
+};
+
 tensorflow::StructuredValue MakeSignature() {
   tensorflow::StructuredValue signature;
   auto* tensor_spec = signature.mutable_tensor_spec_value();
@@ -163,8 +201,60 @@ tensorflow::StructuredValue MakeSignature() {
   return signature;
 }
 
-std::unique_ptr<ReverbServiceImpl> MakeService(
-    int max_size, std::unique_ptr<Checkpointer> checkpointer) {
+// Forwards all calls to a wrapped checkpointer and notifies a notification
+// once a background checkpoint, started after the notification was set, has
+// been saved.
+class NotifyingCheckpointer : public Checkpointer {
+ public:
+  explicit NotifyingCheckpointer(std::unique_ptr<Checkpointer> checkpointer)
+      : checkpointer_(std::move(checkpointer)) {}
+
+  void NotifyOnNextBackgroundSave(absl::Notification* notification) {
+    absl::MutexLock lock(&mu_);
+    notification_ = notification;
+  }
+
+  absl::Status Save(std::vector<Table*> tables, int keep_latest,
+                    std::string* path) override {
+    return checkpointer_->Save(std::move(tables), keep_latest, path);
+  }
+
+  absl::Status SaveInBackground(std::vector<Table*> tables, int keep_latest,
+                                std::string* path) override {
+    absl::Notification* notification;
+    {
+      absl::MutexLock lock(&mu_);
+      notification = notification_;
+      notification_ = nullptr;
+    }
+    auto status =
+        checkpointer_->SaveInBackground(std::move(tables), keep_latest, path);
+    if (notification != nullptr) notification->Notify();
+    return status;
+  }
+
+  absl::Status Load(absl::string_view relative_path, ChunkStore* chunk_store,
+                    std::vector<std::shared_ptr<Table>>* tables) override {
+    return checkpointer_->Load(relative_path, chunk_store, tables);
+  }
+
+  absl::Status LoadLatest(
+      ChunkStore* chunk_store,
+      std::vector<std::shared_ptr<Table>>* tables) override {
+    return checkpointer_->LoadLatest(chunk_store, tables);
+  }
+
+  std::string DebugString() const override {
+    return checkpointer_->DebugString();
+  }
+
+ private:
+  std::unique_ptr<Checkpointer> checkpointer_;
+  absl::Mutex mu_;
+  absl::Notification* notification_ ABSL_GUARDED_BY(mu_) = nullptr;
+};
+
+std::vector<std::shared_ptr<Table>> MakeTables(int max_size) {
   std::vector<std::shared_ptr<Table>> tables;
 
   tables.push_back(absl::make_unique<Table>(
@@ -175,12 +265,25 @@ std::unique_ptr<ReverbServiceImpl> MakeService(
       /*extensions=*/
       std::vector<std::shared_ptr<TableExtension>>{},
       /*signature=*/absl::make_optional(MakeSignature())));
+  return tables;
+}
+
+std::unique_ptr<ReverbServiceImpl> MakeService(
+    int max_size, std::unique_ptr<Checkpointer> checkpointer,
+    ReverbServiceImpl::Options options) {
   std::unique_ptr<ReverbServiceImpl> service;
-  REVERB_CHECK_OK(ReverbServiceImpl::Create(std::move(tables),
-                                            std::move(checkpointer), &service));
+  REVERB_CHECK_OK(ReverbServiceImpl::Create(MakeTables(max_size),
+                                            std::move(checkpointer),
+                                            std::move(options), &service));
   return service;
 }
 
+std::unique_ptr<ReverbServiceImpl> MakeService(
+    int max_size, std::unique_ptr<Checkpointer> checkpointer) {
+  return MakeService(max_size, std::move(checkpointer),
+                     ReverbServiceImpl::Options());
+}
+
 std::unique_ptr<ReverbServiceImpl> MakeService(int max_size) {
   return MakeService(max_size, nullptr);
 }
@@ -287,9 +390,36 @@ TEST(ReverbServiceImplTest, InsertStreamRespondsWithItemKeys) {
   stream.AddItem("dist", {1}, {1}, /*send_confirmation=*/false);
   stream.AddItem("dist", {1}, {}, /*send_confirmation=*/true);
   REVERB_EXPECT_OK(service->InsertStreamInternal(&context, &stream));
-  EXPECT_THAT(stream.responses(), ::testing::SizeIs(2));
-  EXPECT_EQ(stream.responses()[0].key(), first_id);
-  EXPECT_EQ(stream.responses()[1].key(), first_id + 2);
+  std::vector<uint64_t> confirmed_keys;
+  for (const auto& response : stream.responses()) {
+    confirmed_keys.insert(confirmed_keys.end(), response.keys().begin(),
+                          response.keys().end());
+  }
+  EXPECT_THAT(confirmed_keys, ::testing::ElementsAre(first_id, first_id + 2));
+}
+
+TEST(ReverbServiceImplTest, InsertStreamConfirmsUnbatchedItemsSeparately) {
+  std::unique_ptr<ReverbServiceImpl> service = MakeService(10);
+  grpc::ServerContext context;
+
+  FakeInsertStream stream;
+  stream.AddChunk(1);
+  auto first_id = nextId;
+  for (int i = 0; i < 3; i++) {
+    stream.AddItem("dist", {1}, {1}, /*send_confirmation=*/true,
+                   /*accept_batched_confirmation=*/false);
+  }
+  REVERB_EXPECT_OK(service->InsertStreamInternal(&context, &stream));
+
+  // Clients which don't accept batched confirmations only read `key` so every
+  // item must be confirmed in a separate response.
+  std::vector<uint64_t> confirmed_keys;
+  for (const auto& response : stream.responses()) {
+    EXPECT_THAT(response.keys(), ::testing::IsEmpty());
+    confirmed_keys.push_back(response.key());
+  }
+  EXPECT_THAT(confirmed_keys,
+              ::testing::ElementsAre(first_id, first_id + 1, first_id + 2));
 }
 
 TEST(ReverbServiceImplTest, SampleBlocksUntilEnoughInserts) {
@@ -337,6 +467,47 @@ TEST(ReverbServiceImplTest, MutateDeletionWorks) {
   EXPECT_EQ(service->tables()["dist"]->size(), 0);
 }
 
+TEST(ReverbServiceImplTest, MutatePrioritiesStreamAcknowledgesEachBatch) {
+  std::unique_ptr<ReverbServiceImpl> service = MakeService(10);
+
+  FakeInsertStream insert_stream;
+  insert_stream.AddChunk(1);
+  PrioritizedItem first = insert_stream.AddItem("dist", {1}, {1});
+  PrioritizedItem second = insert_stream.AddItem("dist", {1});
+  ASSERT_TRUE(service->InsertStreamInternal(nullptr, &insert_stream).ok());
+  ASSERT_EQ(service->tables()["dist"]->size(), 2);
+
+  FakeMutatePrioritiesStream stream;
+  MutatePrioritiesRequest update;
+  update.set_table("dist");
+  *update.add_updates() = testing::MakeKeyWithPriority(first.key(), 5);
+  stream.AddRequest(update);
+  MutatePrioritiesRequest deletion;
+  deletion.set_table("dist");
+  deletion.add_delete_keys(second.key());
+  stream.AddRequest(deletion);
+  REVERB_EXPECT_OK(service->MutatePrioritiesStreamInternal(nullptr, &stream));
+
+  EXPECT_EQ(stream.num_responses(), 2);
+  EXPECT_EQ(service->tables()["dist"]->size(), 1);
+  Table::Item item;
+  ASSERT_TRUE(service->tables()["dist"]->Get(first.key(), &item));
+  EXPECT_EQ(item.item.priority(), 5);
+}
+
+TEST(ReverbServiceImplTest, MutatePrioritiesStreamFailsOnInvalidTable) {
+  std::unique_ptr<ReverbServiceImpl> service = MakeService(10);
+
+  FakeMutatePrioritiesStream stream;
+  MutatePrioritiesRequest request;
+  request.set_table("invalid");
+  stream.AddRequest(request);
+  EXPECT_EQ(
+      service->MutatePrioritiesStreamInternal(nullptr, &stream).error_code(),
+      grpc::StatusCode::NOT_FOUND);
+  EXPECT_EQ(stream.num_responses(), 0);
+}
+
 TEST(ReverbServiceImplTest, AnyCallWithInvalidDistributionFails) {
   std::unique_ptr<ReverbServiceImpl> service = MakeService(10);
   grpc::ServerContext context;
@@ -393,7 +564,8 @@ TEST(ReverbServiceImplTest, ServerInfoWorks) {
             std::make_pair(uint64_t{0}, uint64_t{0}));
 
   EXPECT_EQ(server_info_response.table_info_size(), 1);
-  const auto& table_info = server_info_response.table_info()[0];
+  TableInfo table_info = server_info_response.table_info()[0];
+  table_info.clear_lock_stats();
 
   TableInfo expected_table_info;
   expected_table_info.set_name("dist");
@@ -417,6 +589,50 @@ TEST(ReverbServiceImplTest, ServerInfoWorks) {
   EXPECT_THAT(table_info, testing::EqualsProto(expected_table_info));
 }
 
+TEST(ReverbServiceImplTest, MetricsWorks) {
+  auto service = MakeService(10);
+
+  FakeInsertStream insert_stream;
+  insert_stream.AddChunk(1);
+  insert_stream.AddChunk(2);
+  insert_stream.AddItem("dist", {1, 2});
+  ASSERT_TRUE(service->InsertStreamInternal(nullptr, &insert_stream).ok());
+
+  FakeSampleStream sample_stream;
+  sample_stream.AddRequest("dist", 1);
+  grpc::ServerContext context;
+  ASSERT_TRUE(service->SampleStreamInternal(&context, &sample_stream).ok());
+
+  MetricsRequest request;
+  MetricsResponse response;
+  ASSERT_TRUE(service->Metrics(nullptr, &request, &response).ok());
+  EXPECT_EQ(response.text(), service->MetricsText());
+
+  const std::string& text = response.text();
+  EXPECT_THAT(text, ::testing::HasSubstr(
+                        "# TYPE reverb_table_inserts_total counter\n"
+                        "reverb_table_inserts_total{table=\"dist\"} 1\n"));
+  EXPECT_THAT(text, ::testing::HasSubstr(
+                        "reverb_table_samples_total{table=\"dist\"} 1\n"));
+  EXPECT_THAT(text,
+              ::testing::HasSubstr("reverb_table_items{table=\"dist\"} 1\n"));
+  EXPECT_THAT(text, ::testing::HasSubstr("reverb_chunk_store_chunks 2\n"));
+  EXPECT_THAT(text, ::testing::HasSubstr(
+                        "reverb_open_streams{rpc=\"InsertStream\"} 0\n"));
+  EXPECT_THAT(text, ::testing::HasSubstr(
+                        "reverb_open_streams{rpc=\"SampleStream\"} 0\n"));
+  EXPECT_THAT(text,
+              ::testing::HasSubstr("reverb_insert_stream_queue_depth 0\n"));
+  EXPECT_THAT(text, ::testing::HasSubstr(
+                        "reverb_operation_latency_seconds_count{op=\"insert\"}"
+                        " 1\n"));
+  EXPECT_THAT(text, ::testing::HasSubstr(
+                        "reverb_operation_latency_seconds_count{op=\"sample\"}"
+                        " 1\n"));
+  EXPECT_THAT(text, ::testing::HasSubstr(
+                        "reverb_checkpoint_duration_seconds_count 0\n"));
+}
+
 TEST(ReverbServiceImplTest, CheckpointCalledWithoutCheckpointer) {
   auto service = MakeService(10);
   CheckpointRequest request;
@@ -458,6 +674,69 @@ TEST(ReverbServiceImplTest, CheckpointAndLoadFromCheckpoint) {
   EXPECT_EQ(loaded_service->tables()["dist"]->size(), 1);
 }
 
+TEST(ReverbServiceImplTest, PeriodicCheckpointsRequireCheckpointer) {
+  ReverbServiceImpl::Options options;
+  options.checkpoint_interval = absl::Milliseconds(10);
+  std::unique_ptr<ReverbServiceImpl> service;
+  EXPECT_EQ(ReverbServiceImpl::Create(MakeTables(10), /*checkpointer=*/nullptr,
+                                      options, &service)
+                .code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
+TEST(ReverbServiceImplTest, PeriodicCheckpointsAreSaved) {
+  std::string path = getenv("TEST_TMPDIR");
+  REVERB_CHECK(tensorflow::Env::Default()->CreateUniqueFileName(&path, "temp"));
+
+  ReverbServiceImpl::Options options;
+  options.checkpoint_interval = absl::Milliseconds(10);
+  auto checkpointer = absl::make_unique<NotifyingCheckpointer>(
+      CreateDefaultCheckpointer(path));
+  auto* notifying_checkpointer = checkpointer.get();
+  auto service = MakeService(10, std::move(checkpointer), options);
+
+  {
+    FakeInsertStream stream;
+    stream.AddChunk(1);
+    stream.AddItem("dist", {1});
+    ASSERT_TRUE(service->InsertStreamInternal(nullptr, &stream).ok());
+  }
+
+  // Wait for a periodic checkpoint which was started after the item was
+  // inserted. Closing the service stops the periodic checkpoints so that the
+  // directory isn't modified while it is loaded below.
+  absl::Notification saved;
+  notifying_checkpointer->NotifyOnNextBackgroundSave(&saved);
+  saved.WaitForNotification();
+  service->Close();
+
+  auto loaded_service = MakeService(10, CreateDefaultCheckpointer(path));
+  EXPECT_EQ(loaded_service->tables()["dist"]->size(), 1);
+}
+
+TEST(ReverbServiceImplTest, WriteAheadLogRejectsMaxTimesSampled) {
+  std::string path = getenv("TEST_TMPDIR");
+  REVERB_CHECK(tensorflow::Env::Default()->CreateUniqueFileName(&path, "temp"));
+  TFRecordCheckpointer::Options checkpointer_options;
+  checkpointer_options.use_write_ahead_log = true;
+
+  std::vector<std::shared_ptr<Table>> tables;
+  tables.push_back(absl::make_unique<Table>(
+      "queue", absl::make_unique<FifoSelector>(),
+      absl::make_unique<FifoSelector>(), 10, /*max_times_sampled=*/1,
+      absl::make_unique<RateLimiter>(kSamplesPerInsert, kMinSizeToSample,
+                                     kMinDiff, kMaxDiff)));
+
+  std::unique_ptr<ReverbServiceImpl> service;
+  EXPECT_EQ(ReverbServiceImpl::Create(
+                std::move(tables),
+                absl::make_unique<TFRecordCheckpointer>(path, "",
+                                                        checkpointer_options),
+                &service)
+                .code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
 }  // namespace
 }  // namespace reverb
 }  // namespace deepmind
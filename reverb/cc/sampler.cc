@@ -15,7 +15,9 @@
 #include "reverb/cc/sampler.h"
 
 #include <algorithm>
+#include <cstring>
 #include <deque>
+#include <limits>
 #include <memory>
 #include <string>
 #include <vector>
@@ -23,8 +25,10 @@
 #include "grpcpp/impl/codegen/client_context.h"
 #include "grpcpp/impl/codegen/sync_stream.h"
 #include "absl/memory/memory.h"
+#include "absl/random/random.h"
 #include "absl/status/status.h"
 #include "absl/strings/str_cat.h"
+#include "absl/strings/str_join.h"
 #include "absl/synchronization/mutex.h"
 #include "absl/time/clock.h"
 #include "absl/time/time.h"
@@ -38,17 +42,65 @@
 #include "reverb/cc/reverb_service.pb.h"
 #include "reverb/cc/schema.pb.h"
 #include "reverb/cc/support/grpc_util.h"
+#include "reverb/cc/support/metrics.h"
+#include "reverb/cc/support/server_weights.h"
 #include "reverb/cc/support/tf_util.h"
 #include "reverb/cc/support/trajectory_util.h"
 #include "reverb/cc/table.h"
 #include "reverb/cc/tensor_compression.h"
 #include "tensorflow/core/framework/tensor.h"
 #include "tensorflow/core/framework/tensor_util.h"
+#include "tensorflow/core/framework/types.h"
 
 namespace deepmind {
 namespace reverb {
 namespace {
 
+// Sets every element in row `row` of `batch` to `value`.
+template <typename T>
+void FillRow(T value, int64_t row, tensorflow::Tensor* batch) {
+  auto rows = batch->flat_outer_dims<T>();
+  for (int64_t i = 0; i < rows.dimension(1); i++) {
+    rows(row, i) = value;
+  }
+}
+
+// Copies all elements of `src` into the flattened `dst`, starting at element
+// `offset` of `dst`.
+absl::Status CopyElements(const tensorflow::Tensor& src, int64_t offset,
+                          tensorflow::Tensor* dst) {
+  if (tensorflow::DataTypeCanUseMemcpy(src.dtype())) {
+    auto from = src.tensor_data();
+    if (from.empty()) return absl::OkStatus();
+    char* to = const_cast<char*>(dst->tensor_data().data());
+    std::memcpy(to + offset * tensorflow::DataTypeSize(src.dtype()),
+                from.data(), from.size());
+    return absl::OkStatus();
+  }
+  if (src.dtype() == tensorflow::DT_STRING) {
+    auto from = src.flat<tensorflow::tstring>();
+    auto to = dst->flat<tensorflow::tstring>();
+    for (int64_t i = 0; i < from.size(); i++) {
+      to(offset + i) = from(i);
+    }
+    return absl::OkStatus();
+  }
+  return absl::UnimplementedError(
+      absl::StrCat("Batching tensors of dtype ",
+                   tensorflow::DataTypeString(src.dtype()),
+                   " is not supported."));
+}
+
+std::string ShapesString(const std::vector<tensorflow::TensorShape>& shapes) {
+  return absl::StrCat(
+      "[",
+      absl::StrJoin(shapes, ", ",
+                    [](std::string* out, const tensorflow::TensorShape& shape) {
+                      absl::StrAppend(out, shape.DebugString());
+                    }),
+      "]");
+}
+
 inline bool SampleIsDone(const std::vector<SampleStreamResponse>& sample) {
   if (sample.empty()) return false;
 
@@ -108,39 +160,33 @@ absl::Status TimestepTrajectoryAsSample(
     // Convert each chunk tensor and release the chunk memory afterwards.
     int64_t insert_index = response.data().data().tensors_size() - 1;
     while (!response.data().data().tensors().empty()) {
-      tensorflow::Tensor batch;
-
-      {
-        // This ensures we release the response proto after converting the
-        // result to a tensor.
-        auto chunk = absl::WrapUnique(response.mutable_data()
-                                          ->mutable_data()
-                                          ->mutable_tensors()
-                                          ->ReleaseLast());
-        batch = DecompressTensorFromProto(*chunk);
-      }
-
-      if (response.data().delta_encoded()) {
-        batch = DeltaEncode(batch, /*encode=*/false);
-      }
-
+      // This ensures we release the response proto after converting the
+      // result to a tensor.
+      auto chunk = absl::WrapUnique(response.mutable_data()
+                                        ->mutable_data()
+                                        ->mutable_tensors()
+                                        ->ReleaseLast());
+
+      tensorflow::TensorShape shape(chunk->tensor_shape());
       if (batch_size < 0) {
-        batch_size = batch.dim_size(0);
+        batch_size = shape.dim_size(0);
       } else {
-        if (batch_size != batch.dim_size(0)) {
+        if (batch_size != shape.dim_size(0)) {
           return absl::InternalError(absl::StrCat(
               "Chunks of the same response must have identical batch size, but "
               "first chunk has batch size ",
               batch_size, " while the current chunk has batch size ",
-              batch.dim_size(0)));
+              shape.dim_size(0)));
         }
       }
 
-      batch =
-          batch.Slice(offset, std::min<int64_t>(offset + remaining, batch_size));
-      if (!batch.IsAligned()) {
-        batch = tensorflow::tensor::DeepCopy(batch);
-      }
+      // Only the steps which are part of the trajectory are decompressed.
+      int64_t length = std::min<int64_t>(remaining, batch_size - offset);
+      shape.set_dim(0, length);
+      tensorflow::Tensor batch(chunk->dtype(), shape);
+      REVERB_RETURN_IF_ERROR(DecompressTensorRowsFromProto(
+          *chunk, response.data().delta_encoded(), offset, length,
+          /*out_offset=*/0, &batch));
 
       batches[insert_index--] = std::move(batch);
     }
@@ -160,7 +206,8 @@ absl::Status TimestepTrajectoryAsSample(
 
   *sample = absl::make_unique<Sample>(
       info.item().key(), info.probability(), info.table_size(),
-      info.item().priority(), std::move(chunks), std::move(squeeze_columns));
+      info.item().priority(), std::move(chunks), std::move(squeeze_columns),
+      info.sequence_number());
   return absl::OkStatus();
 }
 
@@ -180,10 +227,12 @@ absl::Status AsSample(std::vector<SampleStreamResponse> responses,
     chunks[key] = absl::WrapUnique<ChunkData>(response.release_data());
   }
 
-  // Extract all chunks belonging to this sample.
+  // Extract all chunks belonging to this sample. The slices of each column are
+  // decompressed straight into a single tensor.
   std::vector<tensorflow::Tensor> unpacked_columns;
   for (const auto& column : info.item().flat_trajectory().columns()) {
-    std::vector<tensorflow::Tensor> unpacked_chunks;
+    std::vector<const ChunkData*> column_chunks;
+    column_chunks.reserve(column.chunk_slices_size());
     for (const auto& slice : column.chunk_slices()) {
       auto it = chunks.find(slice.chunk_key());
       if (it == chunks.end()) {
@@ -192,15 +241,12 @@ absl::Status AsSample(std::vector<SampleStreamResponse> responses,
                          " could not be found when unpacking item ",
                          info.item().key(), "."));
       }
-      unpacked_chunks.emplace_back();
-      REVERB_RETURN_IF_ERROR(internal::UnpackChunkColumnAndSlice(
-          *it->second, slice, &unpacked_chunks.back()));
+      column_chunks.push_back(it->second.get());
     }
 
-    // TODO(b/177655596): Avoid this concat when timesteps are emitted.
     unpacked_columns.emplace_back();
-    REVERB_RETURN_IF_ERROR(FromTensorflowStatus(
-        tensorflow::tensor::Concat(unpacked_chunks, &unpacked_columns.back())));
+    REVERB_RETURN_IF_ERROR(internal::UnpackColumn(column, column_chunks,
+                                                  &unpacked_columns.back()));
   }
 
   std::vector<bool> squeeze_columns;
@@ -213,7 +259,8 @@ absl::Status AsSample(std::vector<SampleStreamResponse> responses,
                                 info.table_size(), info.item().priority(),
                                 std::deque<std::vector<tensorflow::Tensor>>(
                                     {std::move(unpacked_columns)}),
-                                std::move(squeeze_columns));
+                                std::move(squeeze_columns),
+                                info.sequence_number());
 
   return absl::OkStatus();
 }
@@ -230,18 +277,15 @@ absl::Status AsSample(const Table::SampledItem& sampled_item,
   flat_trajectory.reserve(sampled_item.item.flat_trajectory().columns_size());
 
   for (const auto& column : sampled_item.item.flat_trajectory().columns()) {
-    std::vector<tensorflow::Tensor> unpacked_chunks;
-    unpacked_chunks.reserve(column.chunk_slices_size());
-
+    std::vector<const ChunkData*> column_chunks;
+    column_chunks.reserve(column.chunk_slices_size());
     for (const auto& slice : column.chunk_slices()) {
-      unpacked_chunks.emplace_back();
-      REVERB_RETURN_IF_ERROR(internal::UnpackChunkColumnAndSlice(
-          chunks[slice.chunk_key()]->data(), slice, &unpacked_chunks.back()));
+      column_chunks.push_back(&chunks[slice.chunk_key()]->data());
     }
 
     flat_trajectory.emplace_back();
-    REVERB_RETURN_IF_ERROR(FromTensorflowStatus(
-        tensorflow::tensor::Concat(unpacked_chunks, &flat_trajectory.back())));
+    REVERB_RETURN_IF_ERROR(internal::UnpackColumn(column, column_chunks,
+                                                  &flat_trajectory.back()));
   }
 
   std::vector<bool> squeeze_columns;
@@ -253,7 +297,7 @@ absl::Status AsSample(const Table::SampledItem& sampled_item,
       sampled_item.item.key(), sampled_item.probability,
       sampled_item.table_size, sampled_item.item.priority(),
       std::deque<std::vector<tensorflow::Tensor>>({std::move(flat_trajectory)}),
-      std::move(squeeze_columns));
+      std::move(squeeze_columns), sampled_item.sequence_number);
 
   return absl::OkStatus();
 }
@@ -282,11 +326,11 @@ class GrpcSamplerWorker : public SamplerWorker {
   // in batches with maximum size `samples_per_request`, with a timeout to
   // pass to the `Table::Sample` call. Once complete (either
   // done, from a non transient error, or from timing out), the stream is
-  // closed and the number of samples pushed to `queue` is returned together
+  // closed and the number of samples pushed to `push` is returned together
   // with the status of the stream.  A timeout will cause the Status type
   // DeadlineExceeded to be returned.
   std::pair<int64_t, absl::Status> FetchSamples(
-      internal::Queue<std::unique_ptr<Sample>>* queue, int64_t num_samples,
+      const PushFn& push, int64_t num_samples,
       absl::Duration rate_limiter_timeout) override {
     std::unique_ptr<grpc::ClientReaderWriterInterface<SampleStreamRequest,
                                                       SampleStreamResponse>>
@@ -303,10 +347,20 @@ class GrpcSamplerWorker : public SamplerWorker {
 
     int64_t num_samples_returned = 0;
     while (num_samples_returned < num_samples) {
+      // A deactivated worker returns between requests. The `Sampler` accounts
+      // for the samples which were not fetched.
+      if (!is_active()) {
+        return {num_samples_returned, absl::OkStatus()};
+      }
+      const int64_t samples_per_request =
+          prefetch_controller_ != nullptr
+              ? prefetch_controller_->samples_per_request()
+              : samples_per_request_;
+
       SampleStreamRequest request;
       request.set_table(table_name_);
       request.set_num_samples(
-          std::min(samples_per_request_, num_samples - num_samples_returned));
+          std::min(samples_per_request, num_samples - num_samples_returned));
       request.mutable_rate_limiter_timeout()->set_milliseconds(
           NonnegativeDurationToInt64Millis(rate_limiter_timeout));
       request.set_flexible_batch_size(flexible_batch_size_);
@@ -314,6 +368,7 @@ class GrpcSamplerWorker : public SamplerWorker {
       if (!stream->Write(request)) {
         return {num_samples_returned, FromGrpcStatus(stream->Finish())};
       }
+      const absl::Time request_sent = absl::Now();
 
       for (int64_t i = 0; i < request.num_samples(); i++) {
         std::vector<SampleStreamResponse> responses;
@@ -324,13 +379,16 @@ class GrpcSamplerWorker : public SamplerWorker {
           }
           responses.push_back(std::move(response));
         }
+        if (i == 0 && prefetch_controller_ != nullptr) {
+          prefetch_controller_->RecordRoundTrip(absl::Now() - request_sent);
+        }
 
-        std::unique_ptr<Sample> sample;
-        auto status = AsSample(std::move(responses), &sample);
+        std::vector<std::unique_ptr<Sample>> samples(1);
+        auto status = AsSample(std::move(responses), &samples.front());
         if (!status.ok()) {
           return {num_samples_returned, status};
         }
-        if (!queue->Push(std::move(sample))) {
+        if (!push(std::move(samples))) {
           return {num_samples_returned,
                   absl::CancelledError("`Close` called on Sampler")};
         }
@@ -354,7 +412,8 @@ class GrpcSamplerWorker : public SamplerWorker {
   // Name of the `Table` to sample from.
   const std::string table_name_;
 
-  // The maximum number of samples to request in a "batch".
+  // The maximum number of samples to request in a "batch" unless a
+  // `prefetch_controller_` has been set.
   const int64_t samples_per_request_;
 
   // Upper limit of the number of items that may be sampled in a single call
@@ -371,6 +430,250 @@ class GrpcSamplerWorker : public SamplerWorker {
   absl::Mutex mu_;
 };
 
+// Interval at which `MultiServerSamplerWorker` refreshes the sizes of the
+// table on each server.
+constexpr auto kServerWeightsRefreshInterval = absl::Seconds(1);
+
+// Timeout of the `ServerInfo` calls used to refresh the server weights.
+constexpr auto kServerInfoTimeout = absl::Seconds(1);
+
+class MultiServerSamplerWorker : public SamplerWorker {
+ public:
+  // Constructs a new worker without creating any streams to the servers.
+  MultiServerSamplerWorker(
+      std::vector<std::shared_ptr</* grpc_gen:: */ReverbService::StubInterface>>
+          stubs,
+      std::string table_name, int64_t samples_per_request,
+      int flexible_batch_size)
+      : stubs_(std::move(stubs)),
+        table_name_(std::move(table_name)),
+        samples_per_request_(samples_per_request),
+        flexible_batch_size_(flexible_batch_size),
+        weights_(stubs_.size()),
+        streams_(stubs_.size()) {}
+
+  // Cancels the streams and marks the worker as closed. Active and future
+  // calls to `FetchSamples` will return status `CANCELLED`.
+  void Cancel() override {
+    absl::MutexLock lock(&mu_);
+    closed_ = true;
+    for (auto& stream : streams_) {
+      if (stream.context != nullptr) stream.context->TryCancel();
+    }
+  }
+
+  // Requests `num_samples` samples in batches with maximum size
+  // `samples_per_request`. The samples of each batch are split over the
+  // servers in proportion to the size of the table on each server. The stream
+  // to each server is kept open between calls and is only replaced after it
+  // failed, in which case the server is excluded until its size has been
+  // refreshed.
+  std::pair<int64_t, absl::Status> FetchSamples(
+      const PushFn& push, int64_t num_samples,
+      absl::Duration rate_limiter_timeout) override {
+    int64_t num_samples_returned = 0;
+    while (num_samples_returned < num_samples) {
+      if (!is_active()) {
+        return {num_samples_returned, absl::OkStatus()};
+      }
+      // A single call can span many requests so the weights are refreshed
+      // before each of them rather than once per call.
+      MaybeRefreshWeights();
+      const int64_t samples_per_request =
+          prefetch_controller_ != nullptr
+              ? prefetch_controller_->samples_per_request()
+              : samples_per_request_;
+      const std::vector<int64_t> counts = weights_.Split(
+          std::min(samples_per_request, num_samples - num_samples_returned),
+          &bit_gen_);
+
+      // Send the requests to all servers before reading any responses so the
+      // servers sample concurrently.
+      for (int i = 0; i < stubs_.size(); i++) {
+        if (counts[i] == 0) continue;
+        Stream* stream;
+        if (auto status = GetStream(i, &stream); !status.ok()) {
+          return {num_samples_returned, status};
+        }
+
+        SampleStreamRequest request;
+        request.set_table(table_name_);
+        request.set_num_samples(counts[i]);
+        request.mutable_rate_limiter_timeout()->set_milliseconds(
+            NonnegativeDurationToInt64Millis(rate_limiter_timeout));
+        request.set_flexible_batch_size(flexible_batch_size_);
+        if (!stream->Write(request)) {
+          return {num_samples_returned, CloseStream(i)};
+        }
+      }
+      const absl::Time requests_sent = absl::Now();
+
+      bool round_trip_recorded = false;
+      for (int i = 0; i < stubs_.size(); i++) {
+        for (int64_t j = 0; j < counts[i]; j++) {
+          std::vector<SampleStreamResponse> responses;
+          while (!SampleIsDone(responses)) {
+            SampleStreamResponse response;
+            if (!streams_[i].stream->Read(&response)) {
+              return {num_samples_returned, CloseStream(i)};
+            }
+            responses.push_back(std::move(response));
+          }
+          if (!round_trip_recorded && prefetch_controller_ != nullptr) {
+            prefetch_controller_->RecordRoundTrip(absl::Now() - requests_sent);
+            round_trip_recorded = true;
+          }
+
+          std::vector<std::unique_ptr<Sample>> samples(1);
+          auto status = AsSample(std::move(responses), &samples.front());
+          if (!status.ok()) {
+            // The server could still be streaming the rest of the request so
+            // the stream must be cancelled before it can be finished.
+            CloseStream(i, /*cancel=*/true).IgnoreError();
+            return {num_samples_returned, status};
+          }
+          if (!push(std::move(samples))) {
+            return {num_samples_returned,
+                    absl::CancelledError("`Close` called on Sampler")};
+          }
+          ++num_samples_returned;
+        }
+      }
+    }
+    return {num_samples_returned, absl::OkStatus()};
+  }
+
+ private:
+  using Stream = grpc::ClientReaderWriterInterface<SampleStreamRequest,
+                                                   SampleStreamResponse>;
+
+  struct ServerStream {
+    // The context must outlive the stream.
+    std::unique_ptr<grpc::ClientContext> context;
+    std::unique_ptr<Stream> stream;
+  };
+
+  // Sets the weight of each server to the size of its table if the weights
+  // are more than `kServerWeightsRefreshInterval` old. Servers which can't be
+  // reached keep their previous weight (or exclusion). The servers are queried
+  // concurrently so unreachable servers delay the refresh by at most
+  // `kServerInfoTimeout` in total.
+  void MaybeRefreshWeights() {
+    const absl::Time now = absl::Now();
+    if (now - last_refresh_ < kServerWeightsRefreshInterval) return;
+    last_refresh_ = now;
+
+    std::vector<ServerInfoResponse> responses(stubs_.size());
+    std::vector<grpc::Status> statuses(stubs_.size());
+    {
+      std::vector<std::unique_ptr<internal::Thread>> threads;
+      threads.reserve(stubs_.size());
+      for (int i = 0; i < stubs_.size(); i++) {
+        threads.push_back(internal::StartThread(
+            "ServerInfo", [this, i, now, &responses, &statuses] {
+              grpc::ClientContext context;
+              context.set_deadline(
+                  absl::ToChronoTime(now + kServerInfoTimeout));
+              statuses[i] = stubs_[i]->ServerInfo(
+                  &context, ServerInfoRequest(), &responses[i]);
+            }));
+      }
+      // The threads are joined when they go out of scope.
+    }
+
+    for (int i = 0; i < stubs_.size(); i++) {
+      if (!statuses[i].ok()) continue;
+      for (const auto& info : responses[i].table_info()) {
+        if (info.name() == table_name_) {
+          weights_.Set(i, info.current_size());
+          break;
+        }
+      }
+    }
+  }
+
+  // Opens the stream to the server at `index` unless it is already open.
+  absl::Status GetStream(int index, Stream** stream) {
+    auto& server_stream = streams_[index];
+    if (server_stream.stream == nullptr) {
+      absl::MutexLock lock(&mu_);
+      if (closed_) return absl::CancelledError("`Close` called on Sampler.");
+      server_stream.context = absl::make_unique<grpc::ClientContext>();
+      server_stream.context->set_wait_for_ready(false);
+      server_stream.stream =
+          stubs_[index]->SampleStream(server_stream.context.get());
+    }
+    *stream = server_stream.stream.get();
+    return absl::OkStatus();
+  }
+
+  // Finishes the failed stream to the server at `index`, excludes the server
+  // until it has been refreshed and returns the status of the stream. The
+  // other streams are cancelled as they could still have responses to the
+  // abandoned requests in flight. `cancel` must be set if the stream to
+  // `index` itself could still be open, as `Finish` would otherwise block
+  // until the server ends it.
+  absl::Status CloseStream(int index, bool cancel = false) {
+    if (cancel) {
+      absl::MutexLock lock(&mu_);
+      streams_[index].context->TryCancel();
+    }
+    auto status = FromGrpcStatus(streams_[index].stream->Finish());
+    streams_[index].stream = nullptr;
+    for (int i = 0; i < streams_.size(); i++) {
+      if (streams_[i].stream == nullptr) continue;
+      {
+        absl::MutexLock lock(&mu_);
+        streams_[i].context->TryCancel();
+      }
+      streams_[i].stream->Finish();
+      streams_[i].stream = nullptr;
+    }
+    weights_.Exclude(index);
+
+    // Refresh the weights before the next request so the server can be
+    // included again as soon as it is reachable.
+    last_refresh_ = absl::InfinitePast();
+    if (status.ok()) {
+      return absl::UnavailableError(
+          "SampleStream was closed before all samples had been received.");
+    }
+    return status;
+  }
+
+  // Stubs of the servers which hold a shard of the table each.
+  const std::vector<
+      std::shared_ptr</* grpc_gen:: */ReverbService::StubInterface>>
+      stubs_;
+
+  // Name of the `Table` to sample from.
+  const std::string table_name_;
+
+  // The maximum number of samples to request in a "batch" unless a
+  // `prefetch_controller_` has been set.
+  const int64_t samples_per_request_;
+
+  // Upper limit of the number of items that may be sampled in a single call
+  // to `Table::SampleFlexibleBatch` (lock not released between samples).
+  const int flexible_batch_size_;
+
+  // Weights of the servers and the time they were last refreshed. Only
+  // accessed by the thread calling `FetchSamples`.
+  internal::ServerWeights weights_;
+  absl::Time last_refresh_ = absl::InfinitePast();
+  absl::BitGen bit_gen_;
+
+  // Stream to each server, or nullptr if not open. The streams are only used
+  // by the thread calling `FetchSamples` but the contexts are also cancelled
+  // by `Cancel`.
+  std::vector<ServerStream> streams_;
+
+  // True if `Cancel` has been called.
+  bool closed_ ABSL_GUARDED_BY(mu_) = false;
+
+  absl::Mutex mu_;
+};
+
 class LocalSamplerWorker : public SamplerWorker {
  public:
   // Constructs a new worker without creating a stream to a server.
@@ -385,7 +688,7 @@ class LocalSamplerWorker : public SamplerWorker {
   }
 
   std::pair<int64_t, absl::Status> FetchSamples(
-      internal::Queue<std::unique_ptr<Sample>>* queue, int64_t num_samples,
+      const PushFn& push, int64_t num_samples,
       absl::Duration rate_limiter_timeout) override {
     static const auto kWakeupTimeout = absl::Seconds(3);
     auto final_deadline = absl::Now() + rate_limiter_timeout;
@@ -398,6 +701,9 @@ class LocalSamplerWorker : public SamplerWorker {
           return {0, absl::CancelledError("`Close` called on Sampler.")};
         }
       }
+      if (!is_active()) {
+        return {num_samples_returned, absl::OkStatus()};
+      }
 
       // If the rate limiter deadline is long into the future then we set the
       // deadline `kWakeupTimeout` from now instead. Periodically waking up
@@ -406,10 +712,14 @@ class LocalSamplerWorker : public SamplerWorker {
       auto timeout =
           std::min(final_deadline, absl::Now() + kWakeupTimeout) - absl::Now();
 
-      // Select the biggest batch size constrained by`flexible_batch_size_` and
-      // the number of samples remaining.
+      // Select the biggest batch size constrained by`flexible_batch_size_`,
+      // the prefetch controller and the number of samples remaining.
       auto batch_size = std::min<int>(flexible_batch_size_,
                                       num_samples - num_samples_returned);
+      if (prefetch_controller_ != nullptr) {
+        batch_size = std::min<int64_t>(
+            batch_size, prefetch_controller_->samples_per_request());
+      }
 
       std::vector<Table::SampledItem> items;
       auto status = table_->SampleFlexibleBatch(&items, batch_size, timeout);
@@ -425,17 +735,23 @@ class LocalSamplerWorker : public SamplerWorker {
         return {num_samples_returned, status};
       }
 
-      // Push sampled items to queue.
+      // Push sampled items to Sampler. The whole batch is handed over at once so
+      // that consumers are woken once per batch rather than once per item.
+      std::vector<std::unique_ptr<Sample>> samples;
+      samples.reserve(items.size());
       for (const auto& item : items) {
         std::unique_ptr<Sample> sample;
-        if (status = AsSample(item, &sample); !status.ok()) {
-          return {num_samples_returned, status};
-        }
-        if (!queue->Push(std::move(sample))) {
-          return {num_samples_returned,
-                  absl::CancelledError("`Close` called on Sampler")};
-        }
-        ++num_samples_returned;
+        if (status = AsSample(item, &sample); !status.ok()) break;
+        samples.push_back(std::move(sample));
+      }
+      const int64_t num_converted = samples.size();
+      if (!push(std::move(samples))) {
+        return {num_samples_returned,
+                absl::CancelledError("`Close` called on Sampler")};
+      }
+      num_samples_returned += num_converted;
+      if (!status.ok()) {
+        return {num_samples_returned, status};
       }
     }
 
@@ -463,6 +779,11 @@ int64_t GetNumWorkers(const Sampler::Options& options) {
                           ? Sampler::kDefaultNumWorkers
                           : options.num_workers;
 
+  // The number of samples per batch is not known up front when it is adapted.
+  if (options.max_in_flight_samples_per_worker == Sampler::kAutoSelectValue) {
+    return std::min(num_workers, max_samples);
+  }
+
   // If a subset of the workers are able to fetch all of `max_samples` in the
   // first batch then there is no point in creating all of them.
   return std::min<int64_t>(
@@ -487,6 +808,23 @@ std::vector<std::unique_ptr<SamplerWorker>> MakeGrpcWorkers(
   return workers;
 }
 
+std::vector<std::unique_ptr<SamplerWorker>> MakeMultiServerWorkers(
+    std::vector<std::shared_ptr</* grpc_gen:: */ReverbService::StubInterface>>
+        stubs,
+    const std::string& table_name, const Sampler::Options& options) {
+  REVERB_CHECK(!stubs.empty());
+  int64_t num_workers = GetNumWorkers(options);
+  REVERB_CHECK_GE(num_workers, 1);
+  std::vector<std::unique_ptr<SamplerWorker>> workers;
+  workers.reserve(num_workers);
+  for (int i = 0; i < num_workers; i++) {
+    workers.push_back(absl::make_unique<MultiServerSamplerWorker>(
+        stubs, table_name, options.max_in_flight_samples_per_worker,
+        options.flexible_batch_size));
+  }
+  return workers;
+}
+
 std::vector<std::unique_ptr<SamplerWorker>> MakeLocalWorkers(
     std::shared_ptr<Table> table, const Sampler::Options& options) {
   int64_t num_workers = GetNumWorkers(options);
@@ -503,8 +841,11 @@ std::vector<std::unique_ptr<SamplerWorker>> MakeLocalWorkers(
   // have the desired effect as workers fetch new samples once the previous
   // batch has been depleted effectively limiting the number of in flight items
   // to `flexible_batch_size` (and thus `max_in_flight_samples_per_worker`).
-  flexible_batch_size =
-      std::min(flexible_batch_size, options.max_in_flight_samples_per_worker);
+  // When the number is adapted then the workers apply the limit themselves.
+  if (options.max_in_flight_samples_per_worker != Sampler::kAutoSelectValue) {
+    flexible_batch_size =
+        std::min(flexible_batch_size, options.max_in_flight_samples_per_worker);
+  }
 
   std::vector<std::unique_ptr<SamplerWorker>> workers;
   workers.reserve(num_workers);
@@ -523,6 +864,14 @@ Sampler::Sampler(std::shared_ptr</* grpc_gen:: */ReverbService::StubInterface> s
     : Sampler(MakeGrpcWorkers(std::move(stub), table_name, options), table_name,
               options, std::move(dtypes_and_shapes)) {}
 
+Sampler::Sampler(
+    std::vector<std::shared_ptr</* grpc_gen:: */ReverbService::StubInterface>>
+        stubs,
+    const std::string& table_name, const Options& options,
+    internal::DtypesAndShapes dtypes_and_shapes)
+    : Sampler(MakeMultiServerWorkers(std::move(stubs), table_name, options),
+              table_name, options, std::move(dtypes_and_shapes)) {}
+
 Sampler::Sampler(std::vector<std::unique_ptr<SamplerWorker>> workers,
                  const std::string& table, const Options& options,
                  internal::DtypesAndShapes dtypes_and_shapes)
@@ -534,21 +883,45 @@ Sampler::Sampler(std::vector<std::unique_ptr<SamplerWorker>> workers,
                                   ? kDefaultMaxSamplesPerStream
                                   : options.max_samples_per_stream),
       rate_limiter_timeout_(options.rate_limiter_timeout),
+      max_in_flight_samples_per_worker_(
+          options.max_in_flight_samples_per_worker),
       workers_(std::move(workers)),
+      num_active_workers_(workers_.size()),
       active_sample_(nullptr),
       samples_(std::max<int>(options.num_workers, 1)),
+      reorder_buffer_size_(options.reorder_buffer_size),
+      worker_watermarks_(workers_.size(),
+                         std::numeric_limits<int64_t>::max()),
+      reorder_timeout_(options.reorder_timeout),
       dtypes_and_shapes_(std::move(dtypes_and_shapes)) {
   REVERB_CHECK_GT(max_samples_, 0);
-  REVERB_CHECK_GT(options.max_in_flight_samples_per_worker, 0);
+  REVERB_CHECK(options.max_in_flight_samples_per_worker == kAutoSelectValue ||
+               options.max_in_flight_samples_per_worker > 0);
   REVERB_CHECK(options.num_workers == kAutoSelectValue ||
                options.num_workers > 0);
   REVERB_CHECK(options.flexible_batch_size == kAutoSelectValue ||
                options.flexible_batch_size > 0);
+  REVERB_CHECK_GE(reorder_buffer_size_, 0);
+
+  if (max_in_flight_samples_per_worker_ == kAutoSelectValue) {
+    internal::PrefetchController::Options prefetch_options;
+    prefetch_options.max_workers = workers_.size();
+    prefetch_options.max_in_flight_bytes =
+        options.max_in_flight_bytes == kAutoSelectValue
+            ? kDefaultMaxInFlightBytes
+            : options.max_in_flight_bytes;
+    prefetch_controller_ =
+        absl::make_unique<internal::PrefetchController>(prefetch_options);
+    num_active_workers_ = prefetch_controller_->num_active_workers();
+    for (int i = 0; i < workers_.size(); i++) {
+      workers_[i]->set_prefetch_controller(prefetch_controller_.get(), i);
+    }
+  }
+  caller_num_active_workers_ = num_active_workers_;
 
   for (int i = 0; i < workers_.size(); i++) {
     worker_threads_.push_back(internal::StartThread(
-        absl::StrCat("SamplerWorker_", i),
-        [this, worker = workers_[i].get()] { RunWorker(worker); }));
+        absl::StrCat("SamplerWorker_", i), [this, i] { RunWorker(i); }));
   }
 }
 
@@ -608,6 +981,82 @@ absl::Status Sampler::GetNextTrajectory(std::vector<tensorflow::Tensor>* data) {
   return absl::OkStatus();
 }
 
+absl::Status Sampler::GetNextTrajectoryBatch(
+    int batch_size, std::vector<tensorflow::Tensor>* data) {
+  return GetNextBatch(batch_size, ValidationMode::kTrajectoryBatch, data);
+}
+
+absl::Status Sampler::GetNextSampleBatch(
+    int batch_size, std::vector<tensorflow::Tensor>* data) {
+  return GetNextBatch(batch_size, ValidationMode::kBatchedTimestepBatch, data);
+}
+
+absl::Status Sampler::GetNextBatch(int batch_size, ValidationMode mode,
+                                   std::vector<tensorflow::Tensor>* data) {
+  if (batch_size < 1) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("batch_size (", batch_size, ") must be >= 1."));
+  }
+
+  std::vector<std::unique_ptr<Sample>> samples(batch_size);
+  for (auto& sample : samples) {
+    REVERB_RETURN_IF_ERROR(PopNextSample(&sample));
+
+    // The samples are counted as they are popped. Otherwise a `max_samples`
+    // which isn't a multiple of `batch_size` would block forever.
+    absl::WriterMutexLock lock(&mu_);
+    if (++returned_ == max_samples_) samples_.Close();
+  }
+
+  const bool squeeze = mode == ValidationMode::kTrajectoryBatch;
+  if (!squeeze) {
+    for (const auto& sample : samples) {
+      if (!sample->is_composed_of_timesteps()) {
+        return absl::FailedPreconditionError(
+            "Sampler::GetNextSampleBatch when trajectory cannot be decomposed "
+            "into timesteps.");
+      }
+    }
+  }
+
+  const auto dtypes = samples.front()->ColumnDtypes();
+  const auto shapes = samples.front()->ColumnShapes(squeeze);
+
+  // Allocate the output tensors once and let each sample fill its own row.
+  tensorflow::TensorShape info_shape({batch_size});
+  if (!squeeze) {
+    info_shape.AddDim(shapes.front().dim_size(0));
+  }
+  std::vector<tensorflow::Tensor> batch;
+  batch.reserve(shapes.size() + 4);
+  batch.emplace_back(tensorflow::DT_UINT64, info_shape);
+  batch.emplace_back(tensorflow::DT_DOUBLE, info_shape);
+  batch.emplace_back(tensorflow::DT_INT64, info_shape);
+  batch.emplace_back(tensorflow::DT_DOUBLE, info_shape);
+  for (int i = 0; i < shapes.size(); i++) {
+    auto shape = shapes[i];
+    shape.InsertDim(0, batch_size);
+    batch.emplace_back(dtypes[i], shape);
+  }
+
+  for (int row = 0; row < batch_size; row++) {
+    if (row > 0 && (samples[row]->ColumnDtypes() != dtypes ||
+                    samples[row]->ColumnShapes(squeeze) != shapes)) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          "Unable to batch samples from table '", table_,
+          "' as they do not share the same dtypes and shapes. Sample ", row,
+          " has shapes ", ShapesString(samples[row]->ColumnShapes(squeeze)),
+          " but the first sample has shapes ", ShapesString(shapes), "."));
+    }
+    REVERB_RETURN_IF_ERROR(samples[row]->CopyToBatch(row, &batch));
+  }
+
+  REVERB_RETURN_IF_ERROR(ValidateAgainstOutputSpec(batch, mode));
+
+  std::swap(batch, *data);
+  return absl::OkStatus();
+}
+
 absl::Status Sampler::ValidateAgainstOutputSpec(
     const std::vector<tensorflow::Tensor>& data, Sampler::ValidationMode mode) {
   if (!dtypes_and_shapes_) {
@@ -625,28 +1074,35 @@ absl::Status Sampler::ValidateAgainstOutputSpec(
         internal::DtypesShapesString(internal::SpecsFromTensors(data))));
   }
 
+  // Number of outer (batch and/or sequence) dimensions which are not part of
+  // the spec.
+  int outer_dims = 0;
+  switch (mode) {
+    case ValidationMode::kTimestep:
+    case ValidationMode::kTrajectory:
+      break;
+    case ValidationMode::kBatchedTimestep:
+    case ValidationMode::kTrajectoryBatch:
+      outer_dims = 1;
+      break;
+    case ValidationMode::kBatchedTimestepBatch:
+      outer_dims = 2;
+      break;
+  }
+
   for (int i = 4; i < data.size(); ++i) {
-    tensorflow::TensorShape elem_shape;
-    if (mode == ValidationMode::kBatchedTimestep) {
-      // Remove the outer dimension from data[i].shape() so we can properly
-      // compare against the spec (which doesn't have the sequence dimension).
-      elem_shape = data[i].shape();
-      if (elem_shape.dims() == 0) {
-        return absl::InvalidArgumentError(
-            absl::StrCat("Invalid tensor shape received from table '", table_,
-                         "'.  "
-                         "time_step is false but data[",
-                         i,
-                         "] has scalar shape "
-                         "(no time dimension)."));
-      }
-      elem_shape.RemoveDim(0);
+    // Remove the outer dimensions from data[i].shape() so we can properly
+    // compare against the spec (which doesn't have these dimensions).
+    tensorflow::TensorShape elem_shape = data[i].shape();
+    if (elem_shape.dims() < outer_dims) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          "Invalid tensor shape received from table '", table_, "'.  data[", i,
+          "] has shape ", elem_shape.DebugString(), " but at least ",
+          outer_dims, " outer (batch or time) dimensions were expected."));
     }
+    elem_shape.RemoveDimRange(0, outer_dims);
 
-    auto* shape_ptr =
-        mode == ValidationMode::kTimestep || mode == ValidationMode::kTrajectory
-            ? &(data[i].shape())
-            : &elem_shape;
+    auto* shape_ptr = &elem_shape;
     if (data[i].dtype() != dtypes_and_shapes_->at(i).dtype ||
         !dtypes_and_shapes_->at(i).shape.IsCompatibleWith(*shape_ptr)) {
       return absl::InvalidArgumentError(absl::StrCat(
@@ -682,6 +1138,52 @@ void Sampler::Close() {
   worker_threads_.clear();  // Joins worker threads.
 }
 
+std::string Sampler::MetricsText() const {
+  const internal::PrometheusTextBuilder::Labels labels = {{"table", table_}};
+  internal::PrometheusTextBuilder builder;
+
+  internal::PrefetchController::Stats stats;
+  if (prefetch_controller_ != nullptr) {
+    stats = prefetch_controller_->stats();
+  } else {
+    stats.samples_per_request = max_in_flight_samples_per_worker_;
+    stats.num_active_workers = workers_.size();
+  }
+
+  builder.AddFamily("reverb_sampler_samples_per_request", "gauge",
+                    "Number of samples requested at a time by each worker.");
+  builder.AddSample("reverb_sampler_samples_per_request", labels,
+                    stats.samples_per_request);
+  builder.AddFamily("reverb_sampler_active_workers", "gauge",
+                    "Number of workers which are fetching samples.");
+  builder.AddSample("reverb_sampler_active_workers", labels,
+                    static_cast<int64_t>(stats.num_active_workers));
+
+  // The remaining metrics are only measured when prefetching is adapted.
+  if (prefetch_controller_ == nullptr) {
+    return builder.text();
+  }
+
+  builder.AddFamily("reverb_sampler_pull_rate", "gauge",
+                    "Samples per second pulled from the sampler.");
+  builder.AddSample("reverb_sampler_pull_rate", labels, stats.pull_rate);
+  builder.AddFamily("reverb_sampler_sample_bytes", "gauge",
+                    "Moving average of the size of the fetched samples.");
+  builder.AddSample("reverb_sampler_sample_bytes", labels,
+                    stats.bytes_per_sample);
+  builder.AddFamily("reverb_sampler_round_trip_seconds", "gauge",
+                    "Moving average of the time between sending a request and "
+                    "receiving its first sample.");
+  builder.AddSample("reverb_sampler_round_trip_seconds", labels,
+                    absl::ToDoubleSeconds(stats.round_trip));
+  builder.AddFamily("reverb_sampler_prefetch_adjustments_total", "counter",
+                    "Number of changes to the number of samples per request "
+                    "or active workers.");
+  builder.AddSample("reverb_sampler_prefetch_adjustments_total", labels,
+                    stats.num_adjustments);
+  return builder.text();
+}
+
 absl::Status Sampler::MaybeSampleNext() {
   if (active_sample_ != nullptr && !active_sample_->is_end_of_sample()) {
     return absl::OkStatus();
@@ -690,8 +1192,118 @@ absl::Status Sampler::MaybeSampleNext() {
   return PopNextSample(&active_sample_);
 }
 
+bool Sampler::PushSamples(int worker_index,
+                          std::vector<std::unique_ptr<Sample>> samples) {
+  if (prefetch_controller_ != nullptr) {
+    for (const auto& sample : samples) {
+      prefetch_controller_->RecordSample(sample->num_bytes());
+    }
+  }
+  if (reorder_buffer_size_ == 0) {
+    return samples_.PushMany(std::move(samples));
+  }
+  if (samples.empty()) {
+    return true;
+  }
+  const int64_t watermark = samples.back()->sequence_number();
+  return ReorderSamples(worker_index, std::move(samples), watermark);
+}
+
+bool Sampler::ReorderSamples(int worker_index,
+                             std::vector<std::unique_ptr<Sample>> samples,
+                             int64_t watermark) {
+  absl::MutexLock release_lock(&release_mu_);
+
+  std::vector<std::unique_ptr<Sample>> released;
+  {
+    absl::WriterMutexLock lock(&mu_);
+    for (auto& sample : samples) {
+      const int64_t sequence_number = sample->sequence_number();
+      reorder_buffer_.emplace(sequence_number, std::move(sample));
+    }
+    worker_watermarks_[worker_index] = watermark;
+
+    // Every sample which will be pushed by a worker in the future succeeds the
+    // lowest watermark.
+    const int64_t min_watermark = *std::min_element(worker_watermarks_.begin(),
+                                                    worker_watermarks_.end());
+
+    // Samples are released while they are next in line, they cannot be
+    // preceded by any sample still to be pushed or the buffer is full.
+    while (!reorder_buffer_.empty()) {
+      auto it = reorder_buffer_.begin();
+      const bool is_full =
+          reorder_buffer_.size() >= static_cast<size_t>(reorder_buffer_size_);
+      if (it->first > next_sequence_number_ && it->first > min_watermark &&
+          !is_full) {
+        break;
+      }
+      next_sequence_number_ = std::max(next_sequence_number_, it->first + 1);
+      released.push_back(std::move(it->second));
+      reorder_buffer_.erase(it);
+    }
+  }
+
+  // `release_mu_` is still held so concurrent releases cannot interleave.
+  return released.empty() || samples_.PushMany(std::move(released));
+}
+
+bool Sampler::PopSample(std::unique_ptr<Sample>* sample) {
+  if (reorder_buffer_size_ == 0) {
+    return samples_.Pop(sample);
+  }
+
+  std::vector<std::unique_ptr<Sample>> popped;
+  while (true) {
+    if (!flushed_samples_.empty()) {
+      *sample = std::move(flushed_samples_.front());
+      flushed_samples_.pop_front();
+      return true;
+    }
+    absl::Status status = samples_.PopBatch(1, reorder_timeout_, &popped);
+    if (status.ok()) {
+      *sample = std::move(popped.front());
+      return true;
+    }
+    if (!absl::IsDeadlineExceeded(status)) {
+      return false;
+    }
+    FlushReorderBuffer();
+  }
+}
+
+void Sampler::FlushReorderBuffer() {
+  absl::MutexLock release_lock(&release_mu_);
+
+  // Samples are only pushed while `release_mu_` is held so the samples in
+  // `samples_` precede the ones in `reorder_buffer_`. These are popped first.
+  if (samples_.size() > 0) return;
+
+  absl::WriterMutexLock lock(&mu_);
+  for (auto& sequence_number_and_sample : reorder_buffer_) {
+    next_sequence_number_ = std::max(next_sequence_number_,
+                                     sequence_number_and_sample.first + 1);
+    flushed_samples_.push_back(std::move(sequence_number_and_sample.second));
+  }
+  reorder_buffer_.clear();
+}
+
 absl::Status Sampler::PopNextSample(std::unique_ptr<Sample>* sample) {
-  if (samples_.Pop(sample)) return absl::OkStatus();
+  if (prefetch_controller_ == nullptr) {
+    if (PopSample(sample)) return absl::OkStatus();
+  } else {
+    const bool starved = samples_.size() == 0 && flushed_samples_.empty();
+    if (PopSample(sample)) {
+      prefetch_controller_->RecordPull(absl::Now(), starved);
+      const int num_active_workers = prefetch_controller_->num_active_workers();
+      if (num_active_workers != caller_num_active_workers_) {
+        caller_num_active_workers_ = num_active_workers;
+        absl::WriterMutexLock lock(&mu_);
+        num_active_workers_ = num_active_workers;
+      }
+      return absl::OkStatus();
+    }
+  }
 
   absl::ReaderMutexLock lock(&mu_);
   if (returned_ == max_samples_) {
@@ -703,10 +1315,16 @@ absl::Status Sampler::PopNextSample(std::unique_ptr<Sample>* sample) {
   return worker_status_;
 }
 
-void Sampler::RunWorker(SamplerWorker* worker) {
-  auto trigger = [this]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
-    return should_stop_workers() || requested_ < max_samples_;
+void Sampler::RunWorker(int worker_index) {
+  SamplerWorker* worker = workers_[worker_index].get();
+  auto trigger = [this, worker_index]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    return should_stop_workers() || (requested_ < max_samples_ &&
+                                     worker_index < num_active_workers_);
   };
+  SamplerWorker::PushFn push =
+      [this, worker_index](std::vector<std::unique_ptr<Sample>> samples) {
+        return PushSamples(worker_index, std::move(samples));
+      };
 
   while (true) {
     mu_.LockWhen(absl::Condition(&trigger));
@@ -718,10 +1336,20 @@ void Sampler::RunWorker(SamplerWorker* worker) {
     int64_t samples_to_stream =
         std::min<int64_t>(max_samples_per_stream_, max_samples_ - requested_);
     requested_ += samples_to_stream;
+
+    // The samples of the new stream are drawn from the table after the request
+    // has been sent so they succeed every sample which has been released.
+    worker_watermarks_[worker_index] = next_sequence_number_ - 1;
     mu_.Unlock();
 
-    auto result = worker->FetchSamples(&samples_, samples_to_stream,
-                                       rate_limiter_timeout_);
+    auto result =
+        worker->FetchSamples(push, samples_to_stream, rate_limiter_timeout_);
+
+    // The worker can no longer hold back samples fetched by the others.
+    if (reorder_buffer_size_ > 0) {
+      ReorderSamples(worker_index, {}, std::numeric_limits<int64_t>::max());
+    }
+
     {
       absl::WriterMutexLock lock(&mu_);
 
@@ -744,11 +1372,12 @@ void Sampler::RunWorker(SamplerWorker* worker) {
 Sample::Sample(tensorflow::uint64 key, double probability,
                tensorflow::int64 table_size, double priority,
                std::deque<std::vector<tensorflow::Tensor>> chunks,
-               std::vector<bool> squeeze_columns)
+               std::vector<bool> squeeze_columns, int64_t sequence_number)
     : key_(key),
       probability_(probability),
       table_size_(table_size),
       priority_(priority),
+      sequence_number_(sequence_number),
       num_timesteps_(0),
       num_data_tensors_(0),
       chunks_(std::move(chunks)),
@@ -800,6 +1429,16 @@ std::vector<tensorflow::Tensor> Sample::GetNextTimestep() {
 
 bool Sample::is_end_of_sample() const { return chunks_.empty(); }
 
+int64_t Sample::num_bytes() const {
+  int64_t num_bytes = 0;
+  for (const auto& chunk : chunks_) {
+    for (const auto& tensor : chunk) {
+      num_bytes += tensor.TotalBytes();
+    }
+  }
+  return num_bytes;
+}
+
 bool Sample::is_composed_of_timesteps() const {
   std::vector<int> column_lengths;
   for (int i = 0; i < chunks_.front().size(); i++) {
@@ -926,16 +1565,88 @@ absl::Status Sample::AsTrajectory(std::vector<tensorflow::Tensor>* data) {
   return absl::OkStatus();
 }
 
+std::vector<tensorflow::DataType> Sample::ColumnDtypes() const {
+  std::vector<tensorflow::DataType> dtypes;
+  dtypes.reserve(num_data_tensors_);
+  for (const auto& tensor : chunks_.front()) {
+    dtypes.push_back(tensor.dtype());
+  }
+  return dtypes;
+}
+
+std::vector<tensorflow::TensorShape> Sample::ColumnShapes(bool squeeze) const {
+  std::vector<tensorflow::TensorShape> shapes;
+  shapes.reserve(num_data_tensors_);
+  for (int i = 0; i < num_data_tensors_; i++) {
+    tensorflow::TensorShape shape = chunks_.front()[i].shape();
+    int64_t length = 0;
+    for (const auto& chunk : chunks_) {
+      length += chunk[i].dim_size(0);
+    }
+    shape.set_dim(0, length);
+    if (squeeze && i < squeeze_columns_.size() && squeeze_columns_[i]) {
+      shape.RemoveDim(0);
+    }
+    shapes.push_back(std::move(shape));
+  }
+  return shapes;
+}
+
+absl::Status Sample::CopyToBatch(int64_t row,
+                                 std::vector<tensorflow::Tensor>* batch) {
+  if (next_timestep_called_) {
+    return absl::DataLossError(
+        "Sample::CopyToBatch: Some time steps have been lost.");
+  }
+  if (batch->size() != num_data_tensors_ + 4) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Sample::CopyToBatch: Batch has ", batch->size(),
+                     " tensors but sample has ", num_data_tensors_ + 4, "."));
+  }
+
+  FillRow<tensorflow::uint64>(key_, row, &(*batch)[0]);
+  FillRow<double>(probability_, row, &(*batch)[1]);
+  FillRow<tensorflow::int64>(table_size_, row, &(*batch)[2]);
+  FillRow<double>(priority_, row, &(*batch)[3]);
+
+  for (int i = 0; i < num_data_tensors_; i++) {
+    auto* column = &(*batch)[i + 4];
+    const int64_t row_size = column->NumElements() / column->dim_size(0);
+    const int64_t row_end = (row + 1) * row_size;
+    int64_t offset = row * row_size;
+    for (const auto& chunk : chunks_) {
+      const auto& part = chunk[i];
+      if (part.dtype() != column->dtype() ||
+          offset + part.NumElements() > row_end) {
+        return absl::InvalidArgumentError(absl::StrCat(
+            "Sample::CopyToBatch: Column ", i, " does not fit in row of ",
+            column->DebugString(), "."));
+      }
+      REVERB_RETURN_IF_ERROR(CopyElements(part, offset, column));
+      offset += part.NumElements();
+    }
+    if (offset != row_end) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          "Sample::CopyToBatch: Column ", i, " does not fill row of ",
+          column->DebugString(), "."));
+    }
+  }
+  chunks_.clear();
+
+  return absl::OkStatus();
+}
+
 absl::Status Sampler::Options::Validate() const {
   if (max_samples < 1 && max_samples != kUnlimitedMaxSamples) {
     return absl::InvalidArgumentError(
         absl::StrCat("max_samples (", max_samples, ") must be ",
                      kUnlimitedMaxSamples, " or >= 1"));
   }
-  if (max_in_flight_samples_per_worker < 1) {
-    return absl::InvalidArgumentError(
-        absl::StrCat("max_in_flight_samples_per_worker (",
-                     max_in_flight_samples_per_worker, ") has to be >= 1"));
+  if (max_in_flight_samples_per_worker < 1 &&
+      max_in_flight_samples_per_worker != kAutoSelectValue) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "max_in_flight_samples_per_worker (", max_in_flight_samples_per_worker,
+        ") has to be ", kAutoSelectValue, " or >= 1"));
   }
   if (num_workers < 1 && num_workers != kAutoSelectValue) {
     return absl::InvalidArgumentError(
@@ -958,6 +1669,20 @@ absl::Status Sampler::Options::Validate() const {
         absl::StrCat("flexible_batch_size (", flexible_batch_size, ") must be ",
                      kAutoSelectValue, " or >= 1"));
   }
+  if (max_in_flight_bytes < 1 && max_in_flight_bytes != kAutoSelectValue) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("max_in_flight_bytes (", max_in_flight_bytes, ") must be ",
+                     kAutoSelectValue, " or >= 1"));
+  }
+  if (reorder_buffer_size < 0) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "reorder_buffer_size (", reorder_buffer_size, ") must be >= 0"));
+  }
+  if (reorder_timeout <= absl::ZeroDuration()) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("reorder_timeout (", absl::FormatDuration(reorder_timeout),
+                     ") must be positive."));
+  }
   return absl::OkStatus();
 }
 
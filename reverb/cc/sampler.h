@@ -18,6 +18,8 @@
 #include <stddef.h>
 
 #include <deque>
+#include <functional>
+#include <map>
 #include <memory>
 #include <string>
 #include <vector>
@@ -28,6 +30,7 @@
 #include "absl/time/time.h"
 #include "reverb/cc/platform/thread.h"
 #include "reverb/cc/reverb_service.grpc.pb.h"
+#include "reverb/cc/support/prefetch_controller.h"
 #include "reverb/cc/support/queue.h"
 #include "reverb/cc/support/signature.h"
 #include "reverb/cc/table.h"
@@ -56,7 +59,7 @@ class Sample {
   Sample(tensorflow::uint64 key, double probability,
          tensorflow::int64 table_size, double priority,
          std::deque<std::vector<tensorflow::Tensor>> chunks,
-         std::vector<bool> squeeze_columns);
+         std::vector<bool> squeeze_columns, int64_t sequence_number = -1);
 
   // Returns the next time step from this sample as a flat sequence of tensors.
   // CHECK-fails if the entire sample has already been returned.
@@ -88,12 +91,38 @@ class Sample {
   //   last K tensors holds the actual trajectory data.
   absl::Status AsTrajectory(std::vector<tensorflow::Tensor>* data);
 
+  // Returns the dtypes of the K data tensors.
+  std::vector<tensorflow::DataType> ColumnDtypes() const;
+
+  // Returns the shapes of the K data tensors as returned by `AsTrajectory` (if
+  // `squeeze` is true) or `AsBatchedTimesteps` (if `squeeze` is false).
+  std::vector<tensorflow::TensorShape> ColumnShapes(bool squeeze) const;
+
+  // Writes the entire sample into row `row` of `batch`. `batch` must hold K+4
+  // tensors allocated by the caller with a leading batch dimension. Every
+  // element in the row of the first four tensors is set to the key, sample
+  // probability, table size and priority respectively. The chunks of the K data
+  // columns are copied straight into the row so the sample is never
+  // concatenated on its own.
+  //
+  // Fails with `DataLossError` if `GetNextTimestep()` has already been called
+  // on this sample.
+  // Fails with `InvalidArgumentError` if the data does not exactly fill the row.
+  absl::Status CopyToBatch(int64_t row, std::vector<tensorflow::Tensor>* batch);
+
   // Returns true if the end of the sample has been reached.
   ABSL_MUST_USE_RESULT bool is_end_of_sample() const;
 
   // Returns true if the sample can be decomposed into timesteps.
   ABSL_MUST_USE_RESULT bool is_composed_of_timesteps() const;
 
+  // The number of samples drawn from the table before this one or -1 if
+  // unknown.
+  int64_t sequence_number() const { return sequence_number_; }
+
+  // Total size of the data tensors.
+  int64_t num_bytes() const;
+
  private:
   // The key of the replay item this time step was sampled from.
   tensorflow::uint64 key_;
@@ -104,6 +133,8 @@ class Sample {
   tensorflow::int64 table_size_;
   // Priority of the replay item this time step was sampled from.
   double priority_;
+  // Position of the sample among all samples drawn from the table.
+  int64_t sequence_number_;
 
   // Total number of time steps in this sample.
   int64_t num_timesteps_;
@@ -128,16 +159,43 @@ class Sample {
 // SamplerWorker implements strategy for fetching samples from table.
 class SamplerWorker {
  public:
+  // Hands over samples, in the order they were sampled, to the `Sampler`.
+  // Returns false if the `Sampler` has been closed.
+  using PushFn = std::function<bool(std::vector<std::unique_ptr<Sample>>)>;
+
   virtual ~SamplerWorker() = default;
 
   // When called, future calls to FetchSampes must return CancelledError.
   virtual void Cancel() = 0;
 
-  // Attempt to sample up to `num_samples` and push results to `queue`. Returns
-  // when `num_samples` pushed to `queue` or error encountered.
+  // Makes the worker request the number of samples decided by `controller`
+  // rather than a fixed number and report the round trip times of its requests
+  // to it. `worker_index` is the index of the worker among the workers sharing
+  // `controller`. Must be called before the first call to `FetchSamples`.
+  void set_prefetch_controller(internal::PrefetchController* controller,
+                               int worker_index) {
+    prefetch_controller_ = controller;
+    worker_index_ = worker_index;
+  }
+
+  // Attempt to sample up to `num_samples` and pass results to `push`. Returns
+  // when `num_samples` pushed or error encountered.
   virtual std::pair<int64_t, absl::Status> FetchSamples(
-      internal::Queue<std::unique_ptr<Sample>>* queue, int64_t num_samples,
+      const PushFn& push, int64_t num_samples,
       absl::Duration rate_limiter_timeout) = 0;
+
+ protected:
+  // Returns false if the prefetch controller has deactivated the worker. The
+  // worker should then return from `FetchSamples` instead of sending another
+  // request.
+  bool is_active() const {
+    return prefetch_controller_ == nullptr ||
+           worker_index_ < prefetch_controller_->num_active_workers();
+  }
+
+  // Controller of the number of samples to request, if any.
+  internal::PrefetchController* prefetch_controller_ = nullptr;
+  int worker_index_ = 0;
 };
 
 // The `Sampler` class should be used to retrieve samples from a
@@ -196,12 +254,16 @@ class Sampler {
   static const int kDefaultMaxSamplesPerStream = 10000;
 
   // By default, only one worker is used as any higher number could lead to
-  // incorrect behavior for FIFO samplers.
+  // incorrect behavior for FIFO samplers unless `reorder_buffer_size` is set.
   static const int kDefaultNumWorkers = 1;
 
   // By default samples are fetched one by one.
   static const int kDefaultFlexibleBatchSize = 1;
 
+  // By default, workers with an adaptive number of in flight samples keep at
+  // most 256MB of samples in flight.
+  static const int64_t kDefaultMaxInFlightBytes = int64_t{256} << 20;
+
   struct Options {
     // `max_samples` is the maximum number of samples the object will return.
     // Must be a positive number or `kUnlimitedMaxSamples`.
@@ -210,6 +272,11 @@ class Sampler {
     // `max_in_flight_samples_per_worker` is the number of samples requested by
     // a worker in each batch. A new batch is requested once all the requested
     // samples have been received.
+    //
+    // When set to `kAutoSelectValue`, the number is adapted to the rate at
+    // which samples are consumed, the size of the samples and the round trip
+    // time of the requests. The number of active workers is then also adapted
+    // between 1 and `num_workers`. See `internal::PrefetchController`.
     int max_in_flight_samples_per_worker = 100;
 
     // `num_workers` is the number of worker threads started.
@@ -219,7 +286,9 @@ class Sampler {
 
     // `max_samples_per_stream` is the maximum number of samples to fetch from a
     // stream before a new call is made. Keeping this number low ensures that
-    // the data is fetched uniformly from all servers behind the `stub`.
+    // the data is fetched uniformly from all servers behind the `stub`. When
+    // sampling from multiple stubs the streams are kept open and this is only
+    // the number of samples fetched before a worker yields to the others.
     //
     // When set to `kAutoSelectValue`, `kDefaultMaxSamplesPerStream` is used.
     int max_samples_per_stream = kAutoSelectValue;
@@ -247,6 +316,38 @@ class Sampler {
     // When set to `kAutoSelectValue`, `kDefaultFlexibleBatchSize` is used.
     int flexible_batch_size = kAutoSelectValue;
 
+    // `max_in_flight_bytes` is the maximum number of bytes of samples which
+    // the workers together keep in flight. Only used when
+    // `max_in_flight_samples_per_worker` is `kAutoSelectValue`.
+    //
+    // When set to `kAutoSelectValue`, `kDefaultMaxInFlightBytes` is used.
+    int64_t max_in_flight_bytes = kAutoSelectValue;
+
+    // `reorder_buffer_size`, when > 0, makes the `Sampler` return samples in
+    // the order in which they were sampled from the table even if they are
+    // fetched by multiple workers. This allows FIFO tables to be sampled with
+    // `num_workers > 1`.
+    //
+    // Every sample is tagged by the server with its position among all samples
+    // drawn from the table. A sample is held back in the reorder buffer until
+    // no worker can still deliver a sample which precedes it. If samples are
+    // also drawn by other clients then the positions they consumed are skipped
+    // once all workers have moved past them. When the buffer holds
+    // `reorder_buffer_size` samples, the oldest is released regardless so a
+    // stalled worker cannot block the others indefinitely.
+    //
+    // Ordering is only meaningful when all workers sample from the same
+    // server.
+    int reorder_buffer_size = 0;
+
+    // `reorder_timeout` bounds the time the caller waits for a sample while
+    // samples are held back in the reorder buffer. A worker which is blocked
+    // by the rate limiter cannot tell whether it is still about to deliver an
+    // earlier sample, so once the caller has waited this long the held back
+    // samples are returned in order and the missing positions are skipped.
+    // Only used when `reorder_buffer_size` > 0.
+    absl::Duration reorder_timeout = absl::Seconds(1);
+
     // Checks that field values are valid and returns `InvalidArgument` if any
     // field value invalid.
     absl::Status Validate() const;
@@ -262,6 +363,28 @@ class Sampler {
           const std::string& table_name, const Options& options,
           internal::DtypesAndShapes dtypes_and_shapes = absl::nullopt);
 
+  // Constructs a new `Sampler` which samples from a table sharded over several
+  // servers.
+  //
+  // `stubs` holds a connected gRPC stub to each of the servers.
+  // `table_name` is the name of the `Table` to sample from on every server.
+  // `options` defines details of how to samples.
+  // `dtypes_and_shapes` describes the output signature (if any) to expect.
+  //
+  // Each worker keeps one `SampleStream` open to every server instead of
+  // relying on the load balancing of a single stub, so
+  // `max_samples_per_stream` no longer causes new streams to be opened. The
+  // samples of each request are instead split over the servers in proportion
+  // to the size of the table on each server, as reported by `ServerInfo` and
+  // refreshed every second, which keeps the sampling unbiased when the shards
+  // differ in size. A server whose stream fails is skipped until it reports
+  // its size again.
+  Sampler(std::vector<
+              std::shared_ptr</* grpc_gen:: */ReverbService::StubInterface>>
+              stubs,
+          const std::string& table_name, const Options& options,
+          internal::DtypesAndShapes dtypes_and_shapes = absl::nullopt);
+
   // Constructs a new `Sampler` which samples directly from local `table`.
   //
   // `table` is the table to sample from.
@@ -301,11 +424,36 @@ class Sampler {
   //   has been deleted.
   absl::Status GetNextTrajectory(std::vector<tensorflow::Tensor>* data);
 
+  // Blocks until `batch_size` complete samples have been retrieved or until a
+  // non transient error is encountered or `Close` has been called.
+  //
+  // The result is the same as calling `GetNextTrajectory` `batch_size` times
+  // and stacking the results, except that each output tensor is allocated once
+  // and the samples are copied directly into their rows. All samples in the
+  // batch must therefore have the same shapes. The first 4 tensors are vectors
+  // of length `batch_size`.
+  //
+  // If fewer than `batch_size` samples remain before `max_samples` is reached
+  // then the remaining samples are dropped and `OutOfRangeError` is returned.
+  absl::Status GetNextTrajectoryBatch(int batch_size,
+                                      std::vector<tensorflow::Tensor>* data);
+
+  // Same as `GetNextTrajectoryBatch` but each sample is unpacked as "batched
+  // timesteps" (see `GetNextSample`). All tensors thus have shape
+  // [batch_size, sequence_length, ...].
+  absl::Status GetNextSampleBatch(int batch_size,
+                                  std::vector<tensorflow::Tensor>* data);
+
   // Cancels all workers and joins their threads. Any blocking or future call
   // to `GetNextTimestep` or `GetNextSample` will return CancelledError without
   // blocking.
   void Close();
 
+  // Returns the decisions of the adaptive prefetching (see
+  // `Options::max_in_flight_samples_per_worker`) in the Prometheus text
+  // exposition format.
+  std::string MetricsText() const;
+
   // Sampler is neither copyable nor movable.
   Sampler(const Sampler&) = delete;
   Sampler& operator=(const Sampler&) = delete;
@@ -327,11 +475,37 @@ class Sampler {
     // `GetNextTrajectory` is the caller. The signature represents a complete
     // trajectory and so does the data.
     kTrajectory,
+
+    // `GetNextSampleBatch` is the caller. The signature represents a single
+    // timestep and the data is a batch of sequences of batched timesteps.
+    kBatchedTimestepBatch,
+
+    // `GetNextTrajectoryBatch` is the caller. The signature represents a
+    // complete trajectory and the data is a batch of trajectories.
+    kTrajectoryBatch,
   };
   absl::Status ValidateAgainstOutputSpec(
       const std::vector<tensorflow::Tensor>& data, ValidationMode mode);
 
-  void RunWorker(SamplerWorker* worker) ABSL_LOCKS_EXCLUDED(mu_);
+  void RunWorker(int worker_index) ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Passes samples fetched by the worker at `worker_index` on to `samples_`.
+  // If `reorder_buffer_size_` is set then the samples are routed through
+  // `reorder_buffer_`. Returns false if `samples_` has been closed.
+  bool PushSamples(int worker_index,
+                   std::vector<std::unique_ptr<Sample>> samples)
+      ABSL_LOCKS_EXCLUDED(mu_, release_mu_);
+
+  // Adds `samples` to `reorder_buffer_`, sets the watermark of the worker at
+  // `worker_index` and pushes the samples which can be released, in order, to
+  // `samples_`. Returns false if `samples_` has been closed.
+  bool ReorderSamples(int worker_index,
+                      std::vector<std::unique_ptr<Sample>> samples,
+                      int64_t watermark) ABSL_LOCKS_EXCLUDED(mu_, release_mu_);
+
+  // Implementation of `GetNextTrajectoryBatch` and `GetNextSampleBatch`.
+  absl::Status GetNextBatch(int batch_size, ValidationMode mode,
+                            std::vector<tensorflow::Tensor>* data);
 
   // If `active_sample_` has been read, blocks until a sample has been retrieved
   // (popped from `samples_`) and populates `active_sample_`.
@@ -343,6 +517,16 @@ class Sampler {
   // `GetNextSample`. The returned pointer is only valid if the status is OK.
   absl::Status PopNextSample(std::unique_ptr<Sample>* sample);
 
+  // Pops the next sample from `flushed_samples_` or `samples_`. If the reorder
+  // buffer is used and no sample arrives within `reorder_timeout_` then the
+  // samples held back are flushed. Returns false if `samples_` has been
+  // closed.
+  bool PopSample(std::unique_ptr<Sample>* sample) ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Moves all samples in `reorder_buffer_` to `flushed_samples_` unless a
+  // sample has been released to `samples_` in the meantime.
+  void FlushReorderBuffer() ABSL_LOCKS_EXCLUDED(mu_, release_mu_);
+
   // True if the workers should be shut down. This is the case when either:
   //  - `Close` has been called.
   //  - The number of returned samples equal `max_samples_`.
@@ -378,8 +562,22 @@ class Sampler {
   // `GetNextTimestep`.
   int64_t returned_ ABSL_GUARDED_BY(mu_) = 0;
 
+  // Decides the number of samples requested by workers and the number of
+  // active workers. Null if `max_in_flight_samples_per_worker` is fixed.
+  std::unique_ptr<internal::PrefetchController> prefetch_controller_;
+
+  // The fixed number of samples requested by workers, or `kAutoSelectValue`.
+  const int max_in_flight_samples_per_worker_;
+
   // Workers and threads managing the worker with the same index.
   std::vector<std::unique_ptr<SamplerWorker>> workers_;
+
+  // Workers with an index >= `num_active_workers_` do not start new streams.
+  int num_active_workers_ ABSL_GUARDED_BY(mu_);
+
+  // The value of `num_active_workers_` as last seen by the caller thread. Lets
+  // `PopNextSample` skip locking `mu_` until the controller changes its mind.
+  int caller_num_active_workers_;
   std::vector<std::unique_ptr<internal::Thread>> worker_threads_;
 
   // OK or the first non transient error encountered by a worker.
@@ -393,6 +591,35 @@ class Sampler {
   // Queue of complete samples (timesteps batched up by into sequence).
   internal::Queue<std::unique_ptr<Sample>> samples_;
 
+  // Maximum number of samples held in `reorder_buffer_`. Samples are pushed
+  // directly to `samples_` when 0.
+  const int reorder_buffer_size_;
+
+  // Samples which have been fetched but could still be preceded by a sample
+  // which a worker has yet to push, keyed by their sequence number.
+  std::multimap<int64_t, std::unique_ptr<Sample>> reorder_buffer_
+      ABSL_GUARDED_BY(mu_);
+
+  // The sequence number of the last sample pushed by each worker. Workers
+  // which are not fetching samples are set to `INT64_MAX` as they cannot push
+  // samples which precede the ones in `reorder_buffer_`.
+  std::vector<int64_t> worker_watermarks_ ABSL_GUARDED_BY(mu_);
+
+  // One past the highest sequence number released from `reorder_buffer_`.
+  int64_t next_sequence_number_ ABSL_GUARDED_BY(mu_) = 0;
+
+  // Time the caller waits for a sample before the reorder buffer is flushed.
+  const absl::Duration reorder_timeout_;
+
+  // Samples flushed from `reorder_buffer_`. They precede every sample in
+  // `samples_` and are only accessed by the caller thread.
+  std::deque<std::unique_ptr<Sample>> flushed_samples_;
+
+  // Held while releasing samples from `reorder_buffer_` so that the samples
+  // are pushed to `samples_` in the order they were released. Must be acquired
+  // before `mu_`.
+  absl::Mutex release_mu_ ABSL_ACQUIRED_BEFORE(mu_);
+
   // The dtypes and shapes users expect from either `GetNextTimestep` or
   // `GetNextSample` (whichever they plan to call).  May be absl::nullopt,
   // meaning unknown.
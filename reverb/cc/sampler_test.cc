@@ -24,11 +24,17 @@
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 #include "absl/base/thread_annotations.h"
+#include "absl/strings/match.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/string_view.h"
 #include "absl/synchronization/mutex.h"
 #include "absl/time/clock.h"
 #include "absl/time/time.h"
 #include "reverb/cc/platform/logging.h"
 #include "reverb/cc/platform/status_matchers.h"
+#include "reverb/cc/platform/thread.h"
 #include "reverb/cc/reverb_service.pb.h"
 #include "reverb/cc/reverb_service_mock.grpc.pb.h"
 #include "reverb/cc/selectors/fifo.h"
@@ -47,6 +53,8 @@ namespace {
 
 using test::ExpectTensorEqual;
 using testing::MakeSequenceRange;
+using ::testing::HasSubstr;
+using ::testing::Not;
 using ::testing::SizeIs;
 
 class FakeStream
@@ -97,6 +105,7 @@ class FakeStub : public /* grpc_gen:: */MockReverbServiceStub {
   grpc::ClientReaderWriterInterface<SampleStreamRequest, SampleStreamResponse>*
   SampleStreamRaw(grpc::ClientContext* context) override {
     absl::WriterMutexLock lock(&mu_);
+    num_streams_++;
     if (!streams_.empty()) {
       FakeStream* stream = streams_.front().release();
       streams_.pop_front();
@@ -122,14 +131,55 @@ class FakeStub : public /* grpc_gen:: */MockReverbServiceStub {
         std::move(responses), std::move(status)));
   }
 
+  grpc::Status ServerInfo(grpc::ClientContext* context,
+                          const ServerInfoRequest& request,
+                          ServerInfoResponse* response) override {
+    absl::SleepFor(server_info_delay());
+    absl::ReaderMutexLock lock(&mu_);
+    auto* info = response->add_table_info();
+    info->set_name("table");
+    info->set_current_size(table_size_);
+    return grpc::Status::OK;
+  }
+
   std::vector<SampleStreamRequest> requests() const {
     absl::ReaderMutexLock lock(&mu_);
     return requests_;
   }
 
+  int64_t num_requested_samples() const {
+    absl::ReaderMutexLock lock(&mu_);
+    int64_t num_samples = 0;
+    for (const auto& request : requests_) num_samples += request.num_samples();
+    return num_samples;
+  }
+
+  int num_streams() const {
+    absl::ReaderMutexLock lock(&mu_);
+    return num_streams_;
+  }
+
+  void set_table_size(int64_t table_size) {
+    absl::WriterMutexLock lock(&mu_);
+    table_size_ = table_size;
+  }
+
+  absl::Duration server_info_delay() const {
+    absl::ReaderMutexLock lock(&mu_);
+    return server_info_delay_;
+  }
+
+  void set_server_info_delay(absl::Duration delay) {
+    absl::WriterMutexLock lock(&mu_);
+    server_info_delay_ = delay;
+  }
+
  private:
   std::list<std::unique_ptr<FakeStream>> streams_ ABSL_GUARDED_BY(mu_);
   std::vector<SampleStreamRequest> requests_ ABSL_GUARDED_BY(mu_);
+  int num_streams_ ABSL_GUARDED_BY(mu_) = 0;
+  int64_t table_size_ ABSL_GUARDED_BY(mu_) = 0;
+  absl::Duration server_info_delay_ ABSL_GUARDED_BY(mu_) = absl::ZeroDuration();
   mutable absl::Mutex mu_;
 };
 
@@ -201,6 +251,18 @@ SampleStreamResponse MakeResponse(int item_length, bool delta_encode = false,
   return response;
 }
 
+// Returns the value of the first sample of `family` in the Prometheus
+// formatted `text`, or -1 if there is none.
+double MetricValue(const std::string& text, const std::string& family) {
+  for (absl::string_view line : absl::StrSplit(text, '\n')) {
+    if (!absl::StartsWith(line, absl::StrCat(family, "{"))) continue;
+    double value;
+    REVERB_CHECK(absl::SimpleAtod(line.substr(line.rfind(' ') + 1), &value));
+    return value;
+  }
+  return -1;
+}
+
 std::shared_ptr<Table> MakeTable(int max_size = 100) {
   return std::make_shared<Table>(
       /*name=*/"queue",
@@ -511,6 +573,81 @@ TEST(LocalSamplerTest, GetNextSampleTrimsSequence) {
                                         start_and_end_trimmer_want);
 }
 
+TEST(LocalSamplerTest, GetNextTrajectoryBatchStacksSamples) {
+  auto table = MakeTable();
+  InsertItem(table.get(), 1, 1.0, {3});
+  InsertItem(table.get(), 2, 2.0, {1, 2});
+
+  Sampler sampler(table, {2});
+
+  std::vector<tensorflow::Tensor> batch;
+  REVERB_EXPECT_OK(sampler.GetNextTrajectoryBatch(2, &batch));
+  ASSERT_THAT(batch,
+              SizeIs(5));  // ID, probability, table size, priority, data.
+  EXPECT_EQ(batch[0].shape(), tensorflow::TensorShape({2}));
+  EXPECT_EQ(batch[0].flat<tensorflow::uint64>()(0), 1);
+  EXPECT_EQ(batch[0].flat<tensorflow::uint64>()(1), 2);
+  EXPECT_EQ(batch[3].flat<double>()(0), 1.0);
+  EXPECT_EQ(batch[3].flat<double>()(1), 2.0);
+
+  // Both rows hold the same data even though the second sample was split over
+  // two chunks.
+  EXPECT_EQ(batch[4].shape(), tensorflow::TensorShape({2, 3, 2}));
+  ExpectTensorEqual<tensorflow::uint64>(batch[4].SubSlice(0), MakeTensor(3));
+
+  tensorflow::Tensor second_want;
+  EXPECT_OK(FromTensorflowStatus(
+      tensorflow::tensor::Concat({MakeTensor(1), MakeTensor(2)}, &second_want)));
+  ExpectTensorEqual<tensorflow::uint64>(
+      tensorflow::tensor::DeepCopy(batch[4].SubSlice(1)), second_want);
+}
+
+TEST(LocalSamplerTest, GetNextSampleBatchBatchesTimesteps) {
+  auto table = MakeTable();
+  InsertItem(table.get(), 1, 1.0, {2});
+  InsertItem(table.get(), 2, 1.0, {2});
+
+  Sampler sampler(table, {2});
+
+  std::vector<tensorflow::Tensor> batch;
+  REVERB_EXPECT_OK(sampler.GetNextSampleBatch(2, &batch));
+  ASSERT_THAT(batch,
+              SizeIs(5));  // ID, probability, table size, priority, data.
+  EXPECT_EQ(batch[0].shape(), tensorflow::TensorShape({2, 2}));
+  auto keys = batch[0].matrix<tensorflow::uint64>();
+  EXPECT_EQ(keys(0, 0), 1);
+  EXPECT_EQ(keys(0, 1), 1);
+  EXPECT_EQ(keys(1, 0), 2);
+  EXPECT_EQ(keys(1, 1), 2);
+  EXPECT_EQ(batch[4].shape(), tensorflow::TensorShape({2, 2, 2}));
+}
+
+TEST(LocalSamplerTest, GetNextTrajectoryBatchRejectsDifferentShapes) {
+  auto table = MakeTable();
+  InsertItem(table.get(), 1, 1.0, {3});
+  InsertItem(table.get(), 2, 1.0, {4});
+
+  Sampler sampler(table, {2});
+
+  std::vector<tensorflow::Tensor> batch;
+  EXPECT_EQ(sampler.GetNextTrajectoryBatch(2, &batch).code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
+TEST(LocalSamplerTest, GetNextTrajectoryBatchDropsRemainder) {
+  auto table = MakeTable();
+  for (int i = 0; i < 3; i++) {
+    InsertItem(table.get(), i + 1, 1.0, {2});
+  }
+
+  Sampler sampler(table, {3});
+
+  std::vector<tensorflow::Tensor> batch;
+  REVERB_EXPECT_OK(sampler.GetNextTrajectoryBatch(2, &batch));
+  EXPECT_EQ(sampler.GetNextTrajectoryBatch(2, &batch).code(),
+            absl::StatusCode::kOutOfRange);
+}
+
 TEST(LocalSamplerTest, RespectsMaxInFlightItems) {
   auto table = MakeTable(100);
   for (int i = 0; i < 100; i++) {
@@ -536,6 +673,98 @@ TEST(LocalSamplerTest, RespectsMaxInFlightItems) {
   }
 }
 
+TEST(LocalSamplerTest, ReorderBufferPreservesFifoOrder) {
+  const int kNumItems = 1000;
+  auto table = MakeTable(kNumItems);
+  for (int i = 0; i < kNumItems; i++) {
+    InsertItem(table.get(), i, 1.0, {1});
+  }
+
+  Sampler::Options options;
+  options.max_samples = kNumItems;
+  options.max_in_flight_samples_per_worker = 5;
+  options.num_workers = 8;
+  options.reorder_buffer_size = 100;
+  Sampler sampler(table, options);
+
+  for (int i = 0; i < kNumItems; i++) {
+    std::vector<tensorflow::Tensor> sample;
+    REVERB_ASSERT_OK(sampler.GetNextTrajectory(&sample));
+    EXPECT_EQ(sample[0].scalar<tensorflow::uint64>()(), i);
+  }
+}
+
+TEST(LocalSamplerTest, ReorderBufferSkipsGapsAfterTimeout) {
+  auto table = MakeTable();
+  InsertItem(table.get(), 1, 1.0, {1});
+  InsertItem(table.get(), 2, 1.0, {1});
+
+  // Another client draws the first sample so the sampler never receives the
+  // sample at position 0. The worker which does not receive the second item
+  // is blocked by the rate limiter and never moves past the gap.
+  Table::SampledItem item;
+  REVERB_ASSERT_OK(table->Sample(&item));
+
+  Sampler::Options options;
+  options.max_in_flight_samples_per_worker = 1;
+  options.num_workers = 2;
+  options.reorder_buffer_size = 100;
+  options.reorder_timeout = absl::Milliseconds(50);
+  Sampler sampler(table, options);
+
+  std::vector<tensorflow::Tensor> sample;
+  REVERB_ASSERT_OK(sampler.GetNextTrajectory(&sample));
+  EXPECT_EQ(sample[0].scalar<tensorflow::uint64>()(), 2);
+}
+
+TEST(LocalSamplerTest, AdaptsNumberOfInFlightSamples) {
+  const int kNumItems = 1000;
+  auto table = MakeTable(kNumItems);
+
+  // The items are inserted slowly so the consumer is starved throughout and
+  // the controller has to scale up.
+  auto inserter = internal::StartThread("Inserter", [&table] {
+    for (int i = 0; i < kNumItems; i++) {
+      InsertItem(table.get(), i, 1.0, {1});
+      absl::SleepFor(absl::Milliseconds(1));
+    }
+  });
+
+  Sampler::Options options;
+  options.max_samples = kNumItems;
+  options.max_in_flight_samples_per_worker = Sampler::kAutoSelectValue;
+  options.num_workers = 4;
+  Sampler sampler(table, options);
+
+  for (int i = 0; i < kNumItems; i++) {
+    std::vector<tensorflow::Tensor> sample;
+    REVERB_ASSERT_OK(sampler.GetNextTrajectory(&sample));
+  }
+  inserter = nullptr;  // Joins the thread.
+
+  const std::string metrics = sampler.MetricsText();
+  EXPECT_GT(MetricValue(metrics, "reverb_sampler_samples_per_request"), 1);
+  EXPECT_GT(MetricValue(metrics, "reverb_sampler_active_workers"), 1);
+  EXPECT_GT(MetricValue(metrics, "reverb_sampler_prefetch_adjustments_total"),
+            0);
+  EXPECT_GT(MetricValue(metrics, "reverb_sampler_pull_rate"), 0);
+  EXPECT_GT(MetricValue(metrics, "reverb_sampler_sample_bytes"), 0);
+}
+
+TEST(LocalSamplerTest, MetricsTextReportsFixedSettings) {
+  auto table = MakeTable();
+  Sampler::Options options;
+  options.max_in_flight_samples_per_worker = 7;
+  Sampler sampler(table, options);
+
+  const std::string metrics = sampler.MetricsText();
+  EXPECT_THAT(metrics, HasSubstr("reverb_sampler_samples_per_request{"
+                                 "table=\"queue\"} 7"));
+  EXPECT_THAT(metrics, HasSubstr("reverb_sampler_active_workers{"
+                                 "table=\"queue\"} 1"));
+  EXPECT_THAT(metrics, Not(HasSubstr("reverb_sampler_pull_rate")));
+}
+
 TEST(LocalSamplerTest, Close) {
   auto table = MakeTable();
   InsertItem(table.get(), 1, 1.0, {5});
@@ -621,6 +850,83 @@ TEST(GrpcSamplerTest, RespectsBufferSizeAndMaxSamples) {
   EXPECT_THAT(stub->requests(), SizeIs(2));
 }
 
+TEST(MultiServerSamplerTest, SkipsServersWithEmptyTables) {
+  std::vector<SampleStreamResponse> responses;
+  for (int i = 0; i < 10; i++) responses.push_back(MakeResponse(1));
+  auto empty_stub = MakeGoodStub({});
+  auto stub = MakeGoodStub(std::move(responses));
+  stub->set_table_size(10);
+
+  Sampler::Options options;
+  options.max_samples = 10;
+  options.max_in_flight_samples_per_worker = 5;
+  options.num_workers = 1;
+  Sampler sampler({empty_stub, stub}, "table", options);
+
+  std::vector<tensorflow::Tensor> sample;
+  for (int i = 0; i < 10; i++) {
+    REVERB_EXPECT_OK(sampler.GetNextSample(&sample));
+  }
+  EXPECT_THAT(empty_stub->requests(), ::testing::IsEmpty());
+  EXPECT_EQ(stub->num_requested_samples(), 10);
+}
+
+TEST(MultiServerSamplerTest, SplitsSamplesOverServersWithoutReconnecting) {
+  std::vector<std::shared_ptr<FakeStub>> stubs;
+  for (int i = 0; i < 2; i++) {
+    std::vector<SampleStreamResponse> responses;
+    for (int j = 0; j < 20; j++) responses.push_back(MakeResponse(1));
+    stubs.push_back(MakeGoodStub(std::move(responses)));
+    stubs.back()->set_table_size(5);
+  }
+
+  Sampler::Options options;
+  options.max_samples = 20;
+  options.max_in_flight_samples_per_worker = 2;
+  options.max_samples_per_stream = 2;
+  options.num_workers = 1;
+  Sampler sampler({stubs[0], stubs[1]}, "table", options);
+
+  std::vector<tensorflow::Tensor> sample;
+  for (int i = 0; i < 20; i++) {
+    REVERB_EXPECT_OK(sampler.GetNextSample(&sample));
+  }
+
+  // A single stream is opened to each server even though a new stream would
+  // be opened for every 2 samples when using a single stub.
+  EXPECT_EQ(stubs[0]->num_requested_samples() +
+                stubs[1]->num_requested_samples(),
+            20);
+  EXPECT_LE(stubs[0]->num_streams(), 1);
+  EXPECT_LE(stubs[1]->num_streams(), 1);
+}
+
+TEST(MultiServerSamplerTest, RefreshesServerWeightsConcurrently) {
+  constexpr int kNumServers = 4;
+  constexpr auto kServerInfoDelay = absl::Milliseconds(500);
+  std::vector<std::shared_ptr</* grpc_gen:: */ReverbService::StubInterface>>
+      stubs;
+  for (int i = 0; i < kNumServers; i++) {
+    auto stub = MakeGoodStub({MakeResponse(1)});
+    stub->set_table_size(1);
+    stub->set_server_info_delay(kServerInfoDelay);
+    stubs.push_back(std::move(stub));
+  }
+
+  Sampler::Options options;
+  options.max_samples = 1;
+  options.max_in_flight_samples_per_worker = 1;
+  options.num_workers = 1;
+  const absl::Time start = absl::Now();
+  Sampler sampler(std::move(stubs), "table", options);
+
+  std::vector<tensorflow::Tensor> sample;
+  REVERB_EXPECT_OK(sampler.GetNextSample(&sample));
+
+  // Querying the servers one at a time would take `kNumServers` times as long.
+  EXPECT_LT(absl::Now() - start, kServerInfoDelay * (kNumServers - 1));
+}
+
 TEST(GrpcSamplerTest, UnpacksDeltaEncodedTensors) {
   auto stub = MakeGoodStub({MakeResponse(10, false), MakeResponse(10, true)});
   Sampler sampler(stub, "table", {2, 1});
@@ -926,7 +1232,7 @@ TEST(SamplerDeathTest, DiesIfMaxInFlightSamplesPerWorkerIsNonPositive) {
   ASSERT_DEATH(Sampler sampler(MakeGoodStub({}), "table", options), "");
   ASSERT_DEATH(Sampler sampler(nullptr, options), "");
 
-  options.max_in_flight_samples_per_worker = -1;
+  options.max_in_flight_samples_per_worker = -2;
   ASSERT_DEATH(Sampler sampler(MakeGoodStub({}), "table", options), "");
   ASSERT_DEATH(Sampler sampler(nullptr, options), "");
 }
@@ -976,6 +1282,18 @@ TEST(SamplerOptionsTest, ValidateChecksMaxInFlightSamplesPerWorker) {
   EXPECT_EQ(options.Validate().code(), absl::StatusCode::kInvalidArgument);
   options.max_in_flight_samples_per_worker = -2;
   EXPECT_EQ(options.Validate().code(), absl::StatusCode::kInvalidArgument);
+  options.max_in_flight_samples_per_worker = Sampler::kAutoSelectValue;
+  REVERB_EXPECT_OK(options.Validate());
+}
+
+TEST(SamplerOptionsTest, ValidateChecksMaxInFlightBytes) {
+  Sampler::Options options;
+  options.max_in_flight_bytes = 0;
+  EXPECT_EQ(options.Validate().code(), absl::StatusCode::kInvalidArgument);
+  options.max_in_flight_bytes = Sampler::kAutoSelectValue;
+  REVERB_EXPECT_OK(options.Validate());
+  options.max_in_flight_bytes = 1 << 20;
+  REVERB_EXPECT_OK(options.Validate());
 }
 
 TEST(SamplerOptionsTest, ValidateChecksNumWorkers) {
@@ -1016,6 +1334,24 @@ TEST(SamplerOptionsTest, ValidateChecksFlexibleBatchSize) {
   EXPECT_EQ(options.Validate().code(), absl::StatusCode::kInvalidArgument);
 }
 
+TEST(SamplerOptionsTest, ValidateChecksReorderBufferSize) {
+  Sampler::Options options;
+  options.reorder_buffer_size = -1;
+  EXPECT_EQ(options.Validate().code(), absl::StatusCode::kInvalidArgument);
+  options.reorder_buffer_size = 0;
+  REVERB_EXPECT_OK(options.Validate());
+  options.reorder_buffer_size = 10;
+  REVERB_EXPECT_OK(options.Validate());
+}
+
+TEST(SamplerOptionsTest, ValidateChecksReorderTimeout) {
+  Sampler::Options options;
+  options.reorder_timeout = absl::ZeroDuration();
+  EXPECT_EQ(options.Validate().code(), absl::StatusCode::kInvalidArgument);
+  options.reorder_timeout = absl::Milliseconds(10);
+  REVERB_EXPECT_OK(options.Validate());
+}
+
 }  // namespace
 }  // namespace reverb
 }  // namespace deepmind
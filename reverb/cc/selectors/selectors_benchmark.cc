@@ -0,0 +1,309 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Microbenchmarks for the `ItemSelector` implementations.
+//
+// Every benchmark is parameterized by the number of items held by the selector
+// (1e3 to 1e8). The selectors whose behaviour depends on the priorities
+// (Prioritized and Heap) are also parameterized by the distribution the
+// priorities are drawn from. Besides the usual wall and CPU time per
+// iteration, each benchmark reports:
+//
+//   * time_per_op: average time of a single Insert/Update/Delete/Sample call.
+//   * bytes_per_item: growth of the heap in use while the selector is
+//     populated divided by its size. Only reported when the heap usage can be
+//     queried from the allocator (glibc).
+//
+// Run with e.g:
+//
+//   bazel run -c opt //reverb/cc/selectors:selectors_benchmark -- \
+//     --benchmark_filter='BM_Sample/Prioritized/.*'
+//
+// The largest sizes require several GB of memory per selector.
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <cstdint>
+#include "benchmark/benchmark.h"
+#include "absl/memory/memory.h"
+#include "absl/random/distributions.h"
+#include "absl/random/random.h"
+#include "absl/status/status.h"
+#include "reverb/cc/platform/logging.h"
+#include "reverb/cc/platform/status_macros.h"
+#include "reverb/cc/selectors/fifo.h"
+#include "reverb/cc/selectors/heap.h"
+#include "reverb/cc/selectors/interface.h"
+#include "reverb/cc/selectors/lifo.h"
+#include "reverb/cc/selectors/prioritized.h"
+#include "reverb/cc/selectors/uniform.h"
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+namespace deepmind {
+namespace reverb {
+namespace {
+
+using Key = ItemSelector::Key;
+using SelectorFactory = std::function<std::unique_ptr<ItemSelector>()>;
+
+// Number of operations performed per benchmark iteration by the benchmarks
+// that have to restore the size of the selector between iterations. Large
+// enough to amortize the cost of pausing the timer.
+constexpr int kOpsPerIteration = 1000;
+
+// Priority exponent used by the prioritized selector. Matches the default used
+// in prioritized experience replay.
+constexpr double kPriorityExponent = 0.6;
+
+enum PriorityDistribution : int64_t {
+  // All items have the same priority.
+  kConstant = 0,
+  // Priorities are drawn uniformly from (0, 1].
+  kUniform = 1,
+  // Heavy tailed priorities, similar to the absolute TD errors observed in
+  // practice.
+  kLogNormal = 2,
+};
+
+const char* DistributionName(int64_t distribution) {
+  switch (distribution) {
+    case kConstant:
+      return "constant";
+    case kUniform:
+      return "uniform";
+    case kLogNormal:
+      return "log_normal";
+  }
+  return "unknown";
+}
+
+class PriorityGenerator {
+ public:
+  explicit PriorityGenerator(int64_t distribution)
+      : distribution_(distribution) {}
+
+  double operator()() {
+    switch (distribution_) {
+      case kUniform:
+        return absl::Uniform<double>(absl::IntervalOpenClosed, bit_gen_, 0, 1);
+      case kLogNormal:
+        return std::exp(absl::Gaussian<double>(bit_gen_, 0, 1.5));
+      default:
+        return 1.0;
+    }
+  }
+
+ private:
+  const int64_t distribution_;
+  absl::BitGen bit_gen_;
+};
+
+// Number of bytes of heap memory in use, or -1 if the allocator can't report
+// it.
+int64_t HeapBytesInUse() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+  return mallinfo2().uordblks;
+#else
+  return -1;
+#endif
+}
+
+// Creates a selector and populates it with keys [0, size).
+std::unique_ptr<ItemSelector> MakePopulated(const SelectorFactory& factory,
+                                            int64_t size,
+                                            PriorityGenerator* priorities,
+                                            benchmark::State* state) {
+  const int64_t bytes_before = HeapBytesInUse();
+  auto selector = factory();
+  for (Key key = 0; key < size; key++) {
+    REVERB_CHECK_OK(selector->Insert(key, (*priorities)()));
+  }
+  if (bytes_before >= 0) {
+    state->counters["bytes_per_item"] = benchmark::Counter(
+        static_cast<double>(HeapBytesInUse() - bytes_before) / size);
+  }
+  state->SetLabel(DistributionName(state->range(1)));
+  return selector;
+}
+
+// Reports the time per call given that `ops_per_iteration` calls were made
+// in every iteration.
+void SetTimePerOp(benchmark::State* state, int ops_per_iteration) {
+  state->SetItemsProcessed(state->iterations() * ops_per_iteration);
+  state->counters["time_per_op"] = benchmark::Counter(
+      ops_per_iteration, benchmark::Counter::kIsIterationInvariantRate |
+                             benchmark::Counter::kInvert);
+}
+
+// Inserts new keys into a selector holding `size` items. The inserted keys are
+// deleted (untimed) after each iteration so the size stays constant.
+void BM_Insert(benchmark::State& state, SelectorFactory factory) {
+  PriorityGenerator priorities(state.range(1));
+  auto selector = MakePopulated(factory, state.range(0), &priorities, &state);
+
+  std::vector<double> new_priorities(kOpsPerIteration);
+  Key next_key = state.range(0);
+  for (auto _ : state) {
+    state.PauseTiming();
+    for (double& priority : new_priorities) priority = priorities();
+    const Key first_key = next_key;
+    state.ResumeTiming();
+
+    for (double priority : new_priorities) {
+      benchmark::DoNotOptimize(selector->Insert(next_key++, priority));
+    }
+
+    state.PauseTiming();
+    for (Key key = first_key; key < next_key; key++) {
+      REVERB_CHECK_OK(selector->Delete(key));
+    }
+    state.ResumeTiming();
+  }
+  SetTimePerOp(&state, kOpsPerIteration);
+}
+
+// Updates the priority of random keys.
+void BM_Update(benchmark::State& state, SelectorFactory factory) {
+  PriorityGenerator priorities(state.range(1));
+  auto selector = MakePopulated(factory, state.range(0), &priorities, &state);
+
+  std::vector<std::pair<Key, double>> updates(kOpsPerIteration);
+  absl::BitGen bit_gen;
+  for (auto _ : state) {
+    state.PauseTiming();
+    for (auto& update : updates) {
+      update.first = absl::Uniform<Key>(bit_gen, 0, state.range(0));
+      update.second = priorities();
+    }
+    state.ResumeTiming();
+
+    for (const auto& update : updates) {
+      benchmark::DoNotOptimize(selector->Update(update.first, update.second));
+    }
+  }
+  SetTimePerOp(&state, kOpsPerIteration);
+}
+
+// Deletes the keys picked by the selector itself (as a remover would). The
+// deleted keys are reinserted (untimed) after each iteration so the size stays
+// constant.
+void BM_Delete(benchmark::State& state, SelectorFactory factory) {
+  PriorityGenerator priorities(state.range(1));
+  auto selector = MakePopulated(factory, state.range(0), &priorities, &state);
+
+  const int ops_per_iteration =
+      std::min<int64_t>(kOpsPerIteration, state.range(0));
+  std::vector<std::pair<Key, double>> deleted(ops_per_iteration);
+  for (auto _ : state) {
+    state.PauseTiming();
+    for (auto& item : deleted) {
+      item.first = selector->Sample().key;
+      item.second = priorities();
+      // Temporarily remove the key so the next sample picks a different one.
+      REVERB_CHECK_OK(selector->Delete(item.first));
+    }
+    for (const auto& item : deleted) {
+      REVERB_CHECK_OK(selector->Insert(item.first, item.second));
+    }
+    state.ResumeTiming();
+
+    for (const auto& item : deleted) {
+      benchmark::DoNotOptimize(selector->Delete(item.first));
+    }
+
+    state.PauseTiming();
+    for (const auto& item : deleted) {
+      REVERB_CHECK_OK(selector->Insert(item.first, item.second));
+    }
+    state.ResumeTiming();
+  }
+  SetTimePerOp(&state, ops_per_iteration);
+}
+
+// Samples from a selector holding `size` items.
+void BM_Sample(benchmark::State& state, SelectorFactory factory) {
+  PriorityGenerator priorities(state.range(1));
+  auto selector = MakePopulated(factory, state.range(0), &priorities, &state);
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(selector->Sample());
+  }
+  SetTimePerOp(&state, 1);
+}
+
+// Sizes 1e3, 1e4, ..., 1e8 with constant priorities. Used for the selectors
+// which ignore the priorities.
+void Sizes(benchmark::internal::Benchmark* b) {
+  b->ArgNames({"size", "priorities"});
+  for (int64_t size = 1000; size <= 100000000; size *= 10) {
+    b->Args({size, kConstant});
+  }
+  b->Unit(benchmark::kMicrosecond);
+}
+
+// Sizes 1e3, 1e4, ..., 1e8 crossed with all priority distributions.
+void SizesAndDistributions(benchmark::internal::Benchmark* b) {
+  b->ArgNames({"size", "priorities"});
+  for (int64_t size = 1000; size <= 100000000; size *= 10) {
+    for (int64_t distribution : {kConstant, kUniform, kLogNormal}) {
+      b->Args({size, distribution});
+    }
+  }
+  b->Unit(benchmark::kMicrosecond);
+}
+
+std::unique_ptr<ItemSelector> MakeFifo() {
+  return absl::make_unique<FifoSelector>();
+}
+
+std::unique_ptr<ItemSelector> MakeLifo() {
+  return absl::make_unique<LifoSelector>();
+}
+
+std::unique_ptr<ItemSelector> MakeUniform() {
+  return absl::make_unique<UniformSelector>();
+}
+
+std::unique_ptr<ItemSelector> MakePrioritized() {
+  return absl::make_unique<PrioritizedSelector>(kPriorityExponent);
+}
+
+std::unique_ptr<ItemSelector> MakeMinHeap() {
+  return absl::make_unique<HeapSelector>(/*min_heap=*/true);
+}
+
+#define REVERB_SELECTOR_BENCHMARKS(name, factory, args)     \
+  BENCHMARK_CAPTURE(BM_Insert, name, factory)->Apply(args); \
+  BENCHMARK_CAPTURE(BM_Update, name, factory)->Apply(args); \
+  BENCHMARK_CAPTURE(BM_Delete, name, factory)->Apply(args); \
+  BENCHMARK_CAPTURE(BM_Sample, name, factory)->Apply(args)
+
+REVERB_SELECTOR_BENCHMARKS(Fifo, MakeFifo, Sizes);
+REVERB_SELECTOR_BENCHMARKS(Lifo, MakeLifo, Sizes);
+REVERB_SELECTOR_BENCHMARKS(Uniform, MakeUniform, Sizes);
+REVERB_SELECTOR_BENCHMARKS(Prioritized, MakePrioritized,
+                           SizesAndDistributions);
+REVERB_SELECTOR_BENCHMARKS(Heap, MakeMinHeap, SizesAndDistributions);
+
+}  // namespace
+}  // namespace reverb
+}  // namespace deepmind
@@ -0,0 +1,205 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/sharded_trajectory_writer.h"
+
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include "absl/memory/memory.h"
+#include "absl/random/distributions.h"
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "absl/time/clock.h"
+#include "reverb/cc/platform/logging.h"
+#include "reverb/cc/platform/status_macros.h"
+
+namespace deepmind {
+namespace reverb {
+
+ShardedTrajectoryWriter::ShardedTrajectoryWriter(
+    std::vector<std::shared_ptr</* grpc_gen:: */ReverbService::StubInterface>>
+        stubs,
+    const TrajectoryWriter::Options& options)
+    : num_stream_failures_(stubs.size(), 0),
+      excluded_until_(stubs.size(), absl::InfinitePast()),
+      failed_(stubs.size(), false),
+      active_(0) {
+  REVERB_CHECK(!stubs.empty());
+  for (auto& stub : stubs) {
+    writers_.push_back(
+        absl::make_unique<TrajectoryWriter>(std::move(stub), options));
+  }
+  RouteEpisode();
+}
+
+absl::Status ShardedTrajectoryWriter::Append(
+    std::vector<absl::optional<tensorflow::Tensor>> data,
+    std::vector<absl::optional<std::weak_ptr<CellRef>>>* refs) {
+  return writers_[active_]->Append(std::move(data), refs);
+}
+
+absl::Status ShardedTrajectoryWriter::CreateItem(
+    absl::string_view table, double priority,
+    absl::Span<const TrajectoryColumn> trajectory, absl::Duration timeout) {
+  const uint64_t episode_id = this->episode_id();
+  for (const auto& column : trajectory) {
+    std::vector<std::shared_ptr<CellRef>> refs;
+    // Expired references are reported by `TrajectoryWriter::CreateItem`.
+    if (!column.LockReferences(&refs)) break;
+    for (const auto& ref : refs) {
+      if (ref->episode_id() != episode_id) {
+        return absl::InvalidArgumentError(
+            "Trajectory references data from an episode which has ended. The "
+            "data might be stored on another server than the active episode.");
+      }
+    }
+  }
+  return writers_[active_]->CreateItem(table, priority, trajectory, timeout);
+}
+
+absl::Status ShardedTrajectoryWriter::Flush(int ignore_last_num_items,
+                                            absl::Duration timeout) {
+  const absl::Time deadline = absl::Now() + timeout;
+  for (int i = 0; i < writers_.size(); i++) {
+    if (failed_[i]) continue;
+    REVERB_RETURN_IF_ERROR(CheckShard(
+        i, writers_[i]->Flush(i == active_ ? ignore_last_num_items : 0,
+                              deadline - absl::Now())));
+  }
+  return absl::OkStatus();
+}
+
+absl::Status ShardedTrajectoryWriter::EndEpisode(bool clear_buffers,
+                                                 absl::Duration timeout) {
+  absl::Status status;
+  if (!failed_[active_]) {
+    status = EndActiveEpisode(clear_buffers, timeout);
+    if (absl::IsDeadlineExceeded(status)) return status;
+    status = CheckShard(active_, status);
+  }
+
+  // Even if the server failed the episode is over as the data cannot be moved
+  // to another server.
+  RouteEpisode();
+  return status;
+}
+
+void ShardedTrajectoryWriter::Close() {
+  for (auto& writer : writers_) {
+    writer->Close();
+  }
+}
+
+absl::Status ShardedTrajectoryWriter::ConfigureChunker(
+    int column, const std::shared_ptr<ChunkerOptions>& options) {
+  for (auto& writer : writers_) {
+    REVERB_RETURN_IF_ERROR(writer->ConfigureChunker(column, options));
+  }
+  return absl::OkStatus();
+}
+
+absl::Status ShardedTrajectoryWriter::EndActiveEpisode(bool clear_buffers,
+                                                       absl::Duration timeout) {
+  TrajectoryWriter& writer = *writers_[active_];
+  const absl::Time deadline = absl::Now() + timeout;
+
+  // The pending items are flushed in slices so that a stream failure which
+  // happens while waiting is noticed without waiting for the server to return.
+  while (!HasNewStreamFailures(active_)) {
+    auto status = writer.EndEpisode(
+        clear_buffers,
+        std::min(kStreamFailureCheckInterval, deadline - absl::Now()));
+    if (!absl::IsDeadlineExceeded(status) || absl::Now() >= deadline) {
+      return status;
+    }
+  }
+
+  // The server is unavailable so the episode is ended without waiting for its
+  // items to be confirmed. They keep being retried by the writer of the server
+  // while new episodes are routed elsewhere.
+  return writer.EndEnvEpisode(/*env=*/0, clear_buffers);
+}
+
+bool ShardedTrajectoryWriter::HasNewStreamFailures(int shard) const {
+  return writers_[shard]->num_stream_failures() > num_stream_failures_[shard];
+}
+
+void ShardedTrajectoryWriter::RouteEpisode() {
+  const absl::Time now = absl::Now();
+  for (int i = 0; i < writers_.size(); i++) {
+    if (failed_[i]) {
+      ring_.Remove(i);
+      continue;
+    }
+
+    if (HasNewStreamFailures(i)) {
+      num_stream_failures_[i] = writers_[i]->num_stream_failures();
+      excluded_until_[i] = now + kUnavailableServerBackoff;
+      REVERB_LOG(REVERB_INFO)
+          << "Stream to server " << i << " failed. New episodes are routed "
+          << "to other servers for the next "
+          << absl::FormatDuration(kUnavailableServerBackoff) << ".";
+    }
+
+    if (now < excluded_until_[i]) {
+      ring_.Remove(i);
+    } else {
+      ring_.Add(i);
+    }
+  }
+
+  // If no server is healthy then we pick between the ones which haven't
+  // failed permanently, and if every server has failed then between all of
+  // them so the error is returned by the next call.
+  if (ring_.empty()) {
+    for (int i = 0; i < writers_.size(); i++) {
+      if (!failed_[i]) ring_.Add(i);
+    }
+  }
+  if (ring_.empty()) {
+    for (int i = 0; i < writers_.size(); i++) {
+      ring_.Add(i);
+    }
+  }
+
+  // The routing key is used as the ID of the new episode so the server can be
+  // derived from the episode ID stored in the chunks and items.
+  const uint64_t episode_id = absl::Uniform<uint64_t>(
+      bit_gen_, 0, std::numeric_limits<uint64_t>::max());
+  active_ = ring_.Lookup(episode_id);
+
+  // Only the episode of a writer which failed while ending it can have steps
+  // and the error of such a writer is returned by the next call anyway.
+  auto status = writers_[active_]->SetEpisodeId(/*env=*/0, episode_id);
+  if (!status.ok()) {
+    REVERB_CHECK(failed_[active_]) << status;
+  }
+}
+
+absl::Status ShardedTrajectoryWriter::CheckShard(int shard,
+                                                 absl::Status status) {
+  if (!status.ok() && !absl::IsDeadlineExceeded(status)) {
+    failed_[shard] = true;
+    return absl::Status(status.code(),
+                        absl::StrCat("Writer of server ", shard,
+                                     " failed: ", status.message()));
+  }
+  return status;
+}
+
+}  // namespace reverb
+}  // namespace deepmind
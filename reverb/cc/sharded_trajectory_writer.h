@@ -0,0 +1,161 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REVERB_CC_SHARDED_TRAJECTORY_WRITER_H_
+#define REVERB_CC_SHARDED_TRAJECTORY_WRITER_H_
+
+#include <memory>
+#include <vector>
+
+#include <cstdint>
+#include "absl/random/random.h"
+#include "absl/status/status.h"
+#include "absl/strings/string_view.h"
+#include "absl/time/time.h"
+#include "absl/types/optional.h"
+#include "absl/types/span.h"
+#include "reverb/cc/chunker.h"
+#include "reverb/cc/reverb_service.grpc.pb.h"
+#include "reverb/cc/support/consistent_hash_ring.h"
+#include "reverb/cc/trajectory_writer.h"
+#include "tensorflow/core/framework/tensor.h"
+
+namespace deepmind {
+namespace reverb {
+
+// Writes trajectories to tables which are sharded over several servers. A
+// `TrajectoryWriter`, and thus an InsertStream, is kept open to every server
+// and each episode is written in full to a single server which is picked by
+// consistent hashing of its episode ID. The ID is drawn at the start of the
+// episode and is stored in the chunks and items written for it, so for a given
+// set of healthy servers an episode ID always maps to the same server. Items
+// therefore only reference chunks which are stored on the same server as the
+// item itself.
+//
+// When the stream to a server fails with a transient error (e.g. the server
+// is unavailable) the server is removed from the hash ring at the next episode
+// boundary and new episodes are routed to the remaining servers. The server is
+// added back to the ring after `kUnavailableServerBackoff`. Only the episodes
+// which would have been written to the affected server are moved. Items which
+// were already created keep being retried by the writer of their server.
+//
+// With the exception of `Close`, none of the methods are thread safe.
+class ShardedTrajectoryWriter {
+ public:
+  // Time that a server is kept out of the hash ring after its stream failed.
+  static constexpr absl::Duration kUnavailableServerBackoff = absl::Seconds(5);
+
+  // Interval at which `EndEpisode` checks whether the stream to the server of
+  // the active episode has failed while waiting for its items to be confirmed.
+  static constexpr absl::Duration kStreamFailureCheckInterval =
+      absl::Milliseconds(100);
+
+  // Creates a `TrajectoryWriter` with `options` for each of the (non empty)
+  // `stubs`.
+  ShardedTrajectoryWriter(
+      std::vector<std::shared_ptr</* grpc_gen:: */ReverbService::StubInterface>>
+          stubs,
+      const TrajectoryWriter::Options& options);
+
+  // Appends `data` to the writer of the server that the active episode is
+  // routed to. See `TrajectoryWriter::Append` for details.
+  absl::Status Append(
+      std::vector<absl::optional<tensorflow::Tensor>> data,
+      std::vector<absl::optional<std::weak_ptr<CellRef>>>* refs);
+
+  // Creates an item on the server of the active episode. See
+  // `TrajectoryWriter::CreateItem` for details. Since the data of earlier
+  // episodes might be stored on another server, `trajectory` may only reference
+  // data appended during the active episode. If this is not the case then
+  // `InvalidArgumentError` is returned.
+  absl::Status CreateItem(absl::string_view table, double priority,
+                          absl::Span<const TrajectoryColumn> trajectory,
+                          absl::Duration timeout = absl::InfiniteDuration());
+
+  // Sends and awaits the confirmation of the pending items of all servers.
+  // `ignore_last_num_items` only applies to the server of the active episode as
+  // the items of all other servers belong to episodes which have ended.
+  absl::Status Flush(int ignore_last_num_items = 0,
+                     absl::Duration timeout = absl::InfiniteDuration());
+
+  // Ends the active episode (see `TrajectoryWriter::EndEpisode`) and routes
+  // the next episode to a server. If `DeadlineExceededError` is returned then
+  // the episode has not ended and the call can be retried. If the stream to the
+  // server of the active episode has failed then the episode is ended without
+  // waiting for its items to be confirmed (they are still retried in the
+  // background) so that the next episode can be routed to another server.
+  absl::Status EndEpisode(bool clear_buffers,
+                          absl::Duration timeout = absl::InfiniteDuration());
+
+  // Closes the writers of all servers. See `TrajectoryWriter::Close`.
+  void Close();
+
+  // Configures the column `Chunker` of the writers of all servers. See
+  // `TrajectoryWriter::ConfigureChunker`.
+  absl::Status ConfigureChunker(int column,
+                                const std::shared_ptr<ChunkerOptions>& options);
+
+  // Index of the server (i.e the stub) that the active episode is written to.
+  int active_shard() const { return active_; }
+
+  int num_shards() const { return writers_.size(); }
+
+  // ID of the active episode. This is also the key which the episode was
+  // routed by.
+  uint64_t episode_id() const { return writers_[active_]->episode_id(); }
+
+ private:
+  // Ends the episode on the server of the active episode. Waits for the
+  // pending items of the server to be confirmed unless its stream has failed
+  // since the last call to `RouteEpisode`.
+  absl::Status EndActiveEpisode(bool clear_buffers, absl::Duration timeout);
+
+  // True if the stream to `shard` has failed since it was last checked by
+  // `RouteEpisode`.
+  bool HasNewStreamFailures(int shard) const;
+
+  // Removes servers with recent stream failures from `ring_`, adds back
+  // servers whose backoff has expired and picks the server of a new episode
+  // from its ID.
+  void RouteEpisode();
+
+  // Marks `shard` as failed unless `status` is OK or `DeadlineExceededError`.
+  absl::Status CheckShard(int shard, absl::Status status);
+
+  std::vector<std::unique_ptr<TrajectoryWriter>> writers_;
+
+  // The servers that new episodes can be routed to.
+  internal::ConsistentHashRing ring_;
+
+  // Value of `TrajectoryWriter::num_stream_failures` of each writer when it
+  // was last checked by `RouteEpisode`.
+  std::vector<int64_t> num_stream_failures_;
+
+  // Time until which each server is excluded from `ring_`.
+  std::vector<absl::Time> excluded_until_;
+
+  // True for servers whose writer encountered a non transient error. The
+  // error has been returned to the caller and the server is not used again.
+  std::vector<bool> failed_;
+
+  // Index of the server that the active episode is written to.
+  int active_;
+
+  absl::BitGen bit_gen_;
+};
+
+}  // namespace reverb
+}  // namespace deepmind
+
+#endif  // REVERB_CC_SHARDED_TRAJECTORY_WRITER_H_
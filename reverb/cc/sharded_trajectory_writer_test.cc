@@ -0,0 +1,306 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/sharded_trajectory_writer.h"
+
+#include <memory>
+#include <vector>
+
+#include "grpcpp/impl/codegen/status.h"
+#include "grpcpp/test/mock_stream.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/memory/memory.h"
+#include "absl/status/status.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/types/optional.h"
+#include "reverb/cc/chunker.h"
+#include "reverb/cc/platform/logging.h"
+#include "reverb/cc/platform/status_matchers.h"
+#include "reverb/cc/reverb_service.pb.h"
+#include "reverb/cc/reverb_service_mock.grpc.pb.h"
+#include "reverb/cc/support/consistent_hash_ring.h"
+#include "reverb/cc/support/queue.h"
+#include "reverb/cc/support/signature.h"
+#include "reverb/cc/trajectory_writer.h"
+#include "tensorflow/core/framework/tensor.h"
+#include "tensorflow/core/framework/types.pb.h"
+
+namespace deepmind {
+namespace reverb {
+namespace {
+
+using ::grpc::testing::MockClientReaderWriter;
+using ::testing::_;
+using ::testing::ElementsAre;
+using ::testing::Ge;
+using ::testing::IsEmpty;
+using ::testing::Return;
+using ::testing::SizeIs;
+
+using Step = ::std::vector<::absl::optional<::tensorflow::Tensor>>;
+using StepRef = ::std::vector<::absl::optional<::std::weak_ptr<CellRef>>>;
+
+MATCHER(IsChunk, "") { return arg.has_chunk(); }
+
+MATCHER(IsItem, "") { return arg.item().send_confirmation(); }
+
+tensorflow::Tensor MakeTensor() {
+  return tensorflow::Tensor(tensorflow::DT_INT32, {1});
+}
+
+std::vector<TrajectoryColumn> MakeTrajectory(const StepRef& step) {
+  return {TrajectoryColumn({step[0].value()}, /*squeeze=*/false)};
+}
+
+// Records the requests and confirms every item.
+class FakeStream
+    : public MockClientReaderWriter<InsertStreamRequest, InsertStreamResponse> {
+ public:
+  FakeStream() : pending_confirmation_(10) {}
+
+  ~FakeStream() { pending_confirmation_.Close(); }
+
+  bool Write(const InsertStreamRequest& msg,
+             grpc::WriteOptions options) override {
+    absl::MutexLock lock(&mu_);
+    requests_.push_back(msg);
+    if (msg.item().send_confirmation()) {
+      REVERB_CHECK(pending_confirmation_.Push(msg.item().item().key()));
+    }
+    return true;
+  }
+
+  bool Read(InsertStreamResponse* response) override {
+    uint64_t confirm_id;
+    if (!pending_confirmation_.Pop(&confirm_id)) {
+      return false;
+    }
+    response->set_key(confirm_id);
+    return true;
+  }
+
+  grpc::Status Finish() override {
+    pending_confirmation_.Close();
+    return grpc::Status::OK;
+  }
+
+  std::vector<InsertStreamRequest> requests() const {
+    absl::MutexLock lock(&mu_);
+    return requests_;
+  }
+
+ private:
+  mutable absl::Mutex mu_;
+  std::vector<InsertStreamRequest> requests_ ABSL_GUARDED_BY(mu_);
+  internal::Queue<uint64_t> pending_confirmation_;
+};
+
+// Fails every write as if the server was unavailable.
+class UnavailableStream
+    : public MockClientReaderWriter<InsertStreamRequest, InsertStreamResponse> {
+ public:
+  bool Write(const InsertStreamRequest& msg,
+             grpc::WriteOptions options) override {
+    return false;
+  }
+
+  bool Read(InsertStreamResponse* response) override { return false; }
+
+  grpc::Status Finish() override {
+    return grpc::Status(grpc::StatusCode::UNAVAILABLE, "");
+  }
+};
+
+TrajectoryWriter::Options MakeOptions() {
+  return TrajectoryWriter::Options{
+      .chunker_options = std::make_shared<ConstantChunkerOptions>(
+          /*max_chunk_length=*/1, /*num_keep_alive_refs=*/1),
+  };
+}
+
+class ShardedTrajectoryWriterTest : public ::testing::Test {
+ protected:
+  std::unique_ptr<ShardedTrajectoryWriter> MakeWriter(int num_servers) {
+    std::vector<std::shared_ptr</* grpc_gen:: */ReverbService::StubInterface>>
+        stubs;
+    for (int i = 0; i < num_servers; i++) {
+      auto* stream = new FakeStream();
+      auto stub = std::make_shared</* grpc_gen:: */MockReverbServiceStub>();
+      EXPECT_CALL(*stub, InsertStreamRaw(_)).WillOnce(Return(stream));
+      streams_.push_back(stream);
+      stubs.push_back(std::move(stub));
+    }
+    return absl::make_unique<ShardedTrajectoryWriter>(std::move(stubs),
+                                                      MakeOptions());
+  }
+
+  std::vector<FakeStream*> streams_;
+};
+
+TEST_F(ShardedTrajectoryWriterTest, EpisodeIsWrittenToSingleServer) {
+  auto writer = MakeWriter(3);
+  const int shard = writer->active_shard();
+
+  for (int i = 0; i < 3; i++) {
+    StepRef step;
+    REVERB_ASSERT_OK(writer->Append(Step({MakeTensor()}), &step));
+    REVERB_ASSERT_OK(writer->CreateItem("table", 1.0, MakeTrajectory(step)));
+  }
+  REVERB_ASSERT_OK(writer->Flush());
+
+  for (int i = 0; i < 3; i++) {
+    if (i == shard) {
+      EXPECT_THAT(streams_[i]->requests(),
+                  ElementsAre(IsChunk(), IsItem(), IsChunk(), IsItem(),
+                              IsChunk(), IsItem()));
+    } else {
+      EXPECT_THAT(streams_[i]->requests(), IsEmpty());
+    }
+  }
+}
+
+TEST_F(ShardedTrajectoryWriterTest, EpisodesAreSpreadOverServers) {
+  auto writer = MakeWriter(4);
+
+  std::vector<int> num_episodes(4, 0);
+  for (int i = 0; i < 200; i++) {
+    num_episodes[writer->active_shard()]++;
+    REVERB_ASSERT_OK(writer->EndEpisode(/*clear_buffers=*/true));
+  }
+  for (int count : num_episodes) {
+    EXPECT_GT(count, 0);
+  }
+}
+
+TEST_F(ShardedTrajectoryWriterTest, ServerIsDerivedFromEpisodeId) {
+  auto writer = MakeWriter(4);
+
+  internal::ConsistentHashRing ring;
+  for (int i = 0; i < 4; i++) {
+    ring.Add(i);
+  }
+
+  for (int i = 0; i < 20; i++) {
+    const int shard = writer->active_shard();
+    const uint64_t episode_id = writer->episode_id();
+    EXPECT_EQ(ring.Lookup(episode_id), shard);
+
+    // The routing key is the episode ID which is stored in the chunks.
+    StepRef step;
+    REVERB_ASSERT_OK(writer->Append(Step({MakeTensor()}), &step));
+    REVERB_ASSERT_OK(writer->CreateItem("table", 1.0, MakeTrajectory(step)));
+    REVERB_ASSERT_OK(writer->EndEpisode(/*clear_buffers=*/true));
+
+    const auto requests = streams_[shard]->requests();
+    ASSERT_THAT(requests, SizeIs(Ge(2)));
+    const auto& chunk = requests[requests.size() - 2];
+    ASSERT_TRUE(chunk.has_chunk());
+    EXPECT_EQ(chunk.chunk().sequence_range().episode_id(), episode_id);
+  }
+}
+
+TEST_F(ShardedTrajectoryWriterTest, CreateItemRejectsDataOfEndedEpisode) {
+  auto writer = MakeWriter(2);
+
+  StepRef step;
+  REVERB_ASSERT_OK(writer->Append(Step({MakeTensor()}), &step));
+  REVERB_ASSERT_OK(writer->EndEpisode(/*clear_buffers=*/false));
+
+  EXPECT_EQ(writer->CreateItem("table", 1.0, MakeTrajectory(step)).code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
+TEST(ShardedTrajectoryWriter, UnavailableServerIsRemovedFromRing) {
+  // The first stream to server 0 fails when the item is written. The writer
+  // retries on a new stream which succeeds.
+  auto* fail_stream =
+      new MockClientReaderWriter<InsertStreamRequest, InsertStreamResponse>();
+  EXPECT_CALL(*fail_stream, Write(IsChunk(), _)).WillOnce(Return(true));
+  EXPECT_CALL(*fail_stream, Write(IsItem(), _)).WillOnce(Return(false));
+  EXPECT_CALL(*fail_stream, Read(_)).WillOnce(Return(false));
+  EXPECT_CALL(*fail_stream, Finish())
+      .WillOnce(Return(grpc::Status(grpc::StatusCode::UNAVAILABLE, "")));
+  auto* retry_stream = new FakeStream();
+  auto unavailable_stub =
+      std::make_shared</* grpc_gen:: */MockReverbServiceStub>();
+  EXPECT_CALL(*unavailable_stub, InsertStreamRaw(_))
+      .WillOnce(Return(fail_stream))
+      .WillOnce(Return(retry_stream));
+
+  auto* stream = new FakeStream();
+  auto stub = std::make_shared</* grpc_gen:: */MockReverbServiceStub>();
+  EXPECT_CALL(*stub, InsertStreamRaw(_)).WillOnce(Return(stream));
+
+  ShardedTrajectoryWriter writer({unavailable_stub, stub}, MakeOptions());
+
+  // Skip episodes until one is routed to server 0.
+  while (writer.active_shard() != 0) {
+    REVERB_ASSERT_OK(writer.EndEpisode(/*clear_buffers=*/true));
+  }
+
+  StepRef step;
+  REVERB_ASSERT_OK(writer.Append(Step({MakeTensor()}), &step));
+  REVERB_ASSERT_OK(writer.CreateItem("table", 1.0, MakeTrajectory(step)));
+  REVERB_ASSERT_OK(writer.EndEpisode(/*clear_buffers=*/true));
+  REVERB_ASSERT_OK(writer.Flush());
+  EXPECT_THAT(retry_stream->requests(), ElementsAre(IsChunk(), IsItem()));
+
+  // Server 0 is excluded from the ring for the backoff period.
+  for (int i = 0; i < 100; i++) {
+    EXPECT_EQ(writer.active_shard(), 1);
+    REVERB_ASSERT_OK(writer.EndEpisode(/*clear_buffers=*/true));
+  }
+}
+
+TEST(ShardedTrajectoryWriter, EndEpisodeDoesNotWaitForUnavailableServer) {
+  // Every stream to server 0 fails so its items are never confirmed.
+  auto unavailable_stub =
+      std::make_shared</* grpc_gen:: */MockReverbServiceStub>();
+  EXPECT_CALL(*unavailable_stub, InsertStreamRaw(_))
+      .WillRepeatedly(::testing::Invoke(
+          [](auto) { return new UnavailableStream(); }));
+
+  auto* stream = new FakeStream();
+  auto stub = std::make_shared</* grpc_gen:: */MockReverbServiceStub>();
+  EXPECT_CALL(*stub, InsertStreamRaw(_)).WillOnce(Return(stream));
+
+  ShardedTrajectoryWriter writer({unavailable_stub, stub}, MakeOptions());
+
+  // Skip episodes until one is routed to server 0.
+  while (writer.active_shard() != 0) {
+    REVERB_ASSERT_OK(writer.EndEpisode(/*clear_buffers=*/true));
+  }
+
+  StepRef step;
+  REVERB_ASSERT_OK(writer.Append(Step({MakeTensor()}), &step));
+  REVERB_ASSERT_OK(writer.CreateItem("table", 1.0, MakeTrajectory(step)));
+
+  // The episode ends even though the item is never confirmed and the new
+  // episodes are written to server 1.
+  REVERB_ASSERT_OK(writer.EndEpisode(/*clear_buffers=*/true));
+  for (int i = 0; i < 10; i++) {
+    ASSERT_EQ(writer.active_shard(), 1);
+    REVERB_ASSERT_OK(writer.Append(Step({MakeTensor()}), &step));
+    REVERB_ASSERT_OK(writer.CreateItem("table", 1.0, MakeTrajectory(step)));
+    REVERB_ASSERT_OK(writer.EndEpisode(/*clear_buffers=*/true));
+  }
+  EXPECT_THAT(stream->requests(), SizeIs(20));
+
+  writer.Close();
+}
+
+}  // namespace
+}  // namespace reverb
+}  // namespace deepmind
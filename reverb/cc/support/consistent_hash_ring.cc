@@ -0,0 +1,72 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/support/consistent_hash_ring.h"
+
+#include <algorithm>
+
+#include "reverb/cc/platform/logging.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+namespace {
+
+// The finalizer of SplitMix64. Unlike `absl::Hash` it is not seeded per
+// process so the ring is the same in every process.
+uint64_t Mix(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+}  // namespace
+
+ConsistentHashRing::ConsistentHashRing(int num_virtual_nodes)
+    : num_virtual_nodes_(num_virtual_nodes) {
+  REVERB_CHECK_GE(num_virtual_nodes, 1);
+}
+
+void ConsistentHashRing::Add(int node) {
+  if (contains(node)) return;
+  for (int i = 0; i < num_virtual_nodes_; i++) {
+    ring_.emplace_back(Mix(Mix(node) + i), node);
+  }
+  std::sort(ring_.begin(), ring_.end());
+}
+
+void ConsistentHashRing::Remove(int node) {
+  ring_.erase(std::remove_if(ring_.begin(), ring_.end(),
+                             [node](const auto& p) { return p.second == node; }),
+              ring_.end());
+}
+
+int ConsistentHashRing::Lookup(uint64_t key) const {
+  if (ring_.empty()) return -1;
+  auto it = std::lower_bound(
+      ring_.begin(), ring_.end(), Mix(key),
+      [](const auto& p, uint64_t hash) { return p.first < hash; });
+  if (it == ring_.end()) it = ring_.begin();
+  return it->second;
+}
+
+bool ConsistentHashRing::contains(int node) const {
+  return std::any_of(ring_.begin(), ring_.end(),
+                     [node](const auto& p) { return p.second == node; });
+}
+
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
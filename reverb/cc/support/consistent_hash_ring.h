@@ -0,0 +1,69 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REVERB_CC_SUPPORT_CONSISTENT_HASH_RING_H_
+#define REVERB_CC_SUPPORT_CONSISTENT_HASH_RING_H_
+
+#include <utility>
+#include <vector>
+
+#include <cstdint>
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+
+// Maps keys onto a dynamic set of nodes (e.g. the servers of a sharded table)
+// using consistent hashing. Each node is placed at `num_virtual_nodes` points
+// on a ring of 64 bit hashes and a key is owned by the first node point at or
+// after the hash of the key. Adding or removing a node therefore only moves
+// the keys owned by that node.
+//
+// Hashes are deterministic so the same keys map to the same nodes in every
+// process.
+//
+// This class is not thread safe.
+class ConsistentHashRing {
+ public:
+  explicit ConsistentHashRing(int num_virtual_nodes = 64);
+
+  // Adds `node` to the ring. No-op if `node` is already part of the ring.
+  void Add(int node);
+
+  // Removes `node` from the ring. No-op if `node` is not part of the ring.
+  void Remove(int node);
+
+  // Returns the node which owns `key` or -1 if the ring is empty.
+  int Lookup(uint64_t key) const;
+
+  // True if `node` is part of the ring.
+  bool contains(int node) const;
+
+  // Number of nodes in the ring.
+  int size() const { return ring_.size() / num_virtual_nodes_; }
+
+  bool empty() const { return ring_.empty(); }
+
+ private:
+  const int num_virtual_nodes_;
+
+  // Points of the ring as (hash, node) pairs sorted by hash.
+  std::vector<std::pair<uint64_t, int>> ring_;
+};
+
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
+
+#endif  // REVERB_CC_SUPPORT_CONSISTENT_HASH_RING_H_
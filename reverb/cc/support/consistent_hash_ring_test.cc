@@ -0,0 +1,99 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/support/consistent_hash_ring.h"
+
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+namespace {
+
+constexpr int kNumKeys = 10000;
+
+std::vector<int> LookupAll(const ConsistentHashRing& ring) {
+  std::vector<int> nodes;
+  for (uint64_t key = 0; key < kNumKeys; key++) {
+    nodes.push_back(ring.Lookup(key));
+  }
+  return nodes;
+}
+
+TEST(ConsistentHashRingTest, EmptyRing) {
+  ConsistentHashRing ring;
+  EXPECT_TRUE(ring.empty());
+  EXPECT_EQ(ring.size(), 0);
+  EXPECT_EQ(ring.Lookup(1), -1);
+}
+
+TEST(ConsistentHashRingTest, AddIsIdempotent) {
+  ConsistentHashRing ring;
+  ring.Add(3);
+  ring.Add(3);
+  EXPECT_EQ(ring.size(), 1);
+  EXPECT_TRUE(ring.contains(3));
+  EXPECT_FALSE(ring.contains(0));
+  EXPECT_EQ(ring.Lookup(1), 3);
+}
+
+TEST(ConsistentHashRingTest, KeysAreSpreadOverNodes) {
+  ConsistentHashRing ring;
+  for (int i = 0; i < 4; i++) ring.Add(i);
+
+  std::vector<int> counts(4, 0);
+  for (int node : LookupAll(ring)) counts[node]++;
+  for (int count : counts) {
+    EXPECT_GT(count, kNumKeys / 8);
+    EXPECT_LT(count, kNumKeys / 2);
+  }
+}
+
+TEST(ConsistentHashRingTest, RemoveOnlyMovesKeysOfRemovedNode) {
+  ConsistentHashRing ring;
+  for (int i = 0; i < 4; i++) ring.Add(i);
+  auto before = LookupAll(ring);
+
+  ring.Remove(2);
+  EXPECT_EQ(ring.size(), 3);
+  EXPECT_FALSE(ring.contains(2));
+  auto after = LookupAll(ring);
+  for (int i = 0; i < kNumKeys; i++) {
+    EXPECT_NE(after[i], 2);
+    if (before[i] != 2) {
+      EXPECT_EQ(after[i], before[i]);
+    }
+  }
+
+  ring.Add(2);
+  EXPECT_EQ(LookupAll(ring), before);
+}
+
+TEST(ConsistentHashRingTest, MappingDoesNotDependOnInsertionOrder) {
+  ConsistentHashRing a;
+  ConsistentHashRing b;
+  for (int i = 0; i < 4; i++) {
+    a.Add(i);
+    b.Add(3 - i);
+  }
+  EXPECT_EQ(LookupAll(a), LookupAll(b));
+}
+
+}  // namespace
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
@@ -0,0 +1,90 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/support/lock_stats.h"
+
+#include <algorithm>
+
+#include <cstdint>
+#include "absl/time/time.h"
+#include "reverb/cc/schema.pb.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+namespace {
+
+int BucketIndex(int64_t ns) {
+  if (ns <= 0) return 0;
+  // Number of significant bits, i.e `i` such that 2^(i-1) <= ns < 2^i.
+  const int bits = 64 - __builtin_clzll(static_cast<uint64_t>(ns));
+  return std::min(bits, LockStats::kNumBuckets - 1);
+}
+
+}  // namespace
+
+void LockStats::RecordWait(Op op, int64_t wait_ns) {
+  ops_[op].wait.Record(wait_ns);
+}
+
+void LockStats::RecordHold(Op op, int64_t hold_ns) {
+  ops_[op].hold.Record(hold_ns);
+}
+
+void LockStats::Histogram::Record(int64_t ns) {
+  // The clock is not monotonic so a duration can be (slightly) negative if the
+  // clock is adjusted while it is measured.
+  ns = std::max<int64_t>(ns, 0);
+  count.fetch_add(1, std::memory_order_relaxed);
+  total_ns.fetch_add(ns, std::memory_order_relaxed);
+  buckets[BucketIndex(ns)].fetch_add(1, std::memory_order_relaxed);
+}
+
+void LockStats::Histogram::ToProto(LockTimeHistogram* proto) const {
+  proto->set_count(count.load(std::memory_order_relaxed));
+  const absl::Duration total =
+      absl::Nanoseconds(total_ns.load(std::memory_order_relaxed));
+  proto->mutable_total()->set_seconds(absl::ToInt64Seconds(total));
+  proto->mutable_total()->set_nanos(absl::ToInt64Nanoseconds(
+      total - absl::Seconds(proto->total().seconds())));
+
+  int num_buckets = kNumBuckets;
+  while (num_buckets > 0 &&
+         buckets[num_buckets - 1].load(std::memory_order_relaxed) == 0) {
+    num_buckets--;
+  }
+  for (int i = 0; i < num_buckets; i++) {
+    proto->add_buckets(buckets[i].load(std::memory_order_relaxed));
+  }
+}
+
+TableLockStats LockStats::ToProto() const {
+  TableLockStats proto;
+  auto set = [this](Op op, LockOpStats* out) {
+    ops_[op].wait.ToProto(out->mutable_wait());
+    ops_[op].hold.ToProto(out->mutable_hold());
+  };
+  set(kInsert, proto.mutable_insert());
+  set(kSample, proto.mutable_sample());
+  set(kMutate, proto.mutable_mutate());
+  set(kCheckpoint, proto.mutable_checkpoint());
+  set(kInfo, proto.mutable_info());
+  set(kOther, proto.mutable_other());
+  set(kExtensions, proto.mutable_extensions());
+  return proto;
+}
+
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
@@ -0,0 +1,178 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REVERB_CC_SUPPORT_LOCK_STATS_H_
+#define REVERB_CC_SUPPORT_LOCK_STATS_H_
+
+#include <array>
+#include <atomic>
+
+#include <cstdint>
+#include "absl/base/thread_annotations.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/clock.h"
+#include "reverb/cc/schema.pb.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+
+// Collects how long callers wait for, and then hold, a mutex. The stats are
+// broken down by the operation which acquired the lock.
+//
+// Collection is disabled by default. Recording reads the clock twice per
+// acquisition and updates counters which are shared by all threads, which adds
+// measurable overhead to heavily contended locks. While disabled,
+// `TimedMutexLock` and `ScopedHoldTimer` do neither.
+//
+// This class is thread safe.
+class LockStats {
+ public:
+  enum Op {
+    kInsert = 0,
+    kSample,
+    kMutate,
+    kCheckpoint,
+    kInfo,
+    kOther,
+    // Time spent in `TableExtension` hooks. Only the hold time is recorded as
+    // the hooks are called with the lock already held.
+    kExtensions,
+    kNumOps,
+  };
+
+  // Durations are bucketed by powers of two nanoseconds. Bucket `i` counts
+  // durations in [2^(i-1), 2^i) ns and bucket 0 counts durations below 1ns.
+  static constexpr int kNumBuckets = 40;
+
+  // Enables or disables the collection of new stats. Stats which have already
+  // been collected are kept.
+  void set_enabled(bool enabled) {
+    enabled_.store(enabled, std::memory_order_relaxed);
+  }
+
+  bool enabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+  // Records that `op` waited `wait_ns` to acquire the lock.
+  void RecordWait(Op op, int64_t wait_ns);
+
+  // Records that `op` held the lock for `hold_ns`.
+  void RecordHold(Op op, int64_t hold_ns);
+
+  // Returns a snapshot of the stats.
+  TableLockStats ToProto() const;
+
+  // Current time in nanoseconds.
+  static int64_t Now() { return absl::GetCurrentTimeNanos(); }
+
+ private:
+  struct Histogram {
+    std::atomic<int64_t> count{0};
+    std::atomic<int64_t> total_ns{0};
+    std::array<std::atomic<int64_t>, kNumBuckets> buckets{};
+
+    void Record(int64_t ns);
+    void ToProto(LockTimeHistogram* proto) const;
+  };
+
+  struct OpStats {
+    Histogram wait;
+    Histogram hold;
+  };
+
+  std::atomic<bool> enabled_{false};
+
+  std::array<OpStats, kNumOps> ops_;
+};
+
+// Same as `absl::MutexLock` but records the wait and hold times of the lock in
+// `stats`.
+class ABSL_SCOPED_LOCKABLE TimedMutexLock {
+ public:
+  TimedMutexLock(absl::Mutex* mu, LockStats* stats, LockStats::Op op)
+      ABSL_EXCLUSIVE_LOCK_FUNCTION(mu)
+      : mu_(mu), stats_(stats), op_(op), timed_(stats->enabled()) {
+    if (!timed_) {
+      mu_->Lock();
+      return;
+    }
+    const int64_t start = LockStats::Now();
+    mu_->Lock();
+    acquired_at_ = LockStats::Now();
+    stats_->RecordWait(op_, acquired_at_ - start);
+  }
+
+  ~TimedMutexLock() ABSL_UNLOCK_FUNCTION() {
+    if (!timed_) {
+      mu_->Unlock();
+      return;
+    }
+    const int64_t held = LockStats::Now() - acquired_at_ - excluded_;
+    mu_->Unlock();
+    stats_->RecordHold(op_, held);
+  }
+
+  // Calls `fn`, which may temporarily release the lock (e.g `CondVar::Wait`),
+  // and excludes the time spent in `fn` from the hold time. Used for blocking
+  // waits where the lock is not held for most of the time.
+  template <typename F>
+  auto ExcludeFromHoldTime(F fn) -> decltype(fn()) {
+    if (!timed_) return fn();
+    const int64_t start = LockStats::Now();
+    auto result = fn();
+    excluded_ += LockStats::Now() - start;
+    return result;
+  }
+
+  TimedMutexLock(const TimedMutexLock&) = delete;
+  TimedMutexLock& operator=(const TimedMutexLock&) = delete;
+
+ private:
+  absl::Mutex* const mu_;
+  LockStats* const stats_;
+  const LockStats::Op op_;
+  // Whether `stats_` was enabled when the lock was acquired.
+  const bool timed_;
+  int64_t acquired_at_ = 0;
+  int64_t excluded_ = 0;
+};
+
+// Records the time between construction and destruction as hold time of `op`.
+// Used to time sections which run while a `TimedMutexLock` is already held.
+class ScopedHoldTimer {
+ public:
+  ScopedHoldTimer(LockStats* stats, LockStats::Op op)
+      : stats_(stats),
+        op_(op),
+        start_(stats->enabled() ? LockStats::Now() : -1) {}
+
+  ~ScopedHoldTimer() {
+    if (start_ >= 0) stats_->RecordHold(op_, LockStats::Now() - start_);
+  }
+
+  ScopedHoldTimer(const ScopedHoldTimer&) = delete;
+  ScopedHoldTimer& operator=(const ScopedHoldTimer&) = delete;
+
+ private:
+  LockStats* const stats_;
+  const LockStats::Op op_;
+  // -1 if `stats_` was disabled at construction.
+  const int64_t start_;
+};
+
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
+
+#endif  // REVERB_CC_SUPPORT_LOCK_STATS_H_
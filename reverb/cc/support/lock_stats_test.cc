@@ -0,0 +1,147 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/support/lock_stats.h"
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "reverb/cc/platform/thread.h"
+#include "reverb/cc/schema.pb.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+namespace {
+
+absl::Duration ToDuration(const google::protobuf::Duration& proto) {
+  return absl::Seconds(proto.seconds()) + absl::Nanoseconds(proto.nanos());
+}
+
+TEST(LockStatsTest, EmptyStats) {
+  LockStats stats;
+  auto proto = stats.ToProto();
+  EXPECT_EQ(proto.insert().wait().count(), 0);
+  EXPECT_EQ(proto.insert().hold().count(), 0);
+  EXPECT_EQ(proto.insert().hold().buckets_size(), 0);
+}
+
+TEST(LockStatsTest, RecordsWaitAndHoldTimesPerOp) {
+  absl::Mutex mu;
+  LockStats stats;
+  stats.set_enabled(true);
+  {
+    TimedMutexLock lock(&mu, &stats, LockStats::kSample);
+    absl::SleepFor(absl::Milliseconds(10));
+  }
+  {
+    TimedMutexLock lock(&mu, &stats, LockStats::kSample);
+  }
+  {
+    TimedMutexLock lock(&mu, &stats, LockStats::kInsert);
+  }
+
+  auto proto = stats.ToProto();
+  EXPECT_EQ(proto.sample().wait().count(), 2);
+  EXPECT_EQ(proto.sample().hold().count(), 2);
+  EXPECT_GE(ToDuration(proto.sample().hold().total()), absl::Milliseconds(10));
+  EXPECT_EQ(proto.insert().wait().count(), 1);
+  EXPECT_EQ(proto.insert().hold().count(), 1);
+  EXPECT_EQ(proto.mutate().hold().count(), 0);
+
+  // The 10ms hold lands in a bucket for durations >= 2^23 ns.
+  int64_t total = 0;
+  for (int64_t count : proto.sample().hold().buckets()) total += count;
+  EXPECT_EQ(total, 2);
+  EXPECT_GE(proto.sample().hold().buckets_size(), 25);
+}
+
+TEST(LockStatsTest, RecordsWaitTime) {
+  absl::Mutex mu;
+  LockStats stats;
+  stats.set_enabled(true);
+  mu.Lock();
+  auto thread = StartThread("", [&] {
+    TimedMutexLock lock(&mu, &stats, LockStats::kMutate);
+  });
+  absl::SleepFor(absl::Milliseconds(10));
+  mu.Unlock();
+  thread = nullptr;  // Joins the thread.
+
+  auto proto = stats.ToProto();
+  EXPECT_EQ(proto.mutate().wait().count(), 1);
+  EXPECT_GE(ToDuration(proto.mutate().wait().total()), absl::Milliseconds(5));
+}
+
+TEST(LockStatsTest, ExcludedTimeIsNotCountedAsHeld) {
+  absl::Mutex mu;
+  LockStats stats;
+  stats.set_enabled(true);
+  {
+    TimedMutexLock lock(&mu, &stats, LockStats::kInsert);
+    EXPECT_EQ(lock.ExcludeFromHoldTime([] {
+      absl::SleepFor(absl::Milliseconds(50));
+      return 1;
+    }),
+              1);
+  }
+
+  auto proto = stats.ToProto();
+  EXPECT_EQ(proto.insert().hold().count(), 1);
+  EXPECT_LT(ToDuration(proto.insert().hold().total()), absl::Milliseconds(50));
+}
+
+TEST(LockStatsTest, ScopedHoldTimer) {
+  LockStats stats;
+  stats.set_enabled(true);
+  {
+    ScopedHoldTimer timer(&stats, LockStats::kExtensions);
+    absl::SleepFor(absl::Milliseconds(1));
+  }
+
+  auto proto = stats.ToProto();
+  EXPECT_EQ(proto.extensions().wait().count(), 0);
+  EXPECT_EQ(proto.extensions().hold().count(), 1);
+  EXPECT_GE(ToDuration(proto.extensions().hold().total()),
+            absl::Milliseconds(1));
+}
+
+TEST(LockStatsTest, NothingIsRecordedWhileDisabled) {
+  absl::Mutex mu;
+  LockStats stats;
+  {
+    TimedMutexLock lock(&mu, &stats, LockStats::kInsert);
+    ScopedHoldTimer timer(&stats, LockStats::kExtensions);
+  }
+  stats.set_enabled(true);
+  {
+    TimedMutexLock lock(&mu, &stats, LockStats::kInsert);
+  }
+  stats.set_enabled(false);
+  {
+    TimedMutexLock lock(&mu, &stats, LockStats::kInsert);
+  }
+
+  auto proto = stats.ToProto();
+  EXPECT_EQ(proto.insert().wait().count(), 1);
+  EXPECT_EQ(proto.insert().hold().count(), 1);
+  EXPECT_EQ(proto.extensions().hold().count(), 0);
+}
+
+}  // namespace
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
@@ -0,0 +1,162 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/support/metrics.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+namespace {
+
+std::atomic<int> next_metric_shard{0};
+
+// Escapes a label value as required by the text exposition format.
+std::string EscapeLabelValue(absl::string_view value) {
+  std::string escaped;
+  escaped.reserve(value.size());
+  for (char c : value) {
+    switch (c) {
+      case '\\':
+        escaped.append("\\\\");
+        break;
+      case '"':
+        escaped.append("\\\"");
+        break;
+      case '\n':
+        escaped.append("\\n");
+        break;
+      default:
+        escaped.push_back(c);
+    }
+  }
+  return escaped;
+}
+
+std::string FormatDouble(double value) {
+  if (std::isinf(value)) return value > 0 ? "+Inf" : "-Inf";
+  if (std::isnan(value)) return "NaN";
+  return absl::StrFormat("%.15g", value);
+}
+
+}  // namespace
+
+constexpr std::array<double, LatencyHistogram::kNumBounds>
+    LatencyHistogram::kBucketBounds;
+
+int CurrentThreadMetricShard() {
+  thread_local const int shard =
+      next_metric_shard.fetch_add(1, std::memory_order_relaxed) %
+      kNumMetricShards;
+  return shard;
+}
+
+int64_t StripedCounter::Value() const {
+  int64_t sum = 0;
+  for (const auto& shard : shards_) {
+    sum += shard.value.load(std::memory_order_relaxed);
+  }
+  return sum;
+}
+
+void LatencyHistogram::Record(absl::Duration duration) {
+  const double seconds = absl::ToDoubleSeconds(duration);
+  const int bucket =
+      std::lower_bound(kBucketBounds.begin(), kBucketBounds.end(), seconds) -
+      kBucketBounds.begin();
+  Shard& shard = shards_[CurrentThreadMetricShard()];
+  shard.bucket_counts[bucket].fetch_add(1, std::memory_order_relaxed);
+  shard.sum_ns.fetch_add(absl::ToInt64Nanoseconds(duration),
+                         std::memory_order_relaxed);
+}
+
+LatencyHistogram::Snapshot LatencyHistogram::Collect() const {
+  Snapshot snapshot;
+  snapshot.bucket_counts.resize(kNumBounds + 1, 0);
+  int64_t sum_ns = 0;
+  for (const auto& shard : shards_) {
+    for (int i = 0; i < shard.bucket_counts.size(); i++) {
+      const int64_t count =
+          shard.bucket_counts[i].load(std::memory_order_relaxed);
+      snapshot.bucket_counts[i] += count;
+      snapshot.count += count;
+    }
+    sum_ns += shard.sum_ns.load(std::memory_order_relaxed);
+  }
+  snapshot.sum_seconds = static_cast<double>(sum_ns) / 1e9;
+  return snapshot;
+}
+
+void PrometheusTextBuilder::AddFamily(absl::string_view name,
+                                      absl::string_view type,
+                                      absl::string_view help) {
+  absl::StrAppend(&text_, "# HELP ", name, " ", help, "\n", "# TYPE ", name,
+                  " ", type, "\n");
+}
+
+void PrometheusTextBuilder::AppendName(absl::string_view name,
+                                       const Labels& labels) {
+  absl::StrAppend(&text_, name);
+  if (labels.empty()) return;
+  text_.push_back('{');
+  for (int i = 0; i < labels.size(); i++) {
+    if (i > 0) text_.push_back(',');
+    absl::StrAppend(&text_, labels[i].first, "=\"",
+                    EscapeLabelValue(labels[i].second), "\"");
+  }
+  text_.push_back('}');
+}
+
+void PrometheusTextBuilder::AddSample(absl::string_view name,
+                                      const Labels& labels, int64_t value) {
+  AppendName(name, labels);
+  absl::StrAppend(&text_, " ", value, "\n");
+}
+
+void PrometheusTextBuilder::AddSample(absl::string_view name,
+                                      const Labels& labels, double value) {
+  AppendName(name, labels);
+  absl::StrAppend(&text_, " ", FormatDouble(value), "\n");
+}
+
+void PrometheusTextBuilder::AddHistogram(
+    absl::string_view name, const Labels& labels,
+    const LatencyHistogram::Snapshot& snapshot) {
+  const std::string bucket_name = absl::StrCat(name, "_bucket");
+  Labels bucket_labels = labels;
+  bucket_labels.emplace_back("le", "");
+
+  // Buckets are cumulative in the exposition format.
+  int64_t cumulative = 0;
+  for (int i = 0; i < snapshot.bucket_counts.size(); i++) {
+    cumulative += snapshot.bucket_counts[i];
+    bucket_labels.back().second =
+        FormatDouble(i < LatencyHistogram::kNumBounds
+                         ? LatencyHistogram::kBucketBounds[i]
+                         : std::numeric_limits<double>::infinity());
+    AddSample(bucket_name, bucket_labels, cumulative);
+  }
+  AddSample(absl::StrCat(name, "_sum"), labels, snapshot.sum_seconds);
+  AddSample(absl::StrCat(name, "_count"), labels, snapshot.count);
+}
+
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
@@ -0,0 +1,152 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REVERB_CC_SUPPORT_METRICS_H_
+#define REVERB_CC_SUPPORT_METRICS_H_
+
+#include <array>
+#include <atomic>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <cstdint>
+#include "absl/base/optimization.h"
+#include "absl/strings/string_view.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+
+// Number of shards of `StripedCounter` and `LatencyHistogram`.
+constexpr int kNumMetricShards = 16;
+
+// Returns the metric shard of the calling thread. Threads are assigned shards
+// round robin the first time they call this function, so as long as there are
+// at most `kNumMetricShards` threads updating a metric they never share a
+// cache line.
+int CurrentThreadMetricShard();
+
+// Counter which is updated with relaxed atomics on a per-thread shard and
+// aggregated when read. Updates never take a lock and rarely contend, so the
+// counter can be used on hot paths. Negative deltas are allowed so the counter
+// can also be used as a gauge (e.g the number of open streams).
+//
+// This class is thread safe.
+class StripedCounter {
+ public:
+  void Add(int64_t delta) {
+    shards_[CurrentThreadMetricShard()].value.fetch_add(
+        delta, std::memory_order_relaxed);
+  }
+
+  void Increment() { Add(1); }
+  void Decrement() { Add(-1); }
+
+  // Sum of all shards. Concurrent updates may or may not be included.
+  int64_t Value() const;
+
+ private:
+  struct alignas(ABSL_CACHELINE_SIZE) Shard {
+    std::atomic<int64_t> value{0};
+  };
+
+  std::array<Shard, kNumMetricShards> shards_;
+};
+
+// Histogram of durations with fixed, Prometheus style, bucket bounds. Like
+// `StripedCounter`, every thread records into its own shard and the shards are
+// merged by `Collect`.
+//
+// This class is thread safe.
+class LatencyHistogram {
+ public:
+  // Inclusive upper bounds, in seconds, of all but the last bucket. The last
+  // bucket counts the durations above the largest bound.
+  static constexpr int kNumBounds = 20;
+  static constexpr std::array<double, kNumBounds> kBucketBounds = {
+      1e-5, 2.5e-5, 5e-5, 1e-4, 2.5e-4, 5e-4, 1e-3, 2.5e-3, 5e-3, 1e-2,
+      2.5e-2, 5e-2, 0.1, 0.25, 0.5, 1, 2.5, 10, 60, 600};
+
+  struct Snapshot {
+    // Number of durations per bucket (not cumulative). Has
+    // `kNumBounds + 1` elements.
+    std::vector<int64_t> bucket_counts;
+    int64_t count = 0;
+    double sum_seconds = 0;
+  };
+
+  void Record(absl::Duration duration);
+
+  // Merges the shards. Concurrent updates may or may not be included.
+  Snapshot Collect() const;
+
+ private:
+  struct alignas(ABSL_CACHELINE_SIZE) Shard {
+    std::array<std::atomic<int64_t>, kNumBounds + 1> bucket_counts{};
+    std::atomic<int64_t> sum_ns{0};
+  };
+
+  std::array<Shard, kNumMetricShards> shards_;
+};
+
+// Records the time between construction and destruction in a histogram.
+class ScopedLatencyRecorder {
+ public:
+  explicit ScopedLatencyRecorder(LatencyHistogram* histogram)
+      : histogram_(histogram), start_(absl::Now()) {}
+
+  ~ScopedLatencyRecorder() { histogram_->Record(absl::Now() - start_); }
+
+  ScopedLatencyRecorder(const ScopedLatencyRecorder&) = delete;
+  ScopedLatencyRecorder& operator=(const ScopedLatencyRecorder&) = delete;
+
+ private:
+  LatencyHistogram* const histogram_;
+  const absl::Time start_;
+};
+
+// Builds a document in the Prometheus text exposition format (version 0.0.4).
+// The samples of a metric family must be added directly after the family.
+class PrometheusTextBuilder {
+ public:
+  using Labels = std::vector<std::pair<std::string, std::string>>;
+
+  // Starts a new metric family. `type` is one of "counter", "gauge" or
+  // "histogram".
+  void AddFamily(absl::string_view name, absl::string_view type,
+                 absl::string_view help);
+
+  void AddSample(absl::string_view name, const Labels& labels, int64_t value);
+  void AddSample(absl::string_view name, const Labels& labels, double value);
+
+  // Adds the `_bucket`, `_sum` and `_count` samples of a histogram.
+  void AddHistogram(absl::string_view name, const Labels& labels,
+                    const LatencyHistogram::Snapshot& snapshot);
+
+  const std::string& text() const { return text_; }
+
+ private:
+  void AppendName(absl::string_view name, const Labels& labels);
+
+  std::string text_;
+};
+
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
+
+#endif  // REVERB_CC_SUPPORT_METRICS_H_
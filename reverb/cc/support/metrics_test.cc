@@ -0,0 +1,100 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/support/metrics.h"
+
+#include <memory>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/time/time.h"
+#include "reverb/cc/platform/thread.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+namespace {
+
+using ::testing::HasSubstr;
+
+TEST(StripedCounterTest, SumsUpdatesFromAllThreads) {
+  StripedCounter counter;
+  std::vector<std::unique_ptr<Thread>> threads;
+  for (int i = 0; i < 2 * kNumMetricShards; i++) {
+    threads.push_back(StartThread("", [&counter] {
+      for (int j = 0; j < 1000; j++) counter.Increment();
+    }));
+  }
+  threads.clear();  // Joins all threads.
+  EXPECT_EQ(counter.Value(), 2 * kNumMetricShards * 1000);
+}
+
+TEST(StripedCounterTest, SupportsNegativeDeltas) {
+  StripedCounter counter;
+  counter.Add(5);
+  counter.Decrement();
+  counter.Add(-2);
+  EXPECT_EQ(counter.Value(), 2);
+}
+
+TEST(LatencyHistogramTest, BucketsDurations) {
+  LatencyHistogram histogram;
+  histogram.Record(absl::Microseconds(5));   // <= 1e-5.
+  histogram.Record(absl::Microseconds(10));  // <= 1e-5 (inclusive bound).
+  histogram.Record(absl::Milliseconds(3));   // <= 5e-3.
+  histogram.Record(absl::Hours(1));          // +Inf.
+
+  auto snapshot = histogram.Collect();
+  EXPECT_EQ(snapshot.count, 4);
+  EXPECT_NEAR(snapshot.sum_seconds, 3600.003015, 1e-9);
+  ASSERT_EQ(snapshot.bucket_counts.size(), LatencyHistogram::kNumBounds + 1);
+  EXPECT_EQ(snapshot.bucket_counts[0], 2);
+  EXPECT_EQ(snapshot.bucket_counts[8], 1);
+  EXPECT_EQ(snapshot.bucket_counts.back(), 1);
+}
+
+TEST(PrometheusTextBuilderTest, FormatsCountersAndGauges) {
+  PrometheusTextBuilder builder;
+  builder.AddFamily("reverb_items", "gauge", "Number of items.");
+  builder.AddSample("reverb_items", {{"table", "a\"b"}}, int64_t{3});
+  builder.AddSample("reverb_items", {}, 0.5);
+  EXPECT_EQ(builder.text(),
+            "# HELP reverb_items Number of items.\n"
+            "# TYPE reverb_items gauge\n"
+            "reverb_items{table=\"a\\\"b\"} 3\n"
+            "reverb_items 0.5\n");
+}
+
+TEST(PrometheusTextBuilderTest, HistogramBucketsAreCumulative) {
+  LatencyHistogram histogram;
+  histogram.Record(absl::Microseconds(1));
+  histogram.Record(absl::Seconds(1));
+  histogram.Record(absl::Hours(1));
+
+  PrometheusTextBuilder builder;
+  builder.AddHistogram("latency", {{"op", "x"}}, histogram.Collect());
+  const std::string& text = builder.text();
+  EXPECT_THAT(text, HasSubstr("latency_bucket{op=\"x\",le=\"1e-05\"} 1\n"));
+  EXPECT_THAT(text, HasSubstr("latency_bucket{op=\"x\",le=\"0.5\"} 1\n"));
+  EXPECT_THAT(text, HasSubstr("latency_bucket{op=\"x\",le=\"1\"} 2\n"));
+  EXPECT_THAT(text, HasSubstr("latency_bucket{op=\"x\",le=\"+Inf\"} 3\n"));
+  EXPECT_THAT(text, HasSubstr("latency_count{op=\"x\"} 3\n"));
+  EXPECT_THAT(text, HasSubstr("latency_sum{op=\"x\"} 3601.000001\n"));
+}
+
+}  // namespace
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
@@ -0,0 +1,132 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/support/packed_trajectory.h"
+
+#include <vector>
+
+#include "absl/memory/memory.h"
+#include "reverb/cc/platform/hash_map.h"
+#include "reverb/cc/platform/logging.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+
+PackedTrajectory::PackedTrajectory(const FlatTrajectory& trajectory) {
+  // Assign indices to the chunks in order of first reference.
+  std::vector<uint64_t> chunk_keys;
+  internal::flat_hash_map<uint64_t, uint32_t> chunk_indices;
+  int num_slices = 0;
+  for (const auto& col : trajectory.columns()) {
+    for (const auto& slice : col.chunk_slices()) {
+      if (chunk_indices.emplace(slice.chunk_key(), chunk_keys.size()).second) {
+        chunk_keys.push_back(slice.chunk_key());
+      }
+    }
+    num_slices += col.chunk_slices_size();
+  }
+
+  num_words_ = kHeaderSize + 2 * chunk_keys.size() +
+               trajectory.columns_size() + kSliceSize * num_slices;
+  words_ = absl::make_unique<uint32_t[]>(num_words_);
+
+  uint32_t* out = words_.get();
+  *out++ = trajectory.columns_size();
+  *out++ = chunk_keys.size();
+  for (uint64_t key : chunk_keys) {
+    *out++ = static_cast<uint32_t>(key);
+    *out++ = static_cast<uint32_t>(key >> 32);
+  }
+
+  uint32_t slice_end = 0;
+  for (const auto& col : trajectory.columns()) {
+    slice_end += col.chunk_slices_size();
+    REVERB_CHECK_LT(slice_end, kSqueezeBit);
+    *out++ = slice_end | (col.squeeze() ? kSqueezeBit : 0);
+  }
+
+  for (const auto& col : trajectory.columns()) {
+    for (const auto& slice : col.chunk_slices()) {
+      *out++ = chunk_indices[slice.chunk_key()];
+      *out++ = slice.offset();
+      *out++ = slice.length();
+      *out++ = slice.index();
+    }
+  }
+  REVERB_CHECK_EQ(out - words_.get(), num_words_);
+}
+
+int PackedTrajectory::num_columns() const {
+  return num_words_ == 0 ? 0 : words_[0];
+}
+
+int PackedTrajectory::num_chunks() const {
+  return num_words_ == 0 ? 0 : words_[1];
+}
+
+uint64_t PackedTrajectory::chunk_key(int index) const {
+  const uint32_t* key = &words_[kHeaderSize + 2 * index];
+  return static_cast<uint64_t>(key[0]) | (static_cast<uint64_t>(key[1]) << 32);
+}
+
+int PackedTrajectory::SliceBegin(int column) const {
+  return column == 0 ? 0 : SliceEnd(column - 1);
+}
+
+int PackedTrajectory::SliceEnd(int column) const {
+  return words_[kHeaderSize + 2 * num_chunks() + column] & ~kSqueezeBit;
+}
+
+const uint32_t* PackedTrajectory::slice(int index) const {
+  return &words_[kHeaderSize + 2 * num_chunks() + num_columns() +
+                 kSliceSize * index];
+}
+
+int PackedTrajectory::ColumnLength(int column) const {
+  REVERB_CHECK_GE(column, 0);
+  REVERB_CHECK_LT(column, num_columns());
+  int length = 0;
+  for (int i = SliceBegin(column); i < SliceEnd(column); i++) {
+    length += static_cast<int32_t>(slice(i)[2]);
+  }
+  return length;
+}
+
+FlatTrajectory PackedTrajectory::ToProto() const {
+  FlatTrajectory proto;
+  proto.mutable_columns()->Reserve(num_columns());
+  for (int c = 0; c < num_columns(); c++) {
+    auto* col = proto.add_columns();
+    col->set_squeeze(words_[kHeaderSize + 2 * num_chunks() + c] & kSqueezeBit);
+    col->mutable_chunk_slices()->Reserve(SliceEnd(c) - SliceBegin(c));
+    for (int i = SliceBegin(c); i < SliceEnd(c); i++) {
+      const uint32_t* packed = slice(i);
+      auto* out = col->add_chunk_slices();
+      out->set_chunk_key(chunk_key(packed[0]));
+      out->set_offset(static_cast<int32_t>(packed[1]));
+      out->set_length(static_cast<int32_t>(packed[2]));
+      out->set_index(static_cast<int32_t>(packed[3]));
+    }
+  }
+  return proto;
+}
+
+size_t PackedTrajectory::ByteSize() const {
+  return num_words_ * sizeof(uint32_t);
+}
+
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
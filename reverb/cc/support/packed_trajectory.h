@@ -0,0 +1,79 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REVERB_CC_SUPPORT_PACKED_TRAJECTORY_H_
+#define REVERB_CC_SUPPORT_PACKED_TRAJECTORY_H_
+
+#include <memory>
+
+#include <cstdint>
+#include "reverb/cc/schema.pb.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+
+// Immutable and compact encoding of a `FlatTrajectory`.
+//
+// A `FlatTrajectory` proto allocates one message per column and per chunk
+// slice. Tables hold millions of trajectories for long periods of time so they
+// are instead packed into a single array of 32 bit words:
+//
+//   [num_columns, num_chunks,
+//    chunk keys (two words each, in order of first reference),
+//    end of the slices of each column (squeeze flag in the top bit),
+//    chunk index, offset, length and tensor index of each slice]
+//
+class PackedTrajectory {
+ public:
+  PackedTrajectory() = default;
+  explicit PackedTrajectory(const FlatTrajectory& trajectory);
+
+  PackedTrajectory(PackedTrajectory&&) = default;
+  PackedTrajectory& operator=(PackedTrajectory&&) = default;
+
+  // Decodes the trajectory.
+  FlatTrajectory ToProto() const;
+
+  // Number of columns in the trajectory.
+  int num_columns() const;
+
+  // Number of steps referenced by `column`.
+  int ColumnLength(int column) const;
+
+  // Number of bytes allocated by the encoding.
+  size_t ByteSize() const;
+
+ private:
+  static constexpr int kHeaderSize = 2;
+  static constexpr int kSliceSize = 4;
+  static constexpr uint32_t kSqueezeBit = 1u << 31;
+
+  int num_chunks() const;
+  uint64_t chunk_key(int index) const;
+
+  // Index of the first and one past the last slice of `column`.
+  int SliceBegin(int column) const;
+  int SliceEnd(int column) const;
+  const uint32_t* slice(int index) const;
+
+  int num_words_ = 0;
+  std::unique_ptr<uint32_t[]> words_;
+};
+
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
+
+#endif  // REVERB_CC_SUPPORT_PACKED_TRAJECTORY_H_
@@ -0,0 +1,86 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/support/packed_trajectory.h"
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "reverb/cc/schema.pb.h"
+#include "reverb/cc/testing/proto_test_util.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+namespace {
+
+using ::deepmind::reverb::testing::EqualsProto;
+
+FlatTrajectory MakeTrajectory() {
+  FlatTrajectory trajectory;
+  auto* first = trajectory.add_columns();
+  auto* slice = first->add_chunk_slices();
+  slice->set_chunk_key(1);
+  slice->set_offset(2);
+  slice->set_length(3);
+  slice->set_index(0);
+  slice = first->add_chunk_slices();
+  slice->set_chunk_key(0xFFFFFFFF00000002);
+  slice->set_length(4);
+  slice->set_index(0);
+
+  auto* second = trajectory.add_columns();
+  second->set_squeeze(true);
+  slice = second->add_chunk_slices();
+  slice->set_chunk_key(0xFFFFFFFF00000002);
+  slice->set_offset(3);
+  slice->set_length(1);
+  slice->set_index(1);
+  return trajectory;
+}
+
+TEST(PackedTrajectoryTest, RoundTrip) {
+  auto trajectory = MakeTrajectory();
+  PackedTrajectory packed(trajectory);
+  EXPECT_THAT(packed.ToProto(), EqualsProto(trajectory));
+}
+
+TEST(PackedTrajectoryTest, ColumnLength) {
+  PackedTrajectory packed(MakeTrajectory());
+  EXPECT_EQ(packed.num_columns(), 2);
+  EXPECT_EQ(packed.ColumnLength(0), 7);
+  EXPECT_EQ(packed.ColumnLength(1), 1);
+}
+
+TEST(PackedTrajectoryTest, DeduplicatesChunkKeys) {
+  // Header, two chunk keys, two columns and three slices.
+  EXPECT_EQ(PackedTrajectory(MakeTrajectory()).ByteSize(),
+            sizeof(uint32_t) * (2 + 2 * 2 + 2 + 3 * 4));
+}
+
+TEST(PackedTrajectoryTest, Empty) {
+  PackedTrajectory packed((FlatTrajectory()));
+  EXPECT_EQ(packed.num_columns(), 0);
+  EXPECT_THAT(packed.ToProto(), EqualsProto(FlatTrajectory()));
+
+  PackedTrajectory default_constructed;
+  EXPECT_EQ(default_constructed.num_columns(), 0);
+  EXPECT_EQ(default_constructed.ByteSize(), 0);
+  EXPECT_THAT(default_constructed.ToProto(), EqualsProto(FlatTrajectory()));
+  EXPECT_DEATH(default_constructed.ColumnLength(0), "");
+}
+
+}  // namespace
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
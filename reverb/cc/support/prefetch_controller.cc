@@ -0,0 +1,143 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/support/prefetch_controller.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "reverb/cc/platform/logging.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+namespace {
+
+// Weight of new measurements in the moving averages of the sample size and the
+// round trip time.
+constexpr double kSmoothing = 0.1;
+
+double MovingAverage(double average, double value) {
+  return average == 0 ? value : (1 - kSmoothing) * average + kSmoothing * value;
+}
+
+}  // namespace
+
+PrefetchController::PrefetchController(const Options& options)
+    : options_(options) {
+  REVERB_CHECK_GE(options_.max_workers, 1);
+  REVERB_CHECK_GT(options_.max_in_flight_bytes, 0);
+  REVERB_CHECK_GE(options_.max_samples_per_request, 1);
+}
+
+void PrefetchController::RecordSample(int64_t num_bytes) {
+  absl::MutexLock lock(&mu_);
+  stats_.bytes_per_sample = MovingAverage(stats_.bytes_per_sample, num_bytes);
+}
+
+void PrefetchController::RecordRoundTrip(absl::Duration round_trip) {
+  absl::MutexLock lock(&mu_);
+  stats_.round_trip = absl::Seconds(MovingAverage(
+      absl::ToDoubleSeconds(stats_.round_trip),
+      absl::ToDoubleSeconds(round_trip)));
+}
+
+void PrefetchController::RecordPull(absl::Time now, bool starved) {
+  absl::MutexLock lock(&mu_);
+  // The rate is measured between pulls so the first one only starts the
+  // window.
+  if (window_start_ == absl::InfinitePast()) {
+    window_start_ = now;
+    return;
+  }
+  window_pulls_++;
+  if (starved) window_starved_pulls_++;
+  if (now - window_start_ >= kAdjustmentInterval) {
+    AdjustLocked(now);
+  }
+}
+
+int64_t PrefetchController::samples_per_request() const {
+  absl::MutexLock lock(&mu_);
+  return stats_.samples_per_request;
+}
+
+int PrefetchController::num_active_workers() const {
+  absl::MutexLock lock(&mu_);
+  return stats_.num_active_workers;
+}
+
+PrefetchController::Stats PrefetchController::stats() const {
+  absl::MutexLock lock(&mu_);
+  return stats_;
+}
+
+void PrefetchController::AdjustLocked(absl::Time now) {
+  const double rate =
+      window_pulls_ / absl::ToDoubleSeconds(now - window_start_);
+  stats_.pull_rate =
+      stats_.pull_rate == 0 ? rate : (stats_.pull_rate + rate) / 2;
+  const bool starved =
+      window_starved_pulls_ > kStarvedThreshold * window_pulls_;
+
+  window_start_ = now;
+  window_pulls_ = 0;
+  window_starved_pulls_ = 0;
+
+  int num_workers = stats_.num_active_workers;
+  if (starved) {
+    num_satisfied_intervals_ = 0;
+    num_workers = std::min(num_workers + 1, options_.max_workers);
+  } else if (++num_satisfied_intervals_ >= kScaleDownIntervals) {
+    num_satisfied_intervals_ = 0;
+    num_workers = std::max(num_workers - 1, 1);
+  }
+
+  // Enough samples must be in flight to cover the consumption during a round
+  // trip. Twice that keeps the streams busy while the previous responses are
+  // being consumed.
+  const double in_flight =
+      2 * stats_.pull_rate * absl::ToDoubleSeconds(stats_.round_trip);
+  const int64_t target =
+      static_cast<int64_t>(std::ceil(in_flight / num_workers));
+
+  int64_t samples_per_request = stats_.samples_per_request;
+  if (starved) {
+    samples_per_request = std::max(target, 2 * samples_per_request);
+  } else {
+    samples_per_request = std::max(
+        target, samples_per_request - (samples_per_request + 3) / 4);
+  }
+
+  int64_t max_samples_per_request = options_.max_samples_per_request;
+  if (stats_.bytes_per_sample > 0) {
+    max_samples_per_request = std::min<int64_t>(
+        max_samples_per_request,
+        options_.max_in_flight_bytes / (stats_.bytes_per_sample * num_workers));
+  }
+  samples_per_request =
+      std::clamp<int64_t>(samples_per_request, 1,
+                          std::max<int64_t>(max_samples_per_request, 1));
+
+  if (samples_per_request != stats_.samples_per_request ||
+      num_workers != stats_.num_active_workers) {
+    stats_.num_adjustments++;
+  }
+  stats_.samples_per_request = samples_per_request;
+  stats_.num_active_workers = num_workers;
+}
+
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
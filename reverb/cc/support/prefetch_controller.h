@@ -0,0 +1,128 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REVERB_CC_SUPPORT_PREFETCH_CONTROLLER_H_
+#define REVERB_CC_SUPPORT_PREFETCH_CONTROLLER_H_
+
+#include <cstdint>
+#include "absl/base/thread_annotations.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+
+// Decides how many samples the workers of a `Sampler` keep in flight and how
+// many of the workers are active.
+//
+// The controller observes the rate at which the consumer pulls samples, the
+// size of the samples and the time it takes for a request to be answered.
+// Every `kAdjustmentInterval` it sets the number of samples per request so
+// that the active workers together cover twice the consumption during a round
+// trip, without the in flight samples exceeding `max_in_flight_bytes`. If the
+// consumer had to wait for samples then the request size is doubled (probing
+// for latency bound streams) and a worker is activated (for streams bound by
+// decompression). Workers are deactivated again once the consumer has not been
+// starved for `kScaleDownIntervals` consecutive intervals.
+//
+// This class is thread safe.
+class PrefetchController {
+ public:
+  // Length of the windows over which the pull rate is measured.
+  static constexpr absl::Duration kAdjustmentInterval = absl::Milliseconds(100);
+
+  // Fraction of the pulls of a window which must have found no sample ready
+  // for the consumer to be considered starved.
+  static constexpr double kStarvedThreshold = 0.1;
+
+  // Number of consecutive windows without starvation before a worker is
+  // deactivated.
+  static constexpr int kScaleDownIntervals = 10;
+
+  struct Options {
+    // Maximum number of workers which can be activated. At least one worker is
+    // always active.
+    int max_workers = 1;
+
+    // Upper limit of the bytes of samples in flight across all workers.
+    int64_t max_in_flight_bytes = 256 << 20;
+
+    // Upper limit of the number of samples per request regardless of their
+    // size.
+    int64_t max_samples_per_request = 10000;
+  };
+
+  // The measurements and decisions of the controller.
+  struct Stats {
+    // Samples pulled by the consumer per second.
+    double pull_rate = 0;
+
+    // Moving average of the size of the fetched samples.
+    double bytes_per_sample = 0;
+
+    // Moving average of the time between sending a request and receiving its
+    // first sample.
+    absl::Duration round_trip = absl::ZeroDuration();
+
+    int64_t samples_per_request = 1;
+    int num_active_workers = 1;
+
+    // Number of times `samples_per_request` or `num_active_workers` changed.
+    int64_t num_adjustments = 0;
+  };
+
+  explicit PrefetchController(const Options& options);
+
+  // Records that a worker received a sample of `num_bytes` bytes.
+  void RecordSample(int64_t num_bytes) ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Records the time between sending a request and receiving its first sample.
+  void RecordRoundTrip(absl::Duration round_trip) ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Records that the consumer pulled a sample at `now`. `starved` is true if no
+  // sample was ready when the pull started.
+  void RecordPull(absl::Time now, bool starved) ABSL_LOCKS_EXCLUDED(mu_);
+
+  // The number of samples each worker should request at a time.
+  int64_t samples_per_request() const ABSL_LOCKS_EXCLUDED(mu_);
+
+  // The number of workers which should be fetching samples.
+  int num_active_workers() const ABSL_LOCKS_EXCLUDED(mu_);
+
+  Stats stats() const ABSL_LOCKS_EXCLUDED(mu_);
+
+ private:
+  // Ends the current window and updates the decisions.
+  void AdjustLocked(absl::Time now) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  const Options options_;
+
+  mutable absl::Mutex mu_;
+  Stats stats_ ABSL_GUARDED_BY(mu_);
+
+  // Start of the current window and the pulls observed since then.
+  absl::Time window_start_ ABSL_GUARDED_BY(mu_) = absl::InfinitePast();
+  int64_t window_pulls_ ABSL_GUARDED_BY(mu_) = 0;
+  int64_t window_starved_pulls_ ABSL_GUARDED_BY(mu_) = 0;
+
+  // Number of consecutive windows in which the consumer was not starved.
+  int num_satisfied_intervals_ ABSL_GUARDED_BY(mu_) = 0;
+};
+
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
+
+#endif  // REVERB_CC_SUPPORT_PREFETCH_CONTROLLER_H_
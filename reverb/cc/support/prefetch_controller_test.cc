@@ -0,0 +1,141 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/support/prefetch_controller.h"
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/time/time.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+namespace {
+
+// Records `num_pulls` pulls spread evenly over the adjustment interval which
+// follows `now`.
+void PullForOneInterval(PrefetchController* controller, absl::Time* now,
+                        int num_pulls, bool starved) {
+  for (int i = 0; i < num_pulls; i++) {
+    *now += PrefetchController::kAdjustmentInterval / num_pulls;
+    controller->RecordPull(*now, starved);
+  }
+}
+
+TEST(PrefetchControllerTest, StartsWithSingleSampleAndWorker) {
+  PrefetchController controller({/*max_workers=*/4});
+  EXPECT_EQ(controller.samples_per_request(), 1);
+  EXPECT_EQ(controller.num_active_workers(), 1);
+}
+
+TEST(PrefetchControllerTest, StarvedConsumerIncreasesDepthAndWorkers) {
+  PrefetchController controller({/*max_workers=*/2});
+  absl::Time now = absl::UnixEpoch();
+  controller.RecordPull(now, /*starved=*/false);  // Starts the first window.
+
+  PullForOneInterval(&controller, &now, 10, /*starved=*/true);
+  EXPECT_EQ(controller.samples_per_request(), 2);
+  EXPECT_EQ(controller.num_active_workers(), 2);
+
+  PullForOneInterval(&controller, &now, 10, /*starved=*/true);
+  EXPECT_EQ(controller.samples_per_request(), 4);
+  EXPECT_EQ(controller.num_active_workers(), 2);
+}
+
+TEST(PrefetchControllerTest, DepthCoversRoundTrip) {
+  PrefetchController controller({/*max_workers=*/1});
+  controller.RecordRoundTrip(absl::Milliseconds(50));
+  absl::Time now = absl::UnixEpoch();
+  controller.RecordPull(now, /*starved=*/false);  // Starts the first window.
+
+  // 100 pulls per 100ms, i.e 1000 samples per second.
+  PullForOneInterval(&controller, &now, 100, /*starved=*/false);
+  EXPECT_EQ(controller.samples_per_request(), 100);
+  EXPECT_DOUBLE_EQ(controller.stats().pull_rate, 1000);
+}
+
+TEST(PrefetchControllerTest, DepthIsSplitOverActiveWorkers) {
+  PrefetchController controller({/*max_workers=*/2});
+  controller.RecordRoundTrip(absl::Milliseconds(50));
+  absl::Time now = absl::UnixEpoch();
+  controller.RecordPull(now, /*starved=*/false);  // Starts the first window.
+
+  PullForOneInterval(&controller, &now, 10, /*starved=*/true);
+  ASSERT_EQ(controller.num_active_workers(), 2);
+
+  PullForOneInterval(&controller, &now, 100, /*starved=*/false);
+  EXPECT_EQ(controller.num_active_workers(), 2);
+  EXPECT_EQ(controller.samples_per_request(), 28);
+}
+
+TEST(PrefetchControllerTest, DepthRespectsMemoryLimit) {
+  PrefetchController controller(
+      {/*max_workers=*/1, /*max_in_flight_bytes=*/10 << 20});
+  controller.RecordRoundTrip(absl::Seconds(1));
+  controller.RecordSample(1 << 20);
+  absl::Time now = absl::UnixEpoch();
+  controller.RecordPull(now, /*starved=*/false);  // Starts the first window.
+
+  PullForOneInterval(&controller, &now, 100, /*starved=*/false);
+  EXPECT_EQ(controller.samples_per_request(), 10);
+}
+
+TEST(PrefetchControllerTest, DepthShrinksWhenConsumerSlowsDown) {
+  PrefetchController controller({/*max_workers=*/1});
+  controller.RecordRoundTrip(absl::Milliseconds(50));
+  absl::Time now = absl::UnixEpoch();
+  controller.RecordPull(now, /*starved=*/false);  // Starts the first window.
+
+  PullForOneInterval(&controller, &now, 100, /*starved=*/false);
+  ASSERT_EQ(controller.samples_per_request(), 100);
+
+  for (int i = 0; i < 20; i++) {
+    PullForOneInterval(&controller, &now, 1, /*starved=*/false);
+  }
+  EXPECT_LT(controller.samples_per_request(), 10);
+}
+
+TEST(PrefetchControllerTest, DeactivatesWorkersWhenConsumerIsSatisfied) {
+  PrefetchController controller({/*max_workers=*/3});
+  absl::Time now = absl::UnixEpoch();
+  controller.RecordPull(now, /*starved=*/false);  // Starts the first window.
+
+  PullForOneInterval(&controller, &now, 10, /*starved=*/true);
+  PullForOneInterval(&controller, &now, 10, /*starved=*/true);
+  ASSERT_EQ(controller.num_active_workers(), 3);
+
+  for (int i = 0; i < PrefetchController::kScaleDownIntervals - 1; i++) {
+    PullForOneInterval(&controller, &now, 10, /*starved=*/false);
+  }
+  EXPECT_EQ(controller.num_active_workers(), 3);
+
+  PullForOneInterval(&controller, &now, 10, /*starved=*/false);
+  EXPECT_EQ(controller.num_active_workers(), 2);
+}
+
+TEST(PrefetchControllerTest, TracksAverageSampleSizeAndRoundTrip) {
+  PrefetchController controller({});
+  controller.RecordSample(100);
+  controller.RecordRoundTrip(absl::Milliseconds(10));
+  EXPECT_DOUBLE_EQ(controller.stats().bytes_per_sample, 100);
+  EXPECT_EQ(controller.stats().round_trip, absl::Milliseconds(10));
+
+  controller.RecordSample(200);
+  EXPECT_DOUBLE_EQ(controller.stats().bytes_per_sample, 110);
+}
+
+}  // namespace
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
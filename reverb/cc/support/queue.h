@@ -15,13 +15,19 @@
 #ifndef REVERB_CC_SUPPORT_QUEUE_H_
 #define REVERB_CC_SUPPORT_QUEUE_H_
 
+#include <algorithm>
+#include <atomic>
 #include <vector>
 
+#include <cstdint>
+#include "absl/base/optimization.h"
 #include "absl/base/thread_annotations.h"
 #include "absl/status/status.h"
 #include "absl/strings/str_cat.h"
 #include "absl/synchronization/mutex.h"
+#include "absl/time/clock.h"
 #include "absl/time/time.h"
+#include "reverb/cc/platform/logging.h"
 
 namespace deepmind {
 namespace reverb {
@@ -41,39 +47,49 @@ namespace internal {
 // automatically called. Note that this can occur with the call to
 // `SetLastItemPushed` or with subsequent calls to `Pop`
 //
+// The queue is a lock-free ring buffer in which every slot carries a sequence
+// number that tells producers and consumers whether the slot is free or holds
+// an item of the current lap. A push or pop claims a contiguous range of slots
+// with a single CAS, so `PushMany` and `PopMany` cost the same synchronization
+// as `Push` and `Pop`. Calls which cannot make progress spin briefly and then
+// park on a condition variable. The mutex is only acquired to park or to wake
+// threads which have parked.
+//
+// Every slot stores a sequence number next to the item so the queue uses more
+// memory than a plain buffer of `capacity` items.
+//
 template <typename T>
 class Queue {
  public:
   // `capacity` is the maximum number of elements which the queue can hold.
-  explicit Queue(int capacity)
-      : buffer_(capacity),
-        size_(0),
-        index_(0),
-        closed_(false),
-        last_item_pushed_(false) {}
+  // Must be > 0.
+  explicit Queue(int capacity) : capacity_(capacity), slots_(capacity) {
+    REVERB_CHECK_GT(capacity, 0);
+    for (int i = 0; i < capacity; i++) {
+      slots_[i].seq.store(i, std::memory_order_relaxed);
+    }
+  }
 
   // Closes the queue. All pending and future calls to `Push()` and `Pop()` are
   // unblocked and return false without performing the operation. Additional
   // calls of Close after the first one have no effect.
   void Close() ABSL_LOCKS_EXCLUDED(mu_) {
-    absl::MutexLock lock(&mu_);
-    closed_ = true;
+    closed_.store(true, std::memory_order_release);
+    WakeAll();
   }
 
   // Pushes an item to the queue. Blocks if the queue has reached `capacity`. On
   // success, `true` is returned. If the queue is closed, `false` is returned.
-  bool Push(T x) ABSL_LOCKS_EXCLUDED(mu_) {
-    absl::MutexLock lock(&mu_);
-    mu_.Await(absl::Condition(
-        +[](Queue* q) {
-          return q->closed_ || q->last_item_pushed_ ||
-                 q->size_ < q->buffer_.size();
-        },
-        this));
-    if (closed_ || last_item_pushed_) return false;
-    buffer_[(index_ + size_) % buffer_.size()] = std::move(x);
-    ++size_;
-    return true;
+  bool Push(T x) ABSL_LOCKS_EXCLUDED(mu_) { return PushRange(&x, 1) == 1; }
+
+  // Pushes `items` to the queue in order. Blocks while the queue is full. As
+  // many items as there is room for are pushed at a time, so consumers are
+  // woken once per batch rather than once per item. Returns `false` if the
+  // queue was closed before all items could be pushed, in which case only a
+  // prefix of `items` was pushed.
+  bool PushMany(std::vector<T> items) ABSL_LOCKS_EXCLUDED(mu_) {
+    return PushRange(items.data(), items.size()) ==
+           static_cast<int64_t>(items.size());
   }
 
   // Blocks until queue contains at least `batch_size` items then pops and
@@ -83,51 +99,50 @@ class Queue {
   //   OK: If `batch_size` items could be popped before `timeout`.
   //   InvalidArgumentError: if `batch_size` > queue size.
   //   DeadlineExceededError: if timeout exceeded.
-  //   ResourceExhaustedError: if SetLastItemPushed called before `batch_size`
-  //     items in the queue.
+  //   ResourceExhaustedError: if SetLastItemPushed has been called and the
+  //     queue is not empty. The remaining items can still be popped with `Pop`
+  //     or `PopMany`.
   //   CancelledError: if queue has been closed or SetLastItemPushed called on
   //     an already empty queue.
   //
   absl::Status PopBatch(int batch_size, absl::Duration timeout,
-                        std::vector<T>* out) {
-    if (batch_size > buffer_.size()) {
+                        std::vector<T>* out) ABSL_LOCKS_EXCLUDED(mu_) {
+    if (batch_size > capacity_) {
       return absl::InvalidArgumentError(
           absl::StrCat("Batch size (", batch_size,
-                       ") must be <= of queue size (", buffer_.size(), ")."));
+                       ") must be <= of queue size (", capacity_, ")."));
     }
+    if (batch_size <= 0) return absl::OkStatus();
 
-    auto trigger = [&]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
-      return closed_ || size_ >= batch_size || last_item_pushed_;
-    };
+    int64_t popped = 0;
+    AwaitProgress(
+        &num_waiting_pops_, &can_pop_cv_, absl::Now() + timeout, [&] {
+          if (closed_.load(std::memory_order_acquire)) {
+            popped = kClosed;
+          } else if (enqueue_pos_.load(std::memory_order_acquire) &
+                     kLastItemPushedBit) {
+            popped = size() == 0 ? kClosed : kExhausted;
+          } else {
+            popped = TryPop(batch_size, batch_size, AppendTo(out));
+          }
+          return popped != 0;
+        });
 
-    absl::MutexLock lock(&mu_);
-    if (!mu_.AwaitWithTimeout(absl::Condition(&trigger), timeout) &&
-        !last_item_pushed_ && !closed_) {
-      return absl::DeadlineExceededError(
-          absl::StrCat("Timeout exceeded before ", batch_size,
-                       " items observed in queue."));
-    }
-
-    if (closed_) {
+    if (popped == kClosed) {
       return absl::CancelledError("Queue is closed.");
     }
-
-    if (last_item_pushed_) {
+    if (popped == kExhausted) {
       return absl::ResourceExhaustedError(absl::StrCat(
           "The last item have been pushed to the queue and the current size (",
-          size_, ") is less than the batch size (", batch_size, ")."));
-    }
-
-    for (int i = 0; i < batch_size; i++) {
-      out->push_back(std::move(buffer_[index_]));
-      index_ = (index_ + 1) % buffer_.size();
-      --size_;
+          size(), ") is less than the batch size (", batch_size, ")."));
     }
-
-    if (size_ == 0 && last_item_pushed_) {
-      closed_ = true;
+    if (popped == 0) {
+      return absl::DeadlineExceededError(
+          absl::StrCat("Timeout exceeded before ", batch_size,
+                       " items observed in queue."));
     }
 
+    WakeIfWaiting(&num_waiting_pushes_, &can_push_cv_);
     return absl::OkStatus();
   }
 
@@ -137,11 +152,8 @@ class Queue {
 
   // Marks that no more items will be pushed to the queue.
   void SetLastItemPushed() ABSL_LOCKS_EXCLUDED(mu_) {
-    absl::MutexLock lock(&mu_);
-    last_item_pushed_ = true;
-    if (size_ == 0) {
-      closed_ = true;
-    }
+    enqueue_pos_.fetch_or(kLastItemPushedBit, std::memory_order_acq_rel);
+    WakeAll();
   }
 
   // Removes an element from the queue and move-assigns it to *item. Blocks if
@@ -151,44 +163,245 @@ class Queue {
   // If called after `SetLastItemPushed` and the final item of the queue is
   // returned then queue is closed.
   bool Pop(T* item) ABSL_LOCKS_EXCLUDED(mu_) {
+    return PopRange(1, [item](T&& x) { *item = std::move(x); }) == 1;
+  }
+
+  // Blocks until the queue is non-empty and then pops up to `max_items` items
+  // and appends them to `out`. Returns `false` under the same conditions as
+  // `Pop`. `max_items` must be > 0.
+  bool PopMany(int max_items, std::vector<T>* out) ABSL_LOCKS_EXCLUDED(mu_) {
+    REVERB_CHECK_GT(max_items, 0);
+    return PopRange(std::min(max_items, capacity_), AppendTo(out)) > 0;
+  }
+
+  // Current number of elements. Items which are in the process of being pushed
+  // are included.
+  int size() const {
+    const uint64_t dequeue_pos = dequeue_pos_.load(std::memory_order_acquire);
+    const uint64_t enqueue_pos =
+        enqueue_pos_.load(std::memory_order_acquire) & ~kLastItemPushedBit;
+    if (enqueue_pos <= dequeue_pos) return 0;
+    return std::min<uint64_t>(enqueue_pos - dequeue_pos, capacity_);
+  }
+
+ private:
+  struct Slot {
+    // `pos` when the slot is free to be pushed to for position `pos` and
+    // `pos + 1` when it holds the item pushed at `pos`. Popping the item sets
+    // it to `pos + capacity`, i.e the position of the next lap.
+    std::atomic<uint64_t> seq;
+    T value;
+  };
+
+  // Set in `enqueue_pos_` by `SetLastItemPushed`. The CAS with which pushes
+  // claim slots fails once the bit has been set so the final number of pushed
+  // items is known exactly by the time `SetLastItemPushed` returns.
+  static constexpr uint64_t kLastItemPushedBit = uint64_t{1} << 63;
+
+  // Returned by `TryPush` and `TryPop` in place of the number of moved items.
+  //   kClosed: the queue has been closed, or the last item has been pushed
+  //     (for pushes) or popped (for pops).
+  //   kExhausted: the last item has been pushed and fewer than the requested
+  //     minimum number of items remain.
+  static constexpr int64_t kClosed = -1;
+  static constexpr int64_t kExhausted = -2;
+
+  // Number of attempts made before a blocked call parks its thread. Handoffs
+  // between busy threads are usually resolved within this window.
+  static constexpr int kSpinIterations = 128;
+
+  static auto AppendTo(std::vector<T>* out) {
+    return [out](T&& x) { out->push_back(std::move(x)); };
+  }
+
+  Slot& slot(uint64_t pos) { return slots_[pos % capacity_]; }
+
+  // Pushes up to `n` items starting at `items` without blocking. Returns the
+  // number of items pushed (0 if the queue is full) or `kClosed`.
+  int64_t TryPush(T* items, int64_t n) {
+    uint64_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    while (true) {
+      if ((pos & kLastItemPushedBit) ||
+          closed_.load(std::memory_order_acquire)) {
+        return kClosed;
+      }
+
+      const int64_t max_items = std::min<int64_t>(n, capacity_);
+      int64_t num_free = 0;
+      while (num_free < max_items &&
+             slot(pos + num_free).seq.load(std::memory_order_acquire) ==
+                 pos + num_free) {
+        ++num_free;
+      }
+
+      if (num_free == 0) {
+        // The slot either holds an item from the previous lap, in which case
+        // the queue is full, or it has already been claimed by another push.
+        const auto diff = static_cast<int64_t>(
+            slot(pos).seq.load(std::memory_order_acquire) - pos);
+        if (diff < 0) return 0;
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
+        continue;
+      }
+
+      if (enqueue_pos_.compare_exchange_weak(pos, pos + num_free,
+                                             std::memory_order_relaxed)) {
+        for (int64_t i = 0; i < num_free; i++) {
+          Slot& s = slot(pos + i);
+          s.value = std::move(items[i]);
+          s.seq.store(pos + i + 1, std::memory_order_release);
+        }
+        return num_free;
+      }
+    }
+  }
+
+  // Pops between `min_items` and `max_items` items without blocking and passes
+  // them to `fn`. Returns the number of popped items (0 if fewer than
+  // `min_items` are available), `kClosed` or `kExhausted`.
+  template <typename Fn>
+  int64_t TryPop(int64_t min_items, int64_t max_items, Fn fn) {
+    uint64_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+    while (true) {
+      if (closed_.load(std::memory_order_acquire)) return kClosed;
+
+      int64_t num_ready = 0;
+      while (num_ready < max_items &&
+             slot(pos + num_ready).seq.load(std::memory_order_acquire) ==
+                 pos + num_ready + 1) {
+        ++num_ready;
+      }
+
+      if (num_ready < min_items) {
+        const uint64_t current = dequeue_pos_.load(std::memory_order_relaxed);
+        if (current != pos) {
+          pos = current;
+          continue;
+        }
+        const uint64_t enqueue_pos =
+            enqueue_pos_.load(std::memory_order_acquire);
+        if (enqueue_pos & kLastItemPushedBit) {
+          const uint64_t remaining = (enqueue_pos & ~kLastItemPushedBit) - pos;
+          if (remaining == 0) return kClosed;
+          if (remaining < static_cast<uint64_t>(min_items)) return kExhausted;
+        }
+        return 0;
+      }
+
+      if (dequeue_pos_.compare_exchange_weak(pos, pos + num_ready,
+                                             std::memory_order_relaxed)) {
+        for (int64_t i = 0; i < num_ready; i++) {
+          Slot& s = slot(pos + i);
+          fn(std::move(s.value));
+          s.seq.store(pos + i + capacity_, std::memory_order_release);
+        }
+        return num_ready;
+      }
+    }
+  }
+
+  // Blocking push of `n` items. Returns the number of items pushed, which is
+  // less than `n` only if the queue was closed.
+  int64_t PushRange(T* items, int64_t n) ABSL_LOCKS_EXCLUDED(mu_) {
+    int64_t num_pushed = 0;
+    while (num_pushed < n) {
+      int64_t result = 0;
+      AwaitProgress(&num_waiting_pushes_, &can_push_cv_, absl::InfiniteFuture(),
+                    [&] {
+                      result = TryPush(items + num_pushed, n - num_pushed);
+                      return result != 0;
+                    });
+      if (result == kClosed) break;
+      num_pushed += result;
+      WakeIfWaiting(&num_waiting_pops_, &can_pop_cv_);
+    }
+    return num_pushed;
+  }
+
+  // Blocking pop of between 1 and `max_items` items. Returns the number of
+  // popped items or `kClosed`.
+  template <typename Fn>
+  int64_t PopRange(int64_t max_items, Fn fn) ABSL_LOCKS_EXCLUDED(mu_) {
+    int64_t result = 0;
+    AwaitProgress(&num_waiting_pops_, &can_pop_cv_, absl::InfiniteFuture(),
+                  [&] {
+                    result = TryPop(1, max_items, fn);
+                    return result != 0;
+                  });
+    if (result > 0) {
+      WakeIfWaiting(&num_waiting_pushes_, &can_push_cv_);
+    }
+    return result;
+  }
+
+  // Calls `attempt` until it returns true or `deadline` has passed. The first
+  // `kSpinIterations` attempts are made back to back, after which the thread
+  // parks on `cv` between attempts. `num_waiting` is incremented while parked
+  // so that threads which make progress possible know to signal `cv`. Returns
+  // the result of the final attempt.
+  template <typename Fn>
+  bool AwaitProgress(std::atomic<int>* num_waiting, absl::CondVar* cv,
+                     absl::Time deadline, Fn attempt)
+      ABSL_LOCKS_EXCLUDED(mu_) {
+    for (int i = 0; i < kSpinIterations; i++) {
+      if (attempt()) return true;
+    }
+
     absl::MutexLock lock(&mu_);
-    mu_.Await(absl::Condition(
-        +[](Queue* q) { return q->closed_ || q->size_ > 0; }, this));
-    if (closed_) return false;
-    *item = std::move(buffer_[index_]);
-    index_ = (index_ + 1) % buffer_.size();
-    --size_;
-    if (size_ == 0 && last_item_pushed_) {
-      closed_ = true;
+    // Pairs with the read-modify-write in `WakeIfWaiting`. Operations on
+    // `num_waiting` are totally ordered, so either the waker observes the
+    // incremented counter or the attempts below observe the waker's update.
+    num_waiting->fetch_add(1, std::memory_order_acq_rel);
+    bool done;
+    while (!(done = attempt())) {
+      if (cv->WaitWithDeadline(&mu_, deadline)) {
+        done = attempt();
+        break;
+      }
     }
-    return true;
+    num_waiting->fetch_sub(1, std::memory_order_relaxed);
+    return done;
   }
 
-  // Current number of elements.
-  int size() const ABSL_LOCKS_EXCLUDED(mu_) {
-    absl::ReaderMutexLock lock(&mu_);
-    return size_;
+  // Signals `cv` if any thread is parked on it. The mutex is only acquired
+  // when there is someone to wake.
+  void WakeIfWaiting(std::atomic<int>* num_waiting, absl::CondVar* cv)
+      ABSL_LOCKS_EXCLUDED(mu_) {
+    if (num_waiting->fetch_add(0, std::memory_order_acq_rel) > 0) {
+      absl::MutexLock lock(&mu_);
+      cv->SignalAll();
+    }
   }
 
- private:
-  mutable absl::Mutex mu_;
+  void WakeAll() ABSL_LOCKS_EXCLUDED(mu_) {
+    absl::MutexLock lock(&mu_);
+    can_push_cv_.SignalAll();
+    can_pop_cv_.SignalAll();
+  }
 
-  // Circular buffer. Initialized with fixed size `capacity_`.
-  std::vector<T> buffer_ ABSL_GUARDED_BY(mu_);
+  const int capacity_;
 
-  // Current number of elements.
-  int size_ ABSL_GUARDED_BY(mu_);
+  // Ring buffer of `capacity_` slots.
+  std::vector<Slot> slots_;
 
-  // Index of the beginning of the queue in the circular buffer.
-  int index_ ABSL_GUARDED_BY(mu_);
+  // Position of the next slot to push to (plus `kLastItemPushedBit`) and of
+  // the next slot to pop from. The padding keeps producers and consumers from
+  // invalidating each other's cache lines.
+  char padding0_[ABSL_CACHELINE_SIZE];
+  std::atomic<uint64_t> enqueue_pos_{0};
+  char padding1_[ABSL_CACHELINE_SIZE];
+  std::atomic<uint64_t> dequeue_pos_{0};
+  char padding2_[ABSL_CACHELINE_SIZE];
 
   // Whether `Close()` was called.
-  bool closed_ ABSL_GUARDED_BY(mu_);
+  std::atomic<bool> closed_{false};
 
-  // Whether `SetLastItemPushed()` has been called. When set then push calls are
-  // treated the same as if `Closed()` had been called. If set and the queue is
-  // empty after a pop call then `closed_` is set.
-  bool last_item_pushed_ ABSL_GUARDED_BY(mu_);
+  // Only used for parking threads which have run out of spins.
+  absl::Mutex mu_;
+  absl::CondVar can_push_cv_;
+  absl::CondVar can_pop_cv_;
+  std::atomic<int> num_waiting_pushes_{0};
+  std::atomic<int> num_waiting_pops_{0};
 };
 
 }  // namespace internal
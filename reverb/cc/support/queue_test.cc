@@ -208,6 +208,19 @@ TEST(QueueTest, PopBatchReturnsIfSetLastItemPushed) {
   EXPECT_EQ(status.code(), absl::StatusCode::kResourceExhausted);
 }
 
+TEST(QueueTest, PopBatchReturnsResourceExhaustedOnceLastItemPushed) {
+  Queue<int> q(3);
+  ASSERT_TRUE(q.PushMany({1, 2, 3}));
+  q.SetLastItemPushed();
+
+  std::vector<int> v;
+  EXPECT_EQ(q.PopBatch(2, &v).code(), absl::StatusCode::kResourceExhausted);
+  EXPECT_TRUE(v.empty());
+
+  ASSERT_TRUE(q.PopMany(3, &v));
+  EXPECT_EQ(q.PopBatch(2, &v).code(), absl::StatusCode::kCancelled);
+}
+
 TEST(QueueTest, PopBatchReturnsInvalidArgumentIfBatchSizeTooBig) {
   Queue<int> q(3);
   std::vector<int> v;
@@ -235,6 +248,124 @@ TEST(QueueTest, PopBatchReturnsCancelledIfClosedCalled) {
   EXPECT_EQ(status.code(), absl::StatusCode::kCancelled);
 }
 
+TEST(QueueTest, PushManyAndPopManyAreConsistent) {
+  Queue<int> q(10);
+  ASSERT_TRUE(q.PushMany({1, 2, 3}));
+  ASSERT_TRUE(q.Push(4));
+  EXPECT_EQ(q.size(), 4);
+
+  std::vector<int> v;
+  ASSERT_TRUE(q.PopMany(3, &v));
+  EXPECT_THAT(v, testing::ElementsAre(1, 2, 3));
+  ASSERT_TRUE(q.PopMany(3, &v));
+  EXPECT_THAT(v, testing::ElementsAre(1, 2, 3, 4));
+}
+
+TEST(QueueTest, PushManyBlocksUntilAllItemsPushed) {
+  Queue<int> q(2);
+  absl::Notification n;
+  auto t = StartThread("", [&q, &n] {
+    REVERB_CHECK(q.PushMany({1, 2, 3, 4, 5}));
+    n.Notify();
+  });
+
+  // The queue only has room for two of the items so the producer can't
+  // complete until some of them have been popped.
+  while (q.size() < 2) {
+    absl::SleepFor(absl::Milliseconds(1));
+  }
+  EXPECT_FALSE(n.HasBeenNotified());
+
+  std::vector<int> v;
+  while (v.size() < 5) {
+    ASSERT_TRUE(q.PopMany(5, &v));
+  }
+  n.WaitForNotification();
+  EXPECT_THAT(v, testing::ElementsAre(1, 2, 3, 4, 5));
+}
+
+TEST(QueueTest, PushManyReturnsFalseIfClosed) {
+  Queue<int> q(2);
+  absl::Notification n;
+  bool ok;
+  auto t = StartThread("", [&q, &n, &ok] {
+    ok = q.PushMany({1, 2, 3});
+    n.Notify();
+  });
+  ASSERT_FALSE(n.WaitForNotificationWithTimeout(absl::Milliseconds(100)));
+  q.Close();
+  n.WaitForNotification();
+  EXPECT_FALSE(ok);
+}
+
+TEST(QueueTest, PopManyReturnsFalseOnceLastItemPopped) {
+  Queue<int> q(3);
+  ASSERT_TRUE(q.PushMany({1, 2}));
+  q.SetLastItemPushed();
+
+  std::vector<int> v;
+  ASSERT_TRUE(q.PopMany(10, &v));
+  EXPECT_THAT(v, testing::ElementsAre(1, 2));
+  EXPECT_FALSE(q.PopMany(10, &v));
+}
+
+TEST(QueueTest, ConcurrentProducersAndConsumers) {
+  constexpr int kNumProducers = 4;
+  constexpr int kNumConsumers = 4;
+  constexpr int kItemsPerProducer = 10000;
+
+  Queue<int64_t> q(16);
+  std::vector<int64_t> sums(kNumConsumers, 0);
+  std::vector<int64_t> counts(kNumConsumers, 0);
+
+  std::vector<std::unique_ptr<Thread>> consumers;
+  for (int i = 0; i < kNumConsumers; i++) {
+    consumers.push_back(StartThread("", [&, i] {
+      std::vector<int64_t> v;
+      int64_t x;
+      // Alternate between single and batched pops.
+      while (i % 2 == 0 ? q.Pop(&x) : q.PopMany(8, &v)) {
+        if (i % 2 == 0) v.push_back(x);
+        for (int64_t y : v) sums[i] += y;
+        counts[i] += v.size();
+        v.clear();
+      }
+    }));
+  }
+
+  {
+    std::vector<std::unique_ptr<Thread>> producers;
+    for (int i = 0; i < kNumProducers; i++) {
+      producers.push_back(StartThread("", [&q, i] {
+        for (int j = 0; j < kItemsPerProducer; j += 5) {
+          std::vector<int64_t> batch;
+          for (int k = j; k < j + 5; k++) {
+            batch.push_back(i * kItemsPerProducer + k);
+          }
+          if (i % 2 == 0) {
+            REVERB_CHECK(q.PushMany(std::move(batch)));
+          } else {
+            for (int64_t x : batch) REVERB_CHECK(q.Push(x));
+          }
+        }
+      }));
+    }
+  }  // Joins producers.
+
+  q.SetLastItemPushed();
+  consumers.clear();  // Joins consumers.
+
+  const int64_t n = kNumProducers * kItemsPerProducer;
+  int64_t total_sum = 0;
+  int64_t total_count = 0;
+  for (int i = 0; i < kNumConsumers; i++) {
+    total_sum += sums[i];
+    total_count += counts[i];
+  }
+  EXPECT_EQ(total_count, n);
+  EXPECT_EQ(total_sum, n * (n - 1) / 2);
+}
+
 }  // namespace
 }  // namespace internal
 }  // namespace reverb
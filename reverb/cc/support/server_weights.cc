@@ -0,0 +1,79 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/support/server_weights.h"
+
+#include <algorithm>
+#include <random>
+
+#include "reverb/cc/platform/logging.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+
+ServerWeights::ServerWeights(int num_servers)
+    : weights_(num_servers, 0), excluded_(num_servers, false) {
+  REVERB_CHECK_GE(num_servers, 1);
+}
+
+void ServerWeights::Set(int index, double weight) {
+  weights_[index] = std::max(weight, 0.0);
+  excluded_[index] = false;
+}
+
+void ServerWeights::Exclude(int index) { excluded_[index] = true; }
+
+std::vector<int64_t> ServerWeights::Split(int64_t num_samples,
+                                          absl::BitGen* bit_gen) const {
+  const bool all_excluded =
+      std::all_of(excluded_.begin(), excluded_.end(), [](bool e) { return e; });
+
+  // Weights of the servers which samples can be assigned to.
+  std::vector<double> weights(weights_.size(), 0);
+  double total_weight = 0;
+  for (int i = 0; i < weights_.size(); i++) {
+    if (excluded_[i] && !all_excluded) continue;
+    weights[i] = weights_[i];
+    total_weight += weights_[i];
+  }
+  if (total_weight == 0) {
+    for (int i = 0; i < weights_.size(); i++) {
+      if (excluded_[i] && !all_excluded) continue;
+      weights[i] = 1;
+      total_weight += 1;
+    }
+  }
+
+  // Draw the count of each server from a binomial distribution conditioned on
+  // the counts of the servers before it. The last server takes the remainder
+  // so rounding errors in the weights cannot leave samples unassigned.
+  int last = weights.size() - 1;
+  while (weights[last] == 0) last--;
+  std::vector<int64_t> counts(weights.size(), 0);
+  int64_t remaining = num_samples;
+  for (int i = 0; i < last && remaining > 0; i++) {
+    if (weights[i] == 0) continue;
+    const double p = std::min(weights[i] / total_weight, 1.0);
+    counts[i] = std::binomial_distribution<int64_t>(remaining, p)(*bit_gen);
+    remaining -= counts[i];
+    total_weight -= weights[i];
+  }
+  counts[last] += remaining;
+  return counts;
+}
+
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
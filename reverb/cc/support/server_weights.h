@@ -0,0 +1,69 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REVERB_CC_SUPPORT_SERVER_WEIGHTS_H_
+#define REVERB_CC_SUPPORT_SERVER_WEIGHTS_H_
+
+#include <vector>
+
+#include <cstdint>
+#include "absl/random/random.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+
+// Splits the samples requested from a table which is sharded over several
+// servers so that each server serves a share proportional to its weight
+// (typically the size of its shard of the table).
+//
+// A server can be excluded, e.g. after its stream failed, until its weight is
+// set again. Servers are picked uniformly when none of the included servers
+// has a positive weight, and all servers are included again if every one of
+// them has been excluded.
+//
+// This class is not thread safe.
+class ServerWeights {
+ public:
+  explicit ServerWeights(int num_servers);
+
+  // Sets the weight of the server at `index` and includes it again if it had
+  // been excluded. Negative weights are treated as 0.
+  void Set(int index, double weight);
+
+  // Stops samples from being assigned to the server at `index` until `Set` is
+  // called for it.
+  void Exclude(int index);
+
+  // Draws the number of samples that each server should serve out of
+  // `num_samples`. The counts sum up to `num_samples` and follow a multinomial
+  // distribution over the included servers.
+  std::vector<int64_t> Split(int64_t num_samples, absl::BitGen* bit_gen) const;
+
+  int num_servers() const { return weights_.size(); }
+
+  double weight(int index) const { return weights_[index]; }
+
+  bool excluded(int index) const { return excluded_[index]; }
+
+ private:
+  std::vector<double> weights_;
+  std::vector<bool> excluded_;
+};
+
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
+
+#endif  // REVERB_CC_SUPPORT_SERVER_WEIGHTS_H_
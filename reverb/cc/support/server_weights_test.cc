@@ -0,0 +1,100 @@
+// Copyright 2019 DeepMind Technologies Limited.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "reverb/cc/support/server_weights.h"
+
+#include <numeric>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/random/random.h"
+
+namespace deepmind {
+namespace reverb {
+namespace internal {
+namespace {
+
+using ::testing::ElementsAre;
+
+int64_t Sum(const std::vector<int64_t>& counts) {
+  return std::accumulate(counts.begin(), counts.end(), int64_t{0});
+}
+
+TEST(ServerWeightsTest, SplitsUniformlyWithoutWeights) {
+  ServerWeights weights(2);
+  absl::BitGen bit_gen;
+  auto counts = weights.Split(10000, &bit_gen);
+  EXPECT_EQ(Sum(counts), 10000);
+  EXPECT_NEAR(counts[0], 5000, 300);
+}
+
+TEST(ServerWeightsTest, SplitsProportionallyToWeights) {
+  ServerWeights weights(3);
+  weights.Set(0, 1);
+  weights.Set(1, 3);
+  weights.Set(2, 0);
+  absl::BitGen bit_gen;
+  auto counts = weights.Split(10000, &bit_gen);
+  EXPECT_EQ(Sum(counts), 10000);
+  EXPECT_NEAR(counts[0], 2500, 300);
+  EXPECT_NEAR(counts[1], 7500, 300);
+  EXPECT_EQ(counts[2], 0);
+}
+
+TEST(ServerWeightsTest, ExcludedServersAreSkipped) {
+  ServerWeights weights(3);
+  weights.Set(0, 1);
+  weights.Set(1, 1);
+  weights.Set(2, 1);
+  weights.Exclude(1);
+  absl::BitGen bit_gen;
+  auto counts = weights.Split(100, &bit_gen);
+  EXPECT_EQ(Sum(counts), 100);
+  EXPECT_EQ(counts[1], 0);
+  EXPECT_TRUE(weights.excluded(1));
+
+  weights.Set(1, 1);
+  EXPECT_FALSE(weights.excluded(1));
+}
+
+TEST(ServerWeightsTest, UsesAllServersIfAllAreExcluded) {
+  ServerWeights weights(2);
+  weights.Set(0, 0);
+  weights.Set(1, 5);
+  weights.Exclude(0);
+  weights.Exclude(1);
+  absl::BitGen bit_gen;
+  EXPECT_THAT(weights.Split(10, &bit_gen), ElementsAre(0, 10));
+}
+
+TEST(ServerWeightsTest, SingleServerTakesAllSamples) {
+  ServerWeights weights(1);
+  absl::BitGen bit_gen;
+  EXPECT_THAT(weights.Split(7, &bit_gen), ElementsAre(7));
+  EXPECT_THAT(weights.Split(0, &bit_gen), ElementsAre(0));
+}
+
+TEST(ServerWeightsTest, NegativeWeightsAreTreatedAsZero) {
+  ServerWeights weights(2);
+  weights.Set(0, -1);
+  weights.Set(1, 1);
+  EXPECT_EQ(weights.weight(0), 0);
+  absl::BitGen bit_gen;
+  EXPECT_THAT(weights.Split(10, &bit_gen), ElementsAre(0, 10));
+}
+
+}  // namespace
+}  // namespace internal
+}  // namespace reverb
+}  // namespace deepmind
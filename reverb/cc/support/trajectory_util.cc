@@ -29,6 +29,7 @@
 #include "tensorflow/core/framework/tensor.h"
 #include "tensorflow/core/framework/tensor_util.h"
 #include "tensorflow/core/platform/errors.h"
+#include "tensorflow/core/platform/hash.h"
 
 namespace deepmind {
 namespace reverb {
@@ -99,6 +100,38 @@ int ColumnLength(const FlatTrajectory& trajectory, int column) {
   return length;
 }
 
+FlatTrajectory SliceTrajectory(const FlatTrajectory& trajectory, int offset,
+                               int length) {
+  REVERB_CHECK_GE(offset, 0);
+  REVERB_CHECK_GT(length, 0);
+
+  FlatTrajectory proto;
+  for (const auto& col : trajectory.columns()) {
+    REVERB_CHECK(!col.squeeze());
+    auto* sliced_col = proto.add_columns();
+
+    // Number of steps of the column to skip and to keep respectively.
+    int skip = offset;
+    int remaining = length;
+    for (const auto& slice : col.chunk_slices()) {
+      if (remaining == 0) break;
+      if (skip >= slice.length()) {
+        skip -= slice.length();
+        continue;
+      }
+      auto* sliced = sliced_col->add_chunk_slices();
+      *sliced = slice;
+      sliced->set_offset(slice.offset() + skip);
+      sliced->set_length(std::min(slice.length() - skip, remaining));
+      remaining -= sliced->length();
+      skip = 0;
+    }
+    REVERB_CHECK_EQ(remaining, 0);
+  }
+
+  return proto;
+}
+
 int TimestepTrajectoryLength(const FlatTrajectory& trajectory) {
   REVERB_CHECK(!trajectory.columns().empty());
   return ColumnLength(trajectory, 0);
@@ -142,6 +175,19 @@ bool IsTimestepTrajectory(const FlatTrajectory& trajectory) {
   return true;
 }
 
+uint64_t ChunkContentHash(const ChunkData::Data& data) {
+  uint64_t hash = data.tensors_size();
+  for (const auto& tensor : data.tensors()) {
+    hash = tensorflow::Hash64Combine(hash, tensor.dtype());
+    for (const auto& dim : tensor.tensor_shape().dim()) {
+      hash = tensorflow::Hash64Combine(hash, dim.size());
+    }
+    hash = tensorflow::Hash64Combine(
+        hash, tensorflow::Hash64(tensor.tensor_content()));
+  }
+  return hash == 0 ? 1 : hash;
+}
+
 absl::Status UnpackChunkColumn(const ChunkData& chunk_data, int column,
                                tensorflow::Tensor* out) {
   if (column >= chunk_data.data().tensors_size() || column < 0) {
@@ -161,20 +207,27 @@ absl::Status UnpackChunkColumn(const ChunkData& chunk_data, int column,
 absl::Status UnpackChunkColumnAndSlice(const ChunkData& chunk_data, int column,
                                        int offset, int length,
                                        tensorflow::Tensor* out) {
-  REVERB_RETURN_IF_ERROR(UnpackChunkColumn(chunk_data, column, out));
-
-  if (offset < 0 || offset + length > out->shape().dim_size(0)) {
+  if (column >= chunk_data.data().tensors_size() || column < 0) {
     return absl::InvalidArgumentError(absl::StrCat(
-        "Cannot slice (", offset, ", ", offset + length,
-        ") out of tensor with shape ", out->shape().DebugString(), "."));
+        "Cannot unpack column ", column, " in chunk ", chunk_data.chunk_key(),
+        " which has ", chunk_data.data().tensors_size(), " columns."));
   }
 
-  *out = out->Slice(offset, offset + length);
-  if (!out->IsAligned()) {
-    *out = tensorflow::tensor::DeepCopy(*out);
+  const auto& proto = chunk_data.data().tensors(column);
+  tensorflow::TensorShape shape(proto.tensor_shape());
+  if (shape.dims() == 0 || offset < 0 || length < 0 ||
+      offset + length > shape.dim_size(0)) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Cannot slice (", offset, ", ", offset + length,
+                     ") out of tensor with shape ", shape.DebugString(), "."));
   }
 
-  return absl::OkStatus();
+  // Only decompress the rows of the slice into a tensor of the right size
+  // rather than decompressing the whole column and copying the slice.
+  shape.set_dim(0, length);
+  *out = tensorflow::Tensor(proto.dtype(), shape);
+  return DecompressTensorRowsFromProto(proto, chunk_data.delta_encoded(),
+                                       offset, length, /*out_offset=*/0, out);
 }
 
 absl::Status UnpackChunkColumnAndSlice(const ChunkData& chunk_data,
@@ -184,6 +237,85 @@ absl::Status UnpackChunkColumnAndSlice(const ChunkData& chunk_data,
                                    slice.length(), out);
 }
 
+absl::Status UnpackChunkSliceInto(const ChunkData& chunk_data,
+                                  const FlatTrajectory::ChunkSlice& slice,
+                                  int64_t out_offset, tensorflow::Tensor* out) {
+  if (slice.index() >= chunk_data.data().tensors_size() || slice.index() < 0) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Cannot unpack column ", slice.index(), " in chunk ",
+        chunk_data.chunk_key(), " which has ", chunk_data.data().tensors_size(),
+        " columns."));
+  }
+  return DecompressTensorRowsFromProto(
+      chunk_data.data().tensors(slice.index()), chunk_data.delta_encoded(),
+      slice.offset(), slice.length(), out_offset, out);
+}
+
+absl::Status UnpackColumn(const FlatTrajectory::Column& column,
+                          absl::Span<const ChunkData* const> chunks,
+                          tensorflow::Tensor* out) {
+  if (column.chunk_slices().empty() ||
+      chunks.size() != column.chunk_slices_size()) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Cannot unpack column with ", column.chunk_slices_size(),
+        " slices from ", chunks.size(), " chunks."));
+  }
+
+  // All slices must share the dtype and the shape of the (non batch)
+  // dimensions of the first slice.
+  tensorflow::TensorShape shape;
+  tensorflow::DataType dtype = tensorflow::DT_INVALID;
+  int64_t length = 0;
+  for (int i = 0; i < chunks.size(); i++) {
+    const auto& slice = column.chunk_slices(i);
+    if (slice.index() >= chunks[i]->data().tensors_size() ||
+        slice.index() < 0) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          "Cannot unpack column ", slice.index(), " in chunk ",
+          chunks[i]->chunk_key(), " which has ",
+          chunks[i]->data().tensors_size(), " columns."));
+    }
+
+    const auto& proto = chunks[i]->data().tensors(slice.index());
+    tensorflow::TensorShape slice_shape(proto.tensor_shape());
+    if (slice_shape.dims() == 0) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          "Cannot unpack scalar tensor from chunk ", chunks[i]->chunk_key(),
+          "."));
+    }
+    slice_shape.set_dim(0, slice.length());
+    if (i == 0) {
+      shape = slice_shape;
+      dtype = proto.dtype();
+    } else {
+      shape.set_dim(0, slice.length());
+      if (proto.dtype() != dtype || slice_shape != shape) {
+        return absl::InvalidArgumentError(absl::StrCat(
+            "Slices of column must have the same dtype and shape, but slice 0 "
+            "has (", tensorflow::DataTypeString(dtype), ", ",
+            shape.DebugString(), ") while slice ", i, " has (",
+            tensorflow::DataTypeString(proto.dtype()), ", ",
+            slice_shape.DebugString(), ")."));
+      }
+    }
+    length += slice.length();
+  }
+
+  shape.set_dim(0, length);
+  *out = tensorflow::Tensor(dtype, shape);
+
+  const int64_t row_size = length == 0 ? 0 : shape.num_elements() / length;
+  int64_t out_offset = 0;
+  for (int i = 0; i < chunks.size(); i++) {
+    const auto& slice = column.chunk_slices(i);
+    REVERB_RETURN_IF_ERROR(
+        UnpackChunkSliceInto(*chunks[i], slice, out_offset, out));
+    out_offset += slice.length() * row_size;
+  }
+
+  return absl::OkStatus();
+}
+
 int TimestepTrajectoryOffset(const FlatTrajectory& trajectory) {
   return trajectory.columns(0).chunk_slices(0).offset();
 }
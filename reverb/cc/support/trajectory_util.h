@@ -62,6 +62,17 @@ int TimestepTrajectoryOffset(const FlatTrajectory& trajectory);
 // Number of steps referenced by column.
 int ColumnLength(const FlatTrajectory& trajectory, int column);
 
+// Selects steps [offset, offset + length) of every column of `trajectory`.
+// Slices which fall outside of the window are dropped and the ones at the
+// edges are trimmed. All columns must hold at least `offset + length` steps and
+// must not be squeezed.
+FlatTrajectory SliceTrajectory(const FlatTrajectory& trajectory, int offset,
+                               int length);
+
+// Stable (across processes) hash of the compressed tensors in `data`. Never
+// returns 0 as that is used to signal that no hash has been computed.
+uint64_t ChunkContentHash(const ChunkData::Data& data);
+
 // Decompresses the tensor at index `column` in `chunk_data` into `out`.
 absl::Status UnpackChunkColumn(const ChunkData& chunk_data, int column,
                                tensorflow::Tensor* out);
@@ -78,6 +89,19 @@ absl::Status UnpackChunkColumnAndSlice(const ChunkData& chunk_data,
                                        const FlatTrajectory::ChunkSlice& slice,
                                        tensorflow::Tensor* out);
 
+// Decompresses the steps referenced by `slice` straight into `out`, starting at
+// flat element `out_offset`. No other steps of the chunk are decompressed.
+absl::Status UnpackChunkSliceInto(const ChunkData& chunk_data,
+                                  const FlatTrajectory::ChunkSlice& slice,
+                                  int64_t out_offset, tensorflow::Tensor* out);
+
+// Allocates a single tensor for `column` and decompresses all of its slices
+// directly into it. `chunks[i]` must be the chunk referenced by the i:th slice
+// of `column`. Squeezing is left to the caller.
+absl::Status UnpackColumn(const FlatTrajectory::Column& column,
+                          absl::Span<const ChunkData* const> chunks,
+                          tensorflow::Tensor* out);
+
 }  // namespace internal
 }  // namespace reverb
 }  // namespace deepmind
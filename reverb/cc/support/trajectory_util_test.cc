@@ -25,6 +25,7 @@
 #include "reverb/cc/testing/proto_test_util.h"
 #include "reverb/cc/testing/tensor_testutil.h"
 #include "tensorflow/core/framework/tensor.h"
+#include "tensorflow/core/framework/tensor_util.h"
 #include "tensorflow/core/lib/core/status_test_util.h"
 
 namespace deepmind {
@@ -105,6 +106,60 @@ TEST(FlatTimestepTrajectory, CreateTrajectoryFromVectors) {
               )"));
 }
 
+TEST(SliceTrajectory, TrimsAndDropsSlices) {
+  auto trajectory = FlatTimestepTrajectory(
+      /*chunk_keys=*/{1, 2, 3},
+      /*chunk_lengths=*/{4, 4, 4}, /*num_columns=*/2, /*offset=*/1,
+      /*length=*/11);
+  EXPECT_THAT(SliceTrajectory(trajectory, /*offset=*/2, /*length=*/4),
+              testing::EqualsProto(R"(
+                columns: {
+                  chunk_slices: { chunk_key: 1 offset: 3 length: 1 index: 0 }
+                  chunk_slices: { chunk_key: 2 offset: 0 length: 3 index: 0 }
+                }
+                columns: {
+                  chunk_slices: { chunk_key: 1 offset: 3 length: 1 index: 1 }
+                  chunk_slices: { chunk_key: 2 offset: 0 length: 3 index: 1 }
+                }
+              )"));
+  EXPECT_THAT(SliceTrajectory(trajectory, /*offset=*/7, /*length=*/4),
+              testing::EqualsProto(R"(
+                columns: {
+                  chunk_slices: { chunk_key: 3 offset: 0 length: 4 index: 0 }
+                }
+                columns: {
+                  chunk_slices: { chunk_key: 3 offset: 0 length: 4 index: 1 }
+                }
+              )"));
+}
+
+TEST(SliceTrajectory, SlicesColumnsIndependently) {
+  FlatTrajectory trajectory;
+  auto* first = trajectory.add_columns();
+  auto* slice = first->add_chunk_slices();
+  slice->set_chunk_key(1);
+  slice->set_length(3);
+  slice = first->add_chunk_slices();
+  slice->set_chunk_key(2);
+  slice->set_length(3);
+  auto* second = trajectory.add_columns();
+  slice = second->add_chunk_slices();
+  slice->set_chunk_key(3);
+  slice->set_offset(1);
+  slice->set_length(6);
+
+  EXPECT_THAT(SliceTrajectory(trajectory, /*offset=*/2, /*length=*/2),
+              testing::EqualsProto(R"(
+                columns: {
+                  chunk_slices: { chunk_key: 1 offset: 2 length: 1 }
+                  chunk_slices: { chunk_key: 2 offset: 0 length: 1 }
+                }
+                columns: {
+                  chunk_slices: { chunk_key: 3 offset: 3 length: 2 }
+                }
+              )"));
+}
+
 TEST(IsTimestepTrajectory, SingleColumn) {
   FlatTrajectory trajectory;
   auto* col = trajectory.add_columns();
@@ -255,6 +310,88 @@ TEST(UnpackChunkColumn, SelectsCorrectColumn) {
   test::ExpectTensorEqual<int32_t>(second_got, second_col_tensor);
 }
 
+TEST(UnpackChunkColumnAndSlice, ReturnsSliceOfDeltaEncodedColumn) {
+  tensorflow::Tensor tensor(tensorflow::DT_INT32,
+                            tensorflow::TensorShape({5, 2}));
+  for (int i = 0; i < tensor.NumElements(); i++) {
+    tensor.flat<int32_t>()(i) = i * i;
+  }
+
+  ChunkData data;
+  data.set_delta_encoded(true);
+  CompressTensorAsProto(DeltaEncode(tensor, /*encode=*/true),
+                        data.mutable_data()->add_tensors());
+
+  tensorflow::Tensor got;
+  REVERB_EXPECT_OK(UnpackChunkColumnAndSlice(data, 0, 1, 3, &got));
+  test::ExpectTensorEqual<int32_t>(
+      got, tensorflow::tensor::DeepCopy(tensor.Slice(1, 4)));
+
+  EXPECT_EQ(UnpackChunkColumnAndSlice(data, 0, 3, 3, &got).code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
+TEST(UnpackColumn, ConcatenatesSlices) {
+  tensorflow::Tensor first(tensorflow::DT_INT64,
+                           tensorflow::TensorShape({3, 2}));
+  tensorflow::Tensor second(tensorflow::DT_INT64,
+                            tensorflow::TensorShape({4, 2}));
+  for (int i = 0; i < first.NumElements(); i++) {
+    first.flat<tensorflow::int64>()(i) = i;
+  }
+  for (int i = 0; i < second.NumElements(); i++) {
+    second.flat<tensorflow::int64>()(i) = 100 + i;
+  }
+
+  ChunkData first_chunk;
+  first_chunk.set_chunk_key(1);
+  CompressTensorAsProto(first, first_chunk.mutable_data()->add_tensors());
+  ChunkData second_chunk;
+  second_chunk.set_chunk_key(2);
+  second_chunk.set_delta_encoded(true);
+  CompressTensorAsProto(DeltaEncode(second, /*encode=*/true),
+                        second_chunk.mutable_data()->add_tensors());
+
+  FlatTrajectory::Column column;
+  auto* slice = column.add_chunk_slices();
+  slice->set_chunk_key(1);
+  slice->set_offset(1);
+  slice->set_length(2);
+  slice = column.add_chunk_slices();
+  slice->set_chunk_key(2);
+  slice->set_offset(0);
+  slice->set_length(3);
+
+  tensorflow::Tensor got;
+  REVERB_ASSERT_OK(UnpackColumn(column, {&first_chunk, &second_chunk}, &got));
+  ASSERT_EQ(got.shape(), tensorflow::TensorShape({5, 2}));
+  test::ExpectTensorEqual<tensorflow::int64>(
+      tensorflow::tensor::DeepCopy(got.Slice(0, 2)),
+      tensorflow::tensor::DeepCopy(first.Slice(1, 3)));
+  test::ExpectTensorEqual<tensorflow::int64>(
+      tensorflow::tensor::DeepCopy(got.Slice(2, 5)),
+      tensorflow::tensor::DeepCopy(second.Slice(0, 3)));
+}
+
+TEST(UnpackColumn, RejectsSlicesOfDifferentShapes) {
+  ChunkData first_chunk;
+  CompressTensorAsProto(
+      tensorflow::Tensor(tensorflow::DT_INT64, tensorflow::TensorShape({3, 2})),
+      first_chunk.mutable_data()->add_tensors());
+  ChunkData second_chunk;
+  CompressTensorAsProto(
+      tensorflow::Tensor(tensorflow::DT_INT64, tensorflow::TensorShape({3, 3})),
+      second_chunk.mutable_data()->add_tensors());
+
+  FlatTrajectory::Column column;
+  column.add_chunk_slices()->set_length(3);
+  column.add_chunk_slices()->set_length(3);
+
+  tensorflow::Tensor got;
+  EXPECT_EQ(UnpackColumn(column, {&first_chunk, &second_chunk}, &got).code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
 }  // namespace
 }  // namespace internal
 }  // namespace reverb
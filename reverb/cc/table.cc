@@ -25,13 +25,16 @@
 #include "google/protobuf/timestamp.pb.h"
 #include <cstdint>
 #include "absl/memory/memory.h"
+#include "absl/random/distributions.h"
 #include "absl/status/status.h"
 #include "absl/strings/str_cat.h"
 #include "absl/synchronization/mutex.h"
 #include "absl/time/clock.h"
 #include "absl/time/time.h"
+#include "absl/types/optional.h"
 #include "absl/types/span.h"
 #include "reverb/cc/checkpointing/checkpoint.pb.h"
+#include "reverb/cc/checkpointing/write_ahead_log.h"
 #include "reverb/cc/chunk_store.h"
 #include "reverb/cc/platform/hash_map.h"
 #include "reverb/cc/platform/hash_set.h"
@@ -40,6 +43,9 @@
 #include "reverb/cc/rate_limiter.h"
 #include "reverb/cc/schema.pb.h"
 #include "reverb/cc/selectors/interface.h"
+#include "reverb/cc/support/cleanup.h"
+#include "reverb/cc/support/lock_stats.h"
+#include "reverb/cc/support/packed_trajectory.h"
 #include "reverb/cc/support/trajectory_util.h"
 #include "reverb/cc/table_extensions/interface.h"
 
@@ -49,18 +55,37 @@ namespace {
 
 using Extensions = std::vector<std::shared_ptr<TableExtension>>;
 
-inline bool IsInsertedBefore(const PrioritizedItem& a,
-                             const PrioritizedItem& b) {
-  return a.inserted_at().seconds() < b.inserted_at().seconds() ||
-         (a.inserted_at().seconds() == b.inserted_at().seconds() &&
-          a.inserted_at().nanos() < b.inserted_at().nanos());
+inline void EncodeAsTimestampProto(int64_t unix_nanos,
+                                   google::protobuf::Timestamp* proto) {
+  proto->set_seconds(unix_nanos / 1000000000);
+  proto->set_nanos(unix_nanos % 1000000000);
 }
 
-inline void EncodeAsTimestampProto(absl::Time t,
-                                   google::protobuf::Timestamp* proto) {
-  const int64_t s = absl::ToUnixSeconds(t);
-  proto->set_seconds(s);
-  proto->set_nanos((t - absl::FromUnixSeconds(s)) / absl::Nanoseconds(1));
+inline int64_t DecodeTimestampProto(const google::protobuf::Timestamp& proto) {
+  return proto.seconds() * 1000000000 + proto.nanos();
+}
+
+KeyWithPriority MakeKeyWithPriority(Table::Key key, double priority) {
+  KeyWithPriority update;
+  update.set_key(key);
+  update.set_priority(priority);
+  return update;
+}
+
+// Selects the chunks of `chunks` which are referenced by `trajectory`.
+std::vector<std::shared_ptr<ChunkStore::Chunk>> ReferencedChunks(
+    const FlatTrajectory& trajectory,
+    const std::vector<std::shared_ptr<ChunkStore::Chunk>>& chunks) {
+  const auto keys = internal::GetChunkKeys(trajectory);
+  const internal::flat_hash_set<uint64_t> key_set(keys.begin(), keys.end());
+  std::vector<std::shared_ptr<ChunkStore::Chunk>> referenced;
+  referenced.reserve(keys.size());
+  for (const auto& chunk : chunks) {
+    if (key_set.contains(chunk->key())) {
+      referenced.push_back(chunk);
+    }
+  }
+  return referenced;
 }
 
 inline absl::Status CheckItemValidity(const Table::Item& item) {
@@ -88,23 +113,52 @@ inline absl::Status CheckItemValidity(const Table::Item& item) {
   return absl::OkStatus();
 }
 
+// Checks that `item` holds an episode from which windows of `window_length`
+// steps can be sampled.
+absl::Status CheckEpisodeValidity(const Table::Item& item, int window_length) {
+  const auto& trajectory = item.item.flat_trajectory();
+  const int episode_length = internal::ColumnLength(trajectory, 0);
+  for (int i = 0; i < trajectory.columns_size(); i++) {
+    if (trajectory.columns(i).squeeze()) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          "Column ", i, " is squeezed but items of tables which sample "
+          "windows must not contain squeezed columns."));
+    }
+    if (internal::ColumnLength(trajectory, i) != episode_length) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          "Column ", i, " has length ", internal::ColumnLength(trajectory, i),
+          " but all columns of items in tables which sample windows must "
+          "have the same length (", episode_length, ")."));
+    }
+  }
+  if (episode_length < window_length) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Item has ", episode_length,
+                     " steps which is less than the sample window length (",
+                     window_length, ")."));
+  }
+  return absl::OkStatus();
+}
+
 }  // namespace
 
 Table::Table(std::string name, std::shared_ptr<ItemSelector> sampler,
              std::shared_ptr<ItemSelector> remover, int64_t max_size,
              int32_t max_times_sampled, std::shared_ptr<RateLimiter> rate_limiter,
              Extensions extensions,
-             absl::optional<tensorflow::StructuredValue> signature)
+             absl::optional<tensorflow::StructuredValue> signature,
+             int32_t sample_window_length)
     : sampler_(std::move(sampler)),
       remover_(std::move(remover)),
       num_deleted_episodes_(0),
       max_size_(max_size),
       max_times_sampled_(max_times_sampled),
+      sample_window_length_(sample_window_length),
       name_(std::move(name)),
       rate_limiter_(std::move(rate_limiter)),
       extensions_(std::move(extensions)),
       signature_(std::move(signature)) {
-  REVERB_CHECK_OK(rate_limiter_->RegisterTable(this));
+  REVERB_CHECK_OK(rate_limiter_->RegisterTable(&mu_, this));
   for (auto& extension : extensions_) {
     REVERB_CHECK_OK(extension->RegisterTable(&mu_, this));
   }
@@ -119,90 +173,209 @@ Table::~Table() {
 
 std::vector<Table::Item> Table::Copy(size_t count) const {
   std::vector<Item> items;
-  absl::MutexLock lock(&mu_);
+  internal::TimedMutexLock lock(&mu_, &lock_stats_,
+                                internal::LockStats::kOther);
   items.reserve(count == 0 ? data_.size() : count);
   for (auto it = data_.cbegin();
        it != data_.cend() && (count == 0 || items.size() < count); it++) {
-    items.push_back(it->second);
+    items.push_back(UnpackItem(it->first, it->second));
   }
   return items;
 }
 
 absl::Status Table::InsertOrAssign(Item item) {
+  return InsertOrAssignInternal(std::move(item), /*await_rate_limiter=*/true);
+}
+
+absl::Status Table::InsertOrAssignFromLog(Item item) {
+  return InsertOrAssignInternal(std::move(item), /*await_rate_limiter=*/false);
+}
+
+absl::Status Table::InsertOrAssignInternal(Item item,
+                                           bool await_rate_limiter) {
   REVERB_RETURN_IF_ERROR(CheckItemValidity(item));
+  if (sample_window_length_ > 0) {
+    REVERB_RETURN_IF_ERROR(CheckEpisodeValidity(item, sample_window_length_));
+  }
 
   auto key = item.item.key();
   auto priority = item.item.priority();
 
+  // The item is packed before the lock is acquired.
+  StoredItem stored_item = PackItem(std::move(item));
+
   // If an item is deleted as part of the insert then we keep the data alive
   // until the lock has been released.
-  Item deleted_item;
+  StoredItem deleted_item;
+
+  // The operations may have made room for queued operations of this or other
+  // tables sharing the rate limiter. Their callbacks are called once the lock
+  // has been released.
+  auto run_ready_callbacks =
+      internal::MakeCleanup([this] { rate_limiter_->RunReadyCallbacks(); });
   {
-    absl::MutexLock lock(&mu_);
+    internal::TimedMutexLock lock(&mu_, &lock_stats_,
+                                  internal::LockStats::kInsert);
 
     /// If item already exists in table then update its priority.
     if (data_.contains(key)) {
-      return UpdateItem(key, priority);
+      REVERB_RETURN_IF_ERROR(UpdateItem(key, priority));
+      return LogMutationLocked({MakeKeyWithPriority(key, priority)}, {});
     }
 
     // Wait for the insert to be staged. While waiting the lock is released but
     // once it returns the lock is acquired again. While waiting for the right
     // to insert the operation might have transformed into an update.
-    REVERB_RETURN_IF_ERROR(rate_limiter_->AwaitCanInsert(&mu_));
+    if (await_rate_limiter) {
+      REVERB_RETURN_IF_ERROR(lock.ExcludeFromHoldTime(
+          [this]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+            return rate_limiter_->AwaitCanInsert(&mu_);
+          }));
+    }
 
     if (data_.contains(key)) {
       // If the insert was transformed into an update while waiting we need to
       // notify the limiter so it let another insert call to proceed.
       rate_limiter_->MaybeSignalCondVars(&mu_);
-      return UpdateItem(key, priority);
+      REVERB_RETURN_IF_ERROR(UpdateItem(key, priority));
+      return LogMutationLocked({MakeKeyWithPriority(key, priority)}, {});
     }
 
-    // Set the insertion timestamp after the lock has been acquired as this
-    // represents the order it was inserted into the sampler and remover.
-    EncodeAsTimestampProto(absl::Now(), item.item.mutable_inserted_at());
-    data_[key] = std::move(item);
+    // The item is unpacked for the log before it is moved into the table. It
+    // is logged even if the remover evicts it right away as the replay must
+    // make the same calls to the rate limiter.
+    absl::optional<Item> logged_item;
+    if (write_ahead_log_ != nullptr) {
+      logged_item = UnpackItem(key, stored_item);
+    }
+    REVERB_RETURN_IF_ERROR(
+        InsertLocked(key, std::move(stored_item), &deleted_item));
+    return logged_item.has_value() ? LogInsertLocked(std::move(*logged_item))
+                                   : absl::OkStatus();
+  }
+}
 
-    REVERB_RETURN_IF_ERROR(sampler_->Insert(key, priority));
-    REVERB_RETURN_IF_ERROR(remover_->Insert(key, priority));
+absl::Status Table::InsertLocked(Key key, StoredItem item,
+                                 StoredItem* deleted_item) {
+  const auto priority = item.priority;
 
-    auto it = data_.find(key);
-    for (auto& extension : extensions_) {
-      extension->OnInsert(&mu_, it->second);
-    }
+  // Set the insertion timestamp after the lock has been acquired as this
+  // represents the order it was inserted into the sampler and remover.
+  item.inserted_at_ns = absl::ToUnixNanos(absl::Now());
+  auto it = data_.insert_or_assign(key, std::move(item)).first;
 
-    // Increment references to the episode/s the item is referencing.
-    // We increment before a possible call to DeleteItem since the sampler can
-    // return this key.
-    for (const auto& chunk : it->second.chunks) {
-      ++episode_refs_[chunk->episode_id()];
-    }
+  REVERB_RETURN_IF_ERROR(sampler_->Insert(key, priority));
+  REVERB_RETURN_IF_ERROR(remover_->Insert(key, priority));
 
-    // Remove an item if we exceeded `max_size_`.
-    if (data_.size() > max_size_) {
-      REVERB_RETURN_IF_ERROR(DeleteItem(remover_->Sample().key, &deleted_item));
+  if (!extensions_.empty()) {
+    internal::ScopedHoldTimer timer(&lock_stats_,
+                                    internal::LockStats::kExtensions);
+    const Item unpacked = UnpackItemForExtensions(key, it->second);
+    for (auto& extension : extensions_) {
+      extension->OnInsert(&mu_, unpacked);
     }
+  }
+
+  // Increment references to the episode/s the item is referencing.
+  // We increment before a possible call to DeleteItem since the sampler can
+  // return this key.
+  for (const auto& chunk : it->second.data->chunks) {
+    ++episode_refs_[chunk->episode_id()];
+  }
 
-    // Now that the new item has been inserted and an older item has
-    // (potentially) been removed the insert can be finalized.
-    rate_limiter_->Insert(&mu_);
+  // Remove an item if we exceeded `max_size_`.
+  if (data_.size() > max_size_) {
+    REVERB_RETURN_IF_ERROR(DeleteItem(remover_->Sample().key, deleted_item));
   }
 
+  // Now that the new item has been inserted and an older item has
+  // (potentially) been removed the insert can be finalized.
+  rate_limiter_->Insert(&mu_);
   return absl::OkStatus();
 }
 
+void Table::InsertOrAssignAsync(Item item, absl::Duration timeout,
+                                InsertCallback callback) {
+  if (auto status = CheckItemValidity(item); !status.ok()) {
+    callback(status);
+    return;
+  }
+  if (sample_window_length_ > 0) {
+    if (auto status = CheckEpisodeValidity(item, sample_window_length_);
+        !status.ok()) {
+      callback(status);
+      return;
+    }
+  }
+  const Key key = item.item.key();
+  TryInsertAsync(std::make_shared<PendingInsert>(
+      PendingInsert{key, PackItem(std::move(item)), absl::Now() + timeout,
+                    std::move(callback)}));
+}
+
+void Table::TryInsertAsync(std::shared_ptr<PendingInsert> op) {
+  absl::Status status;
+  bool queued = false;
+  StoredItem deleted_item;
+  {
+    internal::TimedMutexLock lock(&mu_, &lock_stats_,
+                                  internal::LockStats::kInsert);
+    if (data_.contains(op->key)) {
+      status = UpdateItem(op->key, op->item.priority);
+      if (status.ok()) {
+        status = LogMutationLocked(
+            {MakeKeyWithPriority(op->key, op->item.priority)}, {});
+      }
+    } else if ((op->queued || !rate_limiter_->HasQueuedInserts(&mu_)) &&
+               rate_limiter_->CanInsert(&mu_, 1)) {
+      rate_limiter_->RecordAsyncInsert(&mu_, op->start, op->queued);
+      absl::optional<Item> logged_item;
+      if (write_ahead_log_ != nullptr) {
+        logged_item = UnpackItem(op->key, op->item);
+      }
+      status = InsertLocked(op->key, std::move(op->item), &deleted_item);
+      if (status.ok() && logged_item.has_value()) {
+        status = LogInsertLocked(std::move(*logged_item));
+      }
+    } else {
+      op->queued = true;
+      rate_limiter_->EnqueueInsert(
+          &mu_, /*num_inserts=*/1, op->deadline,
+          [this, op](const absl::Status& status) {
+            if (status.ok()) {
+              TryInsertAsync(op);
+              return;
+            }
+            {
+              absl::MutexLock lock(&mu_);
+              rate_limiter_->RecordAsyncInsert(&mu_, op->start,
+                                               /*was_blocked=*/true);
+            }
+            op->callback(status);
+          });
+      queued = true;
+    }
+  }
+  rate_limiter_->RunReadyCallbacks();
+  if (!queued) op->callback(status);
+}
+
 absl::Status Table::MutateItems(absl::Span<const KeyWithPriority> updates,
                                 absl::Span<const Key> deletes) {
-  std::vector<Item> deleted_items(deletes.size());
+  std::vector<StoredItem> deleted_items(deletes.size());
+  auto run_ready_callbacks =
+      internal::MakeCleanup([this] { rate_limiter_->RunReadyCallbacks(); });
   {
-    absl::MutexLock lock(&mu_);
+    internal::TimedMutexLock lock(&mu_, &lock_stats_,
+                                  internal::LockStats::kMutate);
     for (int i = 0; i < deletes.size(); i++) {
       REVERB_RETURN_IF_ERROR(DeleteItem(deletes[i], &deleted_items[i]));
     }
     for (const auto& item : updates) {
       REVERB_RETURN_IF_ERROR(UpdateItem(item.key(), item.priority()));
     }
+    return LogMutationLocked(updates, deletes);
   }
-  return absl::OkStatus();
 }
 
 absl::Status Table::Sample(SampledItem* sampled_item, absl::Duration timeout) {
@@ -220,104 +393,275 @@ absl::Status Table::SampleFlexibleBatch(std::vector<SampledItem>* items,
 
   // Keep references to the (potentially) deleted items alive until the lock has
   // been released.
-  std::vector<Item> deleted_items;
+  std::vector<StoredItem> deleted_items;
+  std::vector<SelectedSample> samples;
+  samples.reserve(batch_size);
+  auto run_ready_callbacks =
+      internal::MakeCleanup([this] { rate_limiter_->RunReadyCallbacks(); });
   {
-    absl::MutexLock lock(&mu_);
-    for (int i = 0; i < batch_size; i++) {
-      if (auto status = rate_limiter_->AwaitAndFinalizeSample(&mu_, timeout);
-          !status.ok()) {
-        // Deadline exceeded errors encountered after the first call means that
-        // it was not possible to proceed with another sample without awaiting
-        // changes. If this happens then we simply return the items that we
-        // sampled so far.
-        if (i != 0 && absl::IsDeadlineExceeded(status)) {
-          return absl::OkStatus();
-        }
-        return status;
-      }
-
-      // All calls but the first should return immediately if the rate limiter
-      // does not allow for another sample call to proceed.
-      timeout = absl::ZeroDuration();
-
-      auto sample = sampler_->Sample();
-      Item& item = data_[sample.key];
+    internal::TimedMutexLock lock(&mu_, &lock_stats_,
+                                  internal::LockStats::kSample);
+    // The rate limiter is only consulted once for the whole batch. It grants
+    // as many samples as it allows (up to `batch_size`) without waiting for
+    // more than the first one.
+    int num_samples = 0;
+    REVERB_RETURN_IF_ERROR(lock.ExcludeFromHoldTime(
+        [this, batch_size, timeout,
+         &num_samples]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+          return rate_limiter_->AwaitAndFinalizeSamples(
+              &mu_, /*max_samples=*/batch_size, /*min_samples=*/1, timeout,
+              &num_samples);
+        }));
+    REVERB_RETURN_IF_ERROR(SampleLocked(num_samples, &samples, &deleted_items));
+  }
 
-      // Increment the sample count.
-      item.item.set_times_sampled(item.item.times_sampled() + 1);
+  // The protos of the sampled items are only built once the lock has been
+  // released.
+  for (const auto& sample : samples) {
+    items->push_back(UnpackSample(sample));
+  }
+  return absl::OkStatus();
+}
 
-      // Copy Details of the sampled item.
-      SampledItem sampled_item = {
-          .item = item.item,
-          .chunks = item.chunks,
-          .probability = sample.probability,
-          .table_size = static_cast<int64_t>(data_.size()),
-      };
-      items->push_back(std::move(sampled_item));
+absl::Status Table::SampleLocked(int num_samples,
+                                 std::vector<SelectedSample>* samples,
+                                 std::vector<StoredItem>* deleted_items) {
+  for (int i = 0; i < num_samples; i++) {
+    // Items which reach `max_times_sampled_` are deleted so the table can run
+    // out of items, or shrink below the min size of the rate limiter, before
+    // all of the granted samples have been used. The remaining samples are
+    // released just as if they had not been granted.
+    if (data_.empty() || (i > 0 && !rate_limiter_->MinSizeReached(&mu_))) {
+      rate_limiter_->ReleaseSamples(&mu_, num_samples - i);
+      break;
+    }
 
-      // Notify extensions which item was sampled.
+    auto sample = sampler_->Sample();
+    StoredItem& item = data_[sample.key];
+
+    // Increment the sample count.
+    item.times_sampled++;
+
+    // Only the scalars and a reference to the immutable data of the item are
+    // copied while the lock is held.
+    samples->push_back({
+        .key = sample.key,
+        .item = item,
+        .probability = sample.probability,
+        .table_size = static_cast<int64_t>(data_.size()),
+        .sequence_number = num_samples_drawn_++,
+        .window_offset =
+            sample_window_length_ > 0 ? SelectWindowLocked(item) : -1,
+    });
+
+    // Notify extensions which item was sampled.
+    if (!extensions_.empty()) {
+      internal::ScopedHoldTimer timer(&lock_stats_,
+                                      internal::LockStats::kExtensions);
+      const Item unpacked = UnpackItemForExtensions(sample.key, item);
       for (auto& extension : extensions_) {
-        extension->OnSample(&mu_, item);
+        extension->OnSample(&mu_, unpacked);
       }
+    }
 
-      // If there is an upper bound of the number of times an item can be
-      // sampled and it is now reached then delete the item before the lock is
-      // released.
-      if (item.item.times_sampled() == max_times_sampled_) {
-        deleted_items.emplace_back();
-        REVERB_RETURN_IF_ERROR(
-            DeleteItem(item.item.key(), &deleted_items.back()));
-      }
+    // If there is an upper bound of the number of times an item can be
+    // sampled and it is now reached then delete the item before the lock is
+    // released.
+    if (item.times_sampled == max_times_sampled_) {
+      deleted_items->emplace_back();
+      REVERB_RETURN_IF_ERROR(DeleteItem(sample.key, &deleted_items->back()));
     }
   }
 
   return absl::OkStatus();
 }
 
+int Table::SelectWindowLocked(const StoredItem& item) {
+  const int num_windows =
+      item.data->trajectory.ColumnLength(0) - sample_window_length_ + 1;
+  return absl::Uniform<int>(bit_gen_, 0, num_windows);
+}
+
+Table::StoredItem Table::PackItem(Item item) {
+  auto data = std::make_shared<StoredItem::Data>();
+  data->trajectory = internal::PackedTrajectory(item.item.flat_trajectory());
+  data->chunks = std::move(item.chunks);
+  return {
+      .priority = item.item.priority(),
+      .times_sampled = item.item.times_sampled(),
+      .inserted_at_ns = DecodeTimestampProto(item.item.inserted_at()),
+      .data = std::move(data),
+  };
+}
+
+Table::Item Table::UnpackItem(Key key, const StoredItem& item,
+                              bool with_trajectory) const {
+  Item unpacked;
+  unpacked.item.set_key(key);
+  unpacked.item.set_table(name_);
+  unpacked.item.set_priority(item.priority);
+  unpacked.item.set_times_sampled(item.times_sampled);
+  EncodeAsTimestampProto(item.inserted_at_ns,
+                         unpacked.item.mutable_inserted_at());
+  if (with_trajectory) {
+    *unpacked.item.mutable_flat_trajectory() = item.data->trajectory.ToProto();
+    unpacked.chunks = item.data->chunks;
+  }
+  return unpacked;
+}
+
+Table::Item Table::UnpackItemForExtensions(Key key,
+                                           const StoredItem& item) const {
+  return UnpackItem(
+      key, item,
+      std::any_of(extensions_.begin(), extensions_.end(),
+                  [](const auto& extension) {
+                    return extension->NeedsTrajectory();
+                  }));
+}
+
+Table::SampledItem Table::UnpackSample(const SelectedSample& sample) const {
+  SampledItem sampled_item;
+  Item unpacked = UnpackItem(sample.key, sample.item);
+  sampled_item.item = std::move(unpacked.item);
+  sampled_item.probability = sample.probability;
+  sampled_item.table_size = sample.table_size;
+  sampled_item.sequence_number = sample.sequence_number;
+
+  if (sample.window_offset < 0) {
+    sampled_item.chunks = std::move(unpacked.chunks);
+    return sampled_item;
+  }
+
+  // Only the chunks referenced by the window are returned so that the data of
+  // the rest of the episode is not sent to the client.
+  *sampled_item.item.mutable_flat_trajectory() =
+      internal::SliceTrajectory(sampled_item.item.flat_trajectory(),
+                                sample.window_offset, sample_window_length_);
+  sampled_item.chunks =
+      ReferencedChunks(sampled_item.item.flat_trajectory(), unpacked.chunks);
+  sampled_item.probability /=
+      sample.item.data->trajectory.ColumnLength(0) - sample_window_length_ + 1;
+  return sampled_item;
+}
+
+void Table::SampleFlexibleBatchAsync(int batch_size, absl::Duration timeout,
+                                     SampleCallback callback) {
+  TrySampleAsync(std::make_shared<PendingSample>(PendingSample{
+      batch_size, absl::Now() + timeout, std::move(callback)}));
+}
+
+void Table::TrySampleAsync(std::shared_ptr<PendingSample> op) {
+  absl::Status status;
+  bool queued = false;
+  std::vector<SelectedSample> samples;
+  std::vector<StoredItem> deleted_items;
+  {
+    internal::TimedMutexLock lock(&mu_, &lock_stats_,
+                                  internal::LockStats::kSample);
+    if ((op->queued || !rate_limiter_->HasQueuedSamples(&mu_)) &&
+        rate_limiter_->CanSample(&mu_, 1)) {
+      // The limiter allows a sample so the call returns without waiting.
+      int num_samples = 0;
+      status = rate_limiter_->FinalizeSamples(
+          &mu_, /*max_samples=*/op->batch_size, &num_samples);
+      rate_limiter_->RecordAsyncSample(&mu_, op->start, op->queued);
+      if (status.ok()) {
+        samples.reserve(num_samples);
+        status = SampleLocked(num_samples, &samples, &deleted_items);
+      }
+    } else {
+      op->queued = true;
+      rate_limiter_->EnqueueSample(
+          &mu_, /*max_samples=*/op->batch_size, /*min_samples=*/1,
+          op->deadline, [this, op](const absl::Status& status) {
+            if (status.ok()) {
+              TrySampleAsync(op);
+              return;
+            }
+            {
+              absl::MutexLock lock(&mu_);
+              rate_limiter_->RecordAsyncSample(&mu_, op->start,
+                                               /*was_blocked=*/true);
+            }
+            op->callback(status, {});
+          });
+      queued = true;
+    }
+  }
+  rate_limiter_->RunReadyCallbacks();
+  if (queued) return;
+
+  std::vector<SampledItem> items;
+  if (status.ok()) {
+    items.reserve(samples.size());
+    for (const auto& sample : samples) {
+      items.push_back(UnpackSample(sample));
+    }
+  }
+  op->callback(status, std::move(items));
+}
+
 int64_t Table::size() const {
-  absl::MutexLock lock(&mu_);
+  internal::TimedMutexLock lock(&mu_, &lock_stats_,
+                                internal::LockStats::kOther);
   return data_.size();
 }
 
 const std::string& Table::name() const { return name_; }
 
+void Table::set_lock_stats_enabled(bool enabled) {
+  lock_stats_.set_enabled(enabled);
+}
+
 TableInfo Table::info() const {
   TableInfo info;
 
   info.set_name(name_);
   info.set_max_size(max_size_);
   info.set_max_times_sampled(max_times_sampled_);
+  info.set_sample_window_length(sample_window_length_);
 
   if (signature_) {
     *info.mutable_signature() = *signature_;
   }
 
-  absl::MutexLock lock(&mu_);
+  internal::TimedMutexLock lock(&mu_, &lock_stats_, internal::LockStats::kInfo);
   *info.mutable_rate_limiter_info() = rate_limiter_->Info(&mu_);
   *info.mutable_sampler_options() = sampler_->options();
   *info.mutable_remover_options() = remover_->options();
   info.set_current_size(data_.size());
   info.set_num_episodes(episode_refs_.size());
   info.set_num_deleted_episodes(num_deleted_episodes_);
+  *info.mutable_lock_stats() = lock_stats_.ToProto();
 
   return info;
 }
 
 void Table::Close() {
-  absl::MutexLock lock(&mu_);
-  rate_limiter_->Cancel(&mu_);
+  {
+    internal::TimedMutexLock lock(&mu_, &lock_stats_,
+                                  internal::LockStats::kOther);
+    rate_limiter_->Cancel(&mu_);
+  }
+  rate_limiter_->RunReadyCallbacks();
 }
 
-absl::Status Table::DeleteItem(Table::Key key, Item* deleted_item) {
+absl::Status Table::DeleteItem(Table::Key key, StoredItem* deleted_item) {
   auto it = data_.find(key);
   if (it == data_.end()) return absl::OkStatus();
 
-  for (auto& extension : extensions_) {
-    extension->OnDelete(&mu_, it->second);
+  if (!extensions_.empty()) {
+    internal::ScopedHoldTimer timer(&lock_stats_,
+                                    internal::LockStats::kExtensions);
+    const Item unpacked = UnpackItemForExtensions(key, it->second);
+    for (auto& extension : extensions_) {
+      extension->OnDelete(&mu_, unpacked);
+    }
   }
 
   // Decrement counts to the episodes the item is referencing.
-  for (const auto& chunk : it->second.chunks) {
+  for (const auto& chunk : it->second.data->chunks) {
     auto ep_it = episode_refs_.find(chunk->episode_id());
     REVERB_CHECK(ep_it != episode_refs_.end());
     if (--(ep_it->second) == 0) {
@@ -340,15 +684,20 @@ absl::Status Table::UpdateItem(
   if (it == data_.end()) {
     return absl::OkStatus();
   }
-  it->second.item.set_priority(priority);
+  it->second.priority = priority;
   REVERB_RETURN_IF_ERROR(sampler_->Update(key, priority));
   REVERB_RETURN_IF_ERROR(remover_->Update(key, priority));
 
-  for (auto& extension : extensions_) {
-    if (std::none_of(
-            exclude.begin(), exclude.end(),
-            [ext_ptr = extension.get()](auto e) { return e == ext_ptr; })) {
-      extension->OnUpdate(&mu_, it->second);
+  if (!extensions_.empty()) {
+    internal::ScopedHoldTimer timer(&lock_stats_,
+                                    internal::LockStats::kExtensions);
+    const Item unpacked = UnpackItemForExtensions(key, it->second);
+    for (auto& extension : extensions_) {
+      if (std::none_of(
+              exclude.begin(), exclude.end(),
+              [ext_ptr = extension.get()](auto e) { return e == ext_ptr; })) {
+        extension->OnUpdate(&mu_, unpacked);
+      }
     }
   }
 
@@ -356,10 +705,17 @@ absl::Status Table::UpdateItem(
 }
 
 absl::Status Table::Reset() {
-  absl::MutexLock lock(&mu_);
+  auto run_ready_callbacks =
+      internal::MakeCleanup([this] { rate_limiter_->RunReadyCallbacks(); });
+  internal::TimedMutexLock lock(&mu_, &lock_stats_,
+                                internal::LockStats::kMutate);
 
-  for (auto& extension : extensions_) {
-    extension->OnReset(&mu_);
+  if (!extensions_.empty()) {
+    internal::ScopedHoldTimer timer(&lock_stats_,
+                                    internal::LockStats::kExtensions);
+    for (auto& extension : extensions_) {
+      extension->OnReset(&mu_);
+    }
   }
 
   sampler_->Clear();
@@ -371,7 +727,7 @@ absl::Status Table::Reset() {
 
   rate_limiter_->Reset(&mu_);
 
-  return absl::OkStatus();
+  return LogResetLocked();
 }
 
 Table::CheckpointAndChunks Table::Checkpoint() {
@@ -379,14 +735,18 @@ Table::CheckpointAndChunks Table::Checkpoint() {
   checkpoint.set_table_name(name());
   checkpoint.set_max_size(max_size_);
   checkpoint.set_max_times_sampled(max_times_sampled_);
+  checkpoint.set_sample_window_length(sample_window_length_);
 
   if (signature_.has_value()) {
     *checkpoint.mutable_signature() = signature_.value();
   }
 
-  absl::MutexLock lock(&mu_);
+  internal::TimedMutexLock lock(&mu_, &lock_stats_,
+                                internal::LockStats::kCheckpoint);
 
   checkpoint.set_num_deleted_episodes(num_deleted_episodes_);
+  checkpoint.set_num_samples_drawn(num_samples_drawn_);
+  checkpoint.set_write_ahead_log_sequence(write_ahead_log_sequence_);
 
   *checkpoint.mutable_sampler() = sampler_->options();
   *checkpoint.mutable_remover() = remover_->options();
@@ -395,23 +755,32 @@ Table::CheckpointAndChunks Table::Checkpoint() {
   // finalized before the items are added
   *checkpoint.mutable_rate_limiter() = rate_limiter_->CheckpointReader(&mu_);
 
-  absl::flat_hash_set<std::shared_ptr<ChunkStore::Chunk>> chunks;
-  for (const auto& entry : data_) {
-    *checkpoint.add_items() = entry.second.item;
-    chunks.insert(entry.second.chunks.begin(), entry.second.chunks.end());
-  }
-
   // Sort the items in ascending order based on their insertion time. This makes
   // it possible to reconstruct ordered structures (Fifo) when the checkpoint is
   // loaded.
-  std::sort(checkpoint.mutable_items()->begin(),
-            checkpoint.mutable_items()->end(), IsInsertedBefore);
+  std::vector<const std::pair<const Key, StoredItem>*> entries;
+  entries.reserve(data_.size());
+  for (const auto& entry : data_) {
+    entries.push_back(&entry);
+  }
+  std::sort(entries.begin(), entries.end(), [](const auto* a, const auto* b) {
+    return a->second.inserted_at_ns < b->second.inserted_at_ns;
+  });
+
+  absl::flat_hash_set<std::shared_ptr<ChunkStore::Chunk>> chunks;
+  checkpoint.mutable_items()->Reserve(entries.size());
+  for (const auto* entry : entries) {
+    *checkpoint.add_items() = UnpackItem(entry->first, entry->second).item;
+    chunks.insert(entry->second.data->chunks.begin(),
+                  entry->second.data->chunks.end());
+  }
 
   return {std::move(checkpoint), std::move(chunks)};
 }
 
 absl::Status Table::InsertCheckpointItem(Table::Item item) {
-  absl::MutexLock lock(&mu_);
+  internal::TimedMutexLock lock(&mu_, &lock_stats_,
+                                internal::LockStats::kInsert);
   REVERB_CHECK_LE(data_.size() + 1, max_size_)
       << "InsertCheckpointItem called on already full Table";
   REVERB_CHECK(!data_.contains(item.item.key()))
@@ -424,12 +793,16 @@ absl::Status Table::InsertCheckpointItem(Table::Item item) {
       remover_->Insert(item.item.key(), item.item.priority()));
 
   const auto key = item.item.key();
-  auto it = data_.emplace(key, std::move(item)).first;
-  for (auto& extension : extensions_) {
-    extension->OnInsert(&mu_, it->second);
+  auto it = data_.emplace(key, PackItem(item)).first;
+  if (!extensions_.empty()) {
+    internal::ScopedHoldTimer timer(&lock_stats_,
+                                    internal::LockStats::kExtensions);
+    for (auto& extension : extensions_) {
+      extension->OnInsert(&mu_, item);
+    }
   }
 
-  for (const auto& chunk : it->second.chunks) {
+  for (const auto& chunk : it->second.data->chunks) {
     ++episode_refs_[chunk->episode_id()];
   }
 
@@ -437,23 +810,26 @@ absl::Status Table::InsertCheckpointItem(Table::Item item) {
 }
 
 bool Table::Get(Table::Key key, Table::Item* item) {
-  absl::MutexLock lock(&mu_);
+  internal::TimedMutexLock lock(&mu_, &lock_stats_,
+                                internal::LockStats::kOther);
   auto it = data_.find(key);
   if (it != data_.end()) {
-    *item = it->second;
+    *item = UnpackItem(key, it->second);
     return true;
   }
   return false;
 }
 
-const internal::flat_hash_map<Table::Key, Table::Item>* Table::RawLookup() {
+const internal::flat_hash_map<Table::Key, Table::StoredItem>*
+Table::RawLookup() {
   mu_.AssertHeld();
   return &data_;
 }
 
 void Table::UnsafeAddExtension(std::shared_ptr<TableExtension> extension) {
   REVERB_CHECK_OK(extension->RegisterTable(&mu_, this));
-  absl::MutexLock lock(&mu_);
+  internal::TimedMutexLock lock(&mu_, &lock_stats_,
+                                internal::LockStats::kOther);
   REVERB_CHECK(data_.empty());
   extensions_.push_back(std::move(extension));
 }
@@ -462,29 +838,37 @@ const std::vector<std::shared_ptr<TableExtension>>& Table::extensions() const {
   return extensions_;
 }
 
+const std::shared_ptr<RateLimiter>& Table::rate_limiter() const {
+  return rate_limiter_;
+}
+
 const absl::optional<tensorflow::StructuredValue>& Table::signature() const {
   return signature_;
 }
 
 bool Table::CanSample(int num_samples) const {
-  absl::MutexLock lock(&mu_);
+  internal::TimedMutexLock lock(&mu_, &lock_stats_,
+                                internal::LockStats::kOther);
   return rate_limiter_->CanSample(&mu_, num_samples);
 }
 
 bool Table::CanInsert(int num_inserts) const {
-  absl::MutexLock lock(&mu_);
+  internal::TimedMutexLock lock(&mu_, &lock_stats_,
+                                internal::LockStats::kOther);
   return rate_limiter_->CanInsert(&mu_, num_inserts);
 }
 
 RateLimiterEventHistory Table::GetRateLimiterEventHistory(
     size_t min_insert_event_id, size_t min_sample_event_id) const {
-  absl::MutexLock lock(&mu_);
+  internal::TimedMutexLock lock(&mu_, &lock_stats_,
+                                internal::LockStats::kOther);
   return rate_limiter_->GetEventHistory(&mu_, min_insert_event_id,
                                         min_sample_event_id);
 }
 
 int64_t Table::num_episodes() const {
-  absl::MutexLock lock(&mu_);
+  internal::TimedMutexLock lock(&mu_, &lock_stats_,
+                                internal::LockStats::kOther);
   return episode_refs_.size();
 }
 
@@ -497,7 +881,8 @@ absl::Status Table::UnsafeUpdateItem(
 std::vector<std::shared_ptr<TableExtension>> Table::UnsafeClearExtensions() {
   std::vector<std::shared_ptr<TableExtension>> extensions;
   {
-    absl::MutexLock lock(&mu_);
+    internal::TimedMutexLock lock(&mu_, &lock_stats_,
+                                  internal::LockStats::kOther);
     REVERB_CHECK(data_.empty());
     extensions.swap(extensions_);
   }
@@ -510,16 +895,61 @@ std::vector<std::shared_ptr<TableExtension>> Table::UnsafeClearExtensions() {
 }
 
 int64_t Table::num_deleted_episodes() const {
-  absl::MutexLock lock(&mu_);
+  internal::TimedMutexLock lock(&mu_, &lock_stats_,
+                                internal::LockStats::kOther);
   return num_deleted_episodes_;
 }
 
 void Table::set_num_deleted_episodes_from_checkpoint(int64_t value) {
-  absl::MutexLock lock(&mu_);
+  internal::TimedMutexLock lock(&mu_, &lock_stats_,
+                                internal::LockStats::kOther);
   REVERB_CHECK(data_.empty() && num_deleted_episodes_ == 0);
   num_deleted_episodes_ = value;
 }
 
+void Table::set_num_samples_drawn_from_checkpoint(int64_t value) {
+  internal::TimedMutexLock lock(&mu_, &lock_stats_,
+                                internal::LockStats::kOther);
+  REVERB_CHECK(data_.empty() && num_samples_drawn_ == 0);
+  num_samples_drawn_ = value;
+}
+
+void Table::set_write_ahead_log(WriteAheadLog* log) {
+  internal::TimedMutexLock lock(&mu_, &lock_stats_,
+                                internal::LockStats::kOther);
+  write_ahead_log_ = log;
+}
+
+int64_t Table::write_ahead_log_sequence() const {
+  internal::TimedMutexLock lock(&mu_, &lock_stats_,
+                                internal::LockStats::kOther);
+  return write_ahead_log_sequence_;
+}
+
+void Table::set_write_ahead_log_sequence(int64_t value) {
+  internal::TimedMutexLock lock(&mu_, &lock_stats_,
+                                internal::LockStats::kOther);
+  write_ahead_log_sequence_ = value;
+}
+
+absl::Status Table::LogInsertLocked(Item item) {
+  if (write_ahead_log_ == nullptr) return absl::OkStatus();
+  return write_ahead_log_->AppendItem(std::move(item.item), item.chunks,
+                                      ++write_ahead_log_sequence_);
+}
+
+absl::Status Table::LogMutationLocked(
+    absl::Span<const KeyWithPriority> updates, absl::Span<const Key> deletes) {
+  if (write_ahead_log_ == nullptr) return absl::OkStatus();
+  return write_ahead_log_->AppendMutation(name_, updates, deletes,
+                                          ++write_ahead_log_sequence_);
+}
+
+absl::Status Table::LogResetLocked() {
+  if (write_ahead_log_ == nullptr) return absl::OkStatus();
+  return write_ahead_log_->AppendReset(name_, ++write_ahead_log_sequence_);
+}
+
 int32_t Table::DefaultFlexibleBatchSize() const {
   const auto& rl_info = rate_limiter_->InfoWithoutCallStats();
   // When a samples per insert ratio is provided then match the batch size with
@@ -546,12 +976,14 @@ int32_t Table::DefaultFlexibleBatchSize() const {
 }
 
 std::string Table::DebugString() const {
-  absl::MutexLock lock(&mu_);
+  internal::TimedMutexLock lock(&mu_, &lock_stats_,
+                                internal::LockStats::kOther);
   std::string str = absl::StrCat(
       "Table(sampler=", sampler_->DebugString(),
       ", remover=", remover_->DebugString(),
       ", max_size=", max_size_,
       ", max_times_sampled=", max_times_sampled_,
+      ", sample_window_length=", sample_window_length_,
       ", name=", name_,
       ", rate_limiter=", rate_limiter_->DebugString(),
       ", signature=",
@@ -16,6 +16,7 @@
 #define REVERB_CC_TABLE_H_
 
 #include <cstddef>
+#include <functional>
 #include <initializer_list>
 #include <memory>
 #include <string>
@@ -24,25 +25,31 @@
 
 #include <cstdint>
 #include "absl/base/thread_annotations.h"
+#include "absl/random/random.h"
 #include "absl/status/status.h"
 #include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
 #include "absl/types/optional.h"
 #include "absl/types/span.h"
 #include "reverb/cc/checkpointing/checkpoint.pb.h"
+#include "reverb/cc/checkpointing/write_ahead_log.h"
 #include "reverb/cc/chunk_store.h"
 #include "reverb/cc/platform/hash_map.h"
 #include "reverb/cc/platform/hash_set.h"
 #include "reverb/cc/rate_limiter.h"
 #include "reverb/cc/schema.pb.h"
 #include "reverb/cc/selectors/interface.h"
+#include "reverb/cc/support/lock_stats.h"
+#include "reverb/cc/support/packed_trajectory.h"
 #include "reverb/cc/table_extensions/interface.h"
 #include "tensorflow/core/protobuf/struct.pb.h"
 
 namespace deepmind {
 namespace reverb {
 
-// Used for representing items of the priority distribution. See
-// PrioritizedItem in schema.proto for documentation.
+// Used for representing items of the priority distribution when they are
+// passed in and out of a `Table`. See PrioritizedItem in schema.proto for
+// documentation. Tables store items in the more compact `Table::StoredItem`.
 struct TableItem {
   PrioritizedItem item;
   std::vector<std::shared_ptr<ChunkStore::Chunk>> chunks;
@@ -88,8 +95,36 @@ class Table {
     std::vector<std::shared_ptr<ChunkStore::Chunk>> chunks;
     double probability;
     int64_t table_size;
+    // Number of samples drawn from the table before this one.
+    int64_t sequence_number;
   };
 
+  // Representation of the items held by the table. Unlike `Item` it does not
+  // hold the name of the table, the insertion time is an integer and the
+  // trajectory is packed. The immutable parts are shared with samples of the
+  // item so the lock does not have to be held while the protos of sampled
+  // items are built.
+  struct StoredItem {
+    struct Data {
+      internal::PackedTrajectory trajectory;
+      std::vector<std::shared_ptr<ChunkStore::Chunk>> chunks;
+    };
+
+    double priority = 0;
+    int32_t times_sampled = 0;
+
+    // Nanoseconds since the Unix epoch.
+    int64_t inserted_at_ns = 0;
+
+    std::shared_ptr<const Data> data;
+  };
+
+  // Callbacks of `InsertOrAssignAsync` and `SampleFlexibleBatchAsync`. They
+  // are called exactly once and without the lock of the table held.
+  using InsertCallback = std::function<void(const absl::Status&)>;
+  using SampleCallback =
+      std::function<void(const absl::Status&, std::vector<SampledItem>)>;
+
   // Used when checkpointing to ensure that none of the chunks referenced by the
   // checkpointed items are removed before the checkpoint operations has
   // completed.
@@ -111,11 +146,16 @@ class Table {
   // `signature` allows an optional declaration of the data that can be stored
   //   in this table.  writers and readers are responsible for checking against
   //   this signature, as it is available via RPC request.
+  // `sample_window_length`, when > 0, makes every item hold a whole episode
+  //   rather than a single trajectory. Sampling an item then returns a window
+  //   of `sample_window_length` consecutive steps, starting at a uniformly
+  //   selected offset within the episode. See `SampleFlexibleBatch`.
   Table(std::string name, std::shared_ptr<ItemSelector> sampler,
         std::shared_ptr<ItemSelector> remover, int64_t max_size,
         int32_t max_times_sampled, std::shared_ptr<RateLimiter> rate_limiter,
         std::vector<std::shared_ptr<TableExtension>> extensions = {},
-        absl::optional<tensorflow::StructuredValue> signature = absl::nullopt);
+        absl::optional<tensorflow::StructuredValue> signature = absl::nullopt,
+        int32_t sample_window_length = 0);
 
   ~Table();
 
@@ -137,12 +177,30 @@ class Table {
   // away.
   absl::Status InsertOrAssign(Item item);
 
+  // Same as `InsertOrAssign` but never blocks the calling thread. If the
+  // RateLimiter does not allow the insert then the operation is queued in the
+  // RateLimiter and completed by the thread which makes room for it, or with
+  // `DeadlineExceededError` once `timeout` has expired. This allows a server
+  // to keep many blocked writers without dedicating a thread to each of them.
+  //
+  // The table must outlive the callback. `Close` cancels queued operations.
+  void InsertOrAssignAsync(Item item, absl::Duration timeout,
+                           InsertCallback callback);
+
   // Inserts an item without consulting or modifying the RateLimiter about the
   // operation.
   //
   // This should ONLY be used when restoring a `Table` from a checkpoint.
   absl::Status InsertCheckpointItem(Item item);
 
+  // Same as `InsertOrAssign` but never blocks on the RateLimiter. The insert is
+  // still registered with the RateLimiter so its state remains consistent with
+  // the content of the table.
+  //
+  // This should ONLY be used when replaying a write-ahead log on top of a
+  // `Table` restored from a checkpoint.
+  absl::Status InsertOrAssignFromLog(Item item);
+
   // Updates the priority or deletes items in this table distribution. All
   // operations in the arguments are applied in the order that they are listed.
   // Different operations can be set at the same time. Ignores non existing keys
@@ -166,14 +224,17 @@ class Table {
   //
   //   1. Block (for at most `timeout`) until `rate_limiter_` allows (at least)
   //      one sample operation to proceed. At this point an exclusive lock on
-  //      the table is acquired.
+  //      the table is acquired and `rate_limiter_` grants as many sample
+  //      operations as it allows, up to `batch_size`.
   //   2. If `timeout` was exceeded, return `DeadlineExceededError`.
   //   3. Select item using `sampler_`, push item to output vector `items`,
   //      call extensions and delete item from table if `max_times_sampled_`
-  //      reached.
-  //   4. (Without releasing the lock) IFF `rate_limiter_` allows for one more
-  //      sample operation to proceed AND `items->size() < batch_size` then go
-  //      to 3, otherwise return OK.
+  //      reached. If `sample_window_length_` is set then the trajectory of the
+  //      pushed item is narrowed down to a window of the sampled episode and
+  //      its probability is divided by the number of windows in the episode.
+  //   4. (Without releasing the lock) IFF there are granted operations left
+  //      AND the table is not empty then go to 3, otherwise return the unused
+  //      operations to `rate_limiter_` and return OK.
   //
   // Note that the timeout is ONLY used when waiting for the first sample
   // operation to be "approved" by the rate limiter. The remaining items of the
@@ -183,6 +244,11 @@ class Table {
                                    int batch_size,
                                    absl::Duration timeout = kDefaultTimeout);
 
+  // Same as `SampleFlexibleBatch` but never blocks the calling thread. See
+  // `InsertOrAssignAsync` for details.
+  void SampleFlexibleBatchAsync(int batch_size, absl::Duration timeout,
+                                SampleCallback callback);
+
   // Returns true iff the current state would allow for `num_samples` to be
   // sampled. Dies if `num_samples` is < 1.
   //
@@ -217,11 +283,14 @@ class Table {
   // Registered table extensions.
   const std::vector<std::shared_ptr<TableExtension>>& extensions() const;
 
+  // Rate limiter of the table. The limiter may be shared with other tables.
+  const std::shared_ptr<RateLimiter>& rate_limiter() const;
+
   // Lookup a single item. Returns true if found, else false.
   bool Get(Key key, Item* item) ABSL_LOCKS_EXCLUDED(mu_);
 
   // Get pointer to `data_`. Must only be called by extensions while lock held.
-  const internal::flat_hash_map<Key, Item>* RawLookup()
+  const internal::flat_hash_map<Key, StoredItem>* RawLookup()
       ABSL_ASSERT_EXCLUSIVE_LOCK(mu_);
 
   // Removes all items and resets the RateLimiter to its initial state.
@@ -246,11 +315,37 @@ class Table {
   void set_num_deleted_episodes_from_checkpoint(int64_t value)
       ABSL_LOCKS_EXCLUDED(mu_);
 
+  // Same as above but for the number of samples drawn from the table, which
+  // is the sequence number of the next sample.
+  void set_num_samples_drawn_from_checkpoint(int64_t value)
+      ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Records the changes made through `InsertOrAssign`, `InsertOrAssignAsync`,
+  // `MutateItems` and `Reset` in `log` (unless nullptr). The entries are
+  // appended while the lock of the table is held so the log order is the
+  // order in which the changes were applied. `log` must outlive the table or
+  // be detached by calling this method with nullptr.
+  void set_write_ahead_log(WriteAheadLog* log) ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Sequence number of the last change that was recorded in the write-ahead
+  // log, or replayed from it. Stored in the checkpoint of the table.
+  int64_t write_ahead_log_sequence() const ABSL_LOCKS_EXCLUDED(mu_);
+
+  // "Manually" sets the write-ahead log sequence number. This is only intended
+  // to be called when restoring the table from a checkpoint and while its
+  // write-ahead log is replayed.
+  void set_write_ahead_log_sequence(int64_t value) ABSL_LOCKS_EXCLUDED(mu_);
+
   const std::string& name() const;
 
   // Metadata about the table, including the current state of the rate limiter.
   TableInfo info() const;
 
+  // Enables or disables the collection of the lock stats reported by `info`.
+  // Disabled by default as collection adds overhead to every acquisition of
+  // the table lock.
+  void set_lock_stats_enabled(bool enabled);
+
   // Signature (if any) of the table.
   const absl::optional<tensorflow::StructuredValue>& signature() const;
 
@@ -276,6 +371,92 @@ class Table {
   std::string DebugString() const;
 
  private:
+  // Implementation of `InsertOrAssign` and `InsertOrAssignFromLog`. If
+  // `await_rate_limiter` is false then the insert proceeds without waiting for
+  // the RateLimiter to allow it.
+  absl::Status InsertOrAssignInternal(Item item, bool await_rate_limiter);
+
+  // A sample selected while the lock was held. It is converted into a
+  // `SampledItem` once the lock has been released.
+  struct SelectedSample {
+    Key key;
+    StoredItem item;
+    double probability;
+    int64_t table_size;
+    int64_t sequence_number;
+
+    // First step of the sampled window or -1 if the whole item is returned.
+    int window_offset;
+  };
+
+  // Appends the insert of `item`, a priority mutation or a reset to
+  // `write_ahead_log_` with the next sequence number. No-op if the table has
+  // no write-ahead log.
+  absl::Status LogInsertLocked(Item item) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  absl::Status LogMutationLocked(absl::Span<const KeyWithPriority> updates,
+                                 absl::Span<const Key> deletes)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  absl::Status LogResetLocked() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Converts between the representation passed to and held by the table. The
+  // trajectory and chunks are left out unless `with_trajectory` is set.
+  static StoredItem PackItem(Item item);
+  Item UnpackItem(Key key, const StoredItem& item,
+                  bool with_trajectory = true) const;
+
+  // Converts the item passed to the hooks of the extensions. The trajectory is
+  // only decoded if an extension needs it.
+  Item UnpackItemForExtensions(Key key, const StoredItem& item) const
+      ABSL_SHARED_LOCKS_REQUIRED(mu_);
+  SampledItem UnpackSample(const SelectedSample& sample) const;
+
+  // Inserts an item which isn't already in the table once the RateLimiter has
+  // allowed it. If an item is removed to respect `max_size_` then it is moved
+  // to `deleted_item`.
+  absl::Status InsertLocked(Key key, StoredItem item, StoredItem* deleted_item)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Samples `num_samples` items which have already been granted by the
+  // RateLimiter. Unused samples are returned to the RateLimiter if the table
+  // runs out of items. Deleted items are moved to `deleted_items`.
+  absl::Status SampleLocked(int num_samples,
+                            std::vector<SelectedSample>* samples,
+                            std::vector<StoredItem>* deleted_items)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Selects the first step of a uniformly selected window of
+  // `sample_window_length_` steps in a sampled episode.
+  int SelectWindowLocked(const StoredItem& item)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // State of an operation created by `InsertOrAssignAsync` or
+  // `SampleFlexibleBatchAsync`.
+  struct PendingInsert {
+    Key key;
+    StoredItem item;
+    absl::Time deadline;
+    InsertCallback callback;
+    absl::Time start = absl::Now();
+    bool queued = false;
+  };
+  struct PendingSample {
+    int batch_size;
+    absl::Time deadline;
+    SampleCallback callback;
+    absl::Time start = absl::Now();
+    bool queued = false;
+  };
+
+  // Completes the operation if the RateLimiter allows it and otherwise queues
+  // it in the RateLimiter. The queued operation is retried when the state of
+  // the RateLimiter changes. Operations which have not been queued yet are
+  // queued behind any waiting operations even if the limiter would allow them,
+  // so that they don't overtake the operations which have waited longer.
+  void TryInsertAsync(std::shared_ptr<PendingInsert> op)
+      ABSL_LOCKS_EXCLUDED(mu_);
+  void TrySampleAsync(std::shared_ptr<PendingSample> op)
+      ABSL_LOCKS_EXCLUDED(mu_);
+
   // Updates item priority in `data_`, `samper_`, `remover_` and calls
   // `OnUpdate` on all extensions not part of `exclude`.
   absl::Status UpdateItem(
@@ -288,7 +469,7 @@ class Table {
   //
   // The deleted item is returned in order to allow the deallocation of the
   // underlying item to be postponed until the lock has been released.
-  absl::Status DeleteItem(Key key, Item* deleted_item)
+  absl::Status DeleteItem(Key key, StoredItem* deleted_item)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
 
   // Distribution used for sampling.
@@ -299,7 +480,7 @@ class Table {
 
   // Bijection of key to item. Used for storing the chunks and timestep range of
   // each item.
-  internal::flat_hash_map<Key, Item> data_ ABSL_GUARDED_BY(mu_);
+  internal::flat_hash_map<Key, StoredItem> data_ ABSL_GUARDED_BY(mu_);
 
   // Count of references from chunks referenced by items.
   internal::flat_hash_map<uint64_t, int64_t> episode_refs_ ABSL_GUARDED_BY(mu_);
@@ -309,6 +490,17 @@ class Table {
   // called.
   int64_t num_deleted_episodes_ ABSL_GUARDED_BY(mu_);
 
+  // The number of samples drawn from the table. Used as the sequence number of
+  // the next sample.
+  int64_t num_samples_drawn_ ABSL_GUARDED_BY(mu_) = 0;
+
+  // Log which the changes to the table are recorded in. Not owned.
+  WriteAheadLog* write_ahead_log_ ABSL_GUARDED_BY(mu_) = nullptr;
+
+  // Sequence number of the last change recorded in (or replayed from) the
+  // write-ahead log.
+  int64_t write_ahead_log_sequence_ ABSL_GUARDED_BY(mu_) = 0;
+
   // Maximum number of items that this container can hold. InsertOrAssign()
   // respects this limit when inserting a new item.
   const int64_t max_size_;
@@ -317,6 +509,13 @@ class Table {
   // A value <= 0 means there is no limit.
   const int32_t max_times_sampled_;
 
+  // Number of steps returned when sampling an episode. A value <= 0 means that
+  // items are returned in full.
+  const int32_t sample_window_length_;
+
+  // Selects the window offsets of sampled episodes.
+  absl::BitGen bit_gen_ ABSL_GUARDED_BY(mu_);
+
   // Name of the table.
   const std::string name_;
 
@@ -333,6 +532,10 @@ class Table {
   // 'extensions_` and `data_`,
   mutable absl::Mutex mu_;
 
+  // Wait and hold times of `mu_`, broken down by operation. Only collected
+  // once enabled with `set_lock_stats_enabled`.
+  mutable internal::LockStats lock_stats_;
+
   // Optional signature for data in the table.
   const absl::optional<tensorflow::StructuredValue> signature_;
 };
@@ -64,6 +64,13 @@ class TableExtension {
   // Executed just before all items are deleted.
   virtual void OnReset(absl::Mutex* mu) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu) = 0;
 
+  // Whether the items passed to the hooks must include the `flat_trajectory`
+  // and `chunks` of the item. Tables hold trajectories in a packed form and
+  // decode them for the hooks while holding the lock, so extensions which only
+  // use the metadata of the items (key, priority, times sampled etc.) should
+  // override this to return false.
+  virtual bool NeedsTrajectory() const { return true; }
+
   // Table calls these methods on construction and destruction.
   virtual absl::Status RegisterTable(absl::Mutex* mu, Table* table)
       ABSL_LOCKS_EXCLUDED(mu) = 0;
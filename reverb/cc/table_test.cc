@@ -29,12 +29,15 @@
 #include "absl/time/time.h"
 #include "reverb/cc/checkpointing/checkpoint.pb.h"
 #include "reverb/cc/chunk_store.h"
+#include "reverb/cc/platform/hash_set.h"
 #include "reverb/cc/platform/status_matchers.h"
 #include "reverb/cc/platform/thread.h"
 #include "reverb/cc/rate_limiter.h"
 #include "reverb/cc/schema.pb.h"
 #include "reverb/cc/selectors/fifo.h"
 #include "reverb/cc/selectors/uniform.h"
+#include "reverb/cc/support/trajectory_util.h"
+#include "reverb/cc/table_extensions/base.h"
 #include "reverb/cc/table_extensions/interface.h"
 #include "reverb/cc/testing/proto_test_util.h"
 #include "tensorflow/core/framework/tensor_shape.h"
@@ -104,6 +107,29 @@ TEST(TableTest, CopyAfterInsert) {
       Partially(testing::EqualsProto("key: 3 times_sampled: 0 priority: 123")));
 }
 
+TEST(TableTest, SampleReturnsInsertedTrajectory) {
+  auto table = MakeUniformTable("dist");
+  auto item = MakeItem(3, 123,
+                       {testing::MakeSequenceRange(300, 0, 4),
+                        testing::MakeSequenceRange(300, 5, 6)});
+  REVERB_EXPECT_OK(table->InsertOrAssign(item));
+
+  Table::SampledItem sample;
+  REVERB_ASSERT_OK(table->Sample(&sample));
+  EXPECT_THAT(sample.item,
+              Partially(testing::EqualsProto(
+                  "key: 3 table: 'dist' times_sampled: 1 priority: 123")));
+  EXPECT_THAT(sample.item.flat_trajectory(),
+              testing::EqualsProto(item.item.flat_trajectory()));
+  EXPECT_GT(sample.item.inserted_at().seconds(), 0);
+  EXPECT_EQ(sample.chunks, item.chunks);
+
+  auto items = table->Copy();
+  ASSERT_THAT(items, SizeIs(1));
+  EXPECT_THAT(items[0].item, testing::EqualsProto(sample.item));
+  EXPECT_EQ(items[0].chunks, item.chunks);
+}
+
 TEST(TableTest, CopySubset) {
   auto table = MakeUniformTable("dist");
   REVERB_EXPECT_OK(table->InsertOrAssign(MakeItem(3, 123)));
@@ -193,6 +219,59 @@ TEST(TableTest, SampleIncrementsSampleTimes) {
   EXPECT_EQ(table->Copy()[0].item.times_sampled(), 2);
 }
 
+TEST(TableTest, SampleAssignsSequenceNumbers) {
+  auto table = MakeUniformTable("dist");
+  REVERB_EXPECT_OK(table->InsertOrAssign(MakeItem(3, 123)));
+
+  Table::SampledItem item;
+  for (int i = 0; i < 3; i++) {
+    REVERB_ASSERT_OK(table->Sample(&item));
+    EXPECT_EQ(item.sequence_number, i);
+  }
+
+  std::vector<Table::SampledItem> items;
+  REVERB_ASSERT_OK(table->SampleFlexibleBatch(&items, 2));
+  ASSERT_THAT(items, SizeIs(2));
+  EXPECT_EQ(items[0].sequence_number, 3);
+  EXPECT_EQ(items[1].sequence_number, 4);
+}
+
+TEST(TableTest, SequenceNumbersContinueAfterCheckpoint) {
+  auto table = MakeUniformTable("dist");
+  REVERB_EXPECT_OK(table->InsertOrAssign(MakeItem(3, 123)));
+
+  Table::SampledItem item;
+  for (int i = 0; i < 3; i++) {
+    REVERB_ASSERT_OK(table->Sample(&item));
+  }
+  EXPECT_EQ(table->Checkpoint().checkpoint.num_samples_drawn(), 3);
+
+  auto restored = MakeUniformTable("dist");
+  restored->set_num_samples_drawn_from_checkpoint(3);
+  REVERB_EXPECT_OK(restored->InsertOrAssign(MakeItem(3, 123)));
+  REVERB_ASSERT_OK(restored->Sample(&item));
+  EXPECT_EQ(item.sequence_number, 3);
+}
+
+TEST(TableTest, SampleFlexibleBatchStopsWhenDeletionsBreakMinSize) {
+  Table table("dist", absl::make_unique<UniformSelector>(),
+              absl::make_unique<FifoSelector>(), /*max_size=*/100,
+              /*max_times_sampled=*/1, MakeLimiter(/*min_size=*/10));
+  for (int i = 0; i < 10; i++) {
+    REVERB_EXPECT_OK(table.InsertOrAssign(MakeItem(i, 1)));
+  }
+
+  // The first sample deletes an item, after which the table is too small to
+  // sample from.
+  std::vector<Table::SampledItem> items;
+  REVERB_ASSERT_OK(table.SampleFlexibleBatch(&items, 5));
+  EXPECT_THAT(items, SizeIs(1));
+  EXPECT_EQ(table.size(), 9);
+
+  // The unused samples are released.
+  EXPECT_EQ(table.Checkpoint().checkpoint.rate_limiter().sample_count(), 1);
+}
+
 TEST(TableTest, MaxTimesSampledIsRespected) {
   auto table = MakeUniformTable("dist", 10, 2);
 
@@ -373,6 +452,130 @@ TEST(TableTest, CloseCancelsPendingCalls) {
   thread = nullptr;  // Joins the thread.
 }
 
+TEST(TableTest, AsyncInsertCompletesWhenSampled) {
+  Table table(
+      /*name=*/"dist",
+      /*sampler=*/absl::make_unique<UniformSelector>(),
+      /*remover=*/absl::make_unique<FifoSelector>(),
+      /*max_size=*/1000,
+      /*max_times_sampled=*/0,
+      absl::make_unique<RateLimiter>(
+          /*samples_per_insert=*/1.0,
+          /*min_size_to_sample=*/1,
+          /*min_diff=*/-10,
+          /*max_diff=*/1));
+
+  std::vector<absl::Status> statuses;
+  auto callback = [&](const absl::Status& s) { statuses.push_back(s); };
+
+  // The first insert completes straight away, the second has to wait.
+  table.InsertOrAssignAsync(MakeItem(1, 123), kTimeout, callback);
+  ASSERT_THAT(statuses, SizeIs(1));
+  REVERB_EXPECT_OK(statuses[0]);
+  table.InsertOrAssignAsync(MakeItem(2, 123), absl::InfiniteDuration(),
+                            callback);
+  EXPECT_THAT(statuses, SizeIs(1));
+  EXPECT_EQ(table.size(), 1);
+
+  // The sample makes room for the queued insert which is completed by the
+  // sampling thread.
+  std::vector<Table::SampledItem> items;
+  REVERB_ASSERT_OK(table.SampleFlexibleBatch(&items, 1));
+  ASSERT_THAT(statuses, SizeIs(2));
+  REVERB_EXPECT_OK(statuses[1]);
+  EXPECT_EQ(table.size(), 2);
+}
+
+TEST(TableTest, AsyncCallsAreRecordedInCallStats) {
+  Table table(
+      /*name=*/"dist",
+      /*sampler=*/absl::make_unique<UniformSelector>(),
+      /*remover=*/absl::make_unique<FifoSelector>(),
+      /*max_size=*/1000,
+      /*max_times_sampled=*/0,
+      absl::make_unique<RateLimiter>(
+          /*samples_per_insert=*/1.0,
+          /*min_size_to_sample=*/1,
+          /*min_diff=*/-10,
+          /*max_diff=*/1));
+
+  int num_calls = 0;
+  auto insert_callback = [&](const absl::Status& s) {
+    REVERB_EXPECT_OK(s);
+    num_calls++;
+  };
+  table.InsertOrAssignAsync(MakeItem(1, 123), kTimeout, insert_callback);
+  table.InsertOrAssignAsync(MakeItem(2, 123), absl::InfiniteDuration(),
+                            insert_callback);
+  table.SampleFlexibleBatchAsync(
+      /*batch_size=*/1, kTimeout,
+      [&](const absl::Status& s, std::vector<Table::SampledItem> sampled) {
+        REVERB_EXPECT_OK(s);
+        num_calls++;
+      });
+  EXPECT_EQ(num_calls, 3);
+
+  // Only the second insert had to wait for the sample.
+  auto info = table.info().rate_limiter_info();
+  EXPECT_EQ(info.insert_stats().completed(), 2);
+  EXPECT_EQ(info.insert_stats().limited(), 1);
+  EXPECT_EQ(info.sample_stats().completed(), 1);
+  EXPECT_EQ(info.sample_stats().limited(), 0);
+}
+
+TEST(TableTest, AsyncSampleCompletesWhenInserted) {
+  auto table = MakeUniformTable("dist");
+
+  absl::Status status;
+  std::vector<Table::SampledItem> items;
+  int num_calls = 0;
+  table->SampleFlexibleBatchAsync(
+      /*batch_size=*/2, absl::InfiniteDuration(),
+      [&](const absl::Status& s, std::vector<Table::SampledItem> sampled) {
+        status = s;
+        items = std::move(sampled);
+        num_calls++;
+      });
+  EXPECT_EQ(num_calls, 0);
+
+  REVERB_ASSERT_OK(table->InsertOrAssign(MakeItem(1, 123)));
+  EXPECT_EQ(num_calls, 1);
+  REVERB_EXPECT_OK(status);
+  EXPECT_THAT(items, ElementsAre(HasItemKey(1), HasItemKey(1)));
+}
+
+TEST(TableTest, AsyncSampleTimesOut) {
+  auto table = MakeUniformTable("dist");
+
+  absl::Status status;
+  absl::Notification notification;
+  table->SampleFlexibleBatchAsync(
+      /*batch_size=*/1, kTimeout,
+      [&](const absl::Status& s, std::vector<Table::SampledItem> sampled) {
+        EXPECT_THAT(sampled, IsEmpty());
+        status = s;
+        notification.Notify();
+      });
+  EXPECT_TRUE(notification.WaitForNotificationWithTimeout(10 * kTimeout));
+  EXPECT_EQ(status.code(), absl::StatusCode::kDeadlineExceeded);
+}
+
+TEST(TableTest, CloseCancelsQueuedAsyncCalls) {
+  auto table = MakeUniformTable("dist");
+
+  absl::Status status;
+  int num_calls = 0;
+  table->SampleFlexibleBatchAsync(
+      /*batch_size=*/1, absl::InfiniteDuration(),
+      [&](const absl::Status& s, std::vector<Table::SampledItem> sampled) {
+        status = s;
+        num_calls++;
+      });
+  table->Close();
+  EXPECT_EQ(num_calls, 1);
+  EXPECT_EQ(status.code(), absl::StatusCode::kCancelled);
+}
+
 TEST(TableTest, ResetResetsRateLimiter) {
   Table table(
       /*name=*/"dist",
@@ -625,12 +828,109 @@ TEST(TableTest, SampleSetsTableSize) {
   }
 }
 
+std::unique_ptr<Table> MakeWindowTable(int32_t sample_window_length) {
+  return absl::make_unique<Table>(
+      "dist", absl::make_unique<UniformSelector>(),
+      absl::make_unique<FifoSelector>(), /*max_size=*/1000,
+      /*max_times_sampled=*/0, MakeLimiter(1), /*extensions=*/
+      std::vector<std::shared_ptr<TableExtension>>{},
+      /*signature=*/absl::nullopt, sample_window_length);
+}
+
+TEST(TableTest, SamplesWindowsOfEpisodes) {
+  auto table = MakeWindowTable(/*sample_window_length=*/3);
+
+  // A single item holding an episode of 10 steps split over two chunks.
+  REVERB_ASSERT_OK(table->InsertOrAssign(
+      MakeItem(1, 1,
+               {testing::MakeSequenceRange(100, 0, 4),
+                testing::MakeSequenceRange(100, 5, 9)})));
+
+  absl::flat_hash_set<int> offsets;
+  for (int i = 0; i < 1000; i++) {
+    Table::SampledItem sample;
+    REVERB_ASSERT_OK(table->Sample(&sample));
+    EXPECT_EQ(sample.item.key(), 1);
+    EXPECT_EQ(internal::ColumnLength(sample.item.flat_trajectory(), 0), 3);
+    EXPECT_DOUBLE_EQ(sample.probability, 1.0 / 8);
+
+    // Only the chunks referenced by the window are returned.
+    auto keys = internal::GetChunkKeys(sample.item.flat_trajectory());
+    ASSERT_EQ(sample.chunks.size(), keys.size());
+    for (int j = 0; j < keys.size(); j++) {
+      EXPECT_EQ(sample.chunks[j]->key(), keys[j]);
+    }
+
+    const auto& first_slice =
+        sample.item.flat_trajectory().columns(0).chunk_slices(0);
+    offsets.insert((first_slice.chunk_key() - 100) * 5 + first_slice.offset());
+  }
+
+  // All 8 windows of the episode are sampled.
+  EXPECT_THAT(offsets, SizeIs(8));
+
+  // The stored item still references the whole episode.
+  auto items = table->Copy();
+  ASSERT_THAT(items, SizeIs(1));
+  EXPECT_EQ(internal::ColumnLength(items[0].item.flat_trajectory(), 0), 10);
+  EXPECT_THAT(items[0].chunks, SizeIs(2));
+}
+
+TEST(TableTest, RejectsEpisodesShorterThanSampleWindow) {
+  auto table = MakeWindowTable(/*sample_window_length=*/3);
+  EXPECT_EQ(table
+                ->InsertOrAssign(
+                    MakeItem(1, 1, {testing::MakeSequenceRange(100, 0, 1)}))
+                .code(),
+            absl::StatusCode::kInvalidArgument);
+  REVERB_EXPECT_OK(table->InsertOrAssign(
+      MakeItem(2, 1, {testing::MakeSequenceRange(200, 0, 2)})));
+  EXPECT_EQ(table->size(), 1);
+}
+
 TEST(PriorityTableDeathTest, DiesIfUnsafeAddExtensionCalledWhenNonEmpty) {
   auto table = MakeUniformTable("dist");
   REVERB_EXPECT_OK(table->InsertOrAssign(MakeItem(1, 1)));
   ASSERT_DEATH(table->UnsafeAddExtension(nullptr), "");
 }
 
+class RecordingExtension : public TableExtensionBase {
+ public:
+  explicit RecordingExtension(bool needs_trajectory)
+      : needs_trajectory_(needs_trajectory) {}
+
+  std::string DebugString() const override { return "RecordingExtension"; }
+
+  void ApplyOnInsert(const TableItem& item) override {
+    inserted_.push_back(item);
+  }
+
+  const std::vector<TableItem>& inserted() const { return inserted_; }
+
+ protected:
+  bool NeedsTrajectory() const override { return needs_trajectory_; }
+
+ private:
+  const bool needs_trajectory_;
+  std::vector<TableItem> inserted_;
+};
+
+TEST(TableTest, ExtensionsOnlyReceiveTrajectoryIfNeeded) {
+  for (bool needs_trajectory : {true, false}) {
+    auto extension = std::make_shared<RecordingExtension>(needs_trajectory);
+    auto table = MakeUniformTable("dist");
+    table->UnsafeAddExtension(extension);
+    REVERB_EXPECT_OK(table->InsertOrAssign(MakeItem(1, 123)));
+
+    ASSERT_THAT(extension->inserted(), SizeIs(1));
+    const TableItem& item = extension->inserted()[0];
+    EXPECT_EQ(item.item.key(), 1);
+    EXPECT_EQ(item.item.priority(), 123);
+    EXPECT_EQ(item.item.has_flat_trajectory(), needs_trajectory);
+    EXPECT_EQ(item.chunks.empty(), !needs_trajectory);
+  }
+}
+
 TEST(TableTest, NumEpisodes) {
   auto table = MakeUniformTable("dist");
 
@@ -742,7 +1042,10 @@ TEST(TableTest, Info) {
   Table::SampledItem sample;
   REVERB_EXPECT_OK(table.Sample(&sample));
 
-  EXPECT_THAT(table.info(), testing::EqualsProto(R"pb(
+  // Lock stats depend on timing and are covered by a separate test.
+  TableInfo info = table.info();
+  info.clear_lock_stats();
+  EXPECT_THAT(info, testing::EqualsProto(R"pb(
                 name: 'dist'
                 sampler_options { uniform: true }
                 remover_options { fifo: true is_deterministic: true }
@@ -770,6 +1073,28 @@ TEST(TableTest, Info) {
               )pb"));
 }
 
+TEST(TableTest, InfoContainsLockStatsPerOperation) {
+  auto table = MakeUniformTable("dist");
+  table->set_lock_stats_enabled(true);
+  REVERB_EXPECT_OK(table->InsertOrAssign(MakeItem(1, 1)));
+  REVERB_EXPECT_OK(table->InsertOrAssign(MakeItem(2, 1)));
+  Table::SampledItem sample;
+  REVERB_EXPECT_OK(table->Sample(&sample));
+  REVERB_EXPECT_OK(table->MutateItems({}, {1}));
+  table->Checkpoint();
+
+  TableLockStats stats = table->info().lock_stats();
+  EXPECT_EQ(stats.insert().wait().count(), 2);
+  EXPECT_EQ(stats.insert().hold().count(), 2);
+  EXPECT_EQ(stats.sample().hold().count(), 1);
+  EXPECT_EQ(stats.mutate().hold().count(), 1);
+  EXPECT_EQ(stats.checkpoint().hold().count(), 1);
+  // The lock of the `info` call itself is released after the stats are read.
+  EXPECT_EQ(stats.info().hold().count(), 0);
+  EXPECT_EQ(stats.info().wait().count(), 1);
+  EXPECT_EQ(stats.extensions().hold().count(), 0);
+}
+
 TEST(TableTest, DefaultFlexibleBatchSize) {
   // If a sample to insert ratio is set then that should be used.
   Table samples_per_insert_table(
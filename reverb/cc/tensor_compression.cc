@@ -14,8 +14,14 @@
 
 #include "reverb/cc/tensor_compression.h"
 
-#include <cstdint>
+#include <algorithm>
+#include <cstring>
+#include <vector>
 
+#include <cstdint>
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
 #include "reverb/cc/platform/logging.h"
 #include "reverb/cc/platform/snappy.h"
 #include "tensorflow/core/framework/register_types.h"
@@ -52,6 +58,98 @@ tensorflow::Tensor DeltaEncode(const tensorflow::Tensor& tensor, bool encode) {
   return output;
 }
 
+// True if `DeltaEncode` transforms tensors of type `dtype`.
+bool IsDeltaEncodedType(tensorflow::DataType dtype) {
+  switch (dtype) {
+#define DELTA_ENCODED_TYPE(T) case tensorflow::DataTypeToEnum<T>::value:
+    TF_CALL_INTEGRAL_TYPES(DELTA_ENCODED_TYPE)
+#undef DELTA_ENCODED_TYPE
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Consumes the uncompressed bytes of a delta encoded tensor and writes the
+// decoded elements in [begin, end) to `dst`. `T` is an unsigned type of the
+// same size as the dtype of the tensor.
+template <typename T>
+class DeltaRowDecoder {
+ public:
+  DeltaRowDecoder(int64_t row_size, int64_t begin, int64_t end, char* dst)
+      : row_size_(row_size),
+        begin_(begin),
+        end_(end),
+        dst_(reinterpret_cast<T*>(dst)),
+        previous_row_(row_size) {}
+
+  void Consume(absl::string_view piece) {
+    const char* data = piece.data();
+    size_t size = piece.size();
+
+    // Complete the element split between the previous piece and this one.
+    if (partial_size_ > 0) {
+      size_t n = std::min(sizeof(T) - partial_size_, size);
+      std::memcpy(partial_ + partial_size_, data, n);
+      partial_size_ += n;
+      data += n;
+      size -= n;
+      if (partial_size_ < sizeof(T)) return;
+      Push(partial_);
+      partial_size_ = 0;
+    }
+
+    for (; size >= sizeof(T); data += sizeof(T), size -= sizeof(T)) {
+      Push(data);
+    }
+
+    std::memcpy(partial_, data, size);
+    partial_size_ = size;
+  }
+
+ private:
+  void Push(const char* bytes) {
+    // Nothing after the last requested row affects the result.
+    if (index_ >= end_) return;
+
+    T value;
+    std::memcpy(&value, bytes, sizeof(T));
+    T& previous = previous_row_[index_ % row_size_];
+    if (index_ >= row_size_) {
+      value += previous;
+    }
+    previous = value;
+
+    if (index_ >= begin_) {
+      dst_[index_ - begin_] = value;
+    }
+    index_++;
+  }
+
+  const int64_t row_size_;
+  const int64_t begin_;
+  const int64_t end_;
+  T* dst_;
+
+  // The last decoded value of every element within a row.
+  std::vector<T> previous_row_;
+
+  // Number of elements consumed so far.
+  int64_t index_ = 0;
+
+  // Bytes of an element which was split over two pieces.
+  char partial_[sizeof(T)];
+  size_t partial_size_ = 0;
+};
+
+template <typename T>
+bool DecompressDeltaRows(const std::string& content, int64_t row_size,
+                         int64_t begin, int64_t end, char* dst) {
+  DeltaRowDecoder<T> decoder(row_size, begin, end, dst);
+  return SnappyUncompressToCallback(
+      content, [&decoder](absl::string_view piece) { decoder.Consume(piece); });
+}
+
 }  // namespace
 
 tensorflow::Tensor DeltaEncode(const tensorflow::Tensor& tensor, bool encode) {
@@ -107,5 +205,104 @@ tensorflow::Tensor DecompressTensorFromProto(
   }
 }
 
+absl::Status DecompressTensorRowsFromProto(const tensorflow::TensorProto& proto,
+                                           bool delta_encoded, int64_t offset,
+                                           int64_t length, int64_t out_offset,
+                                           tensorflow::Tensor* out) {
+  if (proto.dtype() != out->dtype()) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Cannot decompress tensor of dtype ",
+        tensorflow::DataTypeString(proto.dtype()), " into tensor of dtype ",
+        tensorflow::DataTypeString(out->dtype()), "."));
+  }
+
+  tensorflow::TensorShape shape(proto.tensor_shape());
+  if (shape.dims() == 0 || offset < 0 || length < 0 ||
+      offset + length > shape.dim_size(0)) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Cannot decompress rows (", offset, ", ", offset + length,
+                     ") of tensor with shape ", shape.DebugString(), "."));
+  }
+  if (length == 0) return absl::OkStatus();
+
+  const int64_t row_size = shape.num_elements() / shape.dim_size(0);
+  const int64_t begin = offset * row_size;
+  const int64_t end = (offset + length) * row_size;
+  if (out_offset < 0 || out_offset + end - begin > out->NumElements()) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Cannot write ", end - begin, " elements at offset ", out_offset,
+        " of tensor with shape ", out->shape().DebugString(), "."));
+  }
+
+  // String tensors are not compressed.
+  if (proto.dtype() == tensorflow::DT_STRING) {
+    tensorflow::Tensor tensor;
+    if (!tensor.FromProto(proto)) {
+      return absl::DataLossError("Unable to parse string tensor from proto.");
+    }
+    auto from = tensor.flat<tensorflow::tstring>();
+    auto to = out->flat<tensorflow::tstring>();
+    for (int64_t i = begin; i < end; i++) {
+      to(out_offset + i - begin) = from(i);
+    }
+    return absl::OkStatus();
+  }
+
+  const size_t element_size = tensorflow::DataTypeSize(proto.dtype());
+  char* dst = const_cast<char*>(out->tensor_data().data()) +
+              out_offset * element_size;
+  const auto& content = proto.tensor_content();
+
+  bool ok;
+  if (delta_encoded && shape.dims() >= 2 &&
+      IsDeltaEncodedType(proto.dtype())) {
+    switch (element_size) {
+      case 1:
+        ok = DecompressDeltaRows<tensorflow::uint8>(content, row_size, begin,
+                                                    end, dst);
+        break;
+      case 2:
+        ok = DecompressDeltaRows<tensorflow::uint16>(content, row_size, begin,
+                                                     end, dst);
+        break;
+      case 4:
+        ok = DecompressDeltaRows<tensorflow::uint32>(content, row_size, begin,
+                                                     end, dst);
+        break;
+      case 8:
+        ok = DecompressDeltaRows<tensorflow::uint64>(content, row_size, begin,
+                                                     end, dst);
+        break;
+      default:
+        return absl::InternalError(absl::StrCat(
+            "Unexpected element size ", element_size, " of delta encoded ",
+            tensorflow::DataTypeString(proto.dtype()), " tensor."));
+    }
+  } else if (begin == 0 && end == shape.num_elements()) {
+    // The entire tensor is requested so it can be uncompressed in place.
+    ok = SnappyUncompressToString(content, (end - begin) * element_size, dst);
+  } else {
+    const int64_t begin_byte = begin * element_size;
+    const int64_t end_byte = end * element_size;
+    int64_t position = 0;
+    ok = SnappyUncompressToCallback(
+        content, [&](absl::string_view piece) {
+          int64_t from = std::max<int64_t>(position, begin_byte);
+          int64_t to = std::min<int64_t>(position + piece.size(), end_byte);
+          if (from < to) {
+            std::memcpy(dst + from - begin_byte, piece.data() + from - position,
+                        to - from);
+          }
+          position += piece.size();
+        });
+  }
+
+  if (!ok) {
+    return absl::DataLossError(absl::StrCat(
+        "Unable to uncompress tensor with shape ", shape.DebugString(), "."));
+  }
+  return absl::OkStatus();
+}
+
 }  // namespace reverb
 }  // namespace deepmind
@@ -15,6 +15,8 @@
 #ifndef LEARNING_DEEPMIND_REPLAY_REVERB_TENSOR_COMPRESSION_H_
 #define LEARNING_DEEPMIND_REPLAY_REVERB_TENSOR_COMPRESSION_H_
 
+#include <cstdint>
+#include "absl/status/status.h"
 #include "tensorflow/core/framework/tensor.h"
 #include "tensorflow/core/framework/tensor.pb.h"
 
@@ -40,6 +42,19 @@ void CompressTensorAsProto(const tensorflow::Tensor& tensor,
 tensorflow::Tensor DecompressTensorFromProto(
     const tensorflow::TensorProto& proto);
 
+// Decompresses rows [offset, offset + length) of the tensor in `proto` (built
+// by `CompressTensorAsProto`) and writes them to `out`, starting at flat
+// element `out_offset`. If `delta_encoded` is true then the rows are delta
+// decoded (see `DeltaEncode`) as they are decompressed.
+//
+// Only the requested rows are written and no intermediate tensors are
+// allocated, so the rows can be written straight into their final destination
+// (e.g. a slice of a trajectory or a row of a batch).
+absl::Status DecompressTensorRowsFromProto(const tensorflow::TensorProto& proto,
+                                           bool delta_encoded, int64_t offset,
+                                           int64_t length, int64_t out_offset,
+                                           tensorflow::Tensor* out);
+
 template <typename T>
 struct UnsignedType {
   static_assert(
@@ -17,11 +17,13 @@
 #include <string>
 
 #include "gtest/gtest.h"
+#include "reverb/cc/platform/status_matchers.h"
 #include "reverb/cc/testing/tensor_testutil.h"
 #include "tensorflow/core/framework/register_types.h"
 #include "tensorflow/core/framework/tensor.h"
 #include "tensorflow/core/framework/tensor.pb.h"
 #include "tensorflow/core/framework/tensor_shape.h"
+#include "tensorflow/core/framework/tensor_util.h"
 #include "tensorflow/core/framework/types.h"
 #include "tensorflow/core/framework/types.pb.h"
 
@@ -98,6 +100,80 @@ TEST(TensorCompressionTest, NonStringTensorWithDeltaEncoding) {
   test::ExpectTensorEqual<int>(tensor, DeltaEncode(result, false));
 }
 
+template <typename T>
+void DecompressRowsMatchesSliceT(bool delta_encode) {
+  tensorflow::Tensor tensor(tensorflow::DataTypeToEnum<T>::v(),
+                            tensorflow::TensorShape({16, 37, 6}));
+  tensor.flat<T>().setRandom();
+
+  tensorflow::TensorProto proto;
+  CompressTensorAsProto(delta_encode ? DeltaEncode(tensor, true) : tensor,
+                        &proto);
+
+  // Write rows [3, 10) into the middle of a larger tensor.
+  tensorflow::Tensor out(tensorflow::DataTypeToEnum<T>::v(),
+                         tensorflow::TensorShape({9, 37, 6}));
+  REVERB_EXPECT_OK(DecompressTensorRowsFromProto(
+      proto, delta_encode, /*offset=*/3, /*length=*/7,
+      /*out_offset=*/37 * 6, &out));
+  test::ExpectTensorEqual<T>(tensorflow::tensor::DeepCopy(out.Slice(1, 8)),
+                             tensorflow::tensor::DeepCopy(tensor.Slice(3, 10)));
+
+  // Decompress the entire tensor.
+  tensorflow::Tensor all(tensorflow::DataTypeToEnum<T>::v(), tensor.shape());
+  REVERB_EXPECT_OK(DecompressTensorRowsFromProto(proto, delta_encode, 0, 16, 0,
+                                                 &all));
+  test::ExpectTensorEqual<T>(all, tensor);
+}
+
+TEST(TensorCompressionTest, DecompressRowsMatchesSlice) {
+#define DECOMPRESS_ROWS_MATCHES_SLICE(T) \
+  DecompressRowsMatchesSliceT<T>(false); \
+  DecompressRowsMatchesSliceT<T>(true);
+  TF_CALL_INTEGRAL_TYPES(DECOMPRESS_ROWS_MATCHES_SLICE)
+#undef DECOMPRESS_ROWS_MATCHES_SLICE
+  DecompressRowsMatchesSliceT<float>(false);
+  DecompressRowsMatchesSliceT<double>(true);
+}
+
+TEST(TensorCompressionTest, DecompressRowsOfStringTensor) {
+  tensorflow::Tensor tensor(tensorflow::DT_STRING,
+                            tensorflow::TensorShape({3}));
+  tensor.flat<tensorflow::tstring>()(0) = "hello";
+  tensor.flat<tensorflow::tstring>()(1) = "big";
+  tensor.flat<tensorflow::tstring>()(2) = "world";
+
+  tensorflow::TensorProto proto;
+  CompressTensorAsProto(tensor, &proto);
+
+  tensorflow::Tensor out(tensorflow::DT_STRING, tensorflow::TensorShape({2}));
+  REVERB_EXPECT_OK(DecompressTensorRowsFromProto(proto, false, 1, 2, 0, &out));
+  test::ExpectTensorEqual<tensorflow::tstring>(
+      out, tensorflow::tensor::DeepCopy(tensor.Slice(1, 3)));
+}
+
+TEST(TensorCompressionTest, DecompressRowsChecksBounds) {
+  tensorflow::Tensor tensor(tensorflow::DT_INT32,
+                            tensorflow::TensorShape({4, 2}));
+  tensor.flat<int>().setRandom();
+  tensorflow::TensorProto proto;
+  CompressTensorAsProto(tensor, &proto);
+
+  tensorflow::Tensor out(tensorflow::DT_INT32, tensorflow::TensorShape({2, 2}));
+  EXPECT_EQ(
+      DecompressTensorRowsFromProto(proto, false, 3, 2, 0, &out).code(),
+      absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(
+      DecompressTensorRowsFromProto(proto, false, 0, 2, 1, &out).code(),
+      absl::StatusCode::kInvalidArgument);
+
+  tensorflow::Tensor wrong_dtype(tensorflow::DT_INT64,
+                                 tensorflow::TensorShape({2, 2}));
+  EXPECT_EQ(
+      DecompressTensorRowsFromProto(proto, false, 0, 2, 0, &wrong_dtype).code(),
+      absl::StatusCode::kInvalidArgument);
+}
+
 }  // namespace
 }  // namespace reverb
 }  // namespace deepmind
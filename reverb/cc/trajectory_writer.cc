@@ -35,6 +35,7 @@
 #include "reverb/cc/support/cleanup.h"
 #include "reverb/cc/support/grpc_util.h"
 #include "reverb/cc/support/trajectory_util.h"
+#include "tensorflow/core/framework/tensor_util.h"
 #include "tensorflow/core/framework/types.h"
 
 namespace deepmind {
@@ -136,8 +137,6 @@ TrajectoryWriter::TrajectoryWriter(
     const Options& options)
     : stub_(std::move(stub)),
       options_(options),
-      episode_id_(NewKey()),
-      episode_step_(0),
       closed_(false),
       stream_worker_(
           internal::StartThread("TrajectoryWriter_StreamWorker", [this] {
@@ -156,9 +155,18 @@ TrajectoryWriter::TrajectoryWriter(
                 unrecoverable_status_ = status;
                 return;
               }
+
+              if (!status.ok()) {
+                num_stream_failures_++;
+              }
             }
           })) {
   REVERB_CHECK_OK(options.Validate());
+
+  absl::MutexLock lock(&mu_);
+  for (int i = 0; i < options_.num_envs; i++) {
+    episodes_.push_back({NewKey(), 0});
+  }
 }
 
 TrajectoryWriter::~TrajectoryWriter() {
@@ -179,17 +187,83 @@ TrajectoryWriter::~TrajectoryWriter() {
 absl::Status TrajectoryWriter::Append(
     std::vector<absl::optional<tensorflow::Tensor>> data,
     std::vector<absl::optional<std::weak_ptr<CellRef>>>* refs) {
+  if (options_.num_envs != 1) {
+    return absl::FailedPreconditionError(absl::StrCat(
+        "Append can only be used when num_envs is 1 but got ",
+        options_.num_envs, ". Use AppendBatch instead."));
+  }
+  return AppendToEnv(0, std::move(data), refs);
+}
+
+absl::Status TrajectoryWriter::AppendBatch(
+    std::vector<absl::optional<tensorflow::Tensor>> data,
+    std::vector<std::vector<absl::optional<std::weak_ptr<CellRef>>>>* refs) {
+  const int num_envs = options_.num_envs;
+  for (int i = 0; i < data.size(); i++) {
+    if (!data[i].has_value()) continue;
+    const auto& tensor = data[i].value();
+    if (tensor.dims() < 1 || tensor.dim_size(0) != num_envs) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          "Tensor of column ", i, " has shape ", tensor.shape().DebugString(),
+          " but AppendBatch requires the outer dimension to be num_envs (",
+          num_envs, ")."));
+    }
+  }
+
+  // The rows of every env are sliced and validated before any of them is
+  // appended so that an invalid batch doesn't advance some of the envs only.
+  std::vector<std::vector<absl::optional<tensorflow::Tensor>>> env_data(
+      num_envs, std::vector<absl::optional<tensorflow::Tensor>>(data.size()));
+  for (int env = 0; env < num_envs; env++) {
+    for (int i = 0; i < data.size(); i++) {
+      if (!data[i].has_value()) continue;
+
+      // The slice shares the buffer of the batch. Unaligned slices are copied
+      // as some tensor operations (e.g on strings) require aligned buffers.
+      tensorflow::Tensor row = data[i]->SubSlice(env);
+      if (!row.IsAligned()) {
+        row = tensorflow::tensor::DeepCopy(row);
+      }
+      if (auto it = chunkers_.find({env, i}); it != chunkers_.end()) {
+        REVERB_RETURN_IF_ERROR(it->second->CheckCompatible(row));
+      }
+      env_data[env][i] = std::move(row);
+    }
+  }
+  {
+    absl::MutexLock lock(&mu_);
+    REVERB_RETURN_IF_ERROR(unrecoverable_status_);
+  }
+
+  refs->resize(num_envs);
+  for (int env = 0; env < num_envs; env++) {
+    auto status = AppendToEnv(env, std::move(env_data[env]), &(*refs)[env]);
+    if (!status.ok()) {
+      return absl::Status(
+          status.code(),
+          absl::StrCat("Failed to append the row of env ", env,
+                       " after the rows of the envs before it had been "
+                       "appended: ",
+                       status.message()));
+    }
+  }
+  return absl::OkStatus();
+}
+
+absl::Status TrajectoryWriter::AppendToEnv(
+    int env, std::vector<absl::optional<tensorflow::Tensor>> data,
+    std::vector<absl::optional<std::weak_ptr<CellRef>>>* refs) {
   CellRef::EpisodeInfo episode_info;
   {
     absl::MutexLock lock(&mu_);
     REVERB_RETURN_IF_ERROR(unrecoverable_status_);
-    episode_info = {episode_id_, episode_step_};
+    episode_info = episodes_[env];
   }
 
   // If this is the first time the column has been present in the data then
   // create a chunker using the spec of the item.
   for (int i = 0; i < data.size(); i++) {
-    if (data[i].has_value() && !chunkers_.contains(i)) {
+    if (data[i].has_value() && !chunkers_.contains({env, i})) {
       const auto& tensor = data[i].value();
       // If the new column has been configured with `ConfigureChunker` then we
       // use the overrided options. If not then we use the default in
@@ -197,7 +271,7 @@ absl::Status TrajectoryWriter::Append(
       const auto& chunker_options = options_override_.contains(i)
                                         ? options_override_[i]
                                         : options_.chunker_options;
-      chunkers_[i] = std::make_shared<Chunker>(
+      chunkers_[{env, i}] = std::make_shared<Chunker>(
           internal::TensorSpec{std::to_string(i), tensor.dtype(),
                                tensor.shape()},
           chunker_options->Clone());
@@ -212,18 +286,18 @@ absl::Status TrajectoryWriter::Append(
     }
 
     std::weak_ptr<CellRef> ref;
-    REVERB_RETURN_IF_ERROR(
-        chunkers_[i]->Append(std::move(data[i].value()), episode_info, &ref));
+    REVERB_RETURN_IF_ERROR(chunkers_[{env, i}]->Append(
+        std::move(data[i].value()), episode_info, &ref));
     refs->push_back(std::move(ref));
   }
 
   absl::MutexLock lock(&mu_);
 
   // Sanity check that `Append` or `EndEpisode` wasn't called concurrently.
-  REVERB_CHECK_EQ(episode_info.episode_id, episode_id_);
-  REVERB_CHECK_EQ(episode_info.step, episode_step_);
+  REVERB_CHECK_EQ(episode_info.episode_id, episodes_[env].episode_id);
+  REVERB_CHECK_EQ(episode_info.step, episodes_[env].step);
 
-  episode_step_++;
+  episodes_[env].step++;
 
   // Wake up stream worker in case it was blocked on items referencing
   // incomplete chunks
@@ -234,7 +308,7 @@ absl::Status TrajectoryWriter::Append(
 
 absl::Status TrajectoryWriter::CreateItem(
     absl::string_view table, double priority,
-    absl::Span<const TrajectoryColumn> trajectory) {
+    absl::Span<const TrajectoryColumn> trajectory, absl::Duration timeout) {
   if (trajectory.empty() ||
       std::all_of(trajectory.begin(), trajectory.end(),
                   [](const auto& col) { return col.empty(); })) {
@@ -273,6 +347,8 @@ absl::Status TrajectoryWriter::CreateItem(
 
   {
     absl::MutexLock lock(&mu_);
+    REVERB_RETURN_IF_ERROR(WaitForPendingBytesLocked(timeout));
+    AddPendingBytesLocked(item_and_refs);
     write_queue_.push_back(std::move(item_and_refs));
   }
 
@@ -405,6 +481,7 @@ bool TrajectoryWriter::SendItem(
   auto realease_item = internal::MakeCleanup(
       [&request] { request.mutable_item()->release_item(); });
   request.mutable_item()->set_send_confirmation(true);
+  request.mutable_item()->set_accept_batched_confirmation(true);
   for (auto keep_key : keep_keys) {
     request.mutable_item()->add_keep_chunk_keys(keep_key);
   }
@@ -445,7 +522,13 @@ absl::Status TrajectoryWriter::RunStreamWorker() {
     InsertStreamResponse response;
     while (stream->Read(&response)) {
       absl::MutexLock lock(&mu_);
-      in_flight_items_.erase(response.key());
+      for (uint64_t key : response.keys()) {
+        in_flight_items_.erase(key);
+      }
+      // Older servers confirm each item in a separate response.
+      if (response.keys().empty()) {
+        in_flight_items_.erase(response.key());
+      }
     }
   });
 
@@ -512,6 +595,7 @@ absl::Status TrajectoryWriter::RunStreamWorker() {
       absl::MutexLock lock(&mu_);
       // TODO(b/178090185): Maybe keep the item and references around until the
       // item has been confirmed by the server.
+      RemovePendingBytesLocked(write_queue_.front());
       write_queue_.pop_front();
     }
   }
@@ -589,19 +673,49 @@ absl::Status TrajectoryWriter::EndEpisode(bool clear_buffers,
 
   REVERB_RETURN_IF_ERROR(FlushLocked(0, timeout));
 
+  for (int env = 0; env < episodes_.size(); env++) {
+    REVERB_RETURN_IF_ERROR(EndEnvEpisodeLocked(env, clear_buffers));
+  }
+  return absl::OkStatus();
+}
+
+absl::Status TrajectoryWriter::EndEnvEpisode(int env, bool clear_buffers) {
+  absl::MutexLock lock(&mu_);
+  REVERB_RETURN_IF_ERROR(unrecoverable_status_);
+  if (env < 0 || env >= episodes_.size()) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "env (", env, ") must be in [0, ", episodes_.size(), ")."));
+  }
+
+  REVERB_RETURN_IF_ERROR(EndEnvEpisodeLocked(env, clear_buffers));
+
+  // The finalized chunks might allow the worker to send pending items.
+  data_cv_.Signal();
+  return absl::OkStatus();
+}
+
+absl::Status TrajectoryWriter::EndEnvEpisodeLocked(int env,
+                                                   bool clear_buffers) {
   for (auto& it : chunkers_) {
+    if (it.first.first != env) continue;
+
+    // The incomplete chunk must be finalized before the buffer is cleared if
+    // it is referenced by a pending item.
+    if (clear_buffers && !IsReferencedByPendingItem(*it.second)) {
+      it.second->Reset();
+      continue;
+    }
+
+    // This call should NEVER fail but if it does then we will not be able to
+    // recover from it.
+    unrecoverable_status_ = it.second->Flush();
+    REVERB_RETURN_IF_ERROR(unrecoverable_status_);
     if (clear_buffers) {
       it.second->Reset();
-    } else {
-      // This call should NEVER fail but if it does then we will not be able to
-      // recover from it.
-      unrecoverable_status_ = it.second->Flush();
-      REVERB_RETURN_IF_ERROR(unrecoverable_status_);
     }
   }
 
-  episode_id_ = NewKey();
-  episode_step_ = 0;
+  episodes_[env] = {NewKey(), 0};
   return absl::OkStatus();
 }
 
@@ -609,18 +723,186 @@ absl::Status TrajectoryWriter::ConfigureChunker(
     int column, const std::shared_ptr<ChunkerOptions>& options) {
   REVERB_RETURN_IF_ERROR(ValidateChunkerOptions(options.get()));
 
-  if (auto it = chunkers_.find(column); it != chunkers_.end()) {
-    return it->second->ApplyConfig(options->Clone());
+  // The chunkers of every env are checked before any of them is reconfigured
+  // so that the column isn't left with different options across envs.
+  for (const auto& it : chunkers_) {
+    if (it.first.second != column || !it.second->HasBufferedData()) continue;
+    return absl::FailedPreconditionError(absl::StrCat(
+        "The chunker of column ", column, " of env ", it.first.first,
+        " holds data which has not been finalized into a chunk. End the "
+        "episode or flush the writer before calling ConfigureChunker."));
+  }
+
+  for (auto& it : chunkers_) {
+    if (it.first.second != column) continue;
+    REVERB_RETURN_IF_ERROR(it.second->ApplyConfig(options->Clone()));
   }
 
+  // Environments which haven't yet seen the column use the options when their
+  // chunker is created.
   options_override_[column] = options->Clone();
   return absl::OkStatus();
 }
 
+void TrajectoryWriter::AddPendingBytesLocked(
+    const ItemAndRefs& item_and_refs) {
+  num_pending_bytes_ += item_and_refs.item.ByteSizeLong();
+
+  internal::flat_hash_set<uint64_t> chunk_keys;
+  for (const auto& ref : item_and_refs.refs) {
+    if (!chunk_keys.insert(ref->chunk_key()).second) continue;
+
+    auto& chunk = pending_chunks_[ref->chunk_key()];
+    if (chunk.num_items++ > 0) continue;
+
+    if (ref->IsReady()) {
+      chunk.bytes = ref->GetChunk()->ByteSizeLong();
+      num_pending_bytes_ += chunk.bytes;
+    } else {
+      unfinalized_chunk_refs_.push_back(ref);
+    }
+  }
+}
+
+void TrajectoryWriter::RemovePendingBytesLocked(
+    const ItemAndRefs& item_and_refs) {
+  num_pending_bytes_ -= item_and_refs.item.ByteSizeLong();
+
+  internal::flat_hash_set<uint64_t> chunk_keys;
+  for (const auto& ref : item_and_refs.refs) {
+    if (!chunk_keys.insert(ref->chunk_key()).second) continue;
+
+    auto it = pending_chunks_.find(ref->chunk_key());
+    REVERB_CHECK(it != pending_chunks_.end());
+    if (--it->second.num_items == 0) {
+      num_pending_bytes_ -= it->second.bytes;
+      pending_chunks_.erase(it);
+    }
+  }
+}
+
+void TrajectoryWriter::UpdatePendingBytesLocked() const {
+  std::vector<std::shared_ptr<CellRef>> unfinalized;
+  for (auto& ref : unfinalized_chunk_refs_) {
+    auto it = pending_chunks_.find(ref->chunk_key());
+    // All items referencing the chunk have already been written.
+    if (it == pending_chunks_.end()) continue;
+
+    if (!ref->IsReady()) {
+      unfinalized.push_back(std::move(ref));
+    } else if (it->second.bytes == 0) {
+      it->second.bytes = ref->GetChunk()->ByteSizeLong();
+      num_pending_bytes_ += it->second.bytes;
+    }
+  }
+  unfinalized_chunk_refs_ = std::move(unfinalized);
+}
+
+absl::Status TrajectoryWriter::WaitForPendingBytesLocked(
+    absl::Duration timeout) {
+  if (options_.max_pending_bytes == kUnlimitedPendingBytes) {
+    return absl::OkStatus();
+  }
+
+  UpdatePendingBytesLocked();
+  if (num_pending_bytes_ <= options_.max_pending_bytes) {
+    return absl::OkStatus();
+  }
+
+  // The worker sends the items in order so it can only drain the queue if the
+  // chunks referenced by the front items are complete. Once all referenced
+  // chunks are finalized the pending bytes only change when items are removed
+  // from the queue.
+  for (const auto& item : write_queue_) {
+    for (auto& ref : item.refs) {
+      if (!ref->IsReady()) {
+        REVERB_RETURN_IF_ERROR(ref->chunker().lock()->Flush());
+      }
+    }
+  }
+  UpdatePendingBytesLocked();
+  data_cv_.Signal();
+
+  auto cond = [this]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    return closed_ || !unrecoverable_status_.ok() || write_queue_.empty() ||
+           num_pending_bytes_ <= options_.max_pending_bytes;
+  };
+  if (!mu_.AwaitWithTimeout(absl::Condition(&cond), timeout)) {
+    return absl::DeadlineExceededError(absl::StrCat(
+        "Timeout exceeded with ", write_queue_.size(),
+        " items and ", num_pending_bytes_,
+        " bytes waiting to be written. The limit is ",
+        options_.max_pending_bytes, " bytes."));
+  }
+
+  REVERB_RETURN_IF_ERROR(unrecoverable_status_);
+  if (closed_) {
+    return absl::CancelledError("TrajectoryWriter::Close has been called.");
+  }
+  return absl::OkStatus();
+}
+
+bool TrajectoryWriter::IsReferencedByPendingItem(
+    const Chunker& chunker) const {
+  for (const auto& item : write_queue_) {
+    for (const auto& ref : item.refs) {
+      if (!ref->IsReady() && ref->chunker().lock().get() == &chunker) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+uint64_t TrajectoryWriter::episode_id(int env) const {
+  absl::MutexLock lock(&mu_);
+  return episodes_[env].episode_id;
+}
+
+absl::Status TrajectoryWriter::SetEpisodeId(int env, uint64_t episode_id) {
+  absl::MutexLock lock(&mu_);
+  if (env < 0 || env >= episodes_.size()) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "env (", env, ") must be in [0, ", episodes_.size(), ")."));
+  }
+  if (episodes_[env].step != 0) {
+    return absl::FailedPreconditionError(absl::StrCat(
+        "The ID of the episode of env ", env, " cannot be changed after ",
+        episodes_[env].step, " steps have been appended to it."));
+  }
+  episodes_[env].episode_id = episode_id;
+  return absl::OkStatus();
+}
+
+int64_t TrajectoryWriter::num_stream_failures() const {
+  absl::MutexLock lock(&mu_);
+  return num_stream_failures_;
+}
+
+int TrajectoryWriter::num_pending_items() const {
+  absl::MutexLock lock(&mu_);
+  return write_queue_.size();
+}
+
+int64_t TrajectoryWriter::num_pending_bytes() const {
+  absl::MutexLock lock(&mu_);
+  UpdatePendingBytesLocked();
+  return num_pending_bytes_;
+}
+
 absl::Status TrajectoryWriter::Options::Validate() const {
   if (chunker_options == nullptr) {
     return absl::InvalidArgumentError("chunker_options must be set.");
   }
+  if (num_envs < 1) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("num_envs (", num_envs, ") must be >= 1."));
+  }
+  if (max_pending_bytes != kUnlimitedPendingBytes && max_pending_bytes <= 0) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "max_pending_bytes (", max_pending_bytes,
+        ") must be a positive number or kUnlimitedPendingBytes."));
+  }
   return ValidateChunkerOptions(chunker_options.get());
 }
 
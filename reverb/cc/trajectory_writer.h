@@ -19,6 +19,7 @@
 #include <memory>
 #include <optional>
 #include <string_view>
+#include <utility>
 #include <vector>
 
 #include "grpcpp/impl/codegen/client_context.h"
@@ -48,6 +49,8 @@ class TrajectoryColumn;
 // TODO(b/178096736): Write high level API documentation with examples.
 class TrajectoryWriter {
  public:
+  static constexpr int64_t kUnlimitedPendingBytes = -1;
+
   struct Options {
     std::shared_ptr<ChunkerOptions> chunker_options;
 
@@ -58,6 +61,16 @@ class TrajectoryWriter {
     absl::optional<internal::FlatSignatureMap> flat_signature_map =
         absl::nullopt;
 
+    // Number of environments whose episodes are written concurrently. If
+    // greater than 1 then steps must be appended using `AppendBatch`.
+    int num_envs = 1;
+
+    // Maximum number of bytes held by items waiting to be written to the
+    // stream and by the finalized chunks they reference. `CreateItem` blocks
+    // while the budget is exceeded. Must be a positive number or
+    // `kUnlimitedPendingBytes`.
+    int64_t max_pending_bytes = kUnlimitedPendingBytes;
+
     // Checks that field values are valid and returns `InvalidArgument` if
     // any field value, or combination of field values, are invalid.
     absl::Status Validate() const;
@@ -93,6 +106,28 @@ class TrajectoryWriter {
       std::vector<absl::optional<std::weak_ptr<CellRef>>>* refs)
       ABSL_LOCKS_EXCLUDED(mu_);
 
+  // Appends one step to the episode of each of the `num_envs` environments.
+  // Every provided element of `data` must have `num_envs` as its outer
+  // dimension and row `i` is appended to the column `Chunker` of environment
+  // `i`. Each environment has its own chunkers and episode state but the items
+  // of all environments are written over the same stream.
+  //
+  // The rows share the buffer of `data`, so the data is first copied when the
+  // chunk is finalized. Rows which are not sufficiently aligned (which can
+  // happen for small element shapes) are copied right away.
+  //
+  // `refs` is resized to `num_envs` and `(*refs)[i]` is populated in the same
+  // way as `Append` populates its `refs`.
+  //
+  // The rows of all environments are validated before any of them is appended
+  // so an invalid batch (e.g. of the wrong dtype) leaves every environment
+  // unchanged. Should appending still fail then the error names the
+  // environment and the environments before it have been appended to.
+  absl::Status AppendBatch(
+      std::vector<absl::optional<tensorflow::Tensor>> data,
+      std::vector<std::vector<absl::optional<std::weak_ptr<CellRef>>>>* refs)
+      ABSL_LOCKS_EXCLUDED(mu_);
+
   // Defines an item representing the data of `trajectory` and enques it for
   // insertion into `table` where it can be sampled according to `priority`.
   //
@@ -106,12 +141,20 @@ class TrajectoryWriter {
   //
   // Note that this method will not block and wait for the IO to complete. This
   // means that if only `Append` and `CreateItem` are used then the caller will
-  // not be impacted by the rate limiter on the server. Furthermore, the buffer
-  // of pending items (and referenced data) could grow until the process runs
-  // out of memory. The caller must therefore use `Flush` to achieve the
-  // desired level of synchronization.
+  // not be impacted by the rate limiter on the server. Furthermore, unless
+  // `max_pending_bytes` is set, the buffer of pending items (and referenced
+  // data) could grow until the process runs out of memory. The caller must
+  // therefore use `Flush` or `max_pending_bytes` to achieve the desired level
+  // of synchronization.
+  //
+  // If `max_pending_bytes` is exceeded then the chunks referenced by pending
+  // items are finalized and the call blocks for up to `timeout` for the
+  // worker to drain the queue. `DeadlineExceededError` is returned, and the
+  // item is not created, if the budget is still exceeded when the timeout
+  // expires. A zero `timeout` thus fails fast.
   absl::Status CreateItem(absl::string_view table, double priority,
-                          absl::Span<const TrajectoryColumn> trajectory)
+                          absl::Span<const TrajectoryColumn> trajectory,
+                          absl::Duration timeout = absl::InfiniteDuration())
       ABSL_LOCKS_EXCLUDED(mu_);
 
   // Sends all but the last `ignore_last_num_items` pending items and awaits
@@ -133,9 +176,19 @@ class TrajectoryWriter {
   // and confirms all pending items, and resets the episode state (i.e generates
   // a new episode ID and sets step index to 0). If `clear_buffers` is true then
   // all `CellRef`s are invalidated (and their data deleted).
+  //
+  // When `num_envs > 1` then the episodes of all environments are ended.
   absl::Status EndEpisode(
       bool clear_buffers, absl::Duration timeout = absl::InfiniteDuration());
 
+  // Ends the episode of environment `env` without affecting the episodes of
+  // the other environments. The chunks of the environment are finalized and
+  // its episode state is reset. Unlike `EndEpisode`, this does not wait for
+  // the pending items to be confirmed since the items of all environments
+  // share the stream. Use `Flush` for this.
+  absl::Status EndEnvEpisode(int env, bool clear_buffers)
+      ABSL_LOCKS_EXCLUDED(mu_);
+
   // Closes the stream, joins the worker thread and unblocks any concurrent
   // `Flush` call. All future (and concurrent) calls returns CancelledError once
   void Close() ABSL_LOCKS_EXCLUDED(mu_);
@@ -143,10 +196,34 @@ class TrajectoryWriter {
   // Attempts to configure a column `Chunker` (see `Chunker::Configure` for
   // details). If no `Chunker` exists for the column then the options will be
   // used to create the chunker when the column is present for the first time
-  // in the data of an `Append` call.
+  // in the data of an `Append` call. The options are applied to the chunkers
+  // of all environments or, if any of them holds data which has not yet been
+  // finalized, to none of them and `FailedPreconditionError` is returned.
   absl::Status ConfigureChunker(int column,
                                 const std::shared_ptr<ChunkerOptions>& options);
 
+  // ID of the active episode of environment `env`. A new ID is generated by
+  // `EndEpisode` and `EndEnvEpisode`.
+  uint64_t episode_id(int env = 0) const ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Overrides the ID of the active episode of environment `env`. This allows
+  // callers to derive the ID from other state (e.g. the key used to route the
+  // episode to a server). Returns `FailedPreconditionError` if a step has
+  // already been appended to the episode.
+  absl::Status SetEpisodeId(int env, uint64_t episode_id)
+      ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Number of times that the stream to the server was closed by a transient
+  // error (e.g. the server being unavailable) and had to be reopened.
+  int64_t num_stream_failures() const ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Number of items which have not yet been written to the stream.
+  int num_pending_items() const ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Bytes held by the pending items and the finalized chunks they reference.
+  // This is the value which is compared against `max_pending_bytes`.
+  int64_t num_pending_bytes() const ABSL_LOCKS_EXCLUDED(mu_);
+
  private:
   using InsertStream = grpc::ClientReaderWriterInterface<InsertStreamRequest,
                                                          InsertStreamResponse>;
@@ -160,6 +237,49 @@ class TrajectoryWriter {
     std::vector<std::shared_ptr<CellRef>> refs;
   };
 
+  // Appends a step to the episode of environment `env`.
+  absl::Status AppendToEnv(
+      int env, std::vector<absl::optional<tensorflow::Tensor>> data,
+      std::vector<absl::optional<std::weak_ptr<CellRef>>>* refs)
+      ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Flushes, or resets if `clear_buffers` is set, the chunkers of environment
+  // `env` and starts a new episode for it.
+  absl::Status EndEnvEpisodeLocked(int env, bool clear_buffers)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Number of pending items referencing a chunk and the size of the chunk once
+  // it has been finalized.
+  struct PendingChunk {
+    int num_items = 0;
+    int64_t bytes = 0;
+  };
+
+  // Adds the item, and the chunks it references which are not already
+  // accounted for, to `num_pending_bytes_`.
+  void AddPendingBytesLocked(const ItemAndRefs& item_and_refs)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Subtracts the item, and the chunks no longer referenced by any pending
+  // item, from `num_pending_bytes_`.
+  void RemovePendingBytesLocked(const ItemAndRefs& item_and_refs)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Adds the size of chunks which have been finalized since they were first
+  // referenced by a pending item.
+  void UpdatePendingBytesLocked() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Blocks until `num_pending_bytes_` is within `max_pending_bytes` or the
+  // queue is empty. Incomplete chunks referenced by pending items are
+  // finalized so the worker is able to drain the queue.
+  absl::Status WaitForPendingBytesLocked(absl::Duration timeout)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // True if an item in `write_queue_` references the incomplete chunk of
+  // `chunker`.
+  bool IsReferencedByPendingItem(const Chunker& chunker) const
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
   // Sends all but the last `ignore_last_num_items` pending items and awaits
   // confirmation. Incomplete chunks referenced by non ignored items are
   // finalized and transmitted.
@@ -217,18 +337,16 @@ class TrajectoryWriter {
   internal::flat_hash_map<int, std::shared_ptr<ChunkerOptions>>
       options_override_;
 
-  // Mapping from column index to Chunker. Shared pointers are used as the
-  // `CellRef`s created by the chunker will own a weak_ptr created using
-  // `weak_from_this()` on the Chunker.
-  internal::flat_hash_map<int, std::shared_ptr<Chunker>> chunkers_;
+  // Mapping from environment and column index to Chunker. Shared pointers are
+  // used as the `CellRef`s created by the chunker will own a weak_ptr created
+  // using `weak_from_this()` on the Chunker.
+  internal::flat_hash_map<std::pair<int, int>, std::shared_ptr<Chunker>>
+      chunkers_;
 
   mutable absl::Mutex mu_;
 
-  // ID of the active episode.
-  uint64_t episode_id_ ABSL_GUARDED_BY(mu_);
-
-  // Step within the episode.
-  int episode_step_ ABSL_GUARDED_BY(mu_);
+  // ID of the active episode and the step within it, of each environment.
+  std::vector<CellRef::EpisodeInfo> episodes_ ABSL_GUARDED_BY(mu_);
 
   // True if `Close` has been called.
   bool closed_ ABSL_GUARDED_BY(mu_);
@@ -238,9 +356,26 @@ class TrajectoryWriter {
   // `CancelledError`.
   absl::Status unrecoverable_status_ ABSL_GUARDED_BY(mu_);
 
+  // Number of streams which were closed by a transient error.
+  int64_t num_stream_failures_ ABSL_GUARDED_BY(mu_) = 0;
+
   // Items waiting for `stream_worker_` to write it to the steam.
   std::deque<ItemAndRefs> write_queue_ ABSL_GUARDED_BY(mu_);
 
+  // Chunks referenced by items in `write_queue_`, keyed by chunk key.
+  mutable internal::flat_hash_map<uint64_t, PendingChunk> pending_chunks_
+      ABSL_GUARDED_BY(mu_);
+
+  // References to chunks in `pending_chunks_` which had not been finalized
+  // when they were first referenced and thus haven't been added to
+  // `num_pending_bytes_` yet.
+  mutable std::vector<std::shared_ptr<CellRef>> unfinalized_chunk_refs_
+      ABSL_GUARDED_BY(mu_);
+
+  // Bytes of the items in `write_queue_` and of the finalized chunks in
+  // `pending_chunks_`.
+  mutable int64_t num_pending_bytes_ ABSL_GUARDED_BY(mu_) = 0;
+
   // Keys of items which have been written to the stream but for which no
   // confirmation has yet been received from the server.
   internal::flat_hash_set<uint64_t> in_flight_items_ ABSL_GUARDED_BY(mu_);
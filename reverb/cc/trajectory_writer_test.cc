@@ -546,6 +546,7 @@ TEST(TrajectoryWriter, RetriesOnTransientError) {
   // no guarantee that the new stream is connected to the same server and thus
   // the data might not exist on the server.
   EXPECT_THAT(success_stream->requests(), ElementsAre(IsChunk(), IsItem()));
+  EXPECT_EQ(writer.num_stream_failures(), 1);
 }
 
 TEST(TrajectoryWriter, StopsOnNonTransientError) {
@@ -626,6 +627,51 @@ TEST(TrajectoryWriter, FlushReturnsIfTimeoutExpired) {
   writer.Close();
 }
 
+TEST(TrajectoryWriter, CreateItemBlocksWhileMaxPendingBytesExceeded) {
+  absl::Notification write_block;
+  auto* stream =
+      new MockClientReaderWriter<InsertStreamRequest, InsertStreamResponse>();
+  EXPECT_CALL(*stream, Write(_, _))
+      .WillOnce(::testing::Invoke([&](auto, auto) {
+        write_block.WaitForNotification();
+        return true;
+      }))
+      .WillRepeatedly(Return(true));
+  auto stub = std::make_shared</* grpc_gen:: */MockReverbServiceStub>();
+  EXPECT_CALL(*stub, InsertStreamRaw(_)).WillOnce(Return(stream));
+
+  auto options =
+      MakeOptions(/*max_chunk_length=*/1, /*num_keep_alive_refs=*/1);
+  options.max_pending_bytes = 1;
+  TrajectoryWriter writer(stub, options);
+
+  // The first item is accepted since the queue is empty but the worker is
+  // blocked while writing its chunk.
+  StepRef first;
+  REVERB_ASSERT_OK(writer.Append(Step({MakeTensor(kIntSpec)}), &first));
+  REVERB_ASSERT_OK(
+      writer.CreateItem("table", 1.0, MakeTrajectory({{first[0]}})));
+  EXPECT_EQ(writer.num_pending_items(), 1);
+  EXPECT_GT(writer.num_pending_bytes(), 1);
+
+  // The budget is exceeded so a second item is rejected straight away when no
+  // timeout is given.
+  auto status = writer.CreateItem("table", 1.0, MakeTrajectory({{first[0]}}),
+                                  absl::ZeroDuration());
+  EXPECT_EQ(status.code(), absl::StatusCode::kDeadlineExceeded);
+  EXPECT_THAT(std::string(status.message()),
+              ::testing::HasSubstr("The limit is 1 bytes."));
+  EXPECT_EQ(writer.num_pending_items(), 1);
+
+  // Once the worker is unblocked the queue drains and the item is accepted.
+  write_block.Notify();
+  REVERB_EXPECT_OK(
+      writer.CreateItem("table", 1.0, MakeTrajectory({{first[0]}})));
+
+  // Close the writer to avoid having to mock the item confirmation response.
+  writer.Close();
+}
+
 TEST(TrajectoryWriter, FlushCanIgnorePendingItems) {
   auto* stream = new FakeStream();
   auto stub = std::make_shared</* grpc_gen:: */MockReverbServiceStub>();
@@ -1090,10 +1136,32 @@ TEST(TrajectoryWriter, EndEpisodeResetsEpisodeKeyAndStep) {
   // Verify that the `episode_key` was changed between episodes and that the
   // episode step was reset to 0.
   EXPECT_NE(first[0]->lock()->episode_id(), second[0]->lock()->episode_id());
+  EXPECT_EQ(second[0]->lock()->episode_id(), writer.episode_id());
   EXPECT_EQ(first[0]->lock()->episode_step(), 0);
   EXPECT_EQ(second[0]->lock()->episode_step(), 0);
 }
 
+TEST(TrajectoryWriter, SetEpisodeIdOnlyBeforeFirstStep) {
+  auto stub = std::make_shared</* grpc_gen:: */MockReverbServiceStub>();
+  EXPECT_CALL(*stub, InsertStreamRaw(_)).WillOnce(Return(new FakeStream()));
+
+  TrajectoryWriter writer(
+      stub, MakeOptions(/*max_chunk_length=*/1, /*num_keep_alive_refs=*/2));
+
+  REVERB_ASSERT_OK(writer.SetEpisodeId(/*env=*/0, 1337));
+  EXPECT_EQ(writer.episode_id(), 1337);
+
+  StepRef step;
+  REVERB_ASSERT_OK(writer.Append(Step({MakeTensor(kIntSpec)}), &step));
+  EXPECT_EQ(step[0]->lock()->episode_id(), 1337);
+
+  EXPECT_EQ(writer.SetEpisodeId(/*env=*/0, 1338).code(),
+            absl::StatusCode::kFailedPrecondition);
+  EXPECT_EQ(writer.SetEpisodeId(/*env=*/1, 1338).code(),
+            absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(writer.episode_id(), 1337);
+}
+
 TEST(TrajectoryWriter, EndEpisodeReturnsIfTimeoutExpired) {
   absl::Notification write_block;
   auto* stream =
@@ -1131,6 +1199,175 @@ TEST(TrajectoryWriter, EndEpisodeReturnsIfTimeoutExpired) {
   writer.Close();
 }
 
+inline TrajectoryWriter::Options MakeBatchOptions(int max_chunk_length,
+                                                  int num_keep_alive_refs,
+                                                  int num_envs) {
+  auto options = MakeOptions(max_chunk_length, num_keep_alive_refs);
+  options.num_envs = num_envs;
+  return options;
+}
+
+TEST(TrajectoryWriter, AppendRequiresSingleEnv) {
+  auto stub = std::make_shared</* grpc_gen:: */MockReverbServiceStub>();
+  EXPECT_CALL(*stub, InsertStreamRaw(_)).WillOnce(Return(new FakeStream()));
+
+  TrajectoryWriter writer(stub, MakeBatchOptions(/*max_chunk_length=*/1,
+                                                 /*num_keep_alive_refs=*/1,
+                                                 /*num_envs=*/2));
+  StepRef refs;
+  EXPECT_EQ(writer.Append(Step({MakeTensor(kIntSpec)}), &refs).code(),
+            absl::StatusCode::kFailedPrecondition);
+}
+
+TEST(TrajectoryWriter, AppendBatchValidatesOuterDim) {
+  auto stub = std::make_shared</* grpc_gen:: */MockReverbServiceStub>();
+  EXPECT_CALL(*stub, InsertStreamRaw(_)).WillOnce(Return(new FakeStream()));
+
+  TrajectoryWriter writer(stub, MakeBatchOptions(/*max_chunk_length=*/1,
+                                                 /*num_keep_alive_refs=*/1,
+                                                 /*num_envs=*/2));
+  std::vector<StepRef> refs;
+  auto status = writer.AppendBatch(
+      Step({MakeTensor(internal::TensorSpec{"0", tensorflow::DT_INT32, {3}})}),
+      &refs);
+  EXPECT_EQ(status.code(), absl::StatusCode::kInvalidArgument);
+  EXPECT_THAT(std::string(status.message()),
+              ::testing::HasSubstr("outer dimension to be num_envs (2)"));
+}
+
+TEST(TrajectoryWriter, AppendBatchTracksEpisodePerEnv) {
+  auto* stream = new FakeStream();
+  auto stub = std::make_shared</* grpc_gen:: */MockReverbServiceStub>();
+  EXPECT_CALL(*stub, InsertStreamRaw(_)).WillOnce(Return(stream));
+
+  TrajectoryWriter writer(stub, MakeBatchOptions(/*max_chunk_length=*/2,
+                                                 /*num_keep_alive_refs=*/2,
+                                                 /*num_envs=*/2));
+  const auto batch_spec =
+      internal::TensorSpec{"0", tensorflow::DT_INT32, {2, 1}};
+
+  std::vector<StepRef> first;
+  REVERB_ASSERT_OK(writer.AppendBatch(Step({MakeTensor(batch_spec)}), &first));
+  std::vector<StepRef> second;
+  REVERB_ASSERT_OK(
+      writer.AppendBatch(Step({MakeTensor(batch_spec)}), &second));
+
+  ASSERT_EQ(first.size(), 2);
+  ASSERT_EQ(second.size(), 2);
+  for (int env = 0; env < 2; env++) {
+    EXPECT_EQ(first[env][0]->lock()->episode_id(), writer.episode_id(env));
+    EXPECT_EQ(first[env][0]->lock()->episode_step(), 0);
+    EXPECT_EQ(second[env][0]->lock()->episode_step(), 1);
+
+    // The rows of each env are chunked together without the batch dimension.
+    EXPECT_EQ(first[env][0]->lock()->chunk_key(),
+              second[env][0]->lock()->chunk_key());
+  }
+  EXPECT_NE(writer.episode_id(0), writer.episode_id(1));
+  EXPECT_NE(first[0][0]->lock()->chunk_key(), first[1][0]->lock()->chunk_key());
+
+  // Items of both envs are sent over the same stream.
+  REVERB_ASSERT_OK(writer.CreateItem(
+      "table", 1.0, MakeTrajectory({{first[0][0], second[0][0]}})));
+  REVERB_ASSERT_OK(writer.CreateItem(
+      "table", 1.0, MakeTrajectory({{first[1][0], second[1][0]}})));
+  REVERB_ASSERT_OK(writer.Flush());
+  EXPECT_THAT(stream->requests(),
+              ElementsAre(IsChunk(), IsItem(), IsChunk(), IsItem()));
+}
+
+TEST(TrajectoryWriter, EndEnvEpisodeOnlyResetsEnv) {
+  auto stub = std::make_shared</* grpc_gen:: */MockReverbServiceStub>();
+  EXPECT_CALL(*stub, InsertStreamRaw(_)).WillOnce(Return(new FakeStream()));
+
+  TrajectoryWriter writer(stub, MakeBatchOptions(/*max_chunk_length=*/2,
+                                                 /*num_keep_alive_refs=*/2,
+                                                 /*num_envs=*/2));
+  const auto batch_spec =
+      internal::TensorSpec{"0", tensorflow::DT_INT32, {2, 1}};
+
+  std::vector<StepRef> first;
+  REVERB_ASSERT_OK(writer.AppendBatch(Step({MakeTensor(batch_spec)}), &first));
+  const uint64_t env_0_episode = writer.episode_id(0);
+  const uint64_t env_1_episode = writer.episode_id(1);
+
+  REVERB_ASSERT_OK(writer.EndEnvEpisode(1, /*clear_buffers=*/false));
+  EXPECT_EQ(writer.episode_id(0), env_0_episode);
+  EXPECT_NE(writer.episode_id(1), env_1_episode);
+
+  // The chunk of env 1 was finalized while the chunk of env 0 is still open.
+  EXPECT_FALSE(first[0][0]->lock()->IsReady());
+  EXPECT_TRUE(first[1][0]->lock()->IsReady());
+
+  std::vector<StepRef> second;
+  REVERB_ASSERT_OK(
+      writer.AppendBatch(Step({MakeTensor(batch_spec)}), &second));
+  EXPECT_EQ(second[0][0]->lock()->episode_step(), 1);
+  EXPECT_EQ(second[1][0]->lock()->episode_step(), 0);
+
+  EXPECT_EQ(writer.EndEnvEpisode(2, /*clear_buffers=*/false).code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
+TEST(TrajectoryWriter, InvalidAppendBatchLeavesAllEnvsUnchanged) {
+  auto stub = std::make_shared</* grpc_gen:: */MockReverbServiceStub>();
+  EXPECT_CALL(*stub, InsertStreamRaw(_)).WillOnce(Return(new FakeStream()));
+
+  TrajectoryWriter writer(stub, MakeBatchOptions(/*max_chunk_length=*/2,
+                                                 /*num_keep_alive_refs=*/2,
+                                                 /*num_envs=*/2));
+  const auto batch_spec =
+      internal::TensorSpec{"0", tensorflow::DT_INT32, {2, 1}};
+
+  std::vector<StepRef> first;
+  REVERB_ASSERT_OK(writer.AppendBatch(Step({MakeTensor(batch_spec)}), &first));
+
+  // The rows have the wrong dtype for the chunkers of both envs.
+  std::vector<StepRef> invalid;
+  EXPECT_EQ(writer
+                .AppendBatch(Step({MakeTensor(internal::TensorSpec{
+                                 "0", tensorflow::DT_FLOAT, {2, 1}})}),
+                             &invalid)
+                .code(),
+            absl::StatusCode::kInvalidArgument);
+
+  // Neither env was advanced by the failed call.
+  std::vector<StepRef> second;
+  REVERB_ASSERT_OK(
+      writer.AppendBatch(Step({MakeTensor(batch_spec)}), &second));
+  for (int env = 0; env < 2; env++) {
+    EXPECT_EQ(second[env][0]->lock()->episode_step(), 1);
+    EXPECT_EQ(first[env][0]->lock()->chunk_key(),
+              second[env][0]->lock()->chunk_key());
+  }
+}
+
+TEST(TrajectoryWriter, ConfigureChunkerIsAppliedToAllEnvsOrNone) {
+  auto stub = std::make_shared</* grpc_gen:: */MockReverbServiceStub>();
+  EXPECT_CALL(*stub, InsertStreamRaw(_)).WillOnce(Return(new FakeStream()));
+
+  TrajectoryWriter writer(stub, MakeBatchOptions(/*max_chunk_length=*/2,
+                                                 /*num_keep_alive_refs=*/2,
+                                                 /*num_envs=*/2));
+  const auto batch_spec =
+      internal::TensorSpec{"0", tensorflow::DT_INT32, {2, 1}};
+
+  // Only the chunk of env 1 is finalized so env 0 can't be reconfigured.
+  std::vector<StepRef> refs;
+  REVERB_ASSERT_OK(writer.AppendBatch(Step({MakeTensor(batch_spec)}), &refs));
+  REVERB_ASSERT_OK(writer.EndEnvEpisode(1, /*clear_buffers=*/false));
+
+  auto status = writer.ConfigureChunker(
+      0, std::make_shared<ConstantChunkerOptions>(/*max_chunk_length=*/1,
+                                                  /*num_keep_alive_refs=*/1));
+  EXPECT_EQ(status.code(), absl::StatusCode::kFailedPrecondition);
+  EXPECT_THAT(std::string(status.message()), ::testing::HasSubstr("env 0"));
+
+  // Env 1 still uses a max_chunk_length of 2.
+  REVERB_ASSERT_OK(writer.AppendBatch(Step({MakeTensor(batch_spec)}), &refs));
+  EXPECT_FALSE(refs[1][0]->lock()->IsReady());
+}
+
 class TrajectoryWriterOptionsTest : public ::testing::Test {
  protected:
   void ExpectInvalidArgumentWithMessage(const std::string& message) {
@@ -1180,6 +1417,20 @@ TEST_F(TrajectoryWriterOptionsTest, NumKeepAliveLtMaxChunkLength) {
       "num_keep_alive_refs (5) must be >= max_chunk_length (6).");
 }
 
+TEST_F(TrajectoryWriterOptionsTest, ZeroNumEnvs) {
+  options_ = MakeBatchOptions(/*max_chunk_length=*/2, /*num_keep_alive_refs=*/2,
+                              /*num_envs=*/0);
+  ExpectInvalidArgumentWithMessage("num_envs (0) must be >= 1.");
+}
+
+TEST_F(TrajectoryWriterOptionsTest, ZeroMaxPendingBytes) {
+  options_ = MakeOptions(/*max_chunk_length=*/2, /*num_keep_alive_refs=*/2);
+  options_.max_pending_bytes = 0;
+  ExpectInvalidArgumentWithMessage(
+      "max_pending_bytes (0) must be a positive number or "
+      "kUnlimitedPendingBytes.");
+}
+
 }  // namespace
 }  // namespace reverb
 }  // namespace deepmind
@@ -419,6 +419,7 @@ absl::Status Writer::Finish(bool retry_on_unavailable) {
   for (const auto& tensor : batched_tensors) {
     CompressTensorAsProto(tensor, chunk_data.mutable_data()->add_tensors());
   }
+  chunk_data.set_content_hash(internal::ChunkContentHash(chunk_data.data()));
 
   chunks_.emplace_back(std::move(chunk_data));
 
@@ -497,6 +498,7 @@ bool Writer::WritePendingData() {
         keep_chunk_keys.begin(), keep_chunk_keys.end()};
     request.mutable_item()->set_send_confirmation(
         max_in_flight_items_.has_value());
+    request.mutable_item()->set_accept_batched_confirmation(true);
     if (!stream_->Write(request)) return false;
     pending_items_.pop_front();
     if (request.item().send_confirmation()) {
@@ -568,7 +570,8 @@ void Writer::ItemConfirmationWorker() {
     }
     if (!stream_->Read(&response)) break;
     absl::WriterMutexLock lock(&mu_);
-    num_items_in_flight_--;
+    // Older servers confirm each item in a separate response.
+    num_items_in_flight_ -= std::max(response.keys_size(), 1);
   }
   absl::WriterMutexLock lock(&mu_);
   item_confirmation_worker_running_ = false;
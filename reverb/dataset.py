@@ -58,7 +58,8 @@ class ReplayDataset(tf.data.Dataset):
                sequence_length: Optional[int] = None,
                emit_timesteps: bool = True,
                rate_limiter_timeout_ms: int = -1,
-               flexible_batch_size: int = -1):
+               flexible_batch_size: int = -1,
+               batch_size: Optional[int] = None):
     """Constructs a new ReplayDataset.
 
     Args:
@@ -71,7 +72,10 @@ class ReplayDataset(tf.data.Dataset):
         values can result in skewed sampling distributions as large number of
         samples are fetched from single snapshot of the replay (followed by a
         period of lower activity as the samples are consumed). A good rule of
-        thumb is to set this value to 2-3x times the batch size used.
+        thumb is to set this value to 2-3x times the batch size used. If -1
+        then the number is adapted to the rate at which samples are consumed
+        and the number of active workers is adapted between 1 and
+        `num_workers_per_iterator`.
       num_workers_per_iterator: (Defaults to -1, i.e auto selected) The number
         of worker threads to create per dataset iterator. When the selected
         table uses a FIFO sampler (i.e a queue) then exactly 1 worker must be
@@ -107,12 +111,17 @@ class ReplayDataset(tf.data.Dataset):
         Larger `flexible_batch_size` values result a bias towards sampling over
         inserts. In highly overloaded systems this results in higher sample QPS
         and lower insert QPS compared to lower `flexible_batch_size` values.
+      batch_size: (Defaults to None: unbatched) Number of sequences to stack
+        into each element of the dataset. Requires `emit_timesteps` to be False.
+        The samples are copied directly into preallocated
+        `[batch_size, sequence_length, ...]` tensors, which is cheaper than
+        calling `.batch(batch_size, drop_remainder=True)` on the dataset.
 
 
     Raises:
       ValueError: If `dtypes` and `shapes` don't share the same structure.
       ValueError: If `max_in_flight_samples_per_worker` is not a
-        positive integer.
+        positive integer or -1.
       ValueError: If `num_workers_per_iterator` is not a positive integer or -1.
       ValueError: If `max_samples_per_stream` is not a positive integer or -1.
       ValueError: If `sequence_length` is not a positive integer or None.
@@ -120,12 +129,15 @@ class ReplayDataset(tf.data.Dataset):
         `sequence_length` as its leading dimension.
       ValueError: If `rate_limiter_timeout_ms < -1`.
       ValueError: If `flexible_batch_size` is not a positive integer or -1.
+      ValueError: If `batch_size` is not a positive integer or None.
+      ValueError: If `batch_size` is set and `emit_timesteps` is True.
     """
     tree.assert_same_structure(dtypes, shapes, False)
-    if max_in_flight_samples_per_worker < 1:
+    if (max_in_flight_samples_per_worker < 1 and
+        max_in_flight_samples_per_worker != -1):
       raise ValueError(
-          'max_in_flight_samples_per_worker (%d) must be a positive integer' %
-          max_in_flight_samples_per_worker)
+          'max_in_flight_samples_per_worker (%d) must be a positive integer or '
+          '-1' % max_in_flight_samples_per_worker)
     if num_workers_per_iterator < 1 and num_workers_per_iterator != -1:
       raise ValueError(
           'num_workers_per_iterator (%d) must be a positive integer or -1' %
@@ -145,6 +157,12 @@ class ReplayDataset(tf.data.Dataset):
       raise ValueError(
           'flexible_batch_size (%d) must be a positive integer or -1' %
           flexible_batch_size)
+    if batch_size is not None and batch_size < 1:
+      raise ValueError(
+          'batch_size (%s) must be None or a positive integer' % batch_size)
+    if batch_size is not None and emit_timesteps:
+      raise ValueError('batch_size can only be set when emit_timesteps is '
+                       'False')
 
     # Add the info fields.
     dtypes = replay_sample.ReplaySample(replay_sample.SampleInfo.tf_dtypes(),
@@ -187,6 +205,7 @@ class ReplayDataset(tf.data.Dataset):
     self._max_samples_per_stream = max_samples_per_stream
     self._rate_limiter_timeout_ms = rate_limiter_timeout_ms
     self._flexible_batch_size = flexible_batch_size
+    self._batch_size = batch_size
 
     if _is_tf1_runtime():
       # Disabling to avoid errors given the different tf.data.Dataset init args
@@ -209,7 +228,8 @@ class ReplayDataset(tf.data.Dataset):
                            emit_timesteps: bool = True,
                            rate_limiter_timeout_ms: int = -1,
                            get_signature_timeout_secs: Optional[int] = None,
-                           flexible_batch_size: int = -1):
+                           flexible_batch_size: int = -1,
+                           batch_size: Optional[int] = None):
     """Constructs a ReplayDataset using the table's signature to infer specs.
 
     Note: The signature must be provided to `Table` at construction. See
@@ -228,6 +248,7 @@ class ReplayDataset(tf.data.Dataset):
         respond when fetching the table signature. By default no timeout is set
         and the call will block indefinitely if the server does not respond.
       flexible_batch_size: See __init__ for details.
+      batch_size: See __init__ for details.
 
     Returns:
       ReplayDataset using the specs defined by the table signature to build
@@ -269,7 +290,8 @@ class ReplayDataset(tf.data.Dataset):
         sequence_length=sequence_length,
         emit_timesteps=emit_timesteps,
         rate_limiter_timeout_ms=rate_limiter_timeout_ms,
-        flexible_batch_size=flexible_batch_size)
+        flexible_batch_size=flexible_batch_size,
+        batch_size=batch_size)
 
   def _as_variant_tensor(self):
     return gen_dataset_op.reverb_dataset(
@@ -283,14 +305,19 @@ class ReplayDataset(tf.data.Dataset):
         num_workers_per_iterator=self._num_workers_per_iterator,
         max_samples_per_stream=self._max_samples_per_stream,
         rate_limiter_timeout_ms=self._rate_limiter_timeout_ms,
-        flexible_batch_size=self._flexible_batch_size)
+        flexible_batch_size=self._flexible_batch_size,
+        batch_size=self._batch_size or -1)
 
   def _inputs(self) -> List[Any]:
     return []
 
   @property
   def element_spec(self) -> Any:
-    return tree.map_structure(tf.TensorSpec, self._shapes, self._dtypes)
+    shapes = self._shapes
+    if self._batch_size is not None:
+      batch_dim = tf.TensorShape([self._batch_size])
+      shapes = tree.map_structure(batch_dim.concatenate, shapes)
+    return tree.map_structure(tf.TensorSpec, shapes, self._dtypes)
 
 
 def _convert_lists_to_tuples(structure: Any) -> Any:
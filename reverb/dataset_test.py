@@ -176,6 +176,10 @@ class ReplayDatasetTest(tf.test.TestCase, parameterized.TestCase):
       {
           'testcase_name': 'max_in_flight_samples_per_worker_is_minus_1',
           'max_in_flight_samples_per_worker': -1,
+      },
+      {
+          'testcase_name': 'max_in_flight_samples_per_worker_is_minus_2',
+          'max_in_flight_samples_per_worker': -2,
           'want_error': ValueError,
       },
       {
@@ -534,7 +534,8 @@ PYBIND11_MODULE(libpybind, m) {
                   const std::vector<std::shared_ptr<TableExtension>>
                       &extensions,
                   const absl::optional<std::string> &serialized_signature =
-                      absl::nullopt) -> Table * {
+                      absl::nullopt,
+                  int sample_window_length = 0) -> Table * {
                  absl::optional<tensorflow::StructuredValue> signature =
                      absl::nullopt;
                  if (serialized_signature) {
@@ -550,11 +551,12 @@ PYBIND11_MODULE(libpybind, m) {
                  }
                  return new Table(name, sampler, remover, max_size,
                                   max_times_sampled, rate_limiter, extensions,
-                                  std::move(signature));
+                                  std::move(signature), sample_window_length);
                }),
            py::arg("name"), py::arg("sampler"), py::arg("remover"),
            py::arg("max_size"), py::arg("max_times_sampled"),
-           py::arg("rate_limiter"), py::arg("extensions"), py::arg("signature"))
+           py::arg("rate_limiter"), py::arg("extensions"), py::arg("signature"),
+           py::arg("sample_window_length") = 0)
       .def("name", &Table::name)
       .def("can_sample", &Table::CanSample,
            py::call_guard<py::gil_scoped_release>())
@@ -613,6 +615,7 @@ PYBIND11_MODULE(libpybind, m) {
              MaybeRaiseFromStatus(status);
              return sample;
            })
+      .def("MetricsText", &Sampler::MetricsText)
       .def("Close", &Sampler::Close, py::call_guard<py::gil_scoped_release>());
 
   py::class_<Client>(m, "Client")
@@ -728,6 +731,16 @@ PYBIND11_MODULE(libpybind, m) {
         }
         MaybeRaiseFromStatus(status);
         return path;
+      })
+      .def("Metrics", [](Client *client) {
+        std::string text;
+        absl::Status status;
+        {
+          py::gil_scoped_release g;
+          status = client->Metrics(&text);
+        }
+        MaybeRaiseFromStatus(status);
+        return text;
       });
 
   py::class_<Checkpointer, std::shared_ptr<Checkpointer>>(m, "Checkpointer")
@@ -746,18 +759,27 @@ PYBIND11_MODULE(libpybind, m) {
       .def(
           py::init([](std::vector<std::shared_ptr<Table>> priority_tables,
                       int port,
-                      std::shared_ptr<Checkpointer> checkpointer = nullptr) {
+                      std::shared_ptr<Checkpointer> checkpointer = nullptr,
+                      double checkpoint_interval_sec = 0) {
+            auto checkpoint_interval =
+                checkpoint_interval_sec > 0
+                    ? absl::Seconds(checkpoint_interval_sec)
+                    : absl::ZeroDuration();
             std::unique_ptr<Server> server;
-            MaybeRaiseFromStatus(StartServer(std::move(priority_tables), port,
-                                             std::move(checkpointer), &server));
+            MaybeRaiseFromStatus(StartServer(
+                std::move(priority_tables), port, std::move(checkpointer),
+                checkpoint_interval, &server));
             return server.release();
           }),
           py::arg("priority_tables"), py::arg("port"),
-          py::arg("checkpointer") = nullptr)
+          py::arg("checkpointer") = nullptr,
+          py::arg("checkpoint_interval_sec") = 0)
       .def("Stop", &Server::Stop, py::call_guard<py::gil_scoped_release>())
       .def("Wait", &Server::Wait, py::call_guard<py::gil_scoped_release>())
       .def("InProcessClient", &Server::InProcessClient,
            py::call_guard<py::gil_scoped_release>())
+      .def("MetricsText", &Server::MetricsText,
+           py::call_guard<py::gil_scoped_release>())
       .def("__repr__", &Server::DebugString,
            py::call_guard<py::gil_scoped_release>());
 
@@ -106,7 +106,8 @@ class Table:
                rate_limiter: rate_limiters.RateLimiter,
                max_times_sampled: int = 0,
                extensions: Sequence[TableExtensionBase] = (),
-               signature: Optional[reverb_types.SpecNest] = None):
+               signature: Optional[reverb_types.SpecNest] = None,
+               sample_window_length: int = 0):
     """Constructor of the Table.
 
     Args:
@@ -125,15 +126,24 @@ class Table:
         the table.
       signature: Optional nested structure containing `tf.TypeSpec` objects,
         describing the schema of items in this table.
+      sample_window_length: If > 0 then every item holds a whole episode and
+        sampling it returns a window of `sample_window_length` consecutive
+        steps, starting at a uniformly selected offset within the episode. The
+        sample probability is divided by the number of windows in the episode.
+        Items shorter than the window are rejected.
 
     Raises:
       ValueError: If name is empty.
       ValueError: If max_size <= 0.
+      ValueError: If sample_window_length < 0.
     """
     if not name:
       raise ValueError('name must be nonempty')
     if max_size <= 0:
       raise ValueError('max_size (%d) must be a positive integer' % max_size)
+    if sample_window_length < 0:
+      raise ValueError('sample_window_length (%d) must not be negative' %
+                       sample_window_length)
 
     # Merge the c++ extensions into a single list.
     internal_extensions = []
@@ -159,7 +169,8 @@ class Table:
         max_times_sampled=max_times_sampled,
         rate_limiter=rate_limiter.internal_limiter,
         extensions=internal_extensions,
-        signature=signature_proto_str)
+        signature=signature_proto_str,
+        sample_window_length=sample_window_length)
 
   @classmethod
   def queue(cls,
@@ -248,7 +259,8 @@ class Server:
   def __init__(self,
                tables: Sequence[Table] = None,
                port: Union[int, None] = None,
-               checkpointer: checkpointers.CheckpointerBase = None):
+               checkpointer: checkpointers.CheckpointerBase = None,
+               checkpoint_interval_sec: Optional[float] = None):
     """Constructor of Server serving the ReverbService.
 
     Args:
@@ -258,10 +270,15 @@ class Server:
       checkpointer: Checkpointer used for storing/loading checkpoints. If None
         (default) then `checkpointers.default_checkpointer` is used to
         construct the checkpointer.
+      checkpoint_interval_sec: If set then a checkpoint is saved in the
+        background every `checkpoint_interval_sec` seconds. Periodic
+        checkpoints are written with lowered I/O priority and are skipped while
+        a checkpoint requested through `Client.checkpoint` is in progress.
 
     Raises:
       ValueError: If tables is empty.
       ValueError: If multiple Table in tables share names.
+      ValueError: If checkpoint_interval_sec is not positive.
     """
     if not tables:
       raise ValueError('At least one table must be provided')
@@ -271,6 +288,11 @@ class Server:
       raise ValueError('Multiple items in tables have the same name: {}'.format(
           ', '.join(duplicates)))
 
+    if checkpoint_interval_sec is not None and checkpoint_interval_sec <= 0:
+      raise ValueError(
+          'checkpoint_interval_sec must be > 0 but got {}'.format(
+              checkpoint_interval_sec))
+
     if port is None:
       port = portpicker.pick_unused_port()
 
@@ -278,7 +300,8 @@ class Server:
       checkpointer = checkpointers.default_checkpointer()
 
     self._server = pybind.Server([table.internal_table for table in tables],
-                                 port, checkpointer.internal_checkpointer())
+                                 port, checkpointer.internal_checkpointer(),
+                                 checkpoint_interval_sec or 0)
     self._port = port
 
   def __del__(self):
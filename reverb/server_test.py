@@ -68,6 +68,20 @@ class ServerTest(absltest.TestCase):
     with self.assertRaises(ValueError):
       server.Server(tables=[], port=None)
 
+  def test_non_positive_checkpoint_interval(self):
+    with self.assertRaises(ValueError):
+      server.Server(
+          tables=[
+              server.Table(
+                  name=TABLE_NAME,
+                  sampler=item_selectors.Prioritized(1),
+                  remover=item_selectors.Fifo(),
+                  max_size=100,
+                  rate_limiter=rate_limiters.MinSize(2)),
+          ],
+          port=None,
+          checkpoint_interval_sec=0)
+
   def test_can_sample(self):
     table = server.Table(
         name=TABLE_NAME,
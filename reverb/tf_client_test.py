@@ -75,6 +75,17 @@ class SampleOpTest(tf.test.TestCase):
       self.assertEqual(sample.info.table_size, 1)
       self.assertEqual(sample.info.priority, 1)
 
+  def test_reuses_sampler_across_calls(self):
+    input_data = [np.ones((81, 81), dtype=np.float64)]
+    self._client.insert(input_data, {'dist': 1})
+    with self.session() as session:
+      client = tf_client.TFClient(self._client.server_address)
+      sample_op = client.sample('dist', [tf.float64])
+      for _ in range(10):
+        sample = session.run(sample_op)
+        np.testing.assert_equal(input_data, sample.data)
+        self.assertEqual(sample.info.table_size, 1)
+
   def test_dtype_mismatch_result_in_error_raised(self):
     data = [np.zeros((81, 81))]
     self._client.insert(data, {'dist': 1})
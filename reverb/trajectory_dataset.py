@@ -48,7 +48,8 @@ class TrajectoryDataset(tf.data.Dataset):
                num_workers_per_iterator: int = -1,
                max_samples_per_stream: int = -1,
                rate_limiter_timeout_ms: int = -1,
-               flexible_batch_size: int = -1):
+               flexible_batch_size: int = -1,
+               batch_size: Optional[int] = None):
     """Constructs a new TrajectoryDataset.
 
     Args:
@@ -61,7 +62,10 @@ class TrajectoryDataset(tf.data.Dataset):
         values can result in skewed sampling distributions as large number of
         samples are fetched from single snapshot of the replay (followed by a
         period of lower activity as the samples are consumed). A good rule of
-        thumb is to set this value to 2-3x times the batch size used.
+        thumb is to set this value to 2-3x times the batch size used. If -1
+        then the number is adapted to the rate at which samples are consumed
+        and the number of active workers is adapted between 1 and
+        `num_workers_per_iterator`.
       num_workers_per_iterator: (Defaults to -1, i.e auto selected) The number
         of worker threads to create per dataset iterator. When the selected
         table uses a FIFO sampler (i.e a queue) then exactly 1 worker must be
@@ -89,21 +93,28 @@ class TrajectoryDataset(tf.data.Dataset):
           a bias towards sampling over inserts. In highly overloaded systems
           this results in higher sample QPS and lower insert QPS compared to
           lower `flexible_batch_size` values.
+      batch_size: (Defaults to None: unbatched) Number of trajectories to stack
+        into each element of the dataset. The samples are copied directly into
+        preallocated `[batch_size, ...]` tensors, which is cheaper than calling
+        `.batch(batch_size, drop_remainder=True)` on the dataset. All fields
+        within `info` then become vectors of length `batch_size`.
 
     Raises:
       ValueError: If `dtypes` and `shapes` don't share the same structure.
       ValueError: If `max_in_flight_samples_per_worker` is not a
-        positive integer.
+        positive integer or -1.
       ValueError: If `num_workers_per_iterator` is not a positive integer or -1.
       ValueError: If `max_samples_per_stream` is not a positive integer or -1.
       ValueError: If `rate_limiter_timeout_ms < -1`.
       ValueError: If `flexible_batch_size` is not a positive integer or -1.
+      ValueError: If `batch_size` is not a positive integer or None.
     """
     tree.assert_same_structure(dtypes, shapes, False)
-    if max_in_flight_samples_per_worker < 1:
+    if (max_in_flight_samples_per_worker < 1 and
+        max_in_flight_samples_per_worker != -1):
       raise ValueError(
-          'max_in_flight_samples_per_worker (%d) must be a positive integer' %
-          max_in_flight_samples_per_worker)
+          'max_in_flight_samples_per_worker (%d) must be a positive integer or '
+          '-1' % max_in_flight_samples_per_worker)
     if num_workers_per_iterator < 1 and num_workers_per_iterator != -1:
       raise ValueError(
           'num_workers_per_iterator (%d) must be a positive integer or -1' %
@@ -119,6 +130,9 @@ class TrajectoryDataset(tf.data.Dataset):
       raise ValueError(
           'flexible_batch_size (%d) must be a positive integer or -1' %
           flexible_batch_size)
+    if batch_size is not None and batch_size < 1:
+      raise ValueError(
+          'batch_size (%s) must be None or a positive integer' % batch_size)
 
     # Add the info fields (all scalars).
     dtypes = replay_sample.ReplaySample(
@@ -145,6 +159,7 @@ class TrajectoryDataset(tf.data.Dataset):
     self._max_samples_per_stream = max_samples_per_stream
     self._rate_limiter_timeout_ms = rate_limiter_timeout_ms
     self._flexible_batch_size = flexible_batch_size
+    self._batch_size = batch_size
 
     if _is_tf1_runtime():
       # Disabling to avoid errors given the different tf.data.Dataset init args
@@ -165,7 +180,8 @@ class TrajectoryDataset(tf.data.Dataset):
                            max_samples_per_stream: int = -1,
                            rate_limiter_timeout_ms: int = -1,
                            get_signature_timeout_secs: Optional[int] = None,
-                           flexible_batch_size: int = -1):
+                           flexible_batch_size: int = -1,
+                           batch_size: Optional[int] = None):
     """Constructs a TrajectoryDataset using the table's signature to infer specs.
 
     Note: The target `Table` must specify a signature which represent the entire
@@ -183,6 +199,7 @@ class TrajectoryDataset(tf.data.Dataset):
         respond when fetching the table signature. By default no timeout is set
         and the call will block indefinitely if the server does not respond.
       flexible_batch_size: See __init__ for details.
+      batch_size: See __init__ for details.
 
     Returns:
       TrajectoryDataset using the specs defined by the table signature to build
@@ -218,7 +235,8 @@ class TrajectoryDataset(tf.data.Dataset):
         num_workers_per_iterator=num_workers_per_iterator,
         max_samples_per_stream=max_samples_per_stream,
         rate_limiter_timeout_ms=rate_limiter_timeout_ms,
-        flexible_batch_size=flexible_batch_size)
+        flexible_batch_size=flexible_batch_size,
+        batch_size=batch_size)
 
   def _as_variant_tensor(self):
     return gen_trajectory_dataset_op.reverb_trajectory_dataset(
@@ -230,14 +248,19 @@ class TrajectoryDataset(tf.data.Dataset):
         num_workers_per_iterator=self._num_workers_per_iterator,
         max_samples_per_stream=self._max_samples_per_stream,
         rate_limiter_timeout_ms=self._rate_limiter_timeout_ms,
-        flexible_batch_size=self._flexible_batch_size)
+        flexible_batch_size=self._flexible_batch_size,
+        batch_size=self._batch_size or -1)
 
   def _inputs(self) -> List[Any]:
     return []
 
   @property
   def element_spec(self) -> Any:
-    return tree.map_structure(tf.TensorSpec, self._shapes, self._dtypes)
+    shapes = self._shapes
+    if self._batch_size is not None:
+      batch_dim = tf.TensorShape([self._batch_size])
+      shapes = tree.map_structure(batch_dim.concatenate, shapes)
+    return tree.map_structure(tf.TensorSpec, shapes, self._dtypes)
 
 
 def _convert_lists_to_tuples(structure: Any) -> Any: